@@ -2,6 +2,8 @@
 #define _BUS_H_
 
 #include "Dram.h"
+#include "codemap.h"
+#include "device.h"
 #include "exception.h"
 #include "param.h"
 #include "plic.h"
@@ -9,60 +11,193 @@
 #include "uart.h"
 #include "virtio.h"
 
+#include <cstdlib>
+#include <memory>
 #include <vector>
-#include <iostream>
+
+// Physical addresses the bus can map: 2^39 bytes, as many as Sv39 can reach.
+const uint64_t BUS_ADDR_BITS = 39;
+// The map is a two-level table: 1 GiB slots, each split into pages.
+const uint64_t BUS_SLOT_BITS = 30;
+const uint64_t BUS_SLOTS = 1ull << (BUS_ADDR_BITS - BUS_SLOT_BITS);
+const uint64_t BUS_SLOT_PAGES = (1ull << BUS_SLOT_BITS) / PAGE_SIZE;
 
 class Bus{
 public:
-    Bus(std::vector<uint8_t>& code, std::vector<uint8_t> & disk_image) : dram(code), virtio_blk(disk_image) {}
-
-    uint64_t load(uint64_t addr, uint64_t size) {
-        if(addr >= UART_BASE && addr <= UART_END) {
-            return uart.load(addr, size);
-        } else if (addr >= CLINT_BASE && addr <= CLINT_END) {
-            return clint.load(addr, size);
-        } else if (addr >= PLIC_BASE && addr <= PLIC_END) {
-            return plic.load(addr, size);
-        } else if (addr >= DRAM_BASE && addr <= DRAM_END) {
-            return dram.load(addr, size);
-        } else if (addr >= VIRTIO_BASE && addr <= VIRTIO_END) {
-            return virtio_blk.load(addr, size);
-        } else {
-            std::cerr << "bus addr out\n";
-            throw LoadAccessFault(addr);
+    Bus(std::vector<uint8_t>& code, std::vector<uint8_t> & disk_image, uint64_t dram_size = DRAM_SIZE)
+        : Bus(code, std::unique_ptr<BlockBackend>(new MemoryDisk(disk_image)), dram_size) {}
+
+    Bus(std::vector<uint8_t>& code, std::unique_ptr<BlockBackend> disk, uint64_t dram_size = DRAM_SIZE) : dram(code, dram_size), clint(doorbell), uart(doorbell), virtio_blk(std::move(disk), doorbell), code_map(dram_size) {
+        map(UART_BASE, UART_SIZE, &uart);
+        map(CLINT_BASE, CLINT_SIZE, &clint);
+        map(PLIC_BASE, PLIC_SIZE, &plic);
+        map(DRAM_BASE, dram.size(), &dram, dram.host(DRAM_BASE));
+        map(VIRTIO_BASE, VIRTIO_SIZE, &virtio_blk);
+    }
+
+    // Map device at [base, base + size). If the range is plain memory, host is its
+    // backing store, and loads and stores to it skip the device; memory must be page
+    // aligned. Ranges must not overlap; two devices may share a page.
+    void map(uint64_t base, uint64_t size, Device * device, uint8_t * host = nullptr) {
+        regions.emplace_back(new Region{base, base + size - 1, device, host});
+        const Region * region = regions.back().get();
+        for (uint64_t page = base & ~(PAGE_SIZE - 1); page <= region->end; page += PAGE_SIZE) {
+            Slot & slot = slots[page >> BUS_SLOT_BITS];
+            if (!slot) {
+                // calloc hands out untouched zero pages for a block this large, so
+                // only the parts of the slot that get mapped take up memory.
+                slot.reset((const Region **)std::calloc(BUS_SLOT_PAGES, sizeof(const Region *)));
+                if (!slot) {
+                    throw std::bad_alloc();
+                }
+            }
+            const Region * & entry = slot[(page >> 12) & (BUS_SLOT_PAGES - 1)];
+            if (nullptr == entry) {
+                entry = region;
+            } else {
+                // The page is shared: fall back to scanning the regions.
+                entry = &shared;
+            }
+        }
+    }
+
+    // Read size bits at the physical address addr into value. Return the access fault
+    // if some of them are not mapped to one device, Exception::None otherwise.
+    Exception load(uint64_t addr, uint64_t size, uint64_t & value) {
+        const Region * r = find(addr, size);
+        if (nullptr == r) {
+            return Exception::LoadAccessFault;
         }
+        return r->device->load(addr, size, value);
     }
 
-    void store(uint64_t addr, uint64_t size, uint64_t value) {
-        if(addr >= UART_BASE && addr <= UART_END) {
-            uart.store(addr, size, value);
-        } else if (addr >= CLINT_BASE && addr <= CLINT_END) {
-            clint.store(addr, size, value);
-        } else if (addr >= PLIC_BASE && addr <= PLIC_END) {
-            plic.store(addr, size, value);
-        } else if (addr >= DRAM_BASE && addr <= DRAM_END) {
-            dram.store(addr, size, value);
-        } else if (addr >= VIRTIO_BASE && addr <= VIRTIO_END) {
-            virtio_blk.store(addr, size, value);
-        } else {
-            std::cout << std::hex << addr << std::endl;
-            throw StoreAMOAccessFault(addr);
+    Exception store(uint64_t addr, uint64_t size, uint64_t value) {
+        const Region * r = find(addr, size);
+        if (nullptr == r) {
+            return Exception::StoreAMOAccessFault;
         }
+        return r->device->store(addr, size, value);
+    }
+
+    // Host address of the memory page holding paddr, or nullptr if paddr is not plain
+    // memory. Accesses through it bypass the devices, so they must stay within the page.
+    uint8_t * host_page(uint64_t paddr) {
+        uint64_t slot = paddr >> BUS_SLOT_BITS;
+        if (slot >= BUS_SLOTS || !slots[slot]) {
+            return nullptr;
+        }
+        // Memory covers whole pages, so there is no need to check the bounds.
+        const Region * r = slots[slot][(paddr >> 12) & (BUS_SLOT_PAGES - 1)];
+        if (nullptr == r || nullptr == r->host) {
+            return nullptr;
+        }
+        return r->host + ((paddr & ~(PAGE_SIZE - 1)) - r->base);
+    }
+
+    // Last address of DRAM.
+    uint64_t dram_end() const {
+        return DRAM_BASE + dram.size() - 1;
     }
 
     bool uart_is_interrupting() {
         return uart.is_interrupting();
     }
 
+    Uart & get_uart() {
+        return uart;
+    }
+
     VirtioBlock & get_virtio_blk() {
         return virtio_blk;
     }
+
+    Plic & get_plic() {
+        return plic;
+    }
+
+    Clint & get_clint() {
+        return clint;
+    }
+
+    // Where harts in WFI wait for the devices.
+    Doorbell & get_doorbell() {
+        return doorbell;
+    }
+
+    // Pages holding code of the harts on this bus.
+    CodeMap & get_code_map() {
+        return code_map;
+    }
+
+    Dram & get_dram() {
+        return dram;
+    }
+
+    // The devices; DRAM goes in a snapshot separately.
+    void save(SnapshotWriter & w) {
+        clint.save(w);
+        plic.save(w);
+        uart.save(w);
+        virtio_blk.save(w);
+    }
+
+    void restore(SnapshotReader & r) {
+        clint.restore(r);
+        plic.restore(r);
+        uart.restore(r);
+        virtio_blk.restore(r);
+    }
 private:
+    struct Region {
+        uint64_t base;
+        uint64_t end;
+        Device * device;
+        uint8_t * host;
+    };
+
+    struct FreeDeleter {
+        void operator()(const Region ** p) const {
+            std::free(p);
+        }
+    };
+    typedef std::unique_ptr<const Region *[], FreeDeleter> Slot;
+
+    // The region holding all size bits at addr, or nullptr if there is none.
+    const Region * find(uint64_t addr, uint64_t size) const {
+        uint64_t slot = addr >> BUS_SLOT_BITS;
+        if (slot >= BUS_SLOTS || !slots[slot]) {
+            return nullptr;
+        }
+        uint64_t last = addr + size / 8 - 1;
+        const Region * r = slots[slot][(addr >> 12) & (BUS_SLOT_PAGES - 1)];
+        if (&shared == r) {
+            for (const std::unique_ptr<Region> & region : regions) {
+                if (addr >= region->base && last <= region->end) {
+                    return region.get();
+                }
+            }
+            return nullptr;
+        }
+        // A region need not cover the whole of its first and last page.
+        if (nullptr == r || addr < r->base || last > r->end) {
+            return nullptr;
+        }
+        return r;
+    }
+
+    Doorbell doorbell;
 	Dram dram;
     Plic plic;
     Clint clint;
     Uart uart;
     VirtioBlock virtio_blk;
+    CodeMap code_map;
+
+    std::vector<std::unique_ptr<Region>> regions;
+    // marks a page holding more than one region.
+    const Region shared = Region{0, 0, nullptr, nullptr};
+    // slots[addr >> BUS_SLOT_BITS][page in slot] is the region mapped at addr, if any.
+    Slot slots[BUS_SLOTS];
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,16 +2,31 @@
 #define _CPU_H_
 
 #include "param.h"
+#include "amo.h"
+#include "muldiv.h"
+#include "bitmanip.h"
+#include "fp.h"
+#include "vector.h"
 #include "exception.h"
 #include "Bus.h"
 #include "CSR.h"
+#include "block.h"
+#include "decoder.h"
+#include "icache.h"
 #include "interrupt.h"
+#include "jit.h"
+#include "tlb.h"
 #include "virtqueue.h"
 #include "util/circularList.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <sstream>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 
@@ -31,6 +46,18 @@ enum AccessType {
     Instruction, Load, Store
 };
 
+// How circle() runs guest instructions.
+enum class Engine {
+    // fetch, then dispatch through a switch on the decoded op.
+    Interpreter,
+    // each handler jumps straight to the handler of the next instruction.
+    Threaded,
+    // run cached basic blocks linked to their successors.
+    Block,
+    // run blocks translated to x86-64 code; the block engine on other hosts.
+    Jit,
+};
+
 // Riscv Privilege Mode
 typedef uint64_t Mode;
 const Mode user_mode = 0b00;
@@ -39,24 +66,42 @@ const Mode machine_mode = 0b11;
 
 class CPU {
 public:
-	CPU(std::vector<uint8_t>& code, std::vector<uint8_t>& disk_image) : bus(code, disk_image), mode(machine_mode) {
-        for(int i = 0; i < 32; ++i) {
-        	regs[i] = 0;
-        }
-        regs[2] = DRAM_END;
-        pc = DRAM_BASE;
-        enable_paging = false;
-        page_table = 0;
+	// A single hart with a bus of its own.
+	CPU(std::vector<uint8_t>& code, std::vector<uint8_t>& disk_image, uint64_t dram_size = DRAM_SIZE)
+        : owned_bus(new Bus(code, disk_image, dram_size)), bus(*owned_bus), mode(machine_mode), icache(bus.get_code_map()) {
+        reset(0);
     }
 
-    // Load a value from a dram.
-    uint64_t load(uint64_t addr, uint64_t size) {
-        uint64_t paddr = translate(addr, AccessType::Load);
-        return bus.load(addr, size);
+    // Hart hartid of a machine whose harts share bus, see Machine.
+    CPU(Bus & bus, uint64_t hartid) : bus(bus), mode(machine_mode), icache(bus.get_code_map(), hartid) {
+        reset(hartid);
     }
 
-    // Store a value to a dram.
-    void store(uint64_t addr, uint64_t size, uint64_t value) {
+    // Load a value from a dram. Return false if the access raised an exception.
+    bool load(uint64_t addr, uint64_t size, uint64_t & value) {
+        if ((addr & (PAGE_SIZE - 1)) + size / 8 > PAGE_SIZE) {
+            return load_split(addr, size, value);
+        }
+        uint64_t paddr;
+        uint8_t * page;
+        Exception e = translate(addr, AccessType::Load, paddr, page);
+        if (Exception::None == e) {
+            uint64_t offset = paddr & (PAGE_SIZE - 1);
+            if (nullptr != page && offset + size / 8 <= PAGE_SIZE) {
+                value = Dram::read(page + offset, size);
+                return true;
+            }
+            e = bus.load(paddr, size, value);
+        }
+        if (Exception::None != e) {
+            raise(e, addr);
+            return false;
+        }
+        return true;
+    }
+
+    // Store a value to a dram. Return false if the access raised an exception.
+    bool store(uint64_t addr, uint64_t size, uint64_t value) {
         // if (addr == 0x80013dc8 + 8) {
         //     std::cout <<"sss" << std::hex << value << " " <<  fetch()<< std::endl;
         //     std::cout <<"load" << regs[S1] + 64 << " " << load(regs[S1] + 64, 64) << std::endl;
@@ -65,21 +110,247 @@ public:
         //     std::cout <<"0x80013da8: " << std::hex << value << " " <<  fetch()<< std::endl;
         // }
         // the above is code for debugging
-        uint64_t paddr = translate(addr, AccessType::Store);
-        bus.store(addr, size, value);
+        if ((addr & (PAGE_SIZE - 1)) + size / 8 > PAGE_SIZE) {
+            return store_split(addr, size, value);
+        }
+        uint64_t paddr;
+        uint8_t * page;
+        Exception e = translate(addr, AccessType::Store, paddr, page);
+        if (Exception::None == e) {
+            uint64_t offset = paddr & (PAGE_SIZE - 1);
+            if (nullptr != page && offset + size / 8 <= PAGE_SIZE) {
+                Dram::write(page + offset, size, value);
+            } else {
+                e = bus.store(paddr, size, value);
+                // May have moved mtimecmp: look at the timer before the next instruction.
+                timer_deadline = 0;
+            }
+        }
+        if (Exception::None != e) {
+            raise(e, addr);
+            return false;
+        }
+        if (icache.invalidate(paddr, size / 8)) {
+            flush_fetch();
+            blocks.invalidate();
+        }
+        return true;
+    }
+
+    /*!
+     * A misaligned access that crosses into the next virtual page, whose frame need not
+     * follow the first one. Translate both parts before touching either, so that a
+     * fault on the second leaves memory alone. Unless the frames are back to back,
+     * both must be plain memory: paddr and host are then those of each part.
+     * */
+    bool translate_split(uint64_t addr, AccessType access_type, uint64_t (&paddr)[2], uint8_t * (&host)[2]) {
+        uint64_t part[2] = {addr, (addr | (PAGE_SIZE - 1)) + 1};
+        for (int i = 0; i < 2; ++i) {
+            Exception e = translate(part[i], access_type, paddr[i], host[i]);
+            if (Exception::None != e) {
+                raise(e, part[i]);
+                return false;
+            }
+        }
+        if (paddr[0] + (part[1] - addr) == paddr[1]) {
+            return true;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (nullptr == host[i]) {
+                raise((AccessType::Load == access_type) ? Exception::LoadAccessFault : Exception::StoreAMOAccessFault,
+                      part[i]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool load_split(uint64_t addr, uint64_t size, uint64_t & value) {
+        uint64_t paddr[2];
+        uint8_t * host[2];
+        if (!translate_split(addr, AccessType::Load, paddr, host)) {
+            return false;
+        }
+        uint64_t head = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+        if (paddr[0] + head == paddr[1]) {
+            Exception e = bus.load(paddr[0], size, value);
+            if (Exception::None != e) {
+                raise(e, addr);
+                return false;
+            }
+            return true;
+        }
+        uint8_t bytes[8];
+        memcpy(bytes, host[0] + (PAGE_SIZE - head), head);
+        memcpy(bytes + head, host[1], size / 8 - head);
+        value = Dram::read(bytes, size);
+        return true;
+    }
+
+    bool store_split(uint64_t addr, uint64_t size, uint64_t value) {
+        uint64_t paddr[2];
+        uint8_t * host[2];
+        if (!translate_split(addr, AccessType::Store, paddr, host)) {
+            return false;
+        }
+        uint64_t head = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+        bool code;
+        if (paddr[0] + head == paddr[1]) {
+            Exception e = bus.store(paddr[0], size, value);
+            if (Exception::None != e) {
+                raise(e, addr);
+                return false;
+            }
+            timer_deadline = 0;
+            code = icache.invalidate(paddr[0], size / 8);
+        } else {
+            uint8_t bytes[8];
+            Dram::write(bytes, size, value);
+            memcpy(host[0] + (PAGE_SIZE - head), bytes, head);
+            memcpy(host[1], bytes + head, size / 8 - head);
+            code = icache.invalidate(paddr[0], head);
+            code = icache.invalidate(paddr[1], size / 8 - head) || code;
+        }
+        if (code) {
+            flush_fetch();
+            blocks.invalidate();
+        }
+        return true;
+    }
+
+    // Translate addr for an atomic access of size bits, which must be naturally
+    // aligned. Return false if the access raised an exception.
+    bool translate_atomic(uint64_t addr, uint64_t size, AccessType access_type, uint64_t & paddr, uint8_t * & host) {
+        Exception e;
+        if (addr & (size / 8 - 1)) {
+            e = (AccessType::Load == access_type) ? Exception::LoadAddrMisaligned : Exception::StoreAMOAddrMisaligned;
+        } else {
+            e = translate(addr, access_type, paddr, host);
+        }
+        if (Exception::None != e) {
+            raise(e, addr);
+            return false;
+        }
+        return true;
+    }
+
+    // Apply an AMO to the SIZE-bit word at addr and return the old word in value. On
+    // plain memory this is one host atomic operation, so no other hart can write in
+    // between. Return false if the access raised an exception.
+    template <uint64_t SIZE, AmoOp OP>
+    bool amo(uint64_t addr, uint64_t operand, uint64_t & value) {
+        typedef typename Word<SIZE>::type T;
+        uint64_t paddr;
+        uint8_t * page;
+        if (!translate_atomic(addr, SIZE, AccessType::Store, paddr, page)) {
+            return false;
+        }
+        if (nullptr == page) {
+            // Not plain memory: a device sees a read followed by a write.
+            return load(addr, SIZE, value) && store(addr, SIZE, amo_apply<T, OP>((T)value, (T)operand));
+        }
+        value = host_amo<T, OP>((T *)(page + (paddr & (PAGE_SIZE - 1))), (T)operand);
+        if (icache.invalidate(paddr, SIZE / 8)) {
+            flush_fetch();
+            blocks.invalidate();
+        }
+        return true;
+    }
+
+    // LR: load the SIZE-bit word at addr and reserve it for the next SC.
+    template <uint64_t SIZE>
+    bool load_reserved(uint64_t addr, uint64_t & value) {
+        typedef typename Word<SIZE>::type T;
+        uint64_t paddr;
+        uint8_t * page;
+        if (!translate_atomic(addr, SIZE, AccessType::Load, paddr, page)) {
+            return false;
+        }
+        if (nullptr == page) {
+            if (!load(addr, SIZE, value)) {
+                return false;
+            }
+        } else {
+            value = to_le(__atomic_load_n((T *)(page + (paddr & (PAGE_SIZE - 1))), __ATOMIC_SEQ_CST));
+        }
+        reservation = paddr;
+        reserved_value = value;
+        return true;
+    }
+
+    // SC: store the SIZE-bit value to addr if it is still reserved by the last LR, and
+    // drop the reservation either way. Return false if the access raised an exception.
+    template <uint64_t SIZE>
+    bool store_conditional(uint64_t addr, uint64_t value, bool & stored) {
+        typedef typename Word<SIZE>::type T;
+        uint64_t paddr;
+        uint8_t * page;
+        if (!translate_atomic(addr, SIZE, AccessType::Store, paddr, page)) {
+            return false;
+        }
+        uint64_t reserved = reservation;
+        reservation = ~0ull;
+        stored = false;
+        if (reserved != paddr) {
+            return true;
+        }
+        if (nullptr == page) {
+            stored = store(addr, SIZE, value);
+            return stored;
+        }
+        // The reservation holds while the word keeps the value LR read, which is what
+        // a compare-and-swap can check; another hart writing that same value back in
+        // between goes unnoticed.
+        T expected = to_le((T)reserved_value);
+        stored = __atomic_compare_exchange_n((T *)(page + (paddr & (PAGE_SIZE - 1))), &expected, to_le((T)value),
+                                             false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        if (stored && icache.invalidate(paddr, SIZE / 8)) {
+            flush_fetch();
+            blocks.invalidate();
+        }
+        return true;
+    }
+
+    // Get an instruction from the dram. Return false if the fetch raised an exception.
+    // A 32-bit instruction is fetched as two halves, which may lie on different pages.
+    bool fetch(uint64_t & inst) {
+        uint64_t high = 0;
+        if (!fetch_half(pc, inst) || (0x3 == (inst & 0x3) && !fetch_half(pc + 2, high))) {
+            return false;
+        }
+        inst |= high << 16;
+        return true;
     }
 
-    // Get an instruction from the dram.
-    uint64_t fetch() {
-        uint64_t ppc = translate(pc, AccessType::Instruction);
-        uint64_t inst;
-        try{
-            inst = bus.load(ppc, 32);
-        } catch(LoadAccessFault & e) {
-            throw InstructionAccessFault(pc);
+    // Get the 16 bits of instruction at addr. The trap value of a fault is the address
+    // of the half that faulted.
+    bool fetch_half(uint64_t addr, uint64_t & half) {
+        uint64_t paddr;
+        Exception e = translate(addr, AccessType::Instruction, paddr);
+        if (Exception::None == e) {
+            e = bus.load(paddr, 16, half);
+            if (Exception::LoadAccessFault == e) {
+                e = Exception::InstructionAccessFault;
+            }
+        }
+        if (Exception::None != e) {
+            raise(e, addr);
+            return false;
         }
-        return inst;
-    } 
+        return true;
+    }
+
+    // Record the exception raised by the current instruction. Return TRAPPED, the value
+    // an instruction returns instead of its next pc after raising.
+    uint64_t raise(Exception code, uint64_t value) {
+        trap = Trap{code, value};
+        return TRAPPED;
+    }
+
+    // The exception raised by the last instruction that returned TRAPPED.
+    const Trap & get_trap() const {
+        return trap;
+    }
 
     uint64_t get_reg_value(Reg_t t) const {
         return regs[t];
@@ -93,53 +364,254 @@ public:
         return pc;
     }
 
+    Bus & get_bus() {
+        return bus;
+    }
+
     uint64_t execute(uint64_t inst);
 
-    void handle_excption(RISCVException & e);
+    uint64_t execute(const DecodedInst & d);
+
+    // Get the predecoded instruction at pc, decoding it on its first execution. Return
+    // nullptr if the fetch raised an exception.
+    const DecodedInst * fetch_decoded();
+
+    // Forget the page fetch_decoded() is running on, e.g. when the translation may have changed.
+    void flush_fetch();
+
+    // Whether the instruction at offset in the page at host is 32 bits long and runs
+    // into the next page.
+    static bool straddles(const uint8_t * host, uint64_t offset);
 
-    void handle_interrupt(RISCVInterrupt & interrupt);
+    // The bits of the instruction at offset in the page at host that stay on the page.
+    static uint32_t read_inst(const uint8_t * host, uint64_t offset);
 
-    void check_pending_interrupt();
+    void handle_excption(const Trap & t);
 
-    void disk_access();
+    void handle_interrupt(Interrupt interrupt);
+
+    // Pick the interrupt to take now and clear its pending bit, or return Interrupt::None.
+    Interrupt check_pending_interrupt();
+
+    // Set or clear MTIP from mtime and mtimecmp, and decide when to look again.
+    void poll_timer();
+
+    // Set the pending bits of device and software interrupts for this hart in mip.
+    void latch_interrupts();
+
+    // Block the host thread until an interrupt enabled in mie is pending, see WFI.
+    void wait_for_interrupt();
+
+    // Process the requests on the virtio block queue; see the definition.
+    bool disk_access();
+
+    // Copy len bytes of guest physical memory at paddr, as a device does.
+    void dma_read(uint64_t paddr, uint8_t * dst, uint64_t len);
+
+    void dma_write(uint64_t paddr, const uint8_t * src, uint64_t len);
 
     void update_paging(uint64_t csr_addr);
 
-    uint64_t translate(uint64_t addr, AccessType acess_type);
+    // Translate the virtual address addr into paddr. Return the page fault if the
+    // translation fails, Exception::None otherwise.
+    Exception translate(uint64_t addr, AccessType acess_type, uint64_t & paddr);
+
+    // Also return the host address of the page if it is plain memory, see Bus::host_page().
+    Exception translate(uint64_t addr, AccessType access_type, uint64_t & paddr, uint8_t * & host);
+
+    // Walk the page table for a TLB miss. Also return the R/W/X/U bits of the leaf.
+    Exception walk(uint64_t addr, AccessType access_type, uint64_t & paddr, uint64_t & perm);
+
+    // Whether a leaf with the given R/W/X/U bits allows the access in the current mode.
+    bool permits(uint64_t perm, AccessType access_type);
+
+    void set_engine(Engine e) {
+        engine = e;
+    }
+
+    // VLEN, a power of two from 64 to MAX_VLEN. Takes effect from the next vsetvl.
+    void set_vlen(uint64_t bits) {
+        vlenb = bits / 8;
+        csr.store(VLENB, vlenb);
+    }
+
+    // A program without paging ends by jumping out of DRAM. Once paging is on, pc is a
+    // virtual address and only a fatal exception or stop() ends the run.
+    bool running() const {
+        return !stopped.load(std::memory_order_relaxed) && (enable_paging || pc <= bus.dram_end());
+    }
+
+    // Make circle() return at the next instruction or block boundary. May be called
+    // from any thread.
+    void stop() {
+        stopped.store(true, std::memory_order_relaxed);
+        bus.get_doorbell().ring();
+    }
+
+    // Undo stop(), for circle() to carry on where it left off.
+    void resume() {
+        stopped.store(false, std::memory_order_relaxed);
+    }
+
+    // The architectural state only: caches start empty on restore.
+    void save(SnapshotWriter & w) const {
+        for (uint64_t reg : regs) {
+            w.put(reg);
+        }
+        for (uint64_t reg : fregs) {
+            w.put(reg);
+        }
+        w.put(vlenb);
+        w.put(vregs);
+        w.put(pc);
+        w.put(mode);
+        csr.save(w);
+    }
+
+    void restore(SnapshotReader & r) {
+        for (uint64_t & reg : regs) {
+            r.get(reg);
+        }
+        for (uint64_t & reg : fregs) {
+            r.get(reg);
+        }
+        r.get(vlenb);
+        r.get(vregs);
+        r.get(pc);
+        r.get(mode);
+        csr.restore(r);
+        update_paging(SATP);
+        flush_fetch();
+        reservation = ~0ull;
+        // Look at the timer straight away.
+        timer_retired = 0;
+        timer_deadline = 0;
+    }
+
+    // Run until the hart leaves DRAM or hits a fatal exception.
+    void circle() {
+        // The host FPU state belongs to the thread: start from what it has now, and
+        // leave the flags raised in fcsr.
+        host_rm = ~0ull;
+        host_take_flags();
+        run_engine();
+        sync_fflags();
+    }
+
+    void run_engine() {
+        switch (engine) {
+        case Engine::Threaded:
+            run_threaded();
+            break;
+        case Engine::Block:
+            run_blocks();
+            break;
+        case Engine::Jit:
+            run_jit();
+            break;
+        default:
+            run_interpreter();
+            break;
+        }
+    }
+
+    // Take the exception raised by the current instruction. Return false if it is fatal.
+    bool take_trap() {
+        handle_excption(trap);
+        if (trap.is_fatal()) {
+            bus.get_uart().flush();
+            std::cout << "\033[1m\033[31m" << trap.what() << "#" << std::hex << trap.value << "\033[0m" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Take a pending interrupt, if any, after retired instructions have run. Return
+    // true if one was taken. Also catch up with code other harts have overwritten.
+    bool take_interrupt(uint64_t retired = 1) {
+        timer_retired += retired;
+        if (timer_retired >= timer_deadline) {
+            poll_timer();
+        }
+        if (icache.sync()) {
+            flush_fetch();
+            blocks.invalidate();
+        }
+        Interrupt interrupt = check_pending_interrupt();
+        if (Interrupt::None == interrupt) {
+            return false;
+        }
+        handle_interrupt(interrupt);
+        return true;
+    }
+
+    // Run the instruction at pc, then take its exception or a pending interrupt.
+    // Return false if the instruction raised a fatal exception.
+    bool step() {
+        const DecodedInst * d = fetch_decoded();
+        if (nullptr == d) {
+            return take_trap();
+        }
+        DecodedInst inst = *d;
+        uint64_t new_pc = execute(inst);
+        if (TRAPPED == new_pc) {
+            return take_trap();
+        }
+        pc = new_pc;
+        take_interrupt();
+        return true;
+    }
+
+    void run_threaded();
+
+    void run_blocks();
+
+    void run_jit();
+
+    // Called by translated code for instructions it does not emit inline.
+    static uint64_t jit_exec(CPU * cpu, const DecodedInst * d, uint64_t inst_pc);
+
+    // Get the block starting at pc, building it on first execution. Return nullptr
+    // if pc cannot start a block (not in DRAM, not mapped, or an instruction that
+    // straddles two pages).
+    Block * lookup_block();
 
-	void circle() {
-        uint32_t inst = 0, new_pc = 0;
+    // Get the block execution continues with after b, following b's links if possible.
+    Block * next_block(Block * b);
+
+	void run_interpreter() {
+        uint64_t new_pc = 0;
         int s = 1;
         // struct Info{
         //     uint32_t inst;
         //     uint64_t sp;
         // };
         // CircularList<Info> instCache(20);
-        while (pc <= DRAM_END) {
-            try {
-                inst = fetch();
-                // Info info= {inst, regs[SP]};
-                // instCache.insert(info);
-                s++;
-                // std::cout << "(" << std::dec << s++ << ") ";
-                // std::cout << std::hex << inst << std::endl; 
+        while (running()) {
+            const DecodedInst * d = fetch_decoded();
+            // Info info= {d->raw, regs[SP]};
+            // instCache.insert(info);
+            s++;
+            // std::cout << "(" << std::dec << s++ << ") ";
+            // std::cout << std::hex << d->raw << std::endl; 
+            if (nullptr == d) {
+                new_pc = TRAPPED;
+            } else {
+                // A store to this page drops the slot d is in, so run a copy.
+                DecodedInst inst = *d;
                 new_pc = execute(inst);
-                pc = new_pc;
-                check_pending_interrupt();
-            } catch (RISCVException & e) {
-                handle_excption(e);
-                if (e.is_fatal()) {
-                    std::cout << "\033[1m\033[31m" << e.what() << "#" << std::hex << e.value() << "\033[0m" << std::endl;
+            }
+            if (TRAPPED == new_pc) {
+                if (!take_trap()) {
                     // for (auto & i : instCache) {
                     //     std::cout << std::hex << i.inst << " " << i.sp << std::endl;
                     // }
-                    // std::cout << load(regs[A1] + 8, 64) << std::endl;
                     break;
                 }
                 continue;
-            } catch (RISCVInterrupt & interrupt) {
-                handle_interrupt(interrupt);
             }
+            pc = new_pc;
+            take_interrupt();
         }
 	}
 
@@ -157,20 +629,58 @@ public:
 	    std::cout << output.str();
 	}
 
-	inline uint64_t update_pc() {
-		return pc + 4;
+	// The pc of the instruction after d, which is 2 or 4 bytes long.
+	inline uint64_t update_pc(const DecodedInst & d) {
+		return pc + inst_len(d);
 	}
 
     inline void set_pc(uint64_t new_pc) {
         pc = new_pc;
     }
 private:
+    void reset(uint64_t id) {
+        for(int i = 0; i < 32; ++i) {
+        	regs[i] = 0;
+        }
+        regs[2] = bus.dram_end();
+        for (int i = 0; i < 32; ++i) {
+            fregs[i] = 0;
+        }
+        std::memset(vregs, 0, sizeof(vregs));
+        pc = DRAM_BASE;
+        hartid = id;
+        csr.store(MHARTID, hartid);
+        // Programs that run without a kernel can use F, D and V straight away.
+        csr.store(MSTATUS, FS_INITIAL | VS_INITIAL);
+        csr.store(VLENB, vlenb);
+        csr.store(VTYPE, VTYPE_VILL);
+        enable_paging = false;
+        page_table = 0;
+        flush_fetch();
+    }
+
     // 32 64-bit integer registers.
     uint64_t regs[32];
+    // 32 64-bit floating-point registers, single-precision values NaN-boxed.
+    uint64_t fregs[32];
+    // The rounding mode the host FPU of this thread is in, ~0 if unknown.
+    uint64_t host_rm = ~0ull;
+    // VLEN / 8, and 32 vector registers of that many bytes. The registers follow each
+    // other, so that a register group is one run of elements.
+    uint64_t vlenb = DEFAULT_VLEN / 8;
+    alignas(32) uint8_t vregs[32 * MAX_VLEN / 8];
     // pc register contains the memory address of next instruction
     uint64_t pc;
-    // System bus that transfers data between CPU and peripheral devices.
-    Bus bus;
+    // System bus that transfers data between CPU and peripheral devices, shared by
+    // all harts; owned_bus holds it if this hart is the only one.
+    std::unique_ptr<Bus> owned_bus;
+    Bus & bus;
+    uint64_t hartid;
+    std::atomic<bool> stopped{false};
+    // Instructions retired since the last poll_timer(), and how many may retire before
+    // the next one has to run.
+    uint64_t timer_retired = 0;
+    uint64_t timer_deadline = 0;
     // Control and status registers. RISC-V ISA sets aside a 12-bit encoding space (csr[11:0]) for
     // up to 4096 CSRs.
     CSR csr;
@@ -179,538 +689,2209 @@ private:
 
     bool enable_paging;
     uint64_t page_table;
-};
+    // Translations cached for instruction fetch and for loads and stores.
+    Tlb itlb;
+    Tlb dtlb;
 
-uint64_t CPU::execute(uint64_t inst) {
-    uint64_t opcode = inst & 0x7f;
-    uint64_t rd = (inst >> 7) & 0x1f;
-    uint64_t rs1 = (inst >> 15) & 0x1f;
-    uint64_t rs2 = (inst >> 20) & 0x1f;
-    uint64_t funct3 = (inst >> 12) & 0x7;
-    uint64_t funct7 = (inst >> 25) & 0x7f;
+    Engine engine = Engine::Interpreter;
 
+    // Predecoded instructions of the pages executed so far.
+    InstCache icache;
+    // The page fetch_decoded() is running on: its virtual base, its slots and its bytes.
+    uint64_t fetch_vpage;
+    DecodedInst * fetch_page;
+    const uint8_t * fetch_host;
+    // holds instructions that are fetched from outside the cache.
+    DecodedInst fetch_scratch;
 
-    // x0 is hardwired zero
-    regs[0] = 0;
+    BlockCache blocks;
+    // Bumped whenever a virtual address may translate differently, which breaks the
+    // links between blocks.
+    uint64_t translation_epoch = 0;
 
-    switch (opcode) {
-        case 0x03: { // LOAD
-        	// offset[11:0] = inst[31:20]
-        	uint64_t offset = (uint64_t)((int64_t)(int32_t)inst >> 20);
-        	uint64_t addr = regs[rs1] + offset;
-            switch (funct3) {
-                case 0x00: { // LB
-                    uint64_t val = load(addr, 8);
-                    regs[rd] = (uint64_t)(int64_t)(int8_t)val;
-                    return update_pc();
-                }
-                case 0x01: { // LH
-                    uint64_t val = load(addr, 16);
-                    regs[rd] = (uint64_t)(int64_t)(int16_t)val;
-                    return update_pc();
-                }
-                case 0x02: { // LW
-                    uint64_t val = load(addr, 32);
-                    regs[rd] = (uint64_t)(int64_t)(int32_t)val;
-                    return update_pc();
-                }
-                case 0x03: { // LD
-                	uint64_t val = load(addr, 64);
-                    regs[rd] = (uint64_t)(int64_t)(int64_t)val;
-                    return update_pc();
-                }
-                case 0x04: { // LBU
-                    uint64_t val = load(addr, 8);
-                    regs[rd] = val;
-                    return update_pc();
-                }
-                case 0x05: { // LHU
-                    uint64_t val = load(addr, 16);
-                    regs[rd] = val;
-                    return update_pc();
-                }
-                case 0x06: {// LWU
-                	uint64_t val = load(addr, 32);
-                    regs[rd] = val;
-                    return update_pc();
-                } 
-                default: {
-                    throw IllegalInstruction(inst);
-                }
-            }
+    Jit jit;
+
+    // The exception raised by the current instruction, valid once it returned TRAPPED.
+    Trap trap;
+
+    // Physical address reserved by the last LR, ~0 if there is none, and the value
+    // LR read there. Traps drop the reservation.
+    uint64_t reservation = ~0ull;
+    uint64_t reserved_value = 0;
+
+    // Whether F and D instructions may run: mstatus.FS is not Off.
+    bool fp_enabled() {
+        return FS_OFF != (csr.load(MSTATUS) & MASK_FS);
+    }
+
+    // Put the host FPU in the rounding mode of d, frm if d asks for the dynamic one.
+    // Return false if the mode is reserved.
+    bool fp_round(const DecodedInst & d) {
+        return fp_round((d.raw >> 12) & 0x7);
+    }
+
+    bool fp_round(uint64_t rm) {
+        if (RM_DYN == rm) {
+            rm = csr.load(FRM);
         }
-        case 0x0f: {
-            // A fence instruction does nothing because this emulator executes an
-            // instruction sequentially on a single thread.
-            if (0x0 == funct3) {  // FENCE
-                // Do nothing.
-                return update_pc();
-            }
-            else {
-                throw IllegalInstruction(inst);
-            }
+        if (rm > RM_RMM) {
+            return false;
         }
-        case 0x13: { // OP-IMM
-        	uint64_t imm = (uint64_t)((int64_t)(int32_t)(inst & 0xfff00000) >> 20);
-            uint32_t shamt = (uint32_t)(imm & 0x3f);
-            switch (funct3) {
-                case 0x00: { // ADDI
-                    regs[rd] = regs[rs1] + imm;
-                    return update_pc();
-                }
-                case 0x01: { // SLLI
-                    regs[rd] = regs[rs1] << shamt;
-                    return update_pc();
-                }
-                case 0x02: { // SLTI
-                    regs[rd] = ((int64_t)regs[rs1] < (int64_t)imm ? 1 : 0);
-                    return update_pc();
-                }
-                case 0x03: { // SLTIU
-                    regs[rd] = (regs[rs1] < imm ? 1 : 0);
-                    return update_pc();
-                }
-                case 0x04: { // XORI
-                    regs[rd] = regs[rs1] ^ imm;
-                    return update_pc();
-                }
-                case 0x05: { // SRLI/SRAI
-                    switch (funct7 >> 1) {
-                        case 0x00: {// SRLI
-                            regs[rd] = regs[rs1] >> shamt;
-                            return update_pc();
-                        }
-                        case 0x10: { // SRAI
-                            regs[rd] = (uint64_t)((int64_t)regs[rs1] >> shamt);
-                            return update_pc();
-                        }
-                        default: {
-                            throw IllegalInstruction(inst);
-                        }
-                    }
-                }
-                case 0x06: { // ORI
-                    regs[rd] = regs[rs1] | imm;
-                    return update_pc();
-                }
-                case 0x07: { // ANDI
-                    regs[rd] = regs[rs1] & imm;
-                    return update_pc();
-                }
-                default: {
-                    throw IllegalInstruction(inst);
-                }
-            }
+        if (rm != host_rm) {
+            host_set_rounding(rm);
+            host_rm = rm;
         }
-        case 0x17: { // AUIPC
-            uint64_t imm = (uint64_t)(int64_t)(int32_t)(inst & 0xfffff000);
-            regs[rd] = pc + imm;
-            return update_pc();
-        }
-        case 0x1b: {
-        	uint64_t imm = (uint64_t)((int64_t)(int32_t)inst >> 20);
-        	// "SLLIW, SRLIW, and SRAIW encodings with imm[5] != 0 are reserved."
-        	uint32_t shamt = (uint32_t)(imm & 0x1f);
-        	switch(funct3) {
-        	case 0x0: { // ADDIW
-        		regs[rd] = (uint64_t)(int64_t)(int32_t)(regs[rs1] + imm);
-        		return update_pc();
-            }
-        	case 0x1: { // SLLIW
-        		regs[rd] = (uint64_t)(int64_t)(int32_t)(regs[rs1] << shamt);
-        		return update_pc();
-            }
-        	case 0x5: {
-        		switch(funct7) {
-        		case 0x00: { // SRLIW
-        			regs[rd] = (uint64_t)(int64_t)(int32_t)((uint32_t)regs[rs1] >> shamt);
-        			return update_pc();
-                }
-        		case 0x20: { // SRAIW
-        			regs[rd] = (uint64_t)(int64_t)((int32_t)regs[rs1] >> shamt);
-        			return update_pc();
-                }
-        		default: {
-        			throw IllegalInstruction(inst);
-                }
-        		}
-            }
-        	default:{
-        		throw IllegalInstruction(inst);
-            }
-        	}
-        }
-        case 0x23: { // STORE
-            // imm[11:5|4:0] = inst[31:25|11:7]
-            uint64_t imm = (uint64_t)((int64_t)(int32_t)(inst & 0xfe000000) >> 20) | ((inst >> 7) & 0x1f);
-            uint64_t addr = regs[rs1] + imm; 
-            switch (funct3) {
-                case 0x00: { // SB
-                    store(addr, 8, regs[rs2]);
-                    return update_pc();
-                }
-                case 0x01: { // SH
-                    store(addr, 16, regs[rs2]);
-                    return update_pc();
-                }
-                case 0x02: { // SW
-                    store(addr, 32, regs[rs2]);
-                    return update_pc();
-                }
-                case 0x03: { // SD
-                	store(addr, 64, regs[rs2]);
-                	return update_pc();
-                }
-                default: {
-                    throw IllegalInstruction(inst);
-                }
-            }
+        return true;
+    }
+
+    // The f registers or fcsr have changed: mark FS Dirty, once.
+    void fp_dirty() {
+        uint64_t status = csr.load(MSTATUS);
+        if (FS_DIRTY != (status & MASK_FS)) {
+            csr.store(MSTATUS, status | FS_DIRTY);
         }
-        case 0x2f: {
-            // RV64A: "A" standard extension for atomic instructions
-            uint64_t funct5 = (funct7 & 0b1111100) >> 2;
-            uint64_t _aq = (funct7 & 0b0000010) >> 1;
-            uint64_t _rl = funct7 & 0b0000001;
-            if (0x2 == funct3 && 0x00 == funct5) {  // amoadd.w
-                uint64_t t = load(regs[rs1], 32);
-                store(regs[rs1], 32, t + regs[rs2]);
-                regs[rd] = t;
-                return update_pc();
-            }
-            else if (0x3 == funct3 && 0x00 == funct5) {  // amoadd.d
-                uint64_t t = load(regs[rs1], 64);
-                store(regs[rs1], 64, t + regs[rs2]);
-                regs[rd] = t;
-                return update_pc();
-            }
-            else if (0x2 == funct3 && 0x01 == funct5) {  // amoswap.w
-                uint64_t t = load(regs[rs1], 32);
-                store(regs[rs1], 32, regs[rs2]);
-                regs[rd] = t;
-                return update_pc();
-            }
-            else if (0x3 == funct3 && 0x01 == funct5) {  // amoswap.d
-                uint64_t t = load(regs[rs1], 64);
-                store(regs[rs1], 64, regs[rs2]);
-                regs[rd] = t;
-                return update_pc();
-            }
-            else {
-                throw IllegalInstruction(inst);
-            }
+    }
+
+    // Accrue flags the host does not raise by itself in fflags.
+    void fp_raise(uint64_t flags) {
+        if (0 != flags) {
+            csr.store(FFLAGS, csr.load(FFLAGS) | flags);
+        }
+    }
+
+    // Move the flags the host FPU raised into fflags, before fcsr is read or saved.
+    void sync_fflags() {
+        fp_raise(host_take_flags());
+    }
+
+    template <typename F>
+    F freg(uint8_t r) const {
+        return fp_unbox<F>(fregs[r]);
+    }
+
+    template <typename F>
+    void set_freg(uint8_t r, F value) {
+        fregs[r] = fp_box(value);
+        fp_dirty();
+    }
+
+    // An F or D instruction computing op(rs1, rs2, rs3) in the host FPU into rd.
+    template <typename F, typename Op>
+    uint64_t fp_arith(const DecodedInst & d, Op op) {
+        if (!fp_enabled() || !fp_round(d)) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        set_freg<F>(d.rd, fp_canonical(op(freg<F>(d.rs1), freg<F>(d.rs2), freg<F>((uint8_t)d.imm))));
+        return update_pc(d);
+    }
+
+    // FSGNJ, FSGNJN (negate) and FSGNJX (xor): the bits of rs1 with a sign from rs2.
+    template <typename F>
+    uint64_t fp_sign(const DecodedInst & d, bool negate, bool exclusive) {
+        typedef typename FpBits<F>::type T;
+        if (!fp_enabled()) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        const T sign = (T)1 << (8 * sizeof(T) - 1);
+        T a = fp_bits(freg<F>(d.rs1));
+        T b = fp_bits(freg<F>(d.rs2));
+        T s = exclusive ? ((a ^ b) & sign) : ((negate ? ~b : b) & sign);
+        set_freg<F>(d.rd, fp_from_bits<F>((a & ~sign) | s));
+        return update_pc(d);
+    }
+
+    template <typename F>
+    uint64_t fp_min_max(const DecodedInst & d, bool max) {
+        if (!fp_enabled()) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        uint64_t flags = 0;
+        set_freg<F>(d.rd, ::fp_min_max(freg<F>(d.rs1), freg<F>(d.rs2), max, flags));
+        fp_raise(flags);
+        return update_pc(d);
+    }
+
+    // FEQ is quiet, it only signals for signaling NaNs; FLT and FLE signal for any NaN.
+    template <typename F, typename Op>
+    uint64_t fp_compare(const DecodedInst & d, bool quiet, Op op) {
+        if (!fp_enabled()) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        F a = freg<F>(d.rs1);
+        F b = freg<F>(d.rs2);
+        if (quiet ? (fp_is_snan(a) || fp_is_snan(b)) : (std::isnan(a) || std::isnan(b))) {
+            fp_raise(FFLAGS_NV);
+            fp_dirty();
+        }
+        regs[d.rd] = op(a, b) ? 1 : 0;
+        return update_pc(d);
+    }
+
+    // FCVT to the integer type I, sign-extended to 64 bits.
+    template <typename I, typename F>
+    uint64_t fp_to_int(const DecodedInst & d) {
+        if (!fp_enabled() || !fp_round(d)) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        uint64_t flags = 0;
+        I value = ::fp_to_int<I>(freg<F>(d.rs1), flags);
+        regs[d.rd] = (uint64_t)(int64_t)(typename std::make_signed<I>::type)value;
+        if (0 != flags) {
+            fp_raise(flags);
+            fp_dirty();
+        }
+        return update_pc(d);
+    }
+
+    // FCVT from the integer type I, which rs1 holds the low bits of.
+    template <typename F, typename I>
+    uint64_t fp_from_int(const DecodedInst & d) {
+        if (!fp_enabled() || !fp_round(d)) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        set_freg<F>(d.rd, (F)(I)regs[d.rs1]);
+        return update_pc(d);
+    }
+
+    // Whether V instructions may run: mstatus.VS is not Off.
+    bool vec_enabled() {
+        return VS_OFF != (csr.load(MSTATUS) & MASK_VS);
+    }
+
+    // The v registers or the vector CSRs have changed: mark VS Dirty, once.
+    void vec_dirty() {
+        uint64_t status = csr.load(MSTATUS);
+        if (VS_DIRTY != (status & MASK_VS)) {
+            csr.store(MSTATUS, status | VS_DIRTY);
+        }
+    }
+
+    bool is_vector_csr(uint64_t addr) {
+        return (addr >= VSTART && addr <= VCSR) || (addr >= VL && addr <= VLENB);
+    }
+
+    // log2 of SEW in bytes, and the signed log2 of LMUL, from vtype.
+    uint64_t vec_sew() {
+        return (csr.load(VTYPE) >> 3) & 0x7;
+    }
+
+    int64_t vec_lmul() {
+        int64_t vlmul = csr.load(VTYPE) & 0x7;
+        return (vlmul < 4) ? vlmul : vlmul - 8;
+    }
+
+    template <typename T>
+    T * vreg(uint8_t r) {
+        return (T *)(vregs + r * vlenb);
+    }
+
+    // v0 if d is masked, which only leaves the elements whose v0 bit is set.
+    const uint8_t * vec_mask(const DecodedInst & d) {
+        return ((d.raw >> 25) & 0x1) ? nullptr : vregs;
+    }
+
+    /*!
+     * Whether an arithmetic vector instruction may run: V is on, vtype is valid,
+     * vstart is zero (an arithmetic instruction is never resumed halfway), and the
+     * register groups it names are aligned to LMUL. vs1 tells whether rs1 names one
+     * too; a reduction only takes a group from vs2.
+     * */
+    bool vec_ready(const DecodedInst & d, bool vs1, bool reduction = false) {
+        if (!vec_enabled() || 0 != (csr.load(VTYPE) & VTYPE_VILL) || 0 != csr.load(VSTART)) {
+            return false;
+        }
+        uint64_t group = (vec_lmul() > 0) ? (1ull << vec_lmul()) : 1;
+        uint64_t names = d.rs2 | (reduction ? 0 : d.rd) | ((vs1 && !reduction) ? d.rs1 : 0);
+        if (0 != names % group) {
+            return false;
+        }
+        // A masked instruction cannot write v0, which holds its mask.
+        return reduction || nullptr == vec_mask(d) || 0 != d.rd;
+    }
+
+    // vset{i}vl{i}: vtype and vl = min(avl, VLMAX), or vill and vl = 0 if the vtype
+    // is not supported. SEW is up to 64 bits and SEW / LMUL up to ELEN.
+    uint64_t vec_configure(const DecodedInst & d, uint64_t avl, uint64_t vtype) {
+        if (!vec_enabled()) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        uint64_t sew = (vtype >> 3) & 0x7;
+        int64_t lmul = (int64_t)(vtype & 0x7) - (((vtype & 0x7) < 4) ? 0 : 8);
+        uint64_t vl = 0;
+        if (0 != (vtype >> 8) || sew > 3 || -4 == lmul || lmul < (int64_t)sew - 3) {
+            vtype = VTYPE_VILL;
+        } else {
+            uint64_t vlmax = (vlenb >> sew);
+            vlmax = (lmul >= 0) ? (vlmax << lmul) : (vlmax >> -lmul);
+            vl = std::min(avl, vlmax);
+        }
+        csr.store(VTYPE, vtype);
+        csr.store(VL, vl);
+        csr.store(VSTART, 0);
+        regs[d.rd] = vl;
+        vec_dirty();
+        return update_pc(d);
+    }
+
+    // The avl of vsetvli and vsetvl: rs1, or VLMAX if rs1 is x0 but rd is not, or the
+    // current vl if both are x0.
+    uint64_t vec_avl(const DecodedInst & d) {
+        if (0 != d.rs1) {
+            return regs[d.rs1];
+        }
+        return (0 != d.rd) ? ~0ull : csr.load(VL);
+    }
+
+    // An element-wise integer instruction: vd = op(vd, vs2, b) for elements below vl,
+    // with b from vs1, rs1 or the immediate.
+    template <typename Op>
+    uint64_t vec_int(const DecodedInst & d, VecForm form) {
+        if (!vec_ready(d, VecForm::VV == form)) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        switch (vec_sew()) {
+        case 0: vec_int_as<Op, uint8_t>(d, form); break;
+        case 1: vec_int_as<Op, uint16_t>(d, form); break;
+        case 2: vec_int_as<Op, uint32_t>(d, form); break;
+        default: vec_int_as<Op, uint64_t>(d, form); break;
+        }
+        vec_dirty();
+        return update_pc(d);
+    }
+
+    template <typename Op, typename T>
+    void vec_int_as(const DecodedInst & d, VecForm form) {
+        VecGroup<T> a{vreg<T>(d.rs2)};
+        uint64_t vl = csr.load(VL);
+        if (VecForm::VV == form) {
+            vec_map<Op>(vreg<T>(d.rd), a, VecGroup<T>{vreg<T>(d.rs1)}, vl, vec_mask(d));
+        } else {
+            T b = (T)((VecForm::VX == form) ? regs[d.rs1] : d.imm);
+            vec_map<Op>(vreg<T>(d.rd), a, VecScalar<T>{b}, vl, vec_mask(d));
+        }
+    }
+
+    // The floating-point counterpart, for SEW of 32 and 64 bits in frm; b comes from
+    // vs1 or an f register.
+    template <typename Op>
+    uint64_t vec_fp(const DecodedInst & d, VecForm form) {
+        if (!vec_ready(d, VecForm::VV == form) || !fp_enabled() || vec_sew() < 2 || !fp_round(RM_DYN)) {
+            return raise(Exception::IllegalInstruction, d.raw);
+        }
+        if (2 == vec_sew()) {
+            vec_fp_as<Op, float>(d, form);
+        } else {
+            vec_fp_as<Op, double>(d, form);
+        }
+        vec_dirty();
+        fp_dirty();
+        return update_pc(d);
+    }
+
+    template <typename Op, typename F>
+    void vec_fp_as(const DecodedInst & d, VecForm form) {
+        VecGroup<F> a{vreg<F>(d.rs2)};
+        uint64_t vl = csr.load(VL);
+        if (VecForm::VV == form) {
+            vec_map<Op>(vreg<F>(d.rd), a, VecGroup<F>{vreg<F>(d.rs1)}, vl, vec_mask(d));
+        } else {
+            vec_map<Op>(vreg<F>(d.rd), a, VecScalar<F>{freg<F>(d.rs1)}, vl, vec_mask(d));
+        }
+    }
+
+    // vredsum.vs: vd[0] = vs1[0] + the active elements of vs2, wrapping.
+    template <typename T>
+    void vec_redsum_as(const DecodedInst & d) {
+        T sum = (T)(vec_get(vreg<T>(d.rs1), 0) + vec_sum(vreg<T>(d.rs2), csr.load(VL), vec_mask(d)));
+        vec_set(vreg<T>(d.rd), 0, sum);
+    }
+
+    // vle and vse: elements vstart to vl - 1 of the register group at rd, in memory
+    // from rs1 on. Runs of elements within a page are copied in one go.
+    uint64_t vec_access(const DecodedInst & d, AccessType access_type);
+
+    // Whether the CSR instruction d writes its CSR: csrrs and csrrc with x0, and their
+    // immediate forms with 0, only read it.
+    static bool csr_writes(const DecodedInst & d) {
+        return OP_CSRRW == d.op || OP_CSRRWI == d.op || 0 != d.rs1;
+    }
+
+    // Check that the CSR instruction d may access its CSR, and bring fcsr up to date.
+    // The CSRs with both top address bits set are read-only.
+    bool csr_accessible(const DecodedInst & d) {
+        uint64_t addr = d.imm;
+        if (csr_writes(d) && 0x3 == ((addr >> 10) & 0x3)) {
+            return false;
+        }
+        if (is_vector_csr(addr)) {
+            return vec_enabled();
+        }
+        if (addr < FFLAGS || addr > FCSR) {
+            return true;
+        }
+        if (!fp_enabled()) {
+            return false;
+        }
+        sync_fflags();
+        return true;
+    }
+
+    // The CSR instruction d has run. A read leaves FS and VS alone, and the TLBs too.
+    void csr_written(const DecodedInst & d) {
+        if (!csr_writes(d)) {
+            return;
+        }
+        uint64_t addr = d.imm;
+        if (addr >= FFLAGS && addr <= FCSR) {
+            fp_dirty();
+        } else if (is_vector_csr(addr)) {
+            vec_dirty();
+        }
+        update_paging(addr);
+    }
+
+#define RV_OP_DECLARE(op, name) uint64_t exec_##name(const DecodedInst & d);
+    RV_OPS(RV_OP_DECLARE)
+#undef RV_OP_DECLARE
+};
+
+uint64_t CPU::execute(uint64_t inst) {
+    return execute(decode((uint32_t)inst));
+}
+
+uint64_t CPU::execute(const DecodedInst & d) {
+    // x0 is hardwired zero
+    regs[0] = 0;
+
+    switch (d.op) {
+#define RV_OP_CASE(op, name) case OP_##op: return exec_##name(d);
+    RV_OPS(RV_OP_CASE)
+#undef RV_OP_CASE
+    default:
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+}
+
+/*!
+ * Direct-threaded interpreter: every handler ends by fetching the next decoded
+ * instruction and jumping to its handler, so each op has an indirect jump of its own
+ * for the host branch predictor instead of all of them sharing the one of a switch.
+ * Needs the labels-as-values extension of GCC/Clang; elsewhere it is the interpreter.
+ * */
+void CPU::run_threaded() {
+#if defined(__GNUC__)
+    static void * const labels[OP_COUNT] = {
+#define RV_OP_LABEL(code, name) &&L_##code,
+        RV_OPS(RV_OP_LABEL)
+#undef RV_OP_LABEL
+    };
+    const DecodedInst * d;
+    // The instruction being run, copied out of its slot: a store to the page would
+    // drop the slot under the handler.
+    DecodedInst inst;
+    uint64_t new_pc;
+next:
+    if (!running()) {
+        return;
+    }
+    d = fetch_decoded();
+    if (nullptr == d) {
+        goto trapped;
+    }
+    inst = *d;
+    goto *labels[inst.op];
+#define RV_OP_HANDLER(code, name)         \
+L_##code:                                 \
+    regs[0] = 0;                          \
+    new_pc = exec_##name(inst);           \
+    if (TRAPPED == new_pc) {              \
+        goto trapped;                     \
+    }                                     \
+    pc = new_pc;                          \
+    take_interrupt();                     \
+    if (!running()) {                     \
+        return;                           \
+    }                                     \
+    d = fetch_decoded();                  \
+    if (nullptr == d) {                   \
+        goto trapped;                     \
+    }                                     \
+    inst = *d;                            \
+    goto *labels[inst.op];
+    RV_OPS(RV_OP_HANDLER)
+#undef RV_OP_HANDLER
+trapped:
+    if (take_trap()) {
+        goto next;
+    }
+#else
+    run_interpreter();
+#endif
+}
+
+/*!
+ * Block engine: run a whole block, then check for interrupts and move to the next
+ * block through the links of the current one. pc is only written at block
+ * boundaries, or when an instruction in the middle of a block traps.
+ * */
+void CPU::run_blocks() {
+    Block * b = nullptr;
+    while (running()) {
+        if (nullptr == b) {
+            b = lookup_block();
+            if (nullptr == b) {
+                // Cannot be cached, run a single instruction.
+                if (!step()) {
+                    break;
+                }
+                continue;
+            }
+        }
+        const DecodedInst * insts = b->insts.data();
+        size_t last = b->insts.size() - 1;
+        size_t i = 0;
+        uint64_t inst_pc = b->pc;
+        while (i < last && TRAPPED != execute(insts[i])) {
+            inst_pc += inst_len(insts[i]);
+            ++i;
+        }
+        pc = inst_pc;
+        uint64_t new_pc = (i == last) ? execute(insts[last]) : TRAPPED;
+        if (TRAPPED == new_pc) {
+            b = nullptr;
+            if (!take_trap()) {
+                break;
+            }
+            continue;
+        }
+        pc = new_pc;
+        if (take_interrupt(b->insts.size())) {
+            b = nullptr;
+            continue;
+        }
+        b = next_block(b);
+    }
+}
+
+/*!
+ * JIT engine: the block engine, running each block as host code translated on its
+ * first execution. A trapping helper makes the translated code return TRAPPED at once.
+ * */
+void CPU::run_jit() {
+    if (!jit.init()) {
+        std::cerr << "jit unavailable, using the block engine\n";
+        run_blocks();
+        return;
+    }
+    Block * b = nullptr;
+    while (running()) {
+        if (nullptr == b) {
+            b = lookup_block();
+            if (nullptr == b) {
+                // Cannot be cached, run a single instruction.
+                if (!step()) {
+                    break;
+                }
+                continue;
+            }
+        }
+        if (nullptr == b->code) {
+            if (!jit.has_room()) {
+                // Out of code space: start over with an empty cache.
+                blocks.invalidate();
+                b = lookup_block();
+                continue;
+            }
+            b->code = jit.compile(*b, &CPU::jit_exec);
+        }
+        uint64_t new_pc = b->code(this, regs);
+        if (TRAPPED == new_pc) {
+            // pc has been set to the trapping instruction by jit_exec.
+            b = nullptr;
+            if (!take_trap()) {
+                break;
+            }
+            continue;
+        }
+        pc = new_pc;
+        if (take_interrupt(b->insts.size())) {
+            b = nullptr;
+            continue;
+        }
+        b = next_block(b);
+    }
+}
+
+uint64_t CPU::jit_exec(CPU * cpu, const DecodedInst * d, uint64_t inst_pc) {
+    cpu->pc = inst_pc;
+    return cpu->execute(*d);
+}
+
+Block * CPU::lookup_block() {
+    if (blocks.is_stale()) {
+        blocks.flush();
+        jit.reset();
+    }
+    uint64_t ppc;
+    if (Exception::None != translate(pc, AccessType::Instruction, ppc)) {
+        // Let the instruction be fetched on its own to report the fault.
+        return nullptr;
+    }
+    uint64_t satp = csr.load(SATP);
+    Block * b = blocks.find(pc, ppc, mode, satp);
+    if (nullptr != b) {
+        return b;
+    }
+    DecodedInst * page = icache.page(ppc);
+    if (nullptr == page) {
+        return nullptr;
+    }
+    const uint8_t * host = bus.host_page(ppc);
+
+    std::unique_ptr<Block> block(new Block);
+    block->pc = pc;
+    block->ppc = ppc;
+    block->mode = mode;
+    block->satp = satp;
+    block->epoch = translation_epoch;
+    block->next[0] = block->next[1] = nullptr;
+    block->next_pc[0] = block->next_pc[1] = 0;
+    block->code = nullptr;
+    uint64_t offset = ppc & (PAGE_SIZE - 1);
+    uint64_t inst_pc = pc;
+    while (true) {
+        DecodedInst & slot = page[offset >> 1];
+        if (OP_DECODE == slot.op) {
+            if (straddles(host, offset)) {
+                // Left to step(), see fetch_decoded().
+                break;
+            }
+            slot = decode(read_inst(host, offset));
+        }
+        DecodedInst d = slot;
+        if (OP_AUIPC == d.op) {
+            // The block is bound to its virtual pc, so the result is a constant.
+            d.op = OP_LUI;
+            d.imm += inst_pc;
+        }
+        block->insts.push_back(d);
+        offset += inst_len(d);
+        inst_pc += inst_len(d);
+        if (ends_block(d.op) || PAGE_SIZE == offset || MAX_BLOCK_INSTS == block->insts.size()) {
+            break;
+        }
+    }
+    if (block->insts.empty()) {
+        return nullptr;
+    }
+    uint8_t last = block->insts.back().op;
+    block->chainable = is_jump(last) || !ends_block(last);
+    return blocks.insert(std::move(block));
+}
+
+Block * CPU::next_block(Block * b) {
+    if (blocks.is_stale() || !b->chainable) {
+        return lookup_block();
+    }
+    if (b->epoch != translation_epoch) {
+        b->epoch = translation_epoch;
+        b->next[0] = b->next[1] = nullptr;
+    }
+    if (nullptr != b->next[0] && b->next_pc[0] == pc) {
+        return b->next[0];
+    }
+    if (nullptr != b->next[1] && b->next_pc[1] == pc) {
+        return b->next[1];
+    }
+    Block * next = lookup_block();
+    if (nullptr != next) {
+        // Keep the first successor, let the second one follow the latest target.
+        int k = (nullptr == b->next[0]) ? 0 : 1;
+        b->next[k] = next;
+        b->next_pc[k] = pc;
+    }
+    return next;
+}
+
+const DecodedInst * CPU::fetch_decoded() {
+    uint64_t vpage = pc & ~(PAGE_SIZE - 1);
+    uint64_t inst = 0;
+    if (vpage != fetch_vpage) {
+        uint64_t ppc;
+        DecodedInst * page = nullptr;
+        if (Exception::None == translate(pc, AccessType::Instruction, ppc)) {
+            page = icache.page(ppc);
+        }
+        if (nullptr == page) {
+            // Not mapped or not in DRAM, let fetch() report the fault.
+            if (!fetch(inst)) {
+                return nullptr;
+            }
+            fetch_scratch = decode(inst);
+            return &fetch_scratch;
+        }
+        fetch_page = page;
+        fetch_host = bus.host_page(ppc);
+        fetch_vpage = vpage;
+    }
+    uint64_t offset = pc & (PAGE_SIZE - 1);
+    DecodedInst & d = fetch_page[offset >> 1];
+    if (OP_DECODE == d.op) {
+        if (straddles(fetch_host, offset)) {
+            // The upper half is on the next page, which a store would not drop this
+            // page for, so the instruction is never cached.
+            if (!fetch(inst)) {
+                return nullptr;
+            }
+            fetch_scratch = decode(inst);
+            return &fetch_scratch;
+        }
+        d = decode(read_inst(fetch_host, offset));
+    }
+    return &d;
+}
+
+bool CPU::straddles(const uint8_t * host, uint64_t offset) {
+    return PAGE_SIZE - 2 == offset && 0x3 == (Dram::read<16>(host + offset) & 0x3);
+}
+
+uint32_t CPU::read_inst(const uint8_t * host, uint64_t offset) {
+    // A compressed instruction in the last half-word of the page must not read past it.
+    return (PAGE_SIZE - 2 == offset) ? Dram::read<16>(host + offset) : Dram::read<32>(host + offset);
+}
+
+void CPU::flush_fetch() {
+    fetch_vpage = ~0ull;
+}
+
+// A slot that has not been decoded yet. Only reached when executing a zeroed slot.
+uint64_t CPU::exec_decode(const DecodedInst & d) {
+    return execute(decode(d.raw));
+}
+
+uint64_t CPU::exec_illegal(const DecodedInst & d) {
+    return raise(Exception::IllegalInstruction, d.raw);
+}
+
+// LOAD
+uint64_t CPU::exec_lb(const DecodedInst & d) {
+    uint64_t value;
+    if (!load(regs[d.rs1] + d.imm, 8, value)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int8_t)value;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_lh(const DecodedInst & d) {
+    uint64_t value;
+    if (!load(regs[d.rs1] + d.imm, 16, value)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int16_t)value;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_lw(const DecodedInst & d) {
+    uint64_t value;
+    if (!load(regs[d.rs1] + d.imm, 32, value)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)value;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_ld(const DecodedInst & d) {
+    uint64_t value;
+    if (!load(regs[d.rs1] + d.imm, 64, value)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = value;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_lbu(const DecodedInst & d) {
+    uint64_t value;
+    if (!load(regs[d.rs1] + d.imm, 8, value)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = value;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_lhu(const DecodedInst & d) {
+    uint64_t value;
+    if (!load(regs[d.rs1] + d.imm, 16, value)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = value;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_lwu(const DecodedInst & d) {
+    uint64_t value;
+    if (!load(regs[d.rs1] + d.imm, 32, value)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = value;
+    return update_pc(d);
+}
+
+// Other harts run on other host threads and see guest memory through the host's
+// memory model, so a fence is a full host fence.
+uint64_t CPU::exec_fence(const DecodedInst & d) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return update_pc(d);
+}
+
+// Make earlier stores visible to instruction fetch: drop every predecoded instruction.
+uint64_t CPU::exec_fence_i(const DecodedInst & d) {
+    icache.flush();
+    flush_fetch();
+    blocks.invalidate();
+    return update_pc(d);
+}
+
+// OP-IMM
+uint64_t CPU::exec_addi(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] + d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_slli(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] << d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_slti(const DecodedInst & d) {
+    regs[d.rd] = ((int64_t)regs[d.rs1] < (int64_t)d.imm ? 1 : 0);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sltiu(const DecodedInst & d) {
+    regs[d.rd] = (regs[d.rs1] < d.imm ? 1 : 0);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_xori(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] ^ d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_srli(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] >> d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_srai(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)((int64_t)regs[d.rs1] >> d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_ori(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] | d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_andi(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] & d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_auipc(const DecodedInst & d) {
+    regs[d.rd] = pc + d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_addiw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)(regs[d.rs1] + d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_slliw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)(regs[d.rs1] << d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_srliw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)((uint32_t)regs[d.rs1] >> d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sraiw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)((int32_t)regs[d.rs1] >> d.imm);
+    return update_pc(d);
+}
+
+// STORE
+uint64_t CPU::exec_sb(const DecodedInst & d) {
+    if (!store(regs[d.rs1] + d.imm, 8, regs[d.rs2])) {
+        return TRAPPED;
+    }
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sh(const DecodedInst & d) {
+    if (!store(regs[d.rs1] + d.imm, 16, regs[d.rs2])) {
+        return TRAPPED;
+    }
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sw(const DecodedInst & d) {
+    if (!store(regs[d.rs1] + d.imm, 32, regs[d.rs2])) {
+        return TRAPPED;
+    }
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sd(const DecodedInst & d) {
+    if (!store(regs[d.rs1] + d.imm, 64, regs[d.rs2])) {
+        return TRAPPED;
+    }
+    return update_pc(d);
+}
+
+// RV64A: "A" standard extension for atomic instructions. The results of the word
+// forms are sign-extended.
+uint64_t CPU::exec_lr_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!load_reserved<32>(regs[d.rs1], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sc_w(const DecodedInst & d) {
+    bool stored;
+    if (!store_conditional<32>(regs[d.rs1], regs[d.rs2], stored)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = stored ? 0 : 1;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoswap_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Swap>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoadd_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Add>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoxor_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Xor>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoand_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::And>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoor_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Or>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amomin_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Min>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amomax_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Max>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amominu_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Minu>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amomaxu_w(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<32, AmoOp::Maxu>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_lr_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!load_reserved<64>(regs[d.rs1], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sc_d(const DecodedInst & d) {
+    bool stored;
+    if (!store_conditional<64>(regs[d.rs1], regs[d.rs2], stored)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = stored ? 0 : 1;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoswap_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Swap>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoadd_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Add>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoxor_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Xor>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoand_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::And>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amoor_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Or>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amomin_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Min>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amomax_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Max>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amominu_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Minu>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_amomaxu_d(const DecodedInst & d) {
+    uint64_t t;
+    if (!amo<64, AmoOp::Maxu>(regs[d.rs1], regs[d.rs2], t)) {
+        return TRAPPED;
+    }
+    regs[d.rd] = t;
+    return update_pc(d);
+}
+
+// OP
+// "SLL, SRL, and SRA perform logical left, logical right, and arithmetic right
+// shifts on the value in register rs1 by the shift amount held in register rs2.
+// In RV64I, only the low 6 bits of rs2 are considered for the shift amount."
+uint64_t CPU::exec_add(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] + regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sub(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] - regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sll(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] << (regs[d.rs2] & 0x3f);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_slt(const DecodedInst & d) {
+    regs[d.rd] = ((int64_t)regs[d.rs1] < (int64_t)regs[d.rs2] ? 1 : 0);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sltu(const DecodedInst & d) {
+    regs[d.rd] = (regs[d.rs1] < regs[d.rs2] ? 1 : 0);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_xor_(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] ^ regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_srl(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] >> (regs[d.rs2] & 0x3f);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sra(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)((int64_t)regs[d.rs1] >> (regs[d.rs2] & 0x3f));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_or_(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] | regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_and_(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] & regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_lui(const DecodedInst & d) {
+    regs[d.rd] = d.imm;
+    return update_pc(d);
+}
+
+// OP-32
+// "The shift amount is given by rs2[4:0]."
+uint64_t CPU::exec_addw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)(regs[d.rs1] + regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_subw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)(regs[d.rs1] - regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sllw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int32_t)((uint32_t)regs[d.rs1] << (regs[d.rs2] & 0x1f));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_srlw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int32_t)((uint32_t)regs[d.rs1] >> (regs[d.rs2] & 0x1f));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sraw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)((int32_t)regs[d.rs1] >> (int32_t)(regs[d.rs2] & 0x1f));
+    return update_pc(d);
+}
+
+// RV64M: "M" standard extension for integer multiplication and division, see
+// muldiv.h. The results of the word forms are sign-extended, unsigned ones too.
+uint64_t CPU::exec_mul(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] * regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_mulh(const DecodedInst & d) {
+    regs[d.rd] = mulh((int64_t)regs[d.rs1], (int64_t)regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_mulhsu(const DecodedInst & d) {
+    regs[d.rd] = mulhsu((int64_t)regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_mulhu(const DecodedInst & d) {
+    regs[d.rd] = mulhu(regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_div(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)div_signed((int64_t)regs[d.rs1], (int64_t)regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_divu(const DecodedInst & d) {
+    regs[d.rd] = div_unsigned(regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_rem(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)rem_signed((int64_t)regs[d.rs1], (int64_t)regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_remu(const DecodedInst & d) {
+    regs[d.rd] = rem_unsigned(regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_mulw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)(regs[d.rs1] * regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_divw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)div_signed((int32_t)regs[d.rs1], (int32_t)regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_divuw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)div_unsigned((uint32_t)regs[d.rs1], (uint32_t)regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_remw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)rem_signed((int32_t)regs[d.rs1], (int32_t)regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_remuw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)rem_unsigned((uint32_t)regs[d.rs1], (uint32_t)regs[d.rs2]);
+    return update_pc(d);
+}
+
+// Zba, Zbb and Zbs, on the host bit instructions where there are some, see bitmanip.h.
+// The .uw forms take the low word of rs1 zero-extended; the other word forms
+// sign-extend their 32-bit result.
+uint64_t CPU::exec_add_uw(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs2] + (uint32_t)regs[d.rs1];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_slli_uw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(uint32_t)regs[d.rs1] << d.imm;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sh1add(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs2] + (regs[d.rs1] << 1);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sh2add(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs2] + (regs[d.rs1] << 2);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sh3add(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs2] + (regs[d.rs1] << 3);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sh1add_uw(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs2] + ((uint64_t)(uint32_t)regs[d.rs1] << 1);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sh2add_uw(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs2] + ((uint64_t)(uint32_t)regs[d.rs1] << 2);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sh3add_uw(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs2] + ((uint64_t)(uint32_t)regs[d.rs1] << 3);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_andn(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] & ~regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_orn(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] | ~regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_xnor(const DecodedInst & d) {
+    regs[d.rd] = ~(regs[d.rs1] ^ regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_clz(const DecodedInst & d) {
+    regs[d.rd] = clz64(regs[d.rs1]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_ctz(const DecodedInst & d) {
+    regs[d.rd] = ctz64(regs[d.rs1]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_cpop(const DecodedInst & d) {
+    regs[d.rd] = cpop64(regs[d.rs1]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_clzw(const DecodedInst & d) {
+    regs[d.rd] = clz64((uint32_t)regs[d.rs1]) - 32;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_ctzw(const DecodedInst & d) {
+    // Bit 32 stops the count at 32 for a zero word.
+    regs[d.rd] = ctz64(regs[d.rs1] | (1ull << 32));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_cpopw(const DecodedInst & d) {
+    regs[d.rd] = cpop64((uint32_t)regs[d.rs1]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_min(const DecodedInst & d) {
+    regs[d.rd] = ((int64_t)regs[d.rs1] < (int64_t)regs[d.rs2]) ? regs[d.rs1] : regs[d.rs2];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_minu(const DecodedInst & d) {
+    regs[d.rd] = std::min(regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_max(const DecodedInst & d) {
+    regs[d.rd] = ((int64_t)regs[d.rs1] < (int64_t)regs[d.rs2]) ? regs[d.rs2] : regs[d.rs1];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_maxu(const DecodedInst & d) {
+    regs[d.rd] = std::max(regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sext_b(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int8_t)regs[d.rs1];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sext_h(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int16_t)regs[d.rs1];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_zext_h(const DecodedInst & d) {
+    regs[d.rd] = (uint16_t)regs[d.rs1];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_rol(const DecodedInst & d) {
+    regs[d.rd] = rol64(regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_ror(const DecodedInst & d) {
+    regs[d.rd] = ror64(regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_rori(const DecodedInst & d) {
+    regs[d.rd] = ror64(regs[d.rs1], d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_rolw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)rol32((uint32_t)regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_rorw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)ror32((uint32_t)regs[d.rs1], regs[d.rs2]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_roriw(const DecodedInst & d) {
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)ror32((uint32_t)regs[d.rs1], d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_orc_b(const DecodedInst & d) {
+    regs[d.rd] = orc_b(regs[d.rs1]);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_rev8(const DecodedInst & d) {
+    regs[d.rd] = bswap64(regs[d.rs1]);
+    return update_pc(d);
+}
+
+// The single-bit instructions use the low 6 bits of rs2 or of the immediate.
+uint64_t CPU::exec_bclr(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] & ~(1ull << (regs[d.rs2] & 0x3f));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_bclri(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] & ~(1ull << d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_bext(const DecodedInst & d) {
+    regs[d.rd] = (regs[d.rs1] >> (regs[d.rs2] & 0x3f)) & 1;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_bexti(const DecodedInst & d) {
+    regs[d.rd] = (regs[d.rs1] >> d.imm) & 1;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_binv(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] ^ (1ull << (regs[d.rs2] & 0x3f));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_binvi(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] ^ (1ull << d.imm);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_bset(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] | (1ull << (regs[d.rs2] & 0x3f));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_bseti(const DecodedInst & d) {
+    regs[d.rd] = regs[d.rs1] | (1ull << d.imm);
+    return update_pc(d);
+}
+
+// BRANCH
+uint64_t CPU::exec_beq(const DecodedInst & d) {
+    return regs[d.rs1] == regs[d.rs2] ? pc + d.imm : update_pc(d);
+}
+
+uint64_t CPU::exec_bne(const DecodedInst & d) {
+    return regs[d.rs1] != regs[d.rs2] ? pc + d.imm : update_pc(d);
+}
+
+uint64_t CPU::exec_blt(const DecodedInst & d) {
+    return (int64_t)regs[d.rs1] < (int64_t)regs[d.rs2] ? pc + d.imm : update_pc(d);
+}
+
+uint64_t CPU::exec_bge(const DecodedInst & d) {
+    return (int64_t)regs[d.rs1] >= (int64_t)regs[d.rs2] ? pc + d.imm : update_pc(d);
+}
+
+uint64_t CPU::exec_bltu(const DecodedInst & d) {
+    return regs[d.rs1] < regs[d.rs2] ? pc + d.imm : update_pc(d);
+}
+
+uint64_t CPU::exec_bgeu(const DecodedInst & d) {
+    return regs[d.rs1] >= regs[d.rs2] ? pc + d.imm : update_pc(d);
+}
+
+uint64_t CPU::exec_jalr(const DecodedInst & d) {
+    uint64_t t = update_pc(d);
+    uint64_t new_pc = (regs[d.rs1] + d.imm) & (~(uint64_t)1);
+    regs[d.rd] = t;
+    return new_pc;
+}
+
+uint64_t CPU::exec_jal(const DecodedInst & d) {
+    regs[d.rd] = update_pc(d);
+    return pc + d.imm;
+}
+
+// SYSTEM
+uint64_t CPU::exec_ecall([[maybe_unused]] const DecodedInst & d) {
+    if (user_mode == mode) {
+        return raise(Exception::EnvironmentCallFromUMode, pc);
+    }
+    else if (supervisor_mode == mode) {
+        return raise(Exception::EnvironmentCallFromSMode, pc);
+    }
+    else {
+        return raise(Exception::EnvironmentCallFromMMode, pc);
+    }
+}
+
+uint64_t CPU::exec_ebreak([[maybe_unused]] const DecodedInst & d) {
+    return raise(Exception::Breakpoint, pc);
+}
+
+uint64_t CPU::exec_sret([[maybe_unused]] const DecodedInst & d) {
+    // When the SRET instruction is executed to return from the trap
+    // handler, the privilege level is set to user mode if the SPP
+    // bit is 0, or supervisor mode if the SPP bit is 1. The SPP bit
+    // is SSTATUS[8].
+    uint64_t sstatus = csr.load(SSTATUS);
+    mode = (sstatus & MASK_SPP) >> 8;
+    // The SPIE bit is SSTATUS[5] and the SIE bit is the SSTATUS[1]
+    uint64_t spie = (sstatus & MASK_SPIE) >> 5;
+    // set SIE = SPIE
+    sstatus = (sstatus & (~MASK_SIE)) | (spie << 1);
+    // set SPIE = 1
+    sstatus |= MASK_SPIE;
+    // set SPP the least priviledge mode (u-mode)
+    sstatus &= ~MASK_SPP;
+    csr.store(SSTATUS, sstatus);
+    flush_fetch();
+    // set the pc to CSRs[sepc].
+    // With the C extension IALIGN=16, so only sepc[0] is masked on reads. This masking
+    // occurs also for the implicit read by the SRET instruction.
+    return csr.load(SEPC) & (~(uint64_t)1);
+}
+
+uint64_t CPU::exec_mret([[maybe_unused]] const DecodedInst & d) {
+    uint64_t mstatus = csr.load(MSTATUS);
+    // MPP is two bits wide at MSTATUS[12:11]
+    mode = (mstatus & MASK_MPP) >> 11;
+    // The MPIE bit is MSTATUS[7] and the MIE bit is the MSTATUS[3].
+    uint64_t mpie = (mstatus & MASK_MPIE) >> 7;
+    // set MIE = MPIE
+    mstatus = (mstatus & (~MASK_MIE)) | (mpie << 3);
+    // set MPIE = 1
+    mstatus |= MASK_MPIE;
+    // set MPP the least priviledge mode (u-mode)
+    mstatus &= ~MASK_MPP;
+    // if MPP != M, set MPRV = 0
+    mstatus &= ~MASK_MPRV;
+    csr.store(MSTATUS, mstatus);
+    flush_fetch();
+    // set the pc to CSRs[mepc].
+    return csr.load(MEPC) & (~(uint64_t)1);
+}
+
+uint64_t CPU::exec_wfi(const DecodedInst & d) {
+    // 3.1.6.5
+    // WFI is illegal in U-mode, and in S-mode when TW is set.
+    if (user_mode == mode || (supervisor_mode == mode && (csr.load(MSTATUS) & MASK_TW))) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    wait_for_interrupt();
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_sfence_vma(const DecodedInst & d) {
+    itlb.flush();
+    dtlb.flush();
+    flush_fetch();
+    translation_epoch++;
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_csrrw(const DecodedInst & d) {
+    if (!csr_accessible(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t t = csr.load(d.imm);
+    csr.store(d.imm, regs[d.rs1]);
+    regs[d.rd] = t;
+    csr_written(d);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_csrrs(const DecodedInst & d) {
+    if (!csr_accessible(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t t = csr.load(d.imm);
+    csr.store(d.imm, t | regs[d.rs1]);
+    regs[d.rd] = t;
+    csr_written(d);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_csrrc(const DecodedInst & d) {
+    if (!csr_accessible(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t t = csr.load(d.imm);
+    csr.store(d.imm, t & (~regs[d.rs1]));
+    regs[d.rd] = t;
+    csr_written(d);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_csrrwi(const DecodedInst & d) {
+    if (!csr_accessible(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t zimm = (uint64_t)d.rs1;
+    uint64_t t = csr.load(d.imm);
+    csr.store(d.imm, zimm);
+    regs[d.rd] = t;
+    csr_written(d);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_csrrsi(const DecodedInst & d) {
+    if (!csr_accessible(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t zimm = (uint64_t)d.rs1;
+    uint64_t t = csr.load(d.imm);
+    csr.store(d.imm, t | zimm);
+    regs[d.rd] = t;
+    csr_written(d);
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_csrrci(const DecodedInst & d) {
+    if (!csr_accessible(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t zimm = (uint64_t)d.rs1;
+    uint64_t t = csr.load(d.imm);
+    csr.store(d.imm, t & (~zimm));
+    regs[d.rd] = t;
+    csr_written(d);
+    return update_pc(d);
+}
+
+// RV64F and RV64D: "F" and "D" standard extensions for floating point, on the host
+// FPU, see fp.h. Loads and stores move raw bits and signal nothing.
+uint64_t CPU::exec_flw(const DecodedInst & d) {
+    uint64_t value;
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    if (!load(regs[d.rs1] + d.imm, 32, value)) {
+        return TRAPPED;
+    }
+    fregs[d.rd] = 0xffffffff00000000ull | value;
+    fp_dirty();
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fld(const DecodedInst & d) {
+    uint64_t value;
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    if (!load(regs[d.rs1] + d.imm, 64, value)) {
+        return TRAPPED;
+    }
+    fregs[d.rd] = value;
+    fp_dirty();
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fsw(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    if (!store(regs[d.rs1] + d.imm, 32, fregs[d.rs2])) {
+        return TRAPPED;
+    }
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fsd(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    if (!store(regs[d.rs1] + d.imm, 64, fregs[d.rs2])) {
+        return TRAPPED;
+    }
+    return update_pc(d);
+}
+
+// FMV moves bits between the register files as they are; FMV.X.W sign-extends.
+uint64_t CPU::exec_fmv_x_w(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    regs[d.rd] = (uint64_t)(int64_t)(int32_t)fregs[d.rs1];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fmv_w_x(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    fregs[d.rd] = 0xffffffff00000000ull | (uint32_t)regs[d.rs1];
+    fp_dirty();
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fmv_x_d(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    regs[d.rd] = fregs[d.rs1];
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fmv_d_x(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    fregs[d.rd] = regs[d.rs1];
+    fp_dirty();
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fcvt_s_d(const DecodedInst & d) {
+    if (!fp_enabled() || !fp_round(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    set_freg<float>(d.rd, fp_canonical((float)freg<double>(d.rs1)));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fcvt_d_s(const DecodedInst & d) {
+    if (!fp_enabled() || !fp_round(d)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    set_freg<double>(d.rd, fp_canonical((double)freg<float>(d.rs1)));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fmadd_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float c) { return std::fma(a, b, c); });
+}
+
+uint64_t CPU::exec_fmsub_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float c) { return std::fma(a, b, -c); });
+}
+
+uint64_t CPU::exec_fnmsub_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float c) { return std::fma(-a, b, c); });
+}
+
+uint64_t CPU::exec_fnmadd_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float c) { return std::fma(-a, b, -c); });
+}
+
+uint64_t CPU::exec_fadd_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float) { return a + b; });
+}
+
+uint64_t CPU::exec_fsub_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float) { return a - b; });
+}
+
+uint64_t CPU::exec_fmul_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float) { return a * b; });
+}
+
+uint64_t CPU::exec_fdiv_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float b, float) { return a / b; });
+}
+
+uint64_t CPU::exec_fsqrt_s(const DecodedInst & d) {
+    return fp_arith<float>(d, [](float a, float, float) { return std::sqrt(a); });
+}
+
+uint64_t CPU::exec_fsgnj_s(const DecodedInst & d) {
+    return fp_sign<float>(d, false, false);
+}
+
+uint64_t CPU::exec_fsgnjn_s(const DecodedInst & d) {
+    return fp_sign<float>(d, true, false);
+}
+
+uint64_t CPU::exec_fsgnjx_s(const DecodedInst & d) {
+    return fp_sign<float>(d, false, true);
+}
+
+uint64_t CPU::exec_fmin_s(const DecodedInst & d) {
+    return fp_min_max<float>(d, false);
+}
+
+uint64_t CPU::exec_fmax_s(const DecodedInst & d) {
+    return fp_min_max<float>(d, true);
+}
+
+uint64_t CPU::exec_feq_s(const DecodedInst & d) {
+    return fp_compare<float>(d, true, [](float a, float b) { return a == b; });
+}
+
+uint64_t CPU::exec_flt_s(const DecodedInst & d) {
+    return fp_compare<float>(d, false, [](float a, float b) { return a < b; });
+}
+
+uint64_t CPU::exec_fle_s(const DecodedInst & d) {
+    return fp_compare<float>(d, false, [](float a, float b) { return a <= b; });
+}
+
+uint64_t CPU::exec_fclass_s(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    regs[d.rd] = fp_class(freg<float>(d.rs1));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fcvt_w_s(const DecodedInst & d) {
+    return fp_to_int<int32_t, float>(d);
+}
+
+uint64_t CPU::exec_fcvt_wu_s(const DecodedInst & d) {
+    return fp_to_int<uint32_t, float>(d);
+}
+
+uint64_t CPU::exec_fcvt_l_s(const DecodedInst & d) {
+    return fp_to_int<int64_t, float>(d);
+}
+
+uint64_t CPU::exec_fcvt_lu_s(const DecodedInst & d) {
+    return fp_to_int<uint64_t, float>(d);
+}
+
+uint64_t CPU::exec_fcvt_s_w(const DecodedInst & d) {
+    return fp_from_int<float, int32_t>(d);
+}
+
+uint64_t CPU::exec_fcvt_s_wu(const DecodedInst & d) {
+    return fp_from_int<float, uint32_t>(d);
+}
+
+uint64_t CPU::exec_fcvt_s_l(const DecodedInst & d) {
+    return fp_from_int<float, int64_t>(d);
+}
+
+uint64_t CPU::exec_fcvt_s_lu(const DecodedInst & d) {
+    return fp_from_int<float, uint64_t>(d);
+}
+
+uint64_t CPU::exec_fmadd_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double c) { return std::fma(a, b, c); });
+}
+
+uint64_t CPU::exec_fmsub_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double c) { return std::fma(a, b, -c); });
+}
+
+uint64_t CPU::exec_fnmsub_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double c) { return std::fma(-a, b, c); });
+}
+
+uint64_t CPU::exec_fnmadd_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double c) { return std::fma(-a, b, -c); });
+}
+
+uint64_t CPU::exec_fadd_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double) { return a + b; });
+}
+
+uint64_t CPU::exec_fsub_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double) { return a - b; });
+}
+
+uint64_t CPU::exec_fmul_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double) { return a * b; });
+}
+
+uint64_t CPU::exec_fdiv_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double b, double) { return a / b; });
+}
+
+uint64_t CPU::exec_fsqrt_d(const DecodedInst & d) {
+    return fp_arith<double>(d, [](double a, double, double) { return std::sqrt(a); });
+}
+
+uint64_t CPU::exec_fsgnj_d(const DecodedInst & d) {
+    return fp_sign<double>(d, false, false);
+}
+
+uint64_t CPU::exec_fsgnjn_d(const DecodedInst & d) {
+    return fp_sign<double>(d, true, false);
+}
+
+uint64_t CPU::exec_fsgnjx_d(const DecodedInst & d) {
+    return fp_sign<double>(d, false, true);
+}
+
+uint64_t CPU::exec_fmin_d(const DecodedInst & d) {
+    return fp_min_max<double>(d, false);
+}
+
+uint64_t CPU::exec_fmax_d(const DecodedInst & d) {
+    return fp_min_max<double>(d, true);
+}
+
+uint64_t CPU::exec_feq_d(const DecodedInst & d) {
+    return fp_compare<double>(d, true, [](double a, double b) { return a == b; });
+}
+
+uint64_t CPU::exec_flt_d(const DecodedInst & d) {
+    return fp_compare<double>(d, false, [](double a, double b) { return a < b; });
+}
+
+uint64_t CPU::exec_fle_d(const DecodedInst & d) {
+    return fp_compare<double>(d, false, [](double a, double b) { return a <= b; });
+}
+
+uint64_t CPU::exec_fclass_d(const DecodedInst & d) {
+    if (!fp_enabled()) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    regs[d.rd] = fp_class(freg<double>(d.rs1));
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_fcvt_w_d(const DecodedInst & d) {
+    return fp_to_int<int32_t, double>(d);
+}
+
+uint64_t CPU::exec_fcvt_wu_d(const DecodedInst & d) {
+    return fp_to_int<uint32_t, double>(d);
+}
+
+uint64_t CPU::exec_fcvt_l_d(const DecodedInst & d) {
+    return fp_to_int<int64_t, double>(d);
+}
+
+uint64_t CPU::exec_fcvt_lu_d(const DecodedInst & d) {
+    return fp_to_int<uint64_t, double>(d);
+}
+
+uint64_t CPU::exec_fcvt_d_w(const DecodedInst & d) {
+    return fp_from_int<double, int32_t>(d);
+}
+
+uint64_t CPU::exec_fcvt_d_wu(const DecodedInst & d) {
+    return fp_from_int<double, uint32_t>(d);
+}
+
+uint64_t CPU::exec_fcvt_d_l(const DecodedInst & d) {
+    return fp_from_int<double, int64_t>(d);
+}
+
+uint64_t CPU::exec_fcvt_d_lu(const DecodedInst & d) {
+    return fp_from_int<double, uint64_t>(d);
+}
+
+// RVV: the "V" standard extension for vector operations, a subset of it on host SIMD,
+// see vector.h. Tail and masked-off elements are always left undisturbed.
+uint64_t CPU::exec_vsetvli(const DecodedInst & d) {
+    return vec_configure(d, vec_avl(d), d.imm);
+}
+
+uint64_t CPU::exec_vsetivli(const DecodedInst & d) {
+    return vec_configure(d, d.rs1, d.imm);
+}
+
+uint64_t CPU::exec_vsetvl(const DecodedInst & d) {
+    return vec_configure(d, vec_avl(d), regs[d.rs2]);
+}
+
+uint64_t CPU::vec_access(const DecodedInst & d, AccessType access_type) {
+    // log2 of the element width in bytes, by the width field.
+    static const int64_t eew[8] = {0, -1, -1, -1, -1, 1, 2, 3};
+    bool loading = (AccessType::Load == access_type);
+    const uint8_t * mask = vec_mask(d);
+    if (!vec_enabled() || 0 != (csr.load(VTYPE) & VTYPE_VILL)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    // The register group holds vl elements of the memory width: EMUL = EEW / SEW * LMUL.
+    uint64_t size_log2 = eew[(d.raw >> 12) & 0x7];
+    int64_t emul = (int64_t)size_log2 - (int64_t)vec_sew() + vec_lmul();
+    uint64_t group = (emul > 0) ? (1ull << emul) : 1;
+    if (emul < -3 || emul > 3 || 0 != d.rd % group || (loading && nullptr != mask && 0 == d.rd)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t size = 1ull << size_log2;
+    uint8_t * v = vregs + d.rd * vlenb;
+    uint64_t vl = csr.load(VL);
+    uint64_t i = csr.load(VSTART);
+    while (i < vl) {
+        if (nullptr != mask && !vec_active(mask, i)) {
+            i++;
+            continue;
         }
-        case 0x33: { // OP
-            // "SLL, SRL, and SRA perform logical left, logical right, and arithmetic right
-            // shifts on the value in register rs1 by the shift amount held in register rs2.
-            // In RV64I, only the low 6 bits of rs2 are considered for the shift amount."
-            uint64_t shamt = (uint32_t)(uint64_t)(regs[rs2] & 0x3f);
-            switch (funct3) {
-                case 0x00: // ADD/SUB
-                    switch (funct7) {
-                        case 0x00: { // ADD
-                            regs[rd] = regs[rs1] + regs[rs2];
-                            return update_pc();
-                        }
-                        case 0x01: { //MUL
-                        	regs[rd] = regs[rs1] * regs[rs2];
-                        	return update_pc();
-                        }
-                        case 0x20: { // SUB
-                            regs[rd] = regs[rs1] - regs[rs2];
-                            return update_pc();
-                        }
-                        default: {
-                            throw IllegalInstruction(inst);
-                        }
-                    }
-                case 0x01: { // SLL
-                    regs[rd] = regs[rs1] << shamt;
-                    return update_pc();
-                }
-                case 0x02: { // SLT
-                    regs[rd] = ((int64_t)regs[rs1] < (int64_t)regs[rs2] ? 1 : 0);
-                    return update_pc();
-                }
-                case 0x03: { // SLTU
-                    regs[rd] = (regs[rs1] < regs[rs2] ? 1 : 0);
-                    return update_pc();
-                }
-                case 0x04: { // XOR
-                    regs[rd] = regs[rs1] ^ regs[rs2];
-                    return update_pc();
-                }
-                case 0x05: { // SRL/SRA
-                    switch (funct7) {
-                        case 0x00: { // SRL
-                            regs[rd] = regs[rs1] >> shamt;
-                            return update_pc();
-                        }
-                        case 0x20: { // SRA
-                            regs[rd] = (uint64_t)((int64_t)regs[rs1] >> shamt);
-                            return update_pc();
-                        }
-                        default: {
-                            throw IllegalInstruction(inst);
-                        }
-                    }
-                }
-                case 0x06: { // OR
-                    regs[rd] = regs[rs1] | regs[rs2];
-                    return update_pc();
-                }
-                case 0x07: { // AND
-                    regs[rd] = regs[rs1] & regs[rs2];
-                    return update_pc();
-                }
-                default: {
-                    throw IllegalInstruction(inst);
-                }
-            }
+        uint64_t addr = regs[d.rs1] + i * size;
+        uint64_t paddr;
+        uint8_t * page;
+        Exception e = translate(addr, access_type, paddr, page);
+        if (Exception::None != e) {
+            // The instruction resumes from the element that trapped.
+            csr.store(VSTART, i);
+            return raise(e, addr);
         }
-        case 0x37: { // LUI
-            regs[rd] = (uint64_t)(int64_t)(int32_t)(inst & 0xfffff000);
-            return update_pc();
-        }
-        case 0x3b: {
-            // "The shift amount is given by rs2[4:0]."
-            uint32_t shamt = (uint32_t)(regs[rs2] & 0x1f); 
-        	switch(funct3) {
-        	case 0x0: {
-        		if(0x00 == funct7) {  // ADDW
-                    regs[rd] = (uint64_t)(int64_t)(int32_t)(regs[rs1] + regs[rs2]);
-                    return update_pc();
-        		}
-        		else if(0x20 == funct7) { // SUBW
-                    regs[rd] = (uint64_t)(int64_t)(int32_t)(regs[rs1] - regs[rs2]);
-                    return update_pc();
-        		}
-        		else {
-        			throw IllegalInstruction(inst);
-        		}
-            }
-        	case 0x1: { // SLLW
-                if(0x00 != funct7) {
-                    throw IllegalInstruction(inst);
-                }
-        		regs[rd] = (uint64_t)(int32_t)((uint32_t)regs[rs1] << shamt);
-        		return update_pc();
-            }
-        	case 0x5: {
-        		if (0x00 == funct7) {  // SRLW
-                    regs[rd] = (uint64_t)(int32_t)((uint32_t)regs[rs1] >> shamt);
-                    return update_pc();
-        		}
-                else if (0x01 == funct7) {  //DIVU
-                    regs[rd] = (0 == regs[rs2] ? 0xffffffff'ffffffff : regs[rs1] / regs[rs2]);
-                    return update_pc();
-                }
-        		else if (0x20 == funct7) { // SRAW
-                    regs[rd] = (uint64_t)((int32_t)regs[rs1] >> (int32_t)shamt);
-                    return update_pc();
-        		}
-        		else {
-        			throw IllegalInstruction(inst);
-        		}
-            }
-            case 0x7: {
-                if (0x01 == funct7) {  // REMUW
-                    regs[rd] = (0 == regs[rs2] ? regs[rs1] : (uint64_t)(int32_t)((uint32_t)regs[rs1] % (uint32_t)regs[rs2]));
-                    return update_pc();
+        uint64_t offset = paddr & (PAGE_SIZE - 1);
+        if (nullptr != page && offset + size <= PAGE_SIZE) {
+            uint64_t n = std::min(vl - i, (PAGE_SIZE - offset) / size);
+            for (uint64_t j = 0; j < n; j++) {
+                if (nullptr != mask && !vec_active(mask, i + j)) {
+                    continue;
                 }
-                else {
-                    throw IllegalInstruction(inst);
+                if (loading) {
+                    std::memcpy(v + (i + j) * size, page + offset + j * size, size);
+                } else {
+                    std::memcpy(page + offset + j * size, v + (i + j) * size, size);
                 }
             }
-        	default: {
-        		throw IllegalInstruction(inst);
-            }
-        	}
-        }
-        case 0x63: { // BRANCH
-            // imm[12|10:5|4:1|11] = inst[31|30:25|11:8|7]
-            uint64_t imm = (uint64_t)((int64_t)(int32_t)(inst & 0x80000000) >> 19)
-                        | ((inst & 0x80) << 4)   // imm[11]
-                        | ((inst >> 20) & 0x7e0) // imm[10:5]
-                        | ((inst >> 7) & 0x1e);  // imm[4:1]
-            switch (funct3) {
-                case 0x00: { // BEQ
-                    if(regs[rs1] == regs[rs2]) {
-                        return pc + imm;
-                    }
-                    return update_pc();
-                }
-                case 0x01: { // BNE
-                    if(regs[rs1] != regs[rs2]) {
-                        return pc + imm;
-                    }
-                    return update_pc();
-                }
-                case 0x04: { // BLT
-                    if((int64_t)regs[rs1] < (int64_t)regs[rs2]) {
-                        return pc + imm;
-                    }
-                    return update_pc();
-                }
-                case 0x05: { // BGE
-                    if((int64_t)regs[rs1] >= (int64_t)regs[rs2]) {
-                        return pc + imm;
-                    }
-                    return update_pc();
-                }
-                case 0x06: { // BLTU
-                    if(regs[rs1] < regs[rs2]) {
-                        return pc + imm;
-                    }
-                    return update_pc();
-                }
-                case 0x07: { // BGEU
-                    if(regs[rs1] >= regs[rs2]) {
-                        return pc + imm;
-                    }
-                    return update_pc();
-                }
-                default: {
-                    throw IllegalInstruction(inst);
-                }
+            if (!loading && icache.invalidate(paddr, n * size)) {
+                flush_fetch();
+                blocks.invalidate();
             }
+            i += n;
+            continue;
         }
-        case 0x67: {// JALR
-            uint64_t t = pc + 4;
-            uint64_t imm = (uint64_t)((int64_t)(int32_t)(inst & 0xfff00000) >> 20);
-            uint64_t new_pc = (regs[rs1] + imm) & (~(uint64_t)1);
-            regs[rd] = t;
-            return new_pc;
-        }
-        case 0x6f: { // JAL
-            regs[rd] = pc + 4;
-            // imm[20|10:1|11|19:12] = inst[31|30:21|20|19:12]
-            uint64_t imm = (uint64_t)((int64_t)(int32_t)(inst & 0x80000000) >> 11)
-                         | (inst & 0xff000)         // imm[19:12]
-                         | ((inst >> 9) & 0x800)    // imm[11]
-                         | ((inst >> 20) & 0x7fe);  // imm[10:1]
-            return pc + imm;
-        }
-        case 0x73: {
-            size_t csr_addr = (size_t)((inst & 0xfff00000) >> 20);
-            switch(funct3) {
-            case 0x0: {
-                if (0x0 == rs2 && 0x0 == funct7) {
-                    if (user_mode == mode) {
-                        throw EnvironmentCallFromUMode(pc);
-                    }
-                    else if (supervisor_mode == mode) {
-                        throw EnvironmentCallFromSMode(pc);
-                    }
-                    else {
-                        throw EnvironmentCallFromMMode(pc);
-                    }
-                }
-                else if (0x1 == rs2 && 0x0 == funct7) {
-                    throw Breakpoint(pc);
-                }
-                else if (0x2 == rs2 && 0x8 == funct7) {  // SRET
-                    // When the SRET instruction is executed to return from the trap
-                    // handler, the privilege level is set to user mode if the SPP
-                    // bit is 0, or supervisor mode if the SPP bit is 1. The SPP bit
-                    // is SSTATUS[8].
-                    uint64_t sstatus = csr.load(SSTATUS);
-                    mode = (sstatus & MASK_SPP) >> 8;
-                    // The SPIE bit is SSTATUS[5] and the SIE bit is the SSTATUS[1]
-                    uint64_t spie = (sstatus & MASK_SPIE) >> 5;
-                    // set SIE = SPIE
-                    sstatus = (sstatus & (~MASK_SIE)) | (spie << 1);
-                    // set SPIE = 1
-                    sstatus |= MASK_SPIE;
-                    // set SPP the least priviledge mode (u-mode)
-                    sstatus &= ~MASK_SPP;
-                    csr.store(SSTATUS, sstatus);
-                    // set the pc to CSRs[sepc].
-                    // whenever IALIGN=32, bit sepc[1] is masked on reads so that it appears to be 0. This
-                    // masking occurs also for the implicit read by the SRET instruction. 
-                    uint64_t new_pc = csr.load(SEPC) & (~0b11);
-                    return new_pc;
-                }
-                else if (0x2 == rs2 && 0x18 == funct7) {  // MRET
-                    uint64_t mstatus = csr.load(MSTATUS);
-                    // MPP is two bits wide at MSTATUS[12:11]
-                    mode = (mstatus & MASK_MPP) >> 11;
-                    // The MPIE bit is MSTATUS[7] and the MIE bit is the MSTATUS[3].
-                    uint64_t mpie = (mstatus & MASK_MPIE) >> 7;
-                    // set MIE = MPIE
-                    mstatus = (mstatus & (~MASK_MIE)) | (mpie << 3);
-                    // set MPIE = 1
-                    mstatus |= MASK_MPIE;
-                    // set MPP the least priviledge mode (u-mode)
-                    mstatus &= ~MASK_MPP;
-                    // if MPP != M, set MPRV = 0
-                    mstatus &= ~MASK_MPRV;
-                    csr.store(MSTATUS, mstatus);
-                    // set the pc to CSRs[mepc].
-                    uint64_t new_pc = csr.load(MEPC) & (~0b11);
-                    return new_pc;
-                }
-                else if (funct7 = 0x9) {  // SFENCE.VMA
-                    // Do nothing.
-                    return update_pc();
-                }
-                else {
-                    throw IllegalInstruction(inst);
-                }
-            }
-            case 0x1: {  // CSRRW
-                uint64_t t = csr.load(csr_addr);
-                csr.store(csr_addr, regs[rs1]);
-                regs[rd] = t;
-                update_paging(csr_addr);
-                return update_pc();
-            }
-            case 0x2: {  // CSRRS
-                uint64_t t = csr.load(csr_addr);
-                csr.store(csr_addr, t | regs[rs1]);
-                regs[rd] = t;
-                update_paging(csr_addr);
-                return update_pc();
-            }
-            case 0x3: {  // CSRRC
-                uint64_t t = csr.load(csr_addr);
-                csr.store(csr_addr, t & (~regs[rs1]));
-                regs[rd] = t;
-                update_paging(csr_addr);
-                return update_pc();
-            }
-            case 0x5: {  // CSRRWI
-                uint64_t zimm = (uint64_t)rs1;
-                uint64_t t = csr.load(csr_addr);
-                csr.store(csr_addr, zimm);
-                regs[rd] = t;
-                update_paging(csr_addr);
-                return update_pc();
-            }
-            case 0x6: { // CSRRSI
-                uint64_t zimm = (uint64_t)rs1;
-                uint64_t t = csr.load(csr_addr);
-                csr.store(csr_addr, t | zimm);
-                regs[rd] = t;
-                update_paging(csr_addr);
-                return update_pc();
-            }
-            case 0x7: { // CSRRCI
-                uint64_t zimm = (uint64_t)rs1;
-                uint64_t t = csr.load(csr_addr);
-                csr.store(csr_addr, t & (~zimm));
-                regs[rd] = t;
-                update_paging(csr_addr);
-                return update_pc();
-            }
-            default: {
-                throw IllegalInstruction(inst);
-            }
+        // Devices and elements across two pages go one at a time.
+        uint64_t value = 0;
+        bool ok;
+        if (loading) {
+            ok = load(addr, size * 8, value);
+            std::memcpy(v + i * size, &value, size);
+        } else {
+            std::memcpy(&value, v + i * size, size);
+            ok = store(addr, size * 8, value);
+        }
+        if (!ok) {
+            csr.store(VSTART, i);
+            return TRAPPED;
+        }
+        i++;
+    }
+    csr.store(VSTART, 0);
+    if (loading) {
+        vec_dirty();
+    }
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_vle(const DecodedInst & d) {
+    return vec_access(d, AccessType::Load);
+}
+
+uint64_t CPU::exec_vse(const DecodedInst & d) {
+    return vec_access(d, AccessType::Store);
+}
+
+uint64_t CPU::exec_vadd_vv(const DecodedInst & d) {
+    return vec_int<VecAdd>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vadd_vx(const DecodedInst & d) {
+    return vec_int<VecAdd>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vadd_vi(const DecodedInst & d) {
+    return vec_int<VecAdd>(d, VecForm::VI);
+}
+
+uint64_t CPU::exec_vsub_vv(const DecodedInst & d) {
+    return vec_int<VecSub>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vsub_vx(const DecodedInst & d) {
+    return vec_int<VecSub>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vmul_vv(const DecodedInst & d) {
+    return vec_int<VecMul>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vmul_vx(const DecodedInst & d) {
+    return vec_int<VecMul>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vmacc_vv(const DecodedInst & d) {
+    return vec_int<VecMacc>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vmacc_vx(const DecodedInst & d) {
+    return vec_int<VecMacc>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vmv_v_v(const DecodedInst & d) {
+    return vec_int<VecMove>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vmv_v_x(const DecodedInst & d) {
+    return vec_int<VecMove>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vmv_v_i(const DecodedInst & d) {
+    return vec_int<VecMove>(d, VecForm::VI);
+}
+
+uint64_t CPU::exec_vredsum_vs(const DecodedInst & d) {
+    if (!vec_ready(d, false, true)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    if (0 != csr.load(VL)) {
+        switch (vec_sew()) {
+        case 0: vec_redsum_as<uint8_t>(d); break;
+        case 1: vec_redsum_as<uint16_t>(d); break;
+        case 2: vec_redsum_as<uint32_t>(d); break;
+        default: vec_redsum_as<uint64_t>(d); break;
         }
-        } 
-        default: {
-            throw IllegalInstruction(inst);
+        vec_dirty();
+    }
+    return update_pc(d);
+}
+
+// vmv.x.s: element 0 of vs2 sign-extended, whatever vl is.
+uint64_t CPU::exec_vmv_x_s(const DecodedInst & d) {
+    if (!vec_enabled() || 0 != (csr.load(VTYPE) & VTYPE_VILL)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    switch (vec_sew()) {
+    case 0: regs[d.rd] = (uint64_t)(int64_t)vec_get(vreg<int8_t>(d.rs2), 0); break;
+    case 1: regs[d.rd] = (uint64_t)(int64_t)vec_get(vreg<int16_t>(d.rs2), 0); break;
+    case 2: regs[d.rd] = (uint64_t)(int64_t)vec_get(vreg<int32_t>(d.rs2), 0); break;
+    default: regs[d.rd] = vec_get(vreg<uint64_t>(d.rs2), 0); break;
+    }
+    return update_pc(d);
+}
+
+// vmv.s.x: element 0 of vd from rs1, if vl is not zero.
+uint64_t CPU::exec_vmv_s_x(const DecodedInst & d) {
+    if (!vec_ready(d, false, true)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    if (0 != csr.load(VL)) {
+        std::memcpy(vreg<uint8_t>(d.rd), &regs[d.rs1], 1ull << vec_sew());
+        vec_dirty();
+    }
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_vfadd_vv(const DecodedInst & d) {
+    return vec_fp<VecAdd>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vfadd_vf(const DecodedInst & d) {
+    return vec_fp<VecAdd>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vfsub_vv(const DecodedInst & d) {
+    return vec_fp<VecSub>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vfsub_vf(const DecodedInst & d) {
+    return vec_fp<VecSub>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vfmul_vv(const DecodedInst & d) {
+    return vec_fp<VecMul>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vfmul_vf(const DecodedInst & d) {
+    return vec_fp<VecMul>(d, VecForm::VX);
+}
+
+uint64_t CPU::exec_vfmacc_vv(const DecodedInst & d) {
+    return vec_fp<VecMacc>(d, VecForm::VV);
+}
+
+uint64_t CPU::exec_vfmacc_vf(const DecodedInst & d) {
+    return vec_fp<VecMacc>(d, VecForm::VX);
+}
+
+// The unordered sum may add in any order; it adds in element order, as the ordered
+// one has to.
+uint64_t CPU::exec_vfredusum_vs(const DecodedInst & d) {
+    return exec_vfredosum_vs(d);
+}
+
+uint64_t CPU::exec_vfredosum_vs(const DecodedInst & d) {
+    if (!vec_ready(d, false, true) || !fp_enabled() || vec_sew() < 2 || !fp_round(RM_DYN)) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t vl = csr.load(VL);
+    if (0 != vl) {
+        if (2 == vec_sew()) {
+            vec_set(vreg<float>(d.rd), 0, vec_fsum(vec_get(vreg<float>(d.rs1), 0), vreg<float>(d.rs2), vl, vec_mask(d)));
+        } else {
+            vec_set(vreg<double>(d.rd), 0, vec_fsum(vec_get(vreg<double>(d.rs1), 0), vreg<double>(d.rs2), vl, vec_mask(d)));
         }
+        vec_dirty();
+        fp_dirty();
+    }
+    return update_pc(d);
+}
+
+// The vfmv moves copy bits, NaNs as they are. A single goes into an f register NaN-boxed.
+uint64_t CPU::exec_vfmv_f_s(const DecodedInst & d) {
+    if (!vec_enabled() || 0 != (csr.load(VTYPE) & VTYPE_VILL) || !fp_enabled() || vec_sew() < 2) {
+        return raise(Exception::IllegalInstruction, d.raw);
     }
+    if (2 == vec_sew()) {
+        fregs[d.rd] = 0xffffffff00000000ull | vec_get(vreg<uint32_t>(d.rs2), 0);
+    } else {
+        fregs[d.rd] = vec_get(vreg<uint64_t>(d.rs2), 0);
+    }
+    fp_dirty();
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_vfmv_s_f(const DecodedInst & d) {
+    if (!vec_ready(d, false, true) || !fp_enabled() || vec_sew() < 2) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    if (0 != csr.load(VL)) {
+        uint64_t bits = (2 == vec_sew()) ? fp_bits(freg<float>(d.rs1)) : fregs[d.rs1];
+        std::memcpy(vreg<uint8_t>(d.rd), &bits, 1ull << vec_sew());
+        vec_dirty();
+    }
+    return update_pc(d);
+}
+
+uint64_t CPU::exec_vfmv_v_f(const DecodedInst & d) {
+    if (!vec_ready(d, false) || !fp_enabled() || vec_sew() < 2) {
+        return raise(Exception::IllegalInstruction, d.raw);
+    }
+    uint64_t vl = csr.load(VL);
+    if (2 == vec_sew()) {
+        VecScalar<uint32_t> b{fp_bits(freg<float>(d.rs1))};
+        vec_map<VecMove>(vreg<uint32_t>(d.rd), b, b, vl, nullptr);
+    } else {
+        VecScalar<uint64_t> b{fregs[d.rs1]};
+        vec_map<VecMove>(vreg<uint64_t>(d.rd), b, b, vl, nullptr);
+    }
+    vec_dirty();
+    return update_pc(d);
 }
 
 /*!
@@ -725,10 +2906,11 @@ uint64_t CPU::execute(uint64_t inst) {
  * 7. set xPIE to xPIE (SPIE in S-mode, MPIE Iin M-mode).
  * 8. clear up xIE (SIE IN S-mode, MIE in M-mode).
  * */
-void CPU::handle_excption(RISCVException & e) {
+void CPU::handle_excption(const Trap & t) {
+    reservation = ~0ull;
     // Save current PC, mode, and cause
     uint64_t oldpc = pc, oldmode = mode;
-    uint64_t cause = e.code();
+    uint64_t cause = (uint64_t)t.code;
     // If an exception happen in U-mode or S-mode, and the exception is delegated to S-mode.
     // then this exception should be handled in S-mode.
     bool trap_in_s_mode = (mode <= supervisor_mode) && csr.is_medelegated(cause);
@@ -784,7 +2966,7 @@ void CPU::handle_excption(RISCVException & e) {
     // If stval is written with a nonzero value when a misaligned load or store causes an access-fault or
     // page-fault exception, then stval will contain the virtual address of the portion of the access that
     // caused the fault
-    csr.store(TVAL, e.value());
+    csr.store(TVAL, t.value);
 
     // 3.1.6 covers both sstatus and mstatus.
     uint64_t status = csr.load(STATUS);
@@ -801,6 +2983,7 @@ void CPU::handle_excption(RISCVException & e) {
     // set SPP / MPP = previous mode
     status = (status & ~MASK_PP) | (oldmode << pp_i);
     csr.store(STATUS, status);
+    flush_fetch();
 }
 
 /*!
@@ -813,9 +2996,10 @@ void CPU::handle_excption(RISCVException & e) {
  * 6. clear up xIE (SIE in S-mode, MIE in M-mode).
  * 7. set xPP to previous mode. 
  * */
-void CPU::handle_interrupt(RISCVInterrupt & interrupt) {
+void CPU::handle_interrupt(Interrupt interrupt) {
+    reservation = ~0ull;
     uint64_t oldpc = pc, oldmode = mode;
-    uint64_t cause = interrupt.code();
+    uint64_t cause = (uint64_t)interrupt;
     // although cause contains a interrupt bit. Shift the cause make it out.
     bool trap_in_s_mode = (mode <= supervisor_mode) && csr.is_midelegated(cause);
     uint64_t STATUS, TVEC, CAUSE, TVAL, EPC, MASK_PIE, pie_i, MASK_IE, ie_i, MASK_PP, pp_i;
@@ -851,15 +3035,14 @@ void CPU::handle_interrupt(RISCVInterrupt & interrupt) {
     // When MODE=Vectored, all synchronous exceptions into machine mode cause the pc to be set to the address 
     // in the BASE field, whereas interrupts cause the pc to be set to the address in the BASE field plus four 
     // times the interrupt cause number.
+    // Modes 2 and 3 are reserved; the guest may still write them, and gets Direct.
     uint64_t tvec = csr.load(TVEC);
     uint64_t tvec_mode = tvec & 0b11;
     uint64_t tvec_base = tvec & (~0b11);
-    if(0 == tvec_mode) {
-        pc = tvec_base;
-    } else if (1 == tvec_mode) {
-        pc = tvec_base + cause << 2;
+    if (1 == tvec_mode) {
+        pc = tvec_base + ((cause & ~MASK_INTERRUPT_BIT) << 2);
     } else {
-        throw std::logic_error("Unreachable code reached");
+        pc = tvec_base;
     }
     // 3.1.14 & 4.1.7
     // When a trap is taken into S-mode (or M-mode), sepc (or mepc) is written with the virtual address 
@@ -880,13 +3063,87 @@ void CPU::handle_interrupt(RISCVInterrupt & interrupt) {
     // set SPIE = SIE or MPIE = MIE
     status = (status & (~MASK_PIE)) | (ie << pie_i);
     // set SIE = 0 or MIE = 0
-    status &= !MASK_IE;
+    status &= (~MASK_IE);
     // set SPP or MPP = previous mode
     status = (status & (~MASK_PP)) | (oldmode << pp_i);
     csr.store(STATUS, status);
+    flush_fetch();
 }   
 
-void CPU::check_pending_interrupt() {
+/*!
+ * MTIP follows mtime >= mtimecmp. Counting instructions, the hart knows how many it
+ * can run before its mtimecmp is reached and sleeps through them; with the host
+ * clock it can only look every TIMER_QUANTUM instructions. Either way it looks at
+ * least that often, to see mtimecmp writes of other harts and to publish its
+ * instructions to mtime.
+ * */
+void CPU::poll_timer() {
+    Clint & clint = bus.get_clint();
+    uint64_t now = clint.advance(timer_retired);
+    uint64_t cmp = clint.get_mtimecmp(hartid);
+    timer_retired = 0;
+    timer_deadline = TIMER_QUANTUM;
+    if (now >= cmp) {
+        csr.store(MIP, csr.load(MIP) | MASK_MTIP);
+        return;
+    }
+    csr.store(MIP, csr.load(MIP) & ~MASK_MTIP);
+    if (Clock::Instructions == clint.get_clock() && cmp - now < TIMER_QUANTUM) {
+        timer_deadline = cmp - now;
+    }
+}
+
+void CPU::latch_interrupts() {
+    // In fact, we should using priority to decide which interrupt should be handled first.
+    // A device interrupt goes to the first hart that polls it with the source enabled.
+    Plic & plic = bus.get_plic();
+    if (plic.accepts(hartid, UART_IRQ) && bus.uart_is_interrupting() && plic.claim(hartid, UART_IRQ)) {
+        csr.store(MIP, csr.load(MIP) | MASK_SEIP);
+    } else if (plic.accepts(hartid, VIRTIO_IRQ)
+               && (bus.get_virtio_blk().is_interrupting() || bus.get_virtio_blk().has_completed())
+               && plic.claim(hartid, VIRTIO_IRQ)) {
+        // Claim first, so that requests are only posted when their interrupt can be taken.
+        if (disk_access()) {
+            csr.store(MIP, csr.load(MIP) | MASK_SEIP);
+        } else {
+            plic.release(hartid);
+        }
+    }
+    if (bus.get_clint().is_software_interrupting(hartid)) {
+        csr.store(MIP, csr.load(MIP) | MASK_MSIP);
+    }
+}
+
+/*!
+ * WFI may return as soon as an interrupt is pending in mip and enabled in mie, even
+ * if it is globally disabled. Until then the hart sleeps on the doorbell, at most
+ * until mtime reaches its mtimecmp, and a second at a time. Counting instructions,
+ * mtime does not move while every hart sleeps, so a sleep that times out moves it on.
+ * */
+void CPU::wait_for_interrupt() {
+    Doorbell & doorbell = bus.get_doorbell();
+    Clint & clint = bus.get_clint();
+    while (running()) {
+        uint64_t seen = doorbell.epoch();
+        poll_timer();
+        latch_interrupts();
+        if (0 != (csr.load(MIE) & csr.load(MIP))) {
+            return;
+        }
+        if (0 == (csr.load(MIE) & MASK_MTIP)) {
+            doorbell.wait(seen);
+            continue;
+        }
+        uint64_t now = clint.now();
+        uint64_t ticks = std::min(clint.get_mtimecmp(hartid) - now, TIMEBASE_FREQ);
+        doorbell.wait(seen, std::chrono::nanoseconds(ticks * (1'000'000'000 / TIMEBASE_FREQ)));
+        if (doorbell.epoch() == seen) {
+            clint.skip_to(now + ticks);
+        }
+    }
+}
+
+Interrupt CPU::check_pending_interrupt() {
     // 3.1.6.1
     // When a hart is executing in privilege mode x, interrupts are globally enabled when x IE=1 and globally 
     // disabled when xIE=0. Interrupts for lower-privilege modes, w<x, are always globally disabled regardless 
@@ -901,112 +3158,355 @@ void CPU::check_pending_interrupt() {
     // register is set, or the current privilege mode has less privilege than M-mode; (b) bit i is set in both
     // mip and mie; and (c) if register mideleg exists, bit i is not set in mideleg.
     if (machine_mode == mode && 0 == (csr.load(MSTATUS) & MASK_MIE)) {
-        return;
+        return Interrupt::None;
     }
     if(supervisor_mode == mode && 0 == (csr.load(SSTATUS) & MASK_SIE)) {
-        return;
-    }
-    // In fact, we should using priority to decide which interrupt should be handled first.
-    if (bus.uart_is_interrupting()) {
-        bus.store(PLIC_SCLAIM, 32, UART_IRQ);
-        csr.store(MIP, csr.load(MIP) | MASK_SEIP);
-    } else if (bus.get_virtio_blk().is_interrupting()) {
-        disk_access();
-        bus.store(PLIC_SCLAIM, 32, VIRTIO_IRQ);
-        csr.store(MIP, csr.load(MIP) | MASK_SEIP);
+        return Interrupt::None;
     }
+    latch_interrupts();
     // 3.1.9 & 4.1.3
     // Multiple simultaneous interrupts destined for M-mode are handled in the following decreasing
     // priority order: MEI, MSI, MTI, SEI, SSI, STI.
     uint64_t pending = csr.load(MIE) & csr.load(MIP);
     if (pending & MASK_MEIP) {
         csr.store(MIP, csr.load(MIP) & (~MASK_MEIP));
-        throw MachineExternalInterrupt();
+        return Interrupt::MachineExternalInterrupt;
     }
     if (pending & MASK_MSIP) {
         csr.store(MIP, csr.load(MIP) & (~MASK_MSIP));
-        throw MachineSoftwareInterrupt();
+        return Interrupt::MachineSoftwareInterrupt;
     }
     if (pending & MASK_MTIP) {
         csr.store(MIP, csr.load(MIP) & (~MASK_MTIP));
-        throw MachineTimerInterrupt();
+        return Interrupt::MachineTimerInterrupt;
     }
     if (pending & MASK_SEIP) {
         csr.store(MIP, csr.load(MIP) & (~MASK_SEIP));
-        throw SupervisorExternalInterrupt();
+        return Interrupt::SupervisorExternalInterrupt;
     }
     if (pending & MASK_SSIP) {
         csr.store(MIP, csr.load(MIP) & (~MASK_SSIP));
-        throw SupervisorSoftwareInterrupt();
+        return Interrupt::SupervisorSoftwareInterrupt;
     }
     if (pending & MASK_STIP) {
         csr.store(MIP, csr.load(MIP) & (~MASK_STIP));
-        throw SupervisorTimerInterrupt();
-    }
-}
-
-void CPU::disk_access() {
-    const uint64_t desc_size = sizeof(VirtqDesc);
-    // 2.6.2 Legacy Interfaces: A Note on Virtqueue Layout
-    // ------------------------------------------------------------------
-    // Descriptor Table  | Available Ring | (...padding...) | Used Ring
-    // ------------------------------------------------------------------
-    uint64_t desc_addr = bus.get_virtio_blk().desc_addr();
-    uint64_t avail_addr = desc_addr + DESC_NUM * desc_size;
-    uint64_t used_addr = desc_addr + PAGE_SIZE;
-
-    // cast addr to reference to ease field access.
-    VirtqAvail* virtq_avail = (VirtqAvail*)avail_addr;
-    VirtqUsed* virtq_used = (VirtqUsed*)used_addr;
-
-    // The idx field of virtq_avail should be indexed into available ring to get the
-    // index of descriptor we need to process.
-    size_t idx = bus.load((uint64_t)(&virtq_avail->idx), 16);
-    size_t index = bus.load((uint64_t)(&virtq_avail->ring[idx % DESC_NUM]), 16);
-
-    // The first descriptor:
-    // which contains the request information and a pointer to the data descriptor.
-    uint64_t desc_addr0 = desc_addr + desc_size * index;
-    VirtqDesc* virtq_desc0 = (VirtqDesc*)desc_addr0;
-    // The addr field points to a virtio block request. We need the sector number stored 
-    // in the sector field. The iotype tells us whether to read or write.
-    uint64_t req_addr = bus.load((uint64_t)(&virtq_desc0->addr), 64);
-    VirtioBlkRequest* virtq_blk_req = (VirtioBlkRequest*)req_addr;
-    uint64_t blk_sector = bus.load((uint64_t)(&virtq_blk_req->sector), 64);
-    uint32_t iotype = bus.load((uint64_t)(&virtq_blk_req->iotype), 32);
-    // std::cout << "iotype: " << iotype << "\n";
-    // The next field points to the second descriptor. (data descriptor)
-    size_t next0 = bus.load((uint64_t)(&virtq_desc0->next), 16);
-
-    // the second descriptor. 
-    uint64_t desc_addr1 = desc_addr + desc_size * next0;
-    VirtqDesc* virtq_desc1 = (VirtqDesc*)desc_addr1;
-    // The addr field points to the data to read or write
-    uint64_t addr1 = bus.load((uint64_t)(&virtq_desc1->addr), 64);
-    // the len donates the size of the data
-    uint32_t len1 = bus.load((uint64_t)(&virtq_desc1->len), 32);
-
-    switch (iotype) {
-        case VIRTIO_BLK_T_OUT: {
-            for (uint32_t i = 0; i < len1; ++i) {
-                uint8_t data = bus.load(addr1 + i, 8);
-                bus.get_virtio_blk().write_disk(blk_sector * SECTOR_SIZE + i, data);
+        return Interrupt::SupervisorTimerInterrupt;
+    }
+    return Interrupt::None;
+}
+
+void CPU::dma_read(uint64_t paddr, uint8_t * dst, uint64_t len) {
+    while (len > 0) {
+        uint64_t chunk = std::min(len, PAGE_SIZE - (paddr & (PAGE_SIZE - 1)));
+        uint8_t * host = bus.host_page(paddr);
+        if (nullptr != host) {
+            std::memcpy(dst, host + (paddr & (PAGE_SIZE - 1)), chunk);
+        } else {
+            // The device has no way to report a bad address to the driver; reads
+            // from unmapped memory see zero.
+            for (uint64_t i = 0; i < chunk; ++i) {
+                uint64_t value = 0;
+                bus.load(paddr + i, 8, value);
+                dst[i] = value;
+            }
+        }
+        paddr += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+}
+
+void CPU::dma_write(uint64_t paddr, const uint8_t * src, uint64_t len) {
+    if (icache.invalidate(paddr, len)) {
+        flush_fetch();
+        blocks.invalidate();
+    }
+    while (len > 0) {
+        uint64_t chunk = std::min(len, PAGE_SIZE - (paddr & (PAGE_SIZE - 1)));
+        uint8_t * host = bus.host_page(paddr);
+        if (nullptr != host) {
+            std::memcpy(host + (paddr & (PAGE_SIZE - 1)), src, chunk);
+        } else {
+            // and writes to it are dropped.
+            for (uint64_t i = 0; i < chunk; ++i) {
+                bus.store(paddr + i, 8, src[i]);
             }
-            break;
         }
-        case VIRTIO_BLK_T_IN: {
-            for (uint32_t i = 0; i < len1; ++i) {
-                uint8_t data = bus.get_virtio_blk().read_disk(blk_sector * SECTOR_SIZE + i);
-                bus.store(addr1 + i, 8, (uint64_t)data);
+        paddr += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+/*!
+ * Process every request the driver has made available since the last call, post
+ * those an asynchronous backend has completed since, and return whether the driver
+ * wants an interrupt for them. One interrupt covers the batch.
+ *
+ * A request is a descriptor chain of any shape, taken as two byte streams: the
+ * device-readable one starts with the VirtioBlkRequest header, followed by the data
+ * of a write; the device-writable one holds the data of a read, then the status byte.
+ * */
+bool CPU::disk_access() {
+    VirtioBlock & blk = bus.get_virtio_blk();
+    BlockBackend & disk = blk.get_disk();
+    std::lock_guard<std::mutex> guard(blk.queue_mutex());
+    VirtioBlock::Progress & progress = blk.progress();
+    if (!blk.queue_live()) {
+        return false;
+    }
+    bool event_idx = blk.negotiated(VIRTIO_RING_F_EVENT_IDX);
+    bool indirect = blk.negotiated(VIRTIO_RING_F_INDIRECT_DESC);
+    uint16_t old_used_idx = progress.used_idx;
+    uint64_t num = blk.queue_size();
+    uint64_t desc_addr = blk.desc_addr();
+    uint64_t avail_addr = blk.avail_addr();
+    uint64_t used_addr = blk.used_addr();
+
+    auto read16 = [this](uint64_t addr) {
+        uint16_t value;
+        dma_read(addr, (uint8_t *)&value, sizeof(value));
+        return to_le(value);
+    };
+    bool used = false;
+    auto push_used = [&](uint16_t head, uint32_t written) {
+        VirtQUsedusedElem elem = VirtQUsedusedElem{to_le((uint32_t)head), to_le(written)};
+        dma_write(used_addr + offsetof(VirtqUsed, ring) + sizeof(elem) * (progress.used_idx % num),
+                  (const uint8_t *)&elem, sizeof(elem));
+        ++progress.used_idx;
+        used = true;
+    };
+
+    std::vector<VirtioBlock::Request *> completed;
+    blk.take_completed(completed);
+    for (VirtioBlock::Request * r : completed) {
+        if (DiskRequest::Read == r->op) {
+            // The backend wrote guest memory behind the harts' backs.
+            for (size_t i = 0; i < r->iov.size(); ++i) {
+                if (icache.invalidate(r->paddrs[i], r->iov[i].iov_len)) {
+                    flush_fetch();
+                    blocks.invalidate();
+                }
             }
-            break;
         }
-        default:
-            throw std::runtime_error("Unreachable code reached");
+        uint8_t status = r->ok ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+        dma_write(r->status_addr, &status, 1);
+        push_used(r->head, r->ok ? r->written : 1);
     }
 
-    uint16_t new_id = bus.get_virtio_blk().get_new_id();
-    bus.store((uint64_t)(&virtq_used->idx), 16, new_id % 8);
+    struct Segment {
+        uint64_t addr;
+        uint32_t len;
+    };
+    // Only for backends without data().
+    std::vector<uint8_t> buf;
+    uint16_t avail_idx = read16(avail_addr + offsetof(VirtqAvail, idx));
+    while (true) {
+        if (progress.last_avail == avail_idx) {
+            if (!event_idx) {
+                break;
+            }
+            // Ask to be notified of the next request, then look once more, since the
+            // driver may have skipped notifying one it made available meanwhile.
+            uint16_t avail_event = to_le(progress.last_avail);
+            dma_write(used_addr + offsetof(VirtqUsed, ring) + sizeof(VirtQUsedusedElem) * num,
+                      (const uint8_t *)&avail_event, sizeof(avail_event));
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            avail_idx = read16(avail_addr + offsetof(VirtqAvail, idx));
+            if (progress.last_avail == avail_idx) {
+                break;
+            }
+        }
+        uint16_t head = read16(avail_addr + offsetof(VirtqAvail, ring) + 2 * (progress.last_avail % num));
+        // Split the chain into what the device reads and what it writes. A chain
+        // cannot be longer than the queue; stopping there also ends a looping one.
+        Segment in[DESC_NUM], out[DESC_NUM];
+        size_t ins = 0, outs = 0;
+        uint64_t in_len = 0, out_len = 0;
+        // An indirect descriptor swaps the queue's table for one of its own.
+        uint64_t table = desc_addr, table_size = num;
+        bool in_table = false;
+        uint16_t index = head;
+        for (uint64_t n = 0; n < num; ++n) {
+            VirtqDesc d;
+            dma_read(table + sizeof(VirtqDesc) * (index % table_size), (uint8_t *)&d, sizeof(d));
+            uint16_t flags = to_le(d.flags);
+            if (indirect && (flags & VIRTQ_DESC_F_INDIRECT) && !in_table) {
+                in_table = true;
+                table = to_le(d.addr);
+                table_size = to_le(d.len) / sizeof(VirtqDesc);
+                index = 0;
+                if (0 == table_size) {
+                    break;
+                }
+                continue;
+            }
+            Segment seg = Segment{to_le(d.addr), to_le(d.len)};
+            if (flags & VIRTQ_DESC_F_WRITE) {
+                out[outs++] = seg;
+                out_len += seg.len;
+            } else {
+                in[ins++] = seg;
+                in_len += seg.len;
+            }
+            if (0 == (flags & VIRTQ_DESC_F_NEXT)) {
+                break;
+            }
+            index = to_le(d.next);
+        }
+        // Copy len bytes between data and a stream, starting offset bytes into it.
+        auto copy = [this](Segment * segs, size_t count, uint64_t offset, uint8_t * data, uint64_t len, bool to_guest) {
+            uint64_t done = 0;
+            for (size_t i = 0; i < count && done < len; ++i) {
+                if (offset >= segs[i].len) {
+                    offset -= segs[i].len;
+                    continue;
+                }
+                uint64_t chunk = std::min<uint64_t>(segs[i].len - offset, len - done);
+                if (to_guest) {
+                    dma_write(segs[i].addr + offset, data + done, chunk);
+                } else {
+                    dma_read(segs[i].addr + offset, data + done, chunk);
+                }
+                done += chunk;
+                offset = 0;
+            }
+        };
+        // Point req at the host memory behind len bytes of a stream, starting offset
+        // bytes into it. Fail if some of them have none.
+        auto host_iov = [this](Segment * segs, size_t count, uint64_t offset, uint64_t len, VirtioBlock::Request & req) {
+            for (size_t i = 0; i < count && len > 0; ++i) {
+                if (offset >= segs[i].len) {
+                    offset -= segs[i].len;
+                    continue;
+                }
+                uint64_t paddr = segs[i].addr + offset;
+                uint64_t end = paddr + std::min<uint64_t>(segs[i].len - offset, len);
+                len -= end - paddr;
+                offset = 0;
+                while (paddr < end) {
+                    uint64_t chunk = std::min(end - paddr, PAGE_SIZE - (paddr & (PAGE_SIZE - 1)));
+                    uint8_t * host = bus.host_page(paddr);
+                    if (nullptr == host) {
+                        return false;
+                    }
+                    host += paddr & (PAGE_SIZE - 1);
+                    if (!req.iov.empty() && (uint8_t *)req.iov.back().iov_base + req.iov.back().iov_len == host) {
+                        req.iov.back().iov_len += chunk;
+                    } else if (req.iov.size() < IOV_MAX) {
+                        req.iov.push_back(iovec{host, chunk});
+                        req.paddrs.push_back(paddr);
+                    } else {
+                        return false;
+                    }
+                    paddr += chunk;
+                }
+            }
+            return 0 == len;
+        };
+
+        VirtioBlkRequest req;
+        copy(in, ins, 0, (uint8_t *)&req, sizeof(req), false);
+        uint64_t offset = to_le(req.sector) * SECTOR_SIZE;
+        uint32_t type = to_le(req.iotype);
+        if (disk.asynchronous() && in_len >= sizeof(req) && 0 != out_len) {
+            // Leave the transfer to the backend; the hart goes on, and the used entry
+            // waits until the transfer is done.
+            VirtioBlock::Request & r = blk.request(head);
+            r.head = head;
+            r.offset = offset;
+            r.iov.clear();
+            r.paddrs.clear();
+            r.status_addr = 0;
+            for (size_t i = 0, pos = 0; i < outs; pos += out[i++].len) {
+                if (0 != out[i].len && pos + out[i].len == out_len) {
+                    r.status_addr = out[i].addr + out[i].len - 1;
+                }
+            }
+            bool ready = false;
+            if (VIRTIO_BLK_T_IN == type) {
+                r.op = DiskRequest::Read;
+                r.written = out_len;
+                ready = disk.contains(offset, out_len - 1) && host_iov(out, outs, 0, out_len - 1, r);
+            } else if (VIRTIO_BLK_T_OUT == type) {
+                r.op = DiskRequest::Write;
+                r.written = 1;
+                ready = disk.contains(offset, in_len - sizeof(req)) && host_iov(in, ins, sizeof(req), in_len - sizeof(req), r);
+            } else if (VIRTIO_BLK_T_FLUSH == type) {
+                r.op = DiskRequest::Flush;
+                r.written = 1;
+                ready = true;
+            }
+            if (ready) {
+                blk.submit(r);
+                ++progress.last_avail;
+                continue;
+            }
+        }
+
+        uint8_t status = VIRTIO_BLK_S_OK;
+        uint32_t written = 0;
+        if (in_len < sizeof(req) || 0 == out_len) {
+            status = VIRTIO_BLK_S_IOERR;
+        } else if (VIRTIO_BLK_T_OUT == type) {
+            uint64_t len = in_len - sizeof(req);
+            if (!disk.contains(offset, len)) {
+                status = VIRTIO_BLK_S_IOERR;
+            } else if (nullptr != disk.data()) {
+                // Straight from guest memory into the disk.
+                copy(in, ins, sizeof(req), disk.data() + offset, len, false);
+            } else {
+                buf.resize(len);
+                copy(in, ins, sizeof(req), buf.data(), len, false);
+                if (!disk.write(offset, buf.data(), len)) {
+                    status = VIRTIO_BLK_S_IOERR;
+                }
+            }
+        } else if (VIRTIO_BLK_T_IN == type) {
+            uint64_t len = out_len - 1;
+            if (!disk.contains(offset, len)) {
+                status = VIRTIO_BLK_S_IOERR;
+            } else if (nullptr != disk.data()) {
+                copy(out, outs, 0, disk.data() + offset, len, true);
+                written = len;
+            } else {
+                buf.resize(len);
+                if (disk.read(offset, buf.data(), len)) {
+                    copy(out, outs, 0, buf.data(), len, true);
+                    written = len;
+                } else {
+                    status = VIRTIO_BLK_S_IOERR;
+                }
+            }
+        } else if (VIRTIO_BLK_T_FLUSH == type) {
+            if (!disk.flush()) {
+                status = VIRTIO_BLK_S_IOERR;
+            }
+        } else {
+            status = VIRTIO_BLK_S_UNSUPP;
+        }
+        if (0 != out_len) {
+            copy(out, outs, out_len - 1, &status, 1, true);
+            written += 1;
+        }
+        push_used(head, written);
+        ++progress.last_avail;
+    }
+    if (!used) {
+        return false;
+    }
+    // Publish the entries, then the index that covers them.
+    std::atomic_thread_fence(std::memory_order_release);
+    uint16_t used_idx = to_le(progress.used_idx);
+    dma_write(used_addr + offsetof(VirtqUsed, idx), (const uint8_t *)&used_idx, sizeof(used_idx));
+    blk.used_buffer_notify();
+    if (event_idx) {
+        // Interrupt only if used_idx has just passed the used_event the driver asked for.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint16_t used_event = read16(avail_addr + offsetof(VirtqAvail, ring) + 2 * num);
+        return (uint16_t)(progress.used_idx - used_event - 1) < (uint16_t)(progress.used_idx - old_used_idx);
+    }
+    return 0 == (read16(avail_addr + offsetof(VirtqAvail, flags)) & VIRTQ_AVAIL_F_NO_INTERRUPT);
 }
 
 void CPU::update_paging(uint64_t csr_addr) {
@@ -1017,84 +3517,115 @@ void CPU::update_paging(uint64_t csr_addr) {
 
     uint64_t satp = csr.load(SATP);
     page_table = (satp & MASK_PPN) * PAGE_SIZE;
+    itlb.flush();
+    dtlb.flush();
+    flush_fetch();
+    translation_epoch++;
 
     uint64_t mode = satp >> 60;
     enable_paging = (8 == mode); // Sv39
 }
 
-uint64_t CPU::translate(uint64_t addr, AccessType access_type) {
-    if(!enable_paging) {
-        // std::cout<<"enable_paging = false\n";
-        return addr;
+Exception CPU::translate(uint64_t addr, AccessType access_type, uint64_t & paddr) {
+    uint8_t * host;
+    return translate(addr, access_type, paddr, host);
+}
+
+Exception CPU::translate(uint64_t addr, AccessType access_type, uint64_t & paddr, uint8_t * & host) {
+    // M-mode accesses are not translated.
+    if(!enable_paging || machine_mode == mode) {
+        paddr = addr;
+        host = bus.host_page(paddr);
+        return Exception::None;
+    }
+    Tlb & tlb = (AccessType::Instruction == access_type) ? itlb : dtlb;
+    const TlbEntry * e = tlb.find(addr);
+    if (nullptr != e && permits(e->perm, access_type)) {
+        paddr = e->ppage | (addr & (PAGE_SIZE - 1));
+        host = e->host;
+        return Exception::None;
+    }
+    uint64_t perm;
+    Exception fault = walk(addr, access_type, paddr, perm);
+    if (Exception::None == fault) {
+        host = bus.host_page(paddr);
+        tlb.insert(addr, paddr, perm, host);
+    }
+    return fault;
+}
+
+Exception CPU::walk(uint64_t addr, AccessType access_type, uint64_t & paddr, uint64_t & perm) {
+    Exception page_fault = Exception::StoreAMOPageFault;
+    Exception access_fault = Exception::StoreAMOAccessFault;
+    if (access_type == AccessType::Instruction) {
+        page_fault = Exception::InstructionPageFault;
+        access_fault = Exception::InstructionAccessFault;
+    }
+    else if (access_type == AccessType::Load) {
+        page_fault = Exception::LoadPageFault;
+        access_fault = Exception::LoadAccessFault;
     }
-    // std::cout << "translate\n";
-    int levels = 3;
     uint64_t vpn[] = {(addr >> 12) & 0x1ff, (addr >> 21) & 0x1ff, (addr >> 30) & 0x1ff};
     uint64_t a = page_table;
-    uint64_t i = levels - 1;
+    int i = 2;
     uint64_t pte;
-    
+
     while(1) {
-        pte = bus.load(a + vpn[i] * 8, 64);
-        uint64_t v = pte & 1;
-        uint64_t r = (pte >> 1) & 1;
-        uint64_t w = (pte >> 2) & 1;
-        uint64_t x = (pte >> 3) & 1;
-        if (0 == v || (0 == r && 1 == w)) {
-            if (access_type == AccessType::Instruction) {
-                throw InstructionPageFault(addr);
-            }
-            else if (access_type == AccessType::Load) {
-                throw LoadPageFault(addr);
-            }
-            else if (access_type == AccessType::Store) {
-                throw StoreAMOPageFault(addr);
-            }
+        uint8_t * page = bus.host_page(a);
+        if (nullptr != page) {
+            pte = Dram::read<64>(page + vpn[i] * 8);
+        } else if (Exception::None != bus.load(a + vpn[i] * 8, 64, pte)) {
+            return access_fault;
         }
-
-        if (1 == r || 1 == x) {
+        if (0 == (pte & PTE_V) || (0 == (pte & PTE_R) && 0 != (pte & PTE_W))) {
+            return page_fault;
+        }
+        // a leaf has R or X set, anything else points to the next level.
+        if (pte & (PTE_R | PTE_X)) {
             break;
         }
-
         i--;
-
-        uint64_t ppn = (pte >> 10) & 0x0fff'ffff'ffff;
-        a = ppn * PAGE_SIZE;
-
         if (i < 0) {
-            if (access_type == AccessType::Instruction) {
-                throw InstructionPageFault(addr);
-            }
-            else if (access_type == AccessType::Load) {
-                throw LoadPageFault(addr);
-            }
-            else if (access_type == AccessType::Store) {
-                throw StoreAMOPageFault(addr);
-            }
+            return page_fault;
         }
+        a = ((pte >> 10) & 0x0fff'ffff'ffff) * PAGE_SIZE;
     }
 
-    uint64_t ppn[] = {(pte >> 10) & 0x1ff, (pte >> 19) & 0x1ff, (pte >> 28) & 0x03ff'ffff};
-    uint64_t offset = addr & 0xfff;
-    switch(i) {
-    case 0:
-        return (((pte >> 10) & 0x0fff'ffff'ffff) << 12) | offset;
-    case 1:
-        return (ppn[2] << 30) | (ppn[1] << 21) | (vpn[0] << 12) | offset;
-    case 2:
-        return (ppn[2] << 30) | (vpn[1] << 21) | (vpn[0] << 12) | offset;
-    default:
-        if (access_type == AccessType::Instruction) {
-            throw InstructionPageFault(addr);
-        }
-        else if (access_type == AccessType::Load) {
-            throw LoadPageFault(addr);
-        }
-        else if (access_type == AccessType::Store) {
-            throw StoreAMOPageFault(addr);
+    perm = pte & (PTE_R | PTE_W | PTE_X | PTE_U);
+    if (!permits(perm, access_type)) {
+        return page_fault;
+    }
+    // A leaf at level i is a superpage of 2^(9*i) pages; the low i levels of the
+    // virtual page number index into it and its own PPN must be zero there.
+    uint64_t ppn = (pte >> 10) & 0x0fff'ffff'ffff;
+    uint64_t mask = (1ull << (9 * i)) - 1;
+    if (ppn & mask) {
+        return page_fault;
+    }
+    paddr = ((ppn | ((addr >> 12) & mask)) << 12) | (addr & 0xfff);
+    return Exception::None;
+}
+
+bool CPU::permits(uint64_t perm, AccessType access_type) {
+    uint64_t status = csr.load(MSTATUS);
+    // U-mode may only touch user pages; S-mode may load and store to them only
+    // with SUM set, and never executes them.
+    if (perm & PTE_U) {
+        if (user_mode != mode && (AccessType::Instruction == access_type || 0 == (status & MASK_SUM))) {
+            return false;
         }
+    } else if (user_mode == mode) {
+        return false;
+    }
+    switch (access_type) {
+    case AccessType::Instruction:
+        return perm & PTE_X;
+    case AccessType::Load:
+        // MXR makes executable pages readable as well.
+        return (perm & PTE_R) || ((status & MASK_MXR) && (perm & PTE_X));
+    default:
+        return perm & PTE_W;
     }
-    return addr;
 }
 
 #endif
\ No newline at end of file
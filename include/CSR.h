@@ -3,7 +3,25 @@
 
 #include <cstring>
 
+#include "snapshot.h"
+
 const size_t NUM_CSRS = 4096;
+// Unprivileged floating-point CSRs. fflags and frm are fields of fcsr.
+const size_t FFLAGS = 0x001;
+const size_t FRM = 0x002;
+const size_t FCSR = 0x003;
+// Unprivileged vector CSRs. vxsat and vxrm are fields of vcsr; vl, vtype and vlenb
+// are read-only and change through vset{i}vl{i}.
+const size_t VSTART = 0x008;
+const size_t VXSAT = 0x009;
+const size_t VXRM = 0x00a;
+const size_t VCSR = 0x00f;
+const size_t VL = 0xc20;
+const size_t VTYPE = 0xc21;
+const size_t VLENB = 0xc22;
+// vtype.vill: the last vsetvl asked for a vtype that is not supported.
+const uint64_t VTYPE_VILL = 1ull << 63;
+
 // Machine-level CSRs.
 
 // Hardware thread ID.
@@ -75,7 +93,17 @@ const uint64_t MASK_SXL = 0b11ull << 34;
 const uint64_t MASK_SBE = 1ull << 36;
 const uint64_t MASK_MBE = 1ull << 37;
 const uint64_t MASK_SD = 1ull << 63;
-const uint64_t MASK_SSTATUS = MASK_SIE | MASK_SPIE | MASK_UBE | MASK_SPP | MASK_FS
+// Values of the FS field: whether the f registers and fcsr may have changed since
+// the kernel last saved them.
+const uint64_t FS_OFF = 0;
+const uint64_t FS_INITIAL = 1ull << 13;
+const uint64_t FS_CLEAN = 2ull << 13;
+const uint64_t FS_DIRTY = 3ull << 13;
+// Values of the VS field, the same for the v registers and the vector CSRs.
+const uint64_t VS_OFF = 0;
+const uint64_t VS_INITIAL = 1ull << 9;
+const uint64_t VS_DIRTY = 3ull << 9;
+const uint64_t MASK_SSTATUS = MASK_SIE | MASK_SPIE | MASK_UBE | MASK_SPP | MASK_VS | MASK_FS
 | MASK_XS  | MASK_SUM  | MASK_MXR | MASK_UXL | MASK_SD;
 // MIP / SIP field mask
 const uint64_t MASK_SSIP = 1ull << 1;
@@ -106,6 +134,14 @@ public:
 			return csrs[MIP] & csrs[MIDELEG];
 		case SSTATUS:
 			return csrs[MSTATUS] & MASK_SSTATUS;
+		case FFLAGS:
+			return csrs[FCSR] & 0x1f;
+		case FRM:
+			return (csrs[FCSR] >> 5) & 0x7;
+		case VXSAT:
+			return csrs[VCSR] & 0x1;
+		case VXRM:
+			return (csrs[VCSR] >> 1) & 0x3;
 		default:
 			return csrs[addr];
 		}
@@ -116,12 +152,39 @@ public:
         case SIE:
             csrs[MIE] = (csrs[MIE] & ~csrs[MIDELEG]) | (value & csrs[MIDELEG]);
             break;
-        case SIP:
-        	/// MIP OR MIE ?
-            csrs[MIP] = (csrs[MIP] & ~csrs[MIDELEG]) | (value & csrs[MIDELEG]);
+        case SIP: {
+            // Only SSIP is writable; STIP and SEIP are set by the platform.
+            uint64_t mask = MASK_SSIP & csrs[MIDELEG];
+            csrs[MIP] = (csrs[MIP] & ~mask) | (value & mask);
             break;
+        }
         case SSTATUS:
-            csrs[MSTATUS] = (csrs[MSTATUS] & ~MASK_SSTATUS) | (value & MASK_SSTATUS);
+            csrs[MSTATUS] = with_sd((csrs[MSTATUS] & ~MASK_SSTATUS) | (value & MASK_SSTATUS));
+            break;
+        case MSTATUS:
+            csrs[MSTATUS] = with_sd(value);
+            break;
+        case FFLAGS:
+            csrs[FCSR] = (csrs[FCSR] & ~0x1full) | (value & 0x1f);
+            break;
+        case FRM:
+            csrs[FCSR] = (csrs[FCSR] & ~0xe0ull) | ((value & 0x7) << 5);
+            break;
+        case FCSR:
+            csrs[FCSR] = value & 0xff;
+            break;
+        case VXSAT:
+            csrs[VCSR] = (csrs[VCSR] & ~0x1ull) | (value & 0x1);
+            break;
+        case VXRM:
+            csrs[VCSR] = (csrs[VCSR] & ~0x6ull) | ((value & 0x3) << 1);
+            break;
+        case VCSR:
+            csrs[VCSR] = value & 0x7;
+            break;
+        case MIDELEG:
+            // Interrupts for M-mode cannot be delegated.
+            csrs[MIDELEG] = value & ~(MASK_MSIP | MASK_MTIP | MASK_MEIP);
             break;
         default:
             csrs[addr] = value;
@@ -137,7 +200,26 @@ public:
 		return (csrs[MIDELEG] >> (uint32_t)cause) & 1;
 	}
 
+	void save(SnapshotWriter & w) const {
+		for (size_t i = 0; i < NUM_CSRS; ++i) {
+			w.put(csrs[i]);
+		}
+	}
+
+	void restore(SnapshotReader & r) {
+		for (size_t i = 0; i < NUM_CSRS; ++i) {
+			r.get(csrs[i]);
+		}
+	}
+
 private:
+	// SD is read-only: set if any of FS, VS and XS is Dirty.
+	static uint64_t with_sd(uint64_t status) {
+		bool dirty = (MASK_FS == (status & MASK_FS)) || (MASK_VS == (status & MASK_VS))
+			|| (MASK_XS == (status & MASK_XS));
+		return dirty ? (status | MASK_SD) : (status & ~MASK_SD);
+	}
+
 	uint64_t *csrs;
 };
 
@@ -1,48 +1,145 @@
 #ifndef _DRAM_H_
 #define _DRAM_H_
 
+#include <cstdlib>
+#include <cstring>
+#include <new>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define RVEMU_MMAP_DRAM 1
+#include <sys/mman.h>
+#endif
+
+#include "device.h"
 #include "param.h"
 #include "exception.h"
 
-class Dram{
+// Unsigned type of a guest access of SIZE bits.
+template <uint64_t SIZE> struct Word;
+template <> struct Word<8> { typedef uint8_t type; };
+template <> struct Word<16> { typedef uint16_t type; };
+template <> struct Word<32> { typedef uint32_t type; };
+template <> struct Word<64> { typedef uint64_t type; };
+
+// Convert between guest (little-endian) and host byte order.
+inline uint8_t to_le(uint8_t v) { return v; }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+inline uint16_t to_le(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t to_le(uint32_t v) { return __builtin_bswap32(v); }
+inline uint64_t to_le(uint64_t v) { return __builtin_bswap64(v); }
+#else
+inline uint16_t to_le(uint16_t v) { return v; }
+inline uint32_t to_le(uint32_t v) { return v; }
+inline uint64_t to_le(uint64_t v) { return v; }
+#endif
+
+/*!
+ * Guest memory of `size` bytes at DRAM_BASE. It is reserved with an anonymous mmap,
+ * so the host only allocates (zeroed) pages once the guest touches them; starting
+ * a guest costs no more than copying its image in.
+ * */
+class Dram : public Device {
 public:
-	Dram(std::vector<uint8_t> & code): dram(DRAM_SIZE) {
-		std::copy(code.begin(), code.end(), dram.begin());
+	Dram(std::vector<uint8_t> & code, uint64_t size = DRAM_SIZE): size_(size) {
+#ifdef RVEMU_MMAP_DRAM
+		void * p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		dram = (MAP_FAILED == p) ? nullptr : (uint8_t *)p;
+#else
+		dram = (uint8_t *)std::calloc(size_, 1);
+#endif
+		if (nullptr == dram) {
+			throw std::bad_alloc();
+		}
+		std::copy(code.begin(), code.begin() + std::min<uint64_t>(code.size(), size_), dram);
+	}
+
+	~Dram() {
+#ifdef RVEMU_MMAP_DRAM
+		munmap(dram, size_);
+#else
+		std::free(dram);
+#endif
+	}
+
+	Dram(const Dram &) = delete;
+	Dram & operator=(const Dram &) = delete;
+
+	uint64_t size() const {
+		return size_;
+	}
+
+	// Read SIZE bits of guest memory at host address p, which need not be aligned.
+	template <uint64_t SIZE>
+	static uint64_t read(const uint8_t * p) {
+		typename Word<SIZE>::type v;
+		memcpy(&v, p, sizeof(v));
+		return to_le(v);
+	}
+
+	template <uint64_t SIZE>
+	static void write(uint8_t * p, uint64_t value) {
+		typename Word<SIZE>::type v = to_le((typename Word<SIZE>::type)value);
+		memcpy(p, &v, sizeof(v));
+	}
+
+	// size must be 8, 16, 32 or 64. The switch folds away when size is a constant.
+	static uint64_t read(const uint8_t * p, uint64_t size) {
+		switch (size) {
+		case 8: return read<8>(p);
+		case 16: return read<16>(p);
+		case 32: return read<32>(p);
+		default: return read<64>(p);
+		}
+	}
+
+	static void write(uint8_t * p, uint64_t size, uint64_t value) {
+		switch (size) {
+		case 8: write<8>(p, value); break;
+		case 16: write<16>(p, value); break;
+		case 32: write<32>(p, value); break;
+		default: write<64>(p, value); break;
+		}
 	}
 
 	// addr/size must be valid. Check in bus
-	uint64_t load(uint64_t addr, uint64_t size) {
+	Exception load(uint64_t addr, uint64_t size, uint64_t & value) {
         if (size != 8 && size != 16 && size != 32 && size != 64) {
-            std::cerr << "dram LoadAccessFault\n";
-            throw LoadAccessFault(addr);
-        }
-        uint64_t nbytes = size / 8;
-        uint64_t index = (addr - DRAM_BASE);
-        uint64_t code = dram[index];
-        for (uint64_t i = 1; i < nbytes; ++i) {
-            code |= ((uint64_t)dram[index + i] << (i * 8));
+            return Exception::LoadAccessFault;
         }
-        return code;
+        value = read(host(addr), size);
+        return Exception::None;
     }
 
     // addr/size must be valid. Check in bus
-    void store(uint64_t addr, uint64_t size, uint64_t value) {
+    Exception store(uint64_t addr, uint64_t size, uint64_t value) {
         if (size != 8 && size != 16 && size != 32 && size != 64) {
-            // std::cout << "dram.store" << std::endl;
-            throw StoreAMOAccessFault(addr);
-        }
-        uint64_t nbytes = size / 8;
-        uint64_t index = (addr - DRAM_BASE);
-        for (uint64_t i = 0; i < nbytes; ++i) {
-            uint64_t offset = 8 * i;
-            dram[index + i] = (uint8_t)((value >> offset) & 0xff);
+            return Exception::StoreAMOAccessFault;
         }
+        write(host(addr), size, value);
+        return Exception::None;
+    }
+
+    // Host address backing the guest physical address addr, which must be in DRAM.
+    uint8_t * host(uint64_t addr) {
+        return dram + (addr - DRAM_BASE);
+    }
+
+    // Replace the whole of memory with a private mapping of size() bytes of the file
+    // fd from offset on, which must be page aligned, so that pages are only read when
+    // the guest touches them. Host addresses stay the same.
+    bool load(int fd, uint64_t offset) {
+#ifdef RVEMU_MMAP_DRAM
+        void * p = mmap(dram, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, offset);
+        return p == (void *)dram;
+#else
+        return false;
+#endif
     }
 
 private:
-	std::vector<uint8_t> dram;
+	uint8_t * dram;
+	uint64_t size_;
 };
 
-#endif
\ No newline at end of file
+#endif
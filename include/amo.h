@@ -0,0 +1,58 @@
+#ifndef _AMO_H_
+#define _AMO_H_
+
+#include "Dram.h"
+
+#include <cstdint>
+#include <type_traits>
+
+// The read-modify-write operations of the A extension.
+enum class AmoOp {
+    Swap, Add, Xor, And, Or, Min, Max, Minu, Maxu,
+};
+
+// The word an AMO leaves in memory, given the old word and rs2.
+template <typename T, AmoOp OP>
+inline T amo_apply(T old, T operand) {
+    typedef typename std::make_signed<T>::type S;
+    switch (OP) {
+    case AmoOp::Swap: return operand;
+    case AmoOp::Add: return old + operand;
+    case AmoOp::Xor: return old ^ operand;
+    case AmoOp::And: return old & operand;
+    case AmoOp::Or: return old | operand;
+    case AmoOp::Min: return (S)old < (S)operand ? old : operand;
+    case AmoOp::Max: return (S)old > (S)operand ? old : operand;
+    case AmoOp::Minu: return old < operand ? old : operand;
+    default: return old > operand ? old : operand;
+    }
+}
+
+/*!
+ * Apply an AMO to the guest word at host address p, which must be naturally aligned,
+ * and return the old word. Operations the host has an atomic instruction for use it
+ * (xchg, lock xadd/and/or/xor on x86); min and max retry a compare-and-swap. All of
+ * them are sequentially consistent, whatever the aq and rl bits ask for.
+ * */
+template <typename T, AmoOp OP>
+inline T host_amo(T * p, T operand) {
+    switch (OP) {
+    // Bitwise operations work on the guest byte order as they are.
+    case AmoOp::Swap: return to_le(__atomic_exchange_n(p, to_le(operand), __ATOMIC_SEQ_CST));
+    case AmoOp::Xor: return to_le(__atomic_fetch_xor(p, to_le(operand), __ATOMIC_SEQ_CST));
+    case AmoOp::And: return to_le(__atomic_fetch_and(p, to_le(operand), __ATOMIC_SEQ_CST));
+    case AmoOp::Or: return to_le(__atomic_fetch_or(p, to_le(operand), __ATOMIC_SEQ_CST));
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    case AmoOp::Add: return __atomic_fetch_add(p, operand, __ATOMIC_SEQ_CST);
+#endif
+    default: {
+        T old = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(p, &old, to_le(amo_apply<T, OP>(to_le(old), operand)), true,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        }
+        return to_le(old);
+    }
+    }
+}
+
+#endif  // _AMO_H_
@@ -0,0 +1,114 @@
+#ifndef _BITMANIP_H_
+#define _BITMANIP_H_
+
+#include <cstdint>
+
+// The bit counts of Zbb. With GCC and Clang these are builtins, which become lzcnt,
+// tzcnt and popcnt when the build targets a host that has them.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BITMANIP_X86 1
+#endif
+
+// Whether the host has lzcnt, tzcnt (BMI1) and popcnt; checked once. The JIT emits
+// them directly if so.
+inline bool host_has_bit_counts() {
+#if defined(BITMANIP_X86)
+    static const bool has = __builtin_cpu_supports("lzcnt") && __builtin_cpu_supports("bmi")
+                         && __builtin_cpu_supports("popcnt");
+    return has;
+#else
+    return false;
+#endif
+}
+
+#if defined(BITMANIP_X86)
+// A build for baseline x86-64 would call into libgcc for a population count.
+__attribute__((target("popcnt"))) inline uint64_t host_popcnt(uint64_t x) {
+    return __builtin_popcountll(x);
+}
+#endif
+
+// Leading zeros of x, 64 if x is zero.
+inline uint64_t clz64(uint64_t x) {
+#if defined(__GNUC__)
+    return (0 == x) ? 64 : __builtin_clzll(x);
+#else
+    uint64_t n = 0;
+    for (uint64_t bit = 1ull << 63; 0 != bit && 0 == (x & bit); bit >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Trailing zeros of x, 64 if x is zero.
+inline uint64_t ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return (0 == x) ? 64 : __builtin_ctzll(x);
+#else
+    uint64_t n = 0;
+    for (uint64_t bit = 1; 0 != bit && 0 == (x & bit); bit <<= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+inline uint64_t cpop64(uint64_t x) {
+#if defined(BITMANIP_X86)
+    if (host_has_bit_counts()) {
+        return host_popcnt(x);
+    }
+#endif
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (x * 0x0101010101010101ull) >> 56;
+#endif
+}
+
+inline uint64_t bswap64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_bswap64(x);
+#else
+    uint64_t r = 0;
+    for (int i = 0; i < 8; i++) {
+        r = (r << 8) | ((x >> (8 * i)) & 0xff);
+    }
+    return r;
+#endif
+}
+
+// orc.b: each byte becomes all ones if any of its bits is set, zero otherwise.
+inline uint64_t orc_b(uint64_t x) {
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    // The top bit of each byte ends up set if the byte is not zero.
+    uint64_t top = (((x & low7) + low7) | x) & ~low7;
+    return (top >> 7) * 0xff;
+}
+
+// Rotations by n modulo the width; compilers turn these into rol and ror.
+inline uint64_t rol64(uint64_t x, uint64_t n) {
+    n &= 63;
+    return (x << n) | (x >> ((64 - n) & 63));
+}
+
+inline uint64_t ror64(uint64_t x, uint64_t n) {
+    n &= 63;
+    return (x >> n) | (x << ((64 - n) & 63));
+}
+
+inline uint32_t rol32(uint32_t x, uint64_t n) {
+    n &= 31;
+    return (x << n) | (x >> ((32 - n) & 31));
+}
+
+inline uint32_t ror32(uint32_t x, uint64_t n) {
+    n &= 31;
+    return (x >> n) | (x << ((32 - n) & 31));
+}
+
+#endif  // _BITMANIP_H_
@@ -0,0 +1,101 @@
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+#include "decoder.h"
+#include "param.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class CPU;
+
+// A block translated to host code, see jit.h.
+typedef uint64_t (*JitFunc)(CPU * cpu, uint64_t * regs);
+
+// Upper bound of the number of instructions in one block.
+const uint64_t MAX_BLOCK_INSTS = 64;
+
+/*!
+ * Straight-line guest instructions ending at the first branch, jump, CSR or system
+ * instruction, or at the end of the page. A block stays within one physical page and
+ * is only valid for the virtual pc it was built at.
+ * */
+struct Block {
+    // virtual and physical address of the first instruction.
+    uint64_t pc;
+    uint64_t ppc;
+    // privilege mode and satp the block was built under.
+    uint64_t mode;
+    uint64_t satp;
+    // false if the last instruction may change privilege or translation, so the
+    // block it leads to must be looked up again.
+    bool chainable;
+    std::vector<DecodedInst> insts;
+    // Successors seen so far, linked after their first execution. The links are only
+    // followed while `epoch` matches the translation epoch of the hart.
+    uint64_t epoch;
+    uint64_t next_pc[2];
+    Block * next[2];
+    // host code of the block, or nullptr if it has not been translated.
+    JitFunc code;
+};
+
+/*!
+ * Blocks keyed by (virtual pc, physical pc, privilege mode, satp). A page mapped at two
+ * virtual addresses gets a block for each, so no block is ever replaced while others
+ * link to it. The cache is flushed as a whole when code is modified; the flush is
+ * deferred to the next block boundary so the block that is running stays alive.
+ * */
+class BlockCache {
+public:
+    BlockCache(): stale(false) {}
+
+    Block * find(uint64_t pc, uint64_t ppc, uint64_t mode, uint64_t satp) {
+        auto it = blocks.find(Key{pc, ppc, mode, satp});
+        return blocks.end() == it ? nullptr : it->second.get();
+    }
+
+    Block * insert(std::unique_ptr<Block> block) {
+        std::unique_ptr<Block> & slot = blocks[Key{block->pc, block->ppc, block->mode, block->satp}];
+        slot = std::move(block);
+        return slot.get();
+    }
+
+    // Mark every block outdated, e.g. after a store to a page holding code.
+    void invalidate() {
+        stale = true;
+    }
+
+    bool is_stale() const {
+        return stale;
+    }
+
+    void flush() {
+        blocks.clear();
+        stale = false;
+    }
+
+private:
+    struct Key {
+        uint64_t pc;
+        uint64_t ppc;
+        uint64_t mode;
+        uint64_t satp;
+        bool operator==(const Key & other) const {
+            return pc == other.pc && ppc == other.ppc && mode == other.mode && satp == other.satp;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key & k) const {
+            // Aliases of a page differ in the bits above the page offset.
+            return std::hash<uint64_t>()(k.ppc ^ (k.pc & ~(PAGE_SIZE - 1)) ^ (k.satp << 2) ^ k.mode);
+        }
+    };
+
+    std::unordered_map<Key, std::unique_ptr<Block>, KeyHash> blocks;
+    bool stale;
+};
+
+#endif  // _BLOCK_H_
@@ -1,49 +1,157 @@
 #ifndef _CLINT_H_
 #define _CLINT_H_
 
+#include "device.h"
+#include "doorbell.h"
 #include "exception.h"
 #include "param.h"
+#include "snapshot.h"
 
-#include <stdexcept>
+#include <atomic>
+#include <chrono>
 
-#define CLINT_MTIMECMP 0x02004000
-#define CLINT_MTIME 0x0200bff8
+// What mtime counts, see `--clock`.
+enum class Clock {
+    // instructions retired by all harts, one tick each, so that runs repeat exactly.
+    Instructions,
+    // the host monotonic clock at TIMEBASE_FREQ.
+    Host,
+};
 
-class Clint {
+/*!
+ * Core-local interruptor: one mtime shared by all harts, and an msip and mtimecmp
+ * register for each hart. Any hart may write the registers of another one, so they
+ * are atomics; the owning hart polls its msip, see `is_software_interrupting()`.
+ *
+ * Nothing here raises MTIP. Each hart compares its mtimecmp with `advance()` only
+ * when its next deadline may have passed, see CPU::poll_timer().
+ * */
+class Clint : public Device {
 public:
-    Clint() : mtime(0), mtimecmp(0) {}
+    Clint(Doorbell & doorbell) : doorbell(doorbell), mtime(0), start(std::chrono::steady_clock::now()) {
+        for (uint64_t i = 0; i < MAX_HARTS; ++i) {
+            msip[i] = 0;
+            mtimecmp[i] = 0;
+        }
+    }
+
+    // Choose what mtime counts. Call before any hart runs.
+    void set_clock(Clock c) {
+        clock = c;
+        mtime = 0;
+        start = std::chrono::steady_clock::now();
+    }
+
+    Clock get_clock() const {
+        return clock;
+    }
+
+    // The current value of mtime.
+    uint64_t now() const {
+        if (Clock::Host == clock) {
+            return mtime.load(std::memory_order_relaxed) + host_ticks();
+        }
+        return mtime.load(std::memory_order_relaxed);
+    }
+
+    // Account for instructions a hart has retired since it last called this, and
+    // return the current value of mtime.
+    uint64_t advance(uint64_t retired) {
+        if (Clock::Host == clock || 0 == retired) {
+            return now();
+        }
+        return mtime.fetch_add(retired, std::memory_order_relaxed) + retired;
+    }
+
+    // Counting instructions, move mtime on to t if it is behind, as if the time a hart
+    // spent asleep in WFI had been spent running.
+    void skip_to(uint64_t t) {
+        if (Clock::Host == clock) {
+            return;
+        }
+        uint64_t old = mtime.load(std::memory_order_relaxed);
+        while (old < t && !mtime.compare_exchange_weak(old, t, std::memory_order_relaxed)) {
+        }
+    }
 
-    uint64_t load(uint64_t addr, uint64_t size) {
+    uint64_t get_mtimecmp(uint64_t hart) const {
+        return mtimecmp[hart].load(std::memory_order_relaxed);
+    }
+
+    Exception load(uint64_t addr, [[maybe_unused]] uint64_t size, uint64_t & value) {
         // if (size != 64) {
         //     std::cerr << "clint LoadAccessFault " << size << std::endl;
-        //     throw LoadAccessFault(addr);
+        //     return Exception::LoadAccessFault;
         // }
-        if (CLINT_MTIMECMP == addr) {
-            return mtimecmp;
+        if (addr >= CLINT_MSIP && addr < CLINT_MSIP + 4 * MAX_HARTS) {
+            value = msip[(addr - CLINT_MSIP) / 4];
+        } else if (addr >= CLINT_MTIMECMP && addr < CLINT_MTIMECMP + 8 * MAX_HARTS) {
+            value = mtimecmp[(addr - CLINT_MTIMECMP) / 8];
         } else if (CLINT_MTIME == addr) {
-            return mtime;
+            value = now();
         } else{
-            throw LoadAccessFault(addr);
+            return Exception::LoadAccessFault;
         }
+        return Exception::None;
     }
 
-    void store(uint64_t addr, uint64_t size, uint64_t value) {
+    Exception store(uint64_t addr, uint64_t size, uint64_t value) {
+        if (addr >= CLINT_MSIP && addr < CLINT_MSIP + 4 * MAX_HARTS && 32 == size) {
+            // only bit 0 of msip is writable.
+            msip[(addr - CLINT_MSIP) / 4] = value & 1;
+            doorbell.ring();
+            return Exception::None;
+        }
         if (size != 64) {
-            throw StoreAMOAccessFault(addr);
+            return Exception::StoreAMOAccessFault;
         }
-        if (CLINT_MTIMECMP == addr) {
-            mtimecmp = value;
+        if (addr >= CLINT_MTIMECMP && addr < CLINT_MTIMECMP + 8 * MAX_HARTS) {
+            mtimecmp[(addr - CLINT_MTIMECMP) / 8] = value;
         } else if (CLINT_MTIME == addr) {
-            mtime = value;
+            mtime = (Clock::Host == clock) ? value - host_ticks() : value;
         } else {
-            throw StoreAMOAccessFault(addr);
+            return Exception::StoreAMOAccessFault;
         }
+        // A hart in WFI has to recompute how long it may sleep.
+        doorbell.ring();
+        return Exception::None;
+    }
+
+    // Whether msip of hart is set.
+    bool is_software_interrupting(uint64_t hart) const {
+        return 0 != msip[hart].load(std::memory_order_relaxed);
+    }
+
+    void save(SnapshotWriter & w) const {
+        w.put(now());
+        w.put(msip);
+        w.put(mtimecmp);
+    }
+
+    // Call after set_clock(): the host clock carries on from the saved mtime.
+    void restore(SnapshotReader & r) {
+        uint64_t t;
+        r.get(t);
+        mtime = (Clock::Host == clock) ? t - host_ticks() : t;
+        r.get(msip);
+        r.get(mtimecmp);
     }
 
 private:
-    uint64_t mtime;
-    uint64_t mtimecmp;
+    // Ticks of the host clock since start.
+    uint64_t host_ticks() const {
+        std::chrono::nanoseconds ns = std::chrono::steady_clock::now() - start;
+        return ns.count() / (1'000'000'000 / TIMEBASE_FREQ);
+    }
+
+    Doorbell & doorbell;
+    Clock clock = Clock::Instructions;
+    // mtime itself, or with the host clock what mtime was at start.
+    std::atomic<uint64_t> mtime;
+    std::chrono::steady_clock::time_point start;
+    std::atomic<uint32_t> msip[MAX_HARTS];
+    std::atomic<uint64_t> mtimecmp[MAX_HARTS];
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,60 @@
+#ifndef _CODEMAP_H_
+#define _CODEMAP_H_
+
+#include "param.h"
+
+#include <atomic>
+#include <memory>
+
+/*!
+ * Which harts hold predecoded instructions of each DRAM page, shared by all harts on
+ * a bus. Each hart is one bit of a mask. A write to a page with code on it clears the
+ * page's mask; the writer drops its own copy at once, and if other harts had one it
+ * bumps the generation so they find their pages gone at their next poll.
+ * */
+class CodeMap {
+public:
+    CodeMap(uint64_t dram_size = DRAM_SIZE): pages(dram_size / PAGE_SIZE),
+        owners(new std::atomic<uint64_t>[dram_size / PAGE_SIZE]()), generation_(0) {}
+
+    // Number of DRAM pages.
+    uint64_t size() const {
+        return pages;
+    }
+
+    // Record that harts cache the page with the given index.
+    void claim(uint64_t index, uint64_t harts) {
+        owners[index].fetch_or(harts, std::memory_order_relaxed);
+    }
+
+    void release(uint64_t index, uint64_t harts) {
+        owners[index].fetch_and(~harts, std::memory_order_relaxed);
+    }
+
+    bool is_owned(uint64_t index, uint64_t harts) const {
+        return 0 != (owners[index].load(std::memory_order_relaxed) & harts);
+    }
+
+    // The page with the given index is written to by the hart `self`.
+    void write(uint64_t index, uint64_t self) {
+        // Pages without code are the common case and must not cost an atomic write.
+        if (0 == owners[index].load(std::memory_order_relaxed)) {
+            return;
+        }
+        if (owners[index].exchange(0, std::memory_order_acq_rel) & ~self) {
+            generation_.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    uint64_t generation() const {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+private:
+    uint64_t pages;
+    std::unique_ptr<std::atomic<uint64_t>[]> owners;
+    // Polled by every hart after every instruction; keep it off the lines written above.
+    alignas(64) std::atomic<uint64_t> generation_;
+};
+
+#endif  // _CODEMAP_H_
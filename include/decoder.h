@@ -0,0 +1,966 @@
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <cstdint>
+
+/*!
+ * Every instruction the emulator understands. Each entry is (enum name, handler name);
+ * the handler is `CPU::exec_<handler name>`. The list is expanded wherever a table
+ * indexed by the op is needed so that the decoder and the dispatch stay in sync.
+ * */
+#define RV_OPS(X)                                                       \
+    X(DECODE, decode)                                                   \
+    X(ILLEGAL, illegal)                                                 \
+    X(LB, lb) X(LH, lh) X(LW, lw) X(LD, ld)                             \
+    X(LBU, lbu) X(LHU, lhu) X(LWU, lwu)                                 \
+    X(FENCE, fence) X(FENCE_I, fence_i)                                 \
+    X(ADDI, addi) X(SLLI, slli) X(SLTI, slti) X(SLTIU, sltiu)           \
+    X(XORI, xori) X(SRLI, srli) X(SRAI, srai) X(ORI, ori) X(ANDI, andi) \
+    X(AUIPC, auipc)                                                     \
+    X(ADDIW, addiw) X(SLLIW, slliw) X(SRLIW, srliw) X(SRAIW, sraiw)     \
+    X(SB, sb) X(SH, sh) X(SW, sw) X(SD, sd)                             \
+    X(LR_W, lr_w) X(SC_W, sc_w) X(LR_D, lr_d) X(SC_D, sc_d)             \
+    X(AMOSWAP_W, amoswap_w) X(AMOADD_W, amoadd_w) X(AMOXOR_W, amoxor_w) \
+    X(AMOAND_W, amoand_w) X(AMOOR_W, amoor_w)                           \
+    X(AMOMIN_W, amomin_w) X(AMOMAX_W, amomax_w)                         \
+    X(AMOMINU_W, amominu_w) X(AMOMAXU_W, amomaxu_w)                     \
+    X(AMOSWAP_D, amoswap_d) X(AMOADD_D, amoadd_d) X(AMOXOR_D, amoxor_d) \
+    X(AMOAND_D, amoand_d) X(AMOOR_D, amoor_d)                           \
+    X(AMOMIN_D, amomin_d) X(AMOMAX_D, amomax_d)                         \
+    X(AMOMINU_D, amominu_d) X(AMOMAXU_D, amomaxu_d)                     \
+    X(ADD, add) X(SUB, sub) X(SLL, sll) X(SLT, slt)                     \
+    X(SLTU, sltu) X(XOR, xor_) X(SRL, srl) X(SRA, sra)                  \
+    X(OR, or_) X(AND, and_)                                             \
+    X(LUI, lui)                                                         \
+    X(ADDW, addw) X(SUBW, subw) X(SLLW, sllw) X(SRLW, srlw)             \
+    X(SRAW, sraw)                                                       \
+    X(MUL, mul) X(MULH, mulh) X(MULHSU, mulhsu) X(MULHU, mulhu)         \
+    X(DIV, div) X(DIVU, divu) X(REM, rem) X(REMU, remu)                 \
+    X(MULW, mulw) X(DIVW, divw) X(DIVUW, divuw)                         \
+    X(REMW, remw) X(REMUW, remuw)                                       \
+    X(BEQ, beq) X(BNE, bne) X(BLT, blt) X(BGE, bge)                     \
+    X(BLTU, bltu) X(BGEU, bgeu)                                         \
+    X(JALR, jalr) X(JAL, jal)                                           \
+    X(ECALL, ecall) X(EBREAK, ebreak) X(SRET, sret) X(MRET, mret)       \
+    X(WFI, wfi) X(SFENCE_VMA, sfence_vma)                               \
+    X(CSRRW, csrrw) X(CSRRS, csrrs) X(CSRRC, csrrc)                     \
+    X(CSRRWI, csrrwi) X(CSRRSI, csrrsi) X(CSRRCI, csrrci)               \
+    X(FLW, flw) X(FLD, fld) X(FSW, fsw) X(FSD, fsd)                     \
+    RV_FP_OPS(X, S, s) RV_FP_OPS(X, D, d)                               \
+    X(FMV_X_W, fmv_x_w) X(FMV_W_X, fmv_w_x)                             \
+    X(FMV_X_D, fmv_x_d) X(FMV_D_X, fmv_d_x)                             \
+    X(FCVT_S_D, fcvt_s_d) X(FCVT_D_S, fcvt_d_s)                         \
+    X(VSETVLI, vsetvli) X(VSETIVLI, vsetivli) X(VSETVL, vsetvl)         \
+    X(VLE, vle) X(VSE, vse)                                             \
+    X(VADD_VV, vadd_vv) X(VADD_VX, vadd_vx) X(VADD_VI, vadd_vi)         \
+    X(VSUB_VV, vsub_vv) X(VSUB_VX, vsub_vx)                             \
+    X(VMUL_VV, vmul_vv) X(VMUL_VX, vmul_vx)                             \
+    X(VMACC_VV, vmacc_vv) X(VMACC_VX, vmacc_vx)                         \
+    X(VREDSUM_VS, vredsum_vs)                                           \
+    X(VMV_V_V, vmv_v_v) X(VMV_V_X, vmv_v_x) X(VMV_V_I, vmv_v_i)         \
+    X(VMV_X_S, vmv_x_s) X(VMV_S_X, vmv_s_x)                             \
+    X(VFADD_VV, vfadd_vv) X(VFADD_VF, vfadd_vf)                         \
+    X(VFSUB_VV, vfsub_vv) X(VFSUB_VF, vfsub_vf)                         \
+    X(VFMUL_VV, vfmul_vv) X(VFMUL_VF, vfmul_vf)                         \
+    X(VFMACC_VV, vfmacc_vv) X(VFMACC_VF, vfmacc_vf)                     \
+    X(VFREDUSUM_VS, vfredusum_vs) X(VFREDOSUM_VS, vfredosum_vs)         \
+    X(VFMV_F_S, vfmv_f_s) X(VFMV_S_F, vfmv_s_f) X(VFMV_V_F, vfmv_v_f)   \
+    X(ADD_UW, add_uw) X(SLLI_UW, slli_uw)                               \
+    X(SH1ADD, sh1add) X(SH2ADD, sh2add) X(SH3ADD, sh3add)               \
+    X(SH1ADD_UW, sh1add_uw) X(SH2ADD_UW, sh2add_uw)                     \
+    X(SH3ADD_UW, sh3add_uw)                                             \
+    X(ANDN, andn) X(ORN, orn) X(XNOR, xnor)                             \
+    X(CLZ, clz) X(CTZ, ctz) X(CPOP, cpop)                               \
+    X(CLZW, clzw) X(CTZW, ctzw) X(CPOPW, cpopw)                         \
+    X(MIN, min) X(MINU, minu) X(MAX, max) X(MAXU, maxu)                 \
+    X(SEXT_B, sext_b) X(SEXT_H, sext_h) X(ZEXT_H, zext_h)               \
+    X(ROL, rol) X(ROR, ror) X(RORI, rori)                               \
+    X(ROLW, rolw) X(RORW, rorw) X(RORIW, roriw)                         \
+    X(ORC_B, orc_b) X(REV8, rev8)                                       \
+    X(BCLR, bclr) X(BCLRI, bclri) X(BEXT, bext) X(BEXTI, bexti)         \
+    X(BINV, binv) X(BINVI, binvi) X(BSET, bset) X(BSETI, bseti)
+
+// The F and D instructions that exist in both formats, F being S or D.
+#define RV_FP_OPS(X, F, f)                                              \
+    X(FMADD_##F, fmadd_##f) X(FMSUB_##F, fmsub_##f)                     \
+    X(FNMSUB_##F, fnmsub_##f) X(FNMADD_##F, fnmadd_##f)                 \
+    X(FADD_##F, fadd_##f) X(FSUB_##F, fsub_##f) X(FMUL_##F, fmul_##f)   \
+    X(FDIV_##F, fdiv_##f) X(FSQRT_##F, fsqrt_##f)                       \
+    X(FSGNJ_##F, fsgnj_##f) X(FSGNJN_##F, fsgnjn_##f)                   \
+    X(FSGNJX_##F, fsgnjx_##f)                                           \
+    X(FMIN_##F, fmin_##f) X(FMAX_##F, fmax_##f)                         \
+    X(FEQ_##F, feq_##f) X(FLT_##F, flt_##f) X(FLE_##F, fle_##f)         \
+    X(FCLASS_##F, fclass_##f)                                           \
+    X(FCVT_W_##F, fcvt_w_##f) X(FCVT_WU_##F, fcvt_wu_##f)               \
+    X(FCVT_L_##F, fcvt_l_##f) X(FCVT_LU_##F, fcvt_lu_##f)               \
+    X(FCVT_##F##_W, fcvt_##f##_w) X(FCVT_##F##_WU, fcvt_##f##_wu)       \
+    X(FCVT_##F##_L, fcvt_##f##_l) X(FCVT_##F##_LU, fcvt_##f##_lu)
+
+enum Op : uint8_t {
+#define RV_OP_ENUM(op, name) OP_##op,
+    RV_OPS(RV_OP_ENUM)
+#undef RV_OP_ENUM
+    OP_COUNT
+};
+
+/*!
+ * An instruction with all of its fields extracted and its immediate sign-extended,
+ * so that executing it again costs neither a fetch nor a decode.
+ * `OP_DECODE` (all zero) marks a slot that has not been decoded yet.
+ * */
+struct DecodedInst {
+    // index of the handler, one of `Op`.
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    // the raw encoding, reported as the value of an illegal instruction. Only the low
+    // 16 bits are set for a compressed instruction.
+    uint32_t raw;
+    // sign-extended immediate, shift amount, CSR address or rs3 depending on the op.
+    // The rounding mode of an F or D instruction stays in raw.
+    uint64_t imm;
+};
+
+// Length in bytes of the instruction d was decoded from: only 32-bit encodings have
+// both low bits set.
+inline uint64_t inst_len(const DecodedInst & d) {
+    return (3 == (d.raw & 0x3)) ? 4 : 2;
+}
+
+/*!
+ * RV64C: expand a 16-bit instruction into the 32-bit instruction it stands for, so
+ * that it runs through the same handlers. rd', rs1' and rs2' name x8 to x15, or f8
+ * to f15 for the floating-point loads and stores. The reserved encodings are illegal.
+ * */
+inline DecodedInst decode_compressed(uint32_t inst) {
+    DecodedInst d;
+    d.op = OP_ILLEGAL;
+    d.rd = 0;
+    d.rs1 = 0;
+    d.rs2 = 0;
+    d.raw = inst;
+    d.imm = 0;
+
+    uint32_t funct3 = (inst >> 13) & 0x7;
+    uint8_t rd = (inst >> 7) & 0x1f;
+    uint8_t rs2 = (inst >> 2) & 0x1f;
+    uint8_t rd_ = 8 + ((inst >> 7) & 0x7);
+    uint8_t rs2_ = 8 + ((inst >> 2) & 0x7);
+    // imm[5|4:0] = inst[12|6:2], sign-extended; unsigned as a shift amount.
+    uint64_t imm6 = (uint64_t)((int64_t)(int32_t)((((inst >> 12) & 0x1) << 31) | (((inst >> 2) & 0x1f) << 26)) >> 26);
+    uint64_t shamt = ((inst >> 7) & 0x20) | ((inst >> 2) & 0x1f);
+    // all ones if inst[12], the sign bit of every signed immediate, is set.
+    uint64_t sign = 0 - (uint64_t)((inst >> 12) & 0x1);
+
+    switch (inst & 0x3) {
+    case 0x0:
+        switch (funct3) {
+        case 0x0: // C.ADDI4SPN: addi rd', x2, nzuimm[9:2]
+            // nzuimm[5:4|9:6|2|3] = inst[12:11|10:7|6|5]
+            d.imm = ((inst >> 7) & 0x30) | ((inst >> 1) & 0x3c0) | ((inst >> 4) & 0x4) | ((inst >> 2) & 0x8);
+            if (0 != d.imm) {
+                d.op = OP_ADDI;
+                d.rd = rs2_;
+                d.rs1 = 2;
+            }
+            break;
+        case 0x2: // C.LW: lw rd', uimm[6:2](rs1')
+            // uimm[5:3|2|6] = inst[12:10|6|5]
+            d.op = OP_LW;
+            d.rd = rs2_;
+            d.rs1 = rd_;
+            d.imm = ((inst >> 7) & 0x38) | ((inst >> 4) & 0x4) | ((inst << 1) & 0x40);
+            break;
+        case 0x1: // C.FLD
+        case 0x3: // C.LD: ld rd', uimm[7:3](rs1')
+            // uimm[5:3|7:6] = inst[12:10|6:5]
+            d.op = (0x1 == funct3) ? OP_FLD : OP_LD;
+            d.rd = rs2_;
+            d.rs1 = rd_;
+            d.imm = ((inst >> 7) & 0x38) | ((inst << 1) & 0xc0);
+            break;
+        case 0x6: // C.SW
+            d.op = OP_SW;
+            d.rs1 = rd_;
+            d.rs2 = rs2_;
+            d.imm = ((inst >> 7) & 0x38) | ((inst >> 4) & 0x4) | ((inst << 1) & 0x40);
+            break;
+        case 0x5: // C.FSD
+        case 0x7: // C.SD
+            d.op = (0x5 == funct3) ? OP_FSD : OP_SD;
+            d.rs1 = rd_;
+            d.rs2 = rs2_;
+            d.imm = ((inst >> 7) & 0x38) | ((inst << 1) & 0xc0);
+            break;
+        }
+        break;
+    case 0x1:
+        switch (funct3) {
+        case 0x0: // C.ADDI (C.NOP for rd = x0)
+            d.op = OP_ADDI;
+            d.rd = d.rs1 = rd;
+            d.imm = imm6;
+            break;
+        case 0x1: // C.ADDIW
+            if (0 != rd) {
+                d.op = OP_ADDIW;
+                d.rd = d.rs1 = rd;
+                d.imm = imm6;
+            }
+            break;
+        case 0x2: // C.LI: addi rd, x0, imm
+            d.op = OP_ADDI;
+            d.rd = rd;
+            d.imm = imm6;
+            break;
+        case 0x3:
+            if (2 == rd) {
+                // C.ADDI16SP: addi x2, x2, nzimm[9:4]
+                // nzimm[9|4|6|8:7|5] = inst[12|6|5|4:3|2]
+                d.imm = (sign << 9)
+                      | ((inst >> 2) & 0x10) | ((inst << 1) & 0x40) | ((inst << 4) & 0x180) | ((inst << 3) & 0x20);
+                if (0 != d.imm) {
+                    d.op = OP_ADDI;
+                    d.rd = d.rs1 = 2;
+                }
+            } else if (0 != imm6) {
+                // C.LUI: lui rd, nzimm[17:12]
+                d.op = OP_LUI;
+                d.rd = rd;
+                d.imm = imm6 << 12;
+            }
+            break;
+        case 0x4:
+            d.rd = d.rs1 = rd_;
+            d.rs2 = rs2_;
+            switch ((inst >> 10) & 0x3) {
+            case 0x0: d.op = OP_SRLI; d.imm = shamt; break;
+            case 0x1: d.op = OP_SRAI; d.imm = shamt; break;
+            case 0x2: d.op = OP_ANDI; d.imm = imm6; break;
+            case 0x3: {
+                static const uint8_t ops[8] = {
+                    OP_SUB, OP_XOR, OP_OR, OP_AND, OP_SUBW, OP_ADDW, OP_ILLEGAL, OP_ILLEGAL
+                };
+                d.op = ops[((inst >> 10) & 0x4) | ((inst >> 5) & 0x3)];
+                break;
+            }
+            }
+            break;
+        case 0x5: // C.J: jal x0, offset
+            // offset[11|4|9:8|10|6|7|3:1|5] = inst[12|11|10:9|8|7|6|5:3|2]
+            d.op = OP_JAL;
+            d.imm = (sign << 11)
+                  | ((inst >> 7) & 0x10) | ((inst >> 1) & 0x300) | ((inst << 2) & 0x400)
+                  | ((inst >> 1) & 0x40) | ((inst << 1) & 0x80) | ((inst >> 2) & 0xe) | ((inst << 3) & 0x20);
+            break;
+        case 0x6: // C.BEQZ: beq rs1', x0, offset
+        case 0x7: // C.BNEZ
+            // offset[8|4:3|7:6|2:1|5] = inst[12|11:10|6:5|4:3|2]
+            d.op = (0x6 == funct3) ? OP_BEQ : OP_BNE;
+            d.rs1 = rd_;
+            d.imm = (sign << 8)
+                  | ((inst >> 7) & 0x18) | ((inst << 1) & 0xc0) | ((inst >> 2) & 0x6) | ((inst << 3) & 0x20);
+            break;
+        }
+        break;
+    case 0x2:
+        switch (funct3) {
+        case 0x0: // C.SLLI
+            d.op = OP_SLLI;
+            d.rd = d.rs1 = rd;
+            d.imm = shamt;
+            break;
+        case 0x2: // C.LWSP: lw rd, uimm[7:2](x2)
+            // uimm[5|4:2|7:6] = inst[12|6:4|3:2]
+            if (0 != rd) {
+                d.op = OP_LW;
+                d.rd = rd;
+                d.rs1 = 2;
+                d.imm = ((inst >> 7) & 0x20) | ((inst >> 2) & 0x1c) | ((inst << 4) & 0xc0);
+            }
+            break;
+        case 0x1: // C.FLDSP, for which f0 is fine
+        case 0x3: // C.LDSP: ld rd, uimm[8:3](x2)
+            // uimm[5|4:3|8:6] = inst[12|6:5|4:2]
+            if (0 != rd || 0x1 == funct3) {
+                d.op = (0x1 == funct3) ? OP_FLD : OP_LD;
+                d.rd = rd;
+                d.rs1 = 2;
+                d.imm = ((inst >> 7) & 0x20) | ((inst >> 2) & 0x18) | ((inst << 4) & 0x1c0);
+            }
+            break;
+        case 0x4:
+            if (0 == (inst & 0x1000)) {
+                if (0 == rs2) {
+                    // C.JR: jalr x0, 0(rs1)
+                    if (0 != rd) {
+                        d.op = OP_JALR;
+                        d.rs1 = rd;
+                    }
+                } else {
+                    // C.MV: add rd, x0, rs2
+                    d.op = OP_ADD;
+                    d.rd = rd;
+                    d.rs2 = rs2;
+                }
+            } else if (0 == rs2) {
+                if (0 == rd) {
+                    d.op = OP_EBREAK;
+                } else {
+                    // C.JALR: jalr x1, 0(rs1)
+                    d.op = OP_JALR;
+                    d.rd = 1;
+                    d.rs1 = rd;
+                }
+            } else {
+                // C.ADD: add rd, rd, rs2
+                d.op = OP_ADD;
+                d.rd = d.rs1 = rd;
+                d.rs2 = rs2;
+            }
+            break;
+        case 0x6: // C.SWSP: sw rs2, uimm[7:2](x2)
+            // uimm[5:2|7:6] = inst[12:9|8:7]
+            d.op = OP_SW;
+            d.rs1 = 2;
+            d.rs2 = rs2;
+            d.imm = ((inst >> 7) & 0x3c) | ((inst >> 1) & 0xc0);
+            break;
+        case 0x5: // C.FSDSP
+        case 0x7: // C.SDSP: sd rs2, uimm[8:3](x2)
+            // uimm[5:3|8:6] = inst[12:10|9:7]
+            d.op = (0x5 == funct3) ? OP_FSD : OP_SD;
+            d.rs1 = 2;
+            d.rs2 = rs2;
+            d.imm = ((inst >> 7) & 0x38) | ((inst >> 1) & 0x1c0);
+            break;
+        }
+        break;
+    }
+    return d;
+}
+
+/*!
+ * OP-FP: funct7 is the operation with the format in its low bit (0 for S, 1 for D).
+ * funct3 holds the rounding mode or picks a variant, and rs2 picks the integer type
+ * of a conversion.
+ * */
+inline uint8_t decode_fp(uint32_t funct7, uint32_t funct3, uint8_t rs2) {
+    bool dbl = funct7 & 0x1;
+    switch (funct7 >> 1) {
+    case 0x00: return dbl ? OP_FADD_D : OP_FADD_S;
+    case 0x02: return dbl ? OP_FSUB_D : OP_FSUB_S;
+    case 0x04: return dbl ? OP_FMUL_D : OP_FMUL_S;
+    case 0x06: return dbl ? OP_FDIV_D : OP_FDIV_S;
+    case 0x16:
+        if (0 == rs2) {
+            return dbl ? OP_FSQRT_D : OP_FSQRT_S;
+        }
+        break;
+    case 0x08: {
+        static const uint8_t ops[2][3] = {
+            {OP_FSGNJ_S, OP_FSGNJN_S, OP_FSGNJX_S}, {OP_FSGNJ_D, OP_FSGNJN_D, OP_FSGNJX_D},
+        };
+        if (funct3 < 3) {
+            return ops[dbl][funct3];
+        }
+        break;
+    }
+    case 0x0a:
+        if (funct3 < 2) {
+            return dbl ? (funct3 ? OP_FMAX_D : OP_FMIN_D) : (funct3 ? OP_FMAX_S : OP_FMIN_S);
+        }
+        break;
+    case 0x10:
+        // FCVT.S.D and FCVT.D.S: rs2 is the format converted from.
+        if (!dbl && 1 == rs2) {
+            return OP_FCVT_S_D;
+        } else if (dbl && 0 == rs2) {
+            return OP_FCVT_D_S;
+        }
+        break;
+    case 0x28: {
+        static const uint8_t ops[2][3] = {
+            {OP_FLE_S, OP_FLT_S, OP_FEQ_S}, {OP_FLE_D, OP_FLT_D, OP_FEQ_D},
+        };
+        if (funct3 < 3) {
+            return ops[dbl][funct3];
+        }
+        break;
+    }
+    case 0x30: {
+        static const uint8_t ops[2][4] = {
+            {OP_FCVT_W_S, OP_FCVT_WU_S, OP_FCVT_L_S, OP_FCVT_LU_S},
+            {OP_FCVT_W_D, OP_FCVT_WU_D, OP_FCVT_L_D, OP_FCVT_LU_D},
+        };
+        if (rs2 < 4) {
+            return ops[dbl][rs2];
+        }
+        break;
+    }
+    case 0x34: {
+        static const uint8_t ops[2][4] = {
+            {OP_FCVT_S_W, OP_FCVT_S_WU, OP_FCVT_S_L, OP_FCVT_S_LU},
+            {OP_FCVT_D_W, OP_FCVT_D_WU, OP_FCVT_D_L, OP_FCVT_D_LU},
+        };
+        if (rs2 < 4) {
+            return ops[dbl][rs2];
+        }
+        break;
+    }
+    case 0x38:
+        if (0 == rs2 && 0 == funct3) {
+            return dbl ? OP_FMV_X_D : OP_FMV_X_W;
+        } else if (0 == rs2 && 1 == funct3) {
+            return dbl ? OP_FCLASS_D : OP_FCLASS_S;
+        }
+        break;
+    case 0x3c:
+        if (0 == rs2 && 0 == funct3) {
+            return dbl ? OP_FMV_D_X : OP_FMV_W_X;
+        }
+        break;
+    }
+    return OP_ILLEGAL;
+}
+
+/*!
+ * RVV: the OP-V major opcode. funct3 picks the operand form: vector-vector (OPIVV,
+ * OPFVV, OPMVV), vector-immediate (OPIVI), vector-scalar (OPIVX, OPFVF, OPMVX) or
+ * the configuration instructions (OPCFG). Only a subset of the funct6 operations is
+ * implemented. vm stays in raw; the immediate of a .vi form goes in imm.
+ * */
+inline uint8_t decode_vector(uint32_t inst, uint64_t & imm) {
+    uint32_t funct3 = (inst >> 12) & 0x7;
+    uint32_t funct6 = inst >> 26;
+    bool vm = (inst >> 25) & 0x1;
+    uint32_t vs1 = (inst >> 15) & 0x1f;
+    uint32_t vs2 = (inst >> 20) & 0x1f;
+    switch (funct3) {
+    case 0x0: // OPIVV
+        switch (funct6) {
+        case 0x00: return OP_VADD_VV;
+        case 0x02: return OP_VSUB_VV;
+        case 0x17: return (vm && 0 == vs2) ? OP_VMV_V_V : OP_ILLEGAL;
+        }
+        break;
+    case 0x3: // OPIVI
+        imm = (uint64_t)((int64_t)(int32_t)(vs1 << 27) >> 27);
+        switch (funct6) {
+        case 0x00: return OP_VADD_VI;
+        case 0x17: return (vm && 0 == vs2) ? OP_VMV_V_I : OP_ILLEGAL;
+        }
+        break;
+    case 0x4: // OPIVX
+        switch (funct6) {
+        case 0x00: return OP_VADD_VX;
+        case 0x02: return OP_VSUB_VX;
+        case 0x17: return (vm && 0 == vs2) ? OP_VMV_V_X : OP_ILLEGAL;
+        }
+        break;
+    case 0x2: // OPMVV
+        switch (funct6) {
+        case 0x00: return OP_VREDSUM_VS;
+        case 0x10: return (vm && 0 == vs1) ? OP_VMV_X_S : OP_ILLEGAL;
+        case 0x25: return OP_VMUL_VV;
+        case 0x2d: return OP_VMACC_VV;
+        }
+        break;
+    case 0x6: // OPMVX
+        switch (funct6) {
+        case 0x10: return (vm && 0 == vs2) ? OP_VMV_S_X : OP_ILLEGAL;
+        case 0x25: return OP_VMUL_VX;
+        case 0x2d: return OP_VMACC_VX;
+        }
+        break;
+    case 0x1: // OPFVV
+        switch (funct6) {
+        case 0x00: return OP_VFADD_VV;
+        case 0x01: return OP_VFREDUSUM_VS;
+        case 0x02: return OP_VFSUB_VV;
+        case 0x03: return OP_VFREDOSUM_VS;
+        case 0x10: return (vm && 0 == vs1) ? OP_VFMV_F_S : OP_ILLEGAL;
+        case 0x24: return OP_VFMUL_VV;
+        case 0x2c: return OP_VFMACC_VV;
+        }
+        break;
+    case 0x5: // OPFVF
+        switch (funct6) {
+        case 0x00: return OP_VFADD_VF;
+        case 0x02: return OP_VFSUB_VF;
+        case 0x10: return (vm && 0 == vs2) ? OP_VFMV_S_F : OP_ILLEGAL;
+        case 0x17: return (vm && 0 == vs2) ? OP_VFMV_V_F : OP_ILLEGAL;
+        case 0x24: return OP_VFMUL_VF;
+        case 0x2c: return OP_VFMACC_VF;
+        }
+        break;
+    case 0x7: // OPCFG: the new vtype is in imm for the immediate forms.
+        if (0 == (inst >> 31)) {
+            imm = (inst >> 20) & 0x7ff;
+            return OP_VSETVLI;
+        } else if (0x3 == (inst >> 30)) {
+            imm = (inst >> 20) & 0x3ff;
+            return OP_VSETIVLI;
+        } else if (0x40 == (inst >> 25)) {
+            return OP_VSETVL;
+        }
+        break;
+    }
+    return OP_ILLEGAL;
+}
+
+/*!
+ * Zba, Zbb and Zbs share OP, OP-32, OP-IMM and OP-IMM-32 with the base ISA and are
+ * told apart by funct7, or by the upper bits of the immediate. Any other encoding
+ * gives OP_ILLEGAL, for the caller to decode as a base instruction. The shift amount
+ * of the immediate forms goes in imm.
+ * */
+inline uint8_t decode_bitmanip(uint32_t inst, uint64_t & imm) {
+    uint32_t opcode = inst & 0x7f;
+    uint32_t funct3 = (inst >> 12) & 0x7;
+    uint32_t funct7 = inst >> 25;
+    uint32_t funct6 = inst >> 26;
+    uint32_t imm12 = inst >> 20;
+    uint32_t rs2 = (inst >> 20) & 0x1f;
+    switch (opcode) {
+    case 0x33: // OP
+        switch (funct7) {
+        case 0x05: {
+            static const uint8_t ops[8] = {
+                OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_MIN, OP_MINU, OP_MAX, OP_MAXU
+            };
+            return ops[funct3];
+        }
+        case 0x10: {
+            static const uint8_t ops[8] = {
+                OP_ILLEGAL, OP_ILLEGAL, OP_SH1ADD, OP_ILLEGAL, OP_SH2ADD, OP_ILLEGAL, OP_SH3ADD, OP_ILLEGAL
+            };
+            return ops[funct3];
+        }
+        case 0x20:
+            switch (funct3) {
+            case 0x4: return OP_XNOR;
+            case 0x6: return OP_ORN;
+            case 0x7: return OP_ANDN;
+            }
+            break;
+        case 0x30:
+            if (0x1 == funct3) {
+                return OP_ROL;
+            } else if (0x5 == funct3) {
+                return OP_ROR;
+            }
+            break;
+        case 0x24:
+            if (0x1 == funct3) {
+                return OP_BCLR;
+            } else if (0x5 == funct3) {
+                return OP_BEXT;
+            }
+            break;
+        case 0x34: return (0x1 == funct3) ? OP_BINV : OP_ILLEGAL;
+        case 0x14: return (0x1 == funct3) ? OP_BSET : OP_ILLEGAL;
+        }
+        break;
+    case 0x3b: // OP-32
+        switch (funct7) {
+        case 0x04:
+            if (0x0 == funct3) {
+                return OP_ADD_UW;
+            } else if (0x4 == funct3 && 0 == rs2) {
+                return OP_ZEXT_H;
+            }
+            break;
+        case 0x10: {
+            static const uint8_t ops[8] = {
+                OP_ILLEGAL, OP_ILLEGAL, OP_SH1ADD_UW, OP_ILLEGAL, OP_SH2ADD_UW, OP_ILLEGAL, OP_SH3ADD_UW, OP_ILLEGAL
+            };
+            return ops[funct3];
+        }
+        case 0x30:
+            if (0x1 == funct3) {
+                return OP_ROLW;
+            } else if (0x5 == funct3) {
+                return OP_RORW;
+            }
+            break;
+        }
+        break;
+    case 0x13: // OP-IMM
+        imm = imm12 & 0x3f;
+        if (0x1 == funct3) {
+            switch (imm12) {
+            case 0x600: return OP_CLZ;
+            case 0x601: return OP_CTZ;
+            case 0x602: return OP_CPOP;
+            case 0x604: return OP_SEXT_B;
+            case 0x605: return OP_SEXT_H;
+            }
+            switch (funct6) {
+            case 0x0a: return OP_BSETI;
+            case 0x12: return OP_BCLRI;
+            case 0x1a: return OP_BINVI;
+            }
+        } else if (0x5 == funct3) {
+            switch (imm12) {
+            case 0x287: return OP_ORC_B;
+            case 0x6b8: return OP_REV8;
+            }
+            switch (funct6) {
+            case 0x12: return OP_BEXTI;
+            case 0x18: return OP_RORI;
+            }
+        }
+        break;
+    case 0x1b: // OP-IMM-32
+        if (0x1 == funct3) {
+            switch (imm12) {
+            case 0x600: return OP_CLZW;
+            case 0x601: return OP_CTZW;
+            case 0x602: return OP_CPOPW;
+            }
+            if (0x02 == funct6) {
+                imm = imm12 & 0x3f;
+                return OP_SLLI_UW;
+            }
+        } else if (0x5 == funct3 && 0x30 == funct7) {
+            imm = imm12 & 0x1f;
+            return OP_RORIW;
+        }
+        break;
+    }
+    return OP_ILLEGAL;
+}
+
+// Unit-stride vector loads and stores: nf, mew, mop and lumop/sumop all zero. The
+// width field gives the element width, and stays in raw.
+inline bool is_vector_unit_stride(uint32_t inst) {
+    uint32_t funct3 = (inst >> 12) & 0x7;
+    bool width = (0x0 == funct3 || funct3 >= 0x5);
+    return width && 0 == (inst >> 28) && 0 == ((inst >> 20) & 0x1f) && 0 == ((inst >> 26) & 0x3);
+}
+
+inline DecodedInst decode(uint32_t inst) {
+    if (0x3 != (inst & 0x3)) {
+        return decode_compressed(inst & 0xffff);
+    }
+    DecodedInst d;
+    d.op = OP_ILLEGAL;
+    d.rd = (inst >> 7) & 0x1f;
+    d.rs1 = (inst >> 15) & 0x1f;
+    d.rs2 = (inst >> 20) & 0x1f;
+    d.raw = inst;
+    d.imm = 0;
+
+    uint32_t opcode = inst & 0x7f;
+    uint32_t funct3 = (inst >> 12) & 0x7;
+    uint32_t funct7 = (inst >> 25) & 0x7f;
+    // I-type immediate: imm[11:0] = inst[31:20]
+    uint64_t imm_i = (uint64_t)((int64_t)(int32_t)inst >> 20);
+
+    switch (opcode) {
+    case 0x03: { // LOAD
+        static const uint8_t ops[8] = {
+            OP_LB, OP_LH, OP_LW, OP_LD, OP_LBU, OP_LHU, OP_LWU, OP_ILLEGAL
+        };
+        d.op = ops[funct3];
+        d.imm = imm_i;
+        break;
+    }
+    case 0x07: { // LOAD-FP, also vector loads
+        if (0x2 == funct3) {
+            d.op = OP_FLW;
+        } else if (0x3 == funct3) {
+            d.op = OP_FLD;
+        } else if (is_vector_unit_stride(inst)) {
+            d.op = OP_VLE;
+        }
+        d.imm = imm_i;
+        break;
+    }
+    case 0x0f: {
+        if (0x0 == funct3) {
+            d.op = OP_FENCE;
+        } else if (0x1 == funct3) {
+            d.op = OP_FENCE_I;
+        }
+        break;
+    }
+    case 0x13: { // OP-IMM
+        d.op = decode_bitmanip(inst, d.imm);
+        if (OP_ILLEGAL != d.op) {
+            break;
+        }
+        d.imm = imm_i;
+        switch (funct3) {
+        case 0x0: d.op = OP_ADDI; break;
+        case 0x1: d.op = OP_SLLI; d.imm &= 0x3f; break;
+        case 0x2: d.op = OP_SLTI; break;
+        case 0x3: d.op = OP_SLTIU; break;
+        case 0x4: d.op = OP_XORI; break;
+        case 0x5:
+            if (0x00 == (funct7 >> 1)) {
+                d.op = OP_SRLI;
+            } else if (0x10 == (funct7 >> 1)) {
+                d.op = OP_SRAI;
+            }
+            d.imm &= 0x3f;
+            break;
+        case 0x6: d.op = OP_ORI; break;
+        case 0x7: d.op = OP_ANDI; break;
+        }
+        break;
+    }
+    case 0x17: { // AUIPC
+        d.op = OP_AUIPC;
+        d.imm = (uint64_t)(int64_t)(int32_t)(inst & 0xfffff000);
+        break;
+    }
+    case 0x1b: {
+        d.op = decode_bitmanip(inst, d.imm);
+        if (OP_ILLEGAL != d.op) {
+            break;
+        }
+        d.imm = imm_i;
+        switch (funct3) {
+        case 0x0: d.op = OP_ADDIW; break;
+        // "SLLIW, SRLIW, and SRAIW encodings with imm[5] != 0 are reserved."
+        case 0x1: d.op = OP_SLLIW; d.imm &= 0x1f; break;
+        case 0x5:
+            if (0x00 == funct7) {
+                d.op = OP_SRLIW;
+            } else if (0x20 == funct7) {
+                d.op = OP_SRAIW;
+            }
+            d.imm &= 0x1f;
+            break;
+        }
+        break;
+    }
+    case 0x23: { // STORE
+        // imm[11:5|4:0] = inst[31:25|11:7]
+        static const uint8_t ops[8] = {
+            OP_SB, OP_SH, OP_SW, OP_SD, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL
+        };
+        d.op = ops[funct3];
+        d.imm = (uint64_t)((int64_t)(int32_t)(inst & 0xfe000000) >> 20) | ((inst >> 7) & 0x1f);
+        break;
+    }
+    case 0x27: { // STORE-FP, also vector stores
+        if (0x2 == funct3) {
+            d.op = OP_FSW;
+        } else if (0x3 == funct3) {
+            d.op = OP_FSD;
+        } else if (is_vector_unit_stride(inst)) {
+            d.op = OP_VSE;
+        }
+        d.imm = (uint64_t)((int64_t)(int32_t)(inst & 0xfe000000) >> 20) | ((inst >> 7) & 0x1f);
+        break;
+    }
+    case 0x2f: { // RV64A
+        // funct5 selects the operation and funct3 the width. The aq and rl bits are
+        // not decoded: every atomic is sequentially consistent here.
+        bool word = (0x2 == funct3);
+        if (!word && 0x3 != funct3) {
+            break;
+        }
+        switch (funct7 >> 2) {
+        case 0x02:
+            if (0 == d.rs2) {
+                d.op = word ? OP_LR_W : OP_LR_D;
+            }
+            break;
+        case 0x03: d.op = word ? OP_SC_W : OP_SC_D; break;
+        case 0x01: d.op = word ? OP_AMOSWAP_W : OP_AMOSWAP_D; break;
+        case 0x00: d.op = word ? OP_AMOADD_W : OP_AMOADD_D; break;
+        case 0x04: d.op = word ? OP_AMOXOR_W : OP_AMOXOR_D; break;
+        case 0x0c: d.op = word ? OP_AMOAND_W : OP_AMOAND_D; break;
+        case 0x08: d.op = word ? OP_AMOOR_W : OP_AMOOR_D; break;
+        case 0x10: d.op = word ? OP_AMOMIN_W : OP_AMOMIN_D; break;
+        case 0x14: d.op = word ? OP_AMOMAX_W : OP_AMOMAX_D; break;
+        case 0x18: d.op = word ? OP_AMOMINU_W : OP_AMOMINU_D; break;
+        case 0x1c: d.op = word ? OP_AMOMAXU_W : OP_AMOMAXU_D; break;
+        }
+        break;
+    }
+    case 0x33: { // OP
+        if (0x01 == funct7) { // RV64M
+            static const uint8_t ops[8] = {
+                OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU
+            };
+            d.op = ops[funct3];
+            break;
+        }
+        d.op = decode_bitmanip(inst, d.imm);
+        if (OP_ILLEGAL != d.op) {
+            break;
+        }
+        switch (funct3) {
+        case 0x0:
+            if (0x00 == funct7) {
+                d.op = OP_ADD;
+            } else if (0x20 == funct7) {
+                d.op = OP_SUB;
+            }
+            break;
+        case 0x1: d.op = OP_SLL; break;
+        case 0x2: d.op = OP_SLT; break;
+        case 0x3: d.op = OP_SLTU; break;
+        case 0x4: d.op = OP_XOR; break;
+        case 0x5:
+            if (0x00 == funct7) {
+                d.op = OP_SRL;
+            } else if (0x20 == funct7) {
+                d.op = OP_SRA;
+            }
+            break;
+        case 0x6: d.op = OP_OR; break;
+        case 0x7: d.op = OP_AND; break;
+        }
+        break;
+    }
+    case 0x37: { // LUI
+        d.op = OP_LUI;
+        d.imm = (uint64_t)(int64_t)(int32_t)(inst & 0xfffff000);
+        break;
+    }
+    case 0x3b: {
+        if (0x01 == funct7) { // RV64M
+            static const uint8_t ops[8] = {
+                OP_MULW, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_DIVW, OP_DIVUW, OP_REMW, OP_REMUW
+            };
+            d.op = ops[funct3];
+            break;
+        }
+        d.op = decode_bitmanip(inst, d.imm);
+        if (OP_ILLEGAL != d.op) {
+            break;
+        }
+        switch (funct3) {
+        case 0x0:
+            if (0x00 == funct7) {
+                d.op = OP_ADDW;
+            } else if (0x20 == funct7) {
+                d.op = OP_SUBW;
+            }
+            break;
+        case 0x1:
+            if (0x00 == funct7) {
+                d.op = OP_SLLW;
+            }
+            break;
+        case 0x5:
+            if (0x00 == funct7) {
+                d.op = OP_SRLW;
+            } else if (0x20 == funct7) {
+                d.op = OP_SRAW;
+            }
+            break;
+        }
+        break;
+    }
+    case 0x43: case 0x47: case 0x4b: case 0x4f: { // FMADD, FMSUB, FNMSUB, FNMADD
+        // fmt = inst[26:25] is 0 for S and 1 for D, rs3 = inst[31:27].
+        static const uint8_t ops[2][4] = {
+            {OP_FMADD_S, OP_FMSUB_S, OP_FNMSUB_S, OP_FNMADD_S},
+            {OP_FMADD_D, OP_FMSUB_D, OP_FNMSUB_D, OP_FNMADD_D},
+        };
+        if ((funct7 & 0x3) < 2) {
+            d.op = ops[funct7 & 0x3][(opcode >> 2) & 0x3];
+            d.imm = inst >> 27;
+        }
+        break;
+    }
+    case 0x53: // OP-FP
+        d.op = decode_fp(funct7, funct3, d.rs2);
+        break;
+    case 0x57: // OP-V
+        d.op = decode_vector(inst, d.imm);
+        break;
+    case 0x63: { // BRANCH
+        // imm[12|10:5|4:1|11] = inst[31|30:25|11:8|7]
+        static const uint8_t ops[8] = {
+            OP_BEQ, OP_BNE, OP_ILLEGAL, OP_ILLEGAL, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU
+        };
+        d.op = ops[funct3];
+        d.imm = (uint64_t)((int64_t)(int32_t)(inst & 0x80000000) >> 19)
+              | ((inst & 0x80) << 4)   // imm[11]
+              | ((inst >> 20) & 0x7e0) // imm[10:5]
+              | ((inst >> 7) & 0x1e);  // imm[4:1]
+        break;
+    }
+    case 0x67: { // JALR
+        d.op = OP_JALR;
+        d.imm = imm_i;
+        break;
+    }
+    case 0x6f: { // JAL
+        d.op = OP_JAL;
+        // imm[20|10:1|11|19:12] = inst[31|30:21|20|19:12]
+        d.imm = (uint64_t)((int64_t)(int32_t)(inst & 0x80000000) >> 11)
+              | (inst & 0xff000)         // imm[19:12]
+              | ((inst >> 9) & 0x800)    // imm[11]
+              | ((inst >> 20) & 0x7fe);  // imm[10:1]
+        break;
+    }
+    case 0x73: {
+        d.imm = (inst & 0xfff00000) >> 20;  // csr address
+        switch (funct3) {
+        case 0x0:
+            if (0x0 == d.rs2 && 0x00 == funct7) {
+                d.op = OP_ECALL;
+            } else if (0x1 == d.rs2 && 0x00 == funct7) {
+                d.op = OP_EBREAK;
+            } else if (0x2 == d.rs2 && 0x08 == funct7) {
+                d.op = OP_SRET;
+            } else if (0x2 == d.rs2 && 0x18 == funct7) {
+                d.op = OP_MRET;
+            } else if (0x5 == d.rs2 && 0x08 == funct7) {
+                d.op = OP_WFI;
+            } else if (0x09 == funct7) {
+                d.op = OP_SFENCE_VMA;
+            }
+            break;
+        case 0x1: d.op = OP_CSRRW; break;
+        case 0x2: d.op = OP_CSRRS; break;
+        case 0x3: d.op = OP_CSRRC; break;
+        case 0x5: d.op = OP_CSRRWI; break;
+        case 0x6: d.op = OP_CSRRSI; break;
+        case 0x7: d.op = OP_CSRRCI; break;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return d;
+}
+
+// Whether op may transfer control or change privilege/translation, i.e. must be the
+// last instruction of a block.
+inline bool ends_block(uint8_t op) {
+    switch (op) {
+    case OP_DECODE: case OP_ILLEGAL: case OP_FENCE_I:
+    case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+    case OP_JALR: case OP_JAL:
+    case OP_ECALL: case OP_EBREAK: case OP_SRET: case OP_MRET: case OP_WFI: case OP_SFENCE_VMA:
+    case OP_CSRRW: case OP_CSRRS: case OP_CSRRC: case OP_CSRRWI: case OP_CSRRSI: case OP_CSRRCI:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Whether op only transfers control, leaving privilege and translation alone.
+inline bool is_jump(uint8_t op) {
+    switch (op) {
+    case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+    case OP_JALR: case OP_JAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+#endif  // _DECODER_H_
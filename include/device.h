@@ -0,0 +1,22 @@
+#ifndef _DEVICE_H_
+#define _DEVICE_H_
+
+#include "exception.h"
+
+#include <cstdint>
+
+/*!
+ * Something mapped into the physical address space, see Bus::map(). addr is the full
+ * physical address and size is in bits. Return the access fault to raise, or
+ * Exception::None.
+ * */
+class Device {
+public:
+	virtual ~Device() {}
+
+	virtual Exception load(uint64_t addr, uint64_t size, uint64_t & value) = 0;
+
+	virtual Exception store(uint64_t addr, uint64_t size, uint64_t value) = 0;
+};
+
+#endif
@@ -0,0 +1,884 @@
+#ifndef _DISK_H_
+#define _DISK_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define RVEMU_IO_URING
+#endif
+
+#include "param.h"
+
+// How the disk image is accessed, see `--disk-io`.
+enum class DiskIo {
+    // mapped into memory and copied to and from on the hart that asks.
+    Mmap,
+    // read and written through io_uring while the harts run on.
+    Uring,
+    // read and written by a pool of host threads while the harts run on.
+    Threads,
+};
+
+// Worker threads of ThreadPoolDisk.
+const size_t DISK_THREADS = 4;
+// Submission queue entries of UringDisk.
+const unsigned DISK_QUEUE_DEPTH = 64;
+
+/*!
+ * A transfer handed to an asynchronous backend. The iovecs point into guest memory
+ * and must stay valid until the backend completes the request.
+ * */
+struct DiskRequest {
+    enum Op {
+        Read,
+        Write,
+        Flush,
+    };
+    Op op;
+    uint64_t offset;
+    std::vector<iovec> iov;
+    // Set by the backend before it completes the request.
+    bool ok;
+};
+
+/*!
+ * Storage behind the virtio block device, addressed in bytes. Transfers that run
+ * past the end fail as a whole.
+ * */
+class BlockBackend {
+public:
+    virtual ~BlockBackend() {}
+
+    virtual uint64_t size() const = 0;
+
+    // The whole disk at one host address, for callers that copy to and from it
+    // themselves; nullptr if the backend does not keep it in memory.
+    virtual uint8_t * data() {
+        return nullptr;
+    }
+
+    virtual bool read(uint64_t offset, uint8_t * dst, uint64_t len) = 0;
+
+    virtual bool write(uint64_t offset, const uint8_t * src, uint64_t len) = 0;
+
+    // Make every completed write durable.
+    virtual bool flush() {
+        return true;
+    }
+
+    // Whether submit() works. Otherwise all transfers go through read() and write().
+    virtual bool asynchronous() const {
+        return false;
+    }
+
+    // Start req. The backend passes it to the completion handler, from a thread of its
+    // own, once done.
+    virtual void submit(DiskRequest * req) {
+        req->ok = false;
+        completion(req);
+    }
+
+    void set_completion(std::function<void(DiskRequest *)> handler) {
+        completion = handler;
+    }
+
+    bool contains(uint64_t offset, uint64_t len) const {
+        return offset <= size() && len <= size() - offset;
+    }
+
+protected:
+    std::function<void(DiskRequest *)> completion;
+};
+
+// A backend whose bytes are all at one host address.
+class MappedDisk : public BlockBackend {
+public:
+    uint64_t size() const {
+        return size_;
+    }
+
+    uint8_t * data() {
+        return base;
+    }
+
+    bool read(uint64_t offset, uint8_t * dst, uint64_t len) {
+        if (!contains(offset, len)) {
+            return false;
+        }
+        std::memcpy(dst, base + offset, len);
+        return true;
+    }
+
+    bool write(uint64_t offset, const uint8_t * src, uint64_t len) {
+        if (!contains(offset, len)) {
+            return false;
+        }
+        std::memcpy(base + offset, src, len);
+        return true;
+    }
+
+protected:
+    MappedDisk() : base(nullptr), size_(0) {}
+
+    uint8_t * base;
+    uint64_t size_;
+};
+
+// A disk in a vector of its own. Nothing written to it outlives the emulator.
+class MemoryDisk : public MappedDisk {
+public:
+    MemoryDisk(const std::vector<uint8_t> & image) : bytes(image) {
+        base = bytes.data();
+        size_ = bytes.size();
+    }
+
+private:
+    std::vector<uint8_t> bytes;
+};
+
+/*!
+ * An image file mapped shared, so opening it reads nothing, pages are only faulted
+ * in as the guest touches them, and guest writes land in the file. A file we may not
+ * write is mapped private instead: the guest still sees its own writes, but they are
+ * lost on exit.
+ * */
+class FileDisk : public MappedDisk {
+public:
+    ~FileDisk() {
+        if (nullptr != base) {
+            munmap(base, size_);
+        }
+        if (-1 != fd) {
+            close(fd);
+        }
+    }
+
+    FileDisk(const FileDisk &) = delete;
+    FileDisk & operator=(const FileDisk &) = delete;
+
+    // Map the image at path. Return nullptr if it cannot be opened or mapped.
+    static std::unique_ptr<FileDisk> open(const std::string & path) {
+        std::unique_ptr<FileDisk> disk(new FileDisk());
+        bool writable = true;
+        disk->fd = ::open(path.c_str(), O_RDWR);
+        if (-1 == disk->fd && (EACCES == errno || EROFS == errno)) {
+            writable = false;
+            disk->fd = ::open(path.c_str(), O_RDONLY);
+        }
+        struct stat st;
+        if (-1 == disk->fd || 0 != fstat(disk->fd, &st)) {
+            return nullptr;
+        }
+        if (0 == st.st_size) {
+            return disk;
+        }
+        void * p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, disk->fd, 0);
+        if (MAP_FAILED == p) {
+            return nullptr;
+        }
+        disk->base = (uint8_t *)p;
+        disk->size_ = st.st_size;
+        if (!writable) {
+            std::cerr << path << " is read-only; disk writes will not be saved" << std::endl;
+        }
+        return disk;
+    }
+
+    bool flush() {
+        return nullptr == base || 0 == msync(base, size_, MS_SYNC);
+    }
+
+private:
+    FileDisk() : fd(-1) {}
+
+    int fd;
+};
+
+// An image file read and written with pread() and pwrite(), which owns fd.
+class FdDisk : public BlockBackend {
+public:
+    ~FdDisk() {
+        close(fd);
+    }
+
+    FdDisk(const FdDisk &) = delete;
+    FdDisk & operator=(const FdDisk &) = delete;
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    bool read(uint64_t offset, uint8_t * dst, uint64_t len) {
+        if (!contains(offset, len)) {
+            return false;
+        }
+        while (len > 0) {
+            ssize_t n = pread(fd, dst, len, offset);
+            if (n < 0 && EINTR == errno) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            dst += n;
+            offset += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool write(uint64_t offset, const uint8_t * src, uint64_t len) {
+        if (!contains(offset, len)) {
+            return false;
+        }
+        while (len > 0) {
+            ssize_t n = pwrite(fd, src, len, offset);
+            if (n < 0 && EINTR == errno) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            src += n;
+            offset += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool flush() {
+        return 0 == fdatasync(fd);
+    }
+
+protected:
+    FdDisk(int fd, uint64_t size) : fd(fd), size_(size) {}
+
+    // Carry out req on the calling thread, but for its first skip bytes.
+    bool perform(DiskRequest * req, uint64_t skip = 0) {
+        if (DiskRequest::Flush == req->op) {
+            return flush();
+        }
+        uint64_t offset = req->offset;
+        for (const iovec & v : req->iov) {
+            uint64_t len = v.iov_len;
+            uint8_t * base = (uint8_t *)v.iov_base;
+            if (skip >= len) {
+                skip -= len;
+                offset += len;
+                continue;
+            }
+            bool ok = (DiskRequest::Read == req->op)
+                ? read(offset + skip, base + skip, len - skip)
+                : write(offset + skip, base + skip, len - skip);
+            if (!ok) {
+                return false;
+            }
+            skip = 0;
+            offset += len;
+        }
+        return true;
+    }
+
+    int fd;
+    uint64_t size_;
+};
+
+// Requests run on a few host threads, which block in the system calls instead of the harts.
+class ThreadPoolDisk : public FdDisk {
+public:
+    ThreadPoolDisk(int fd, uint64_t size, size_t threads = DISK_THREADS) : FdDisk(fd, size), stopping(false) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~ThreadPoolDisk() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cvar.notify_all();
+        for (std::thread & t : workers) {
+            t.join();
+        }
+    }
+
+    bool asynchronous() const {
+        return true;
+    }
+
+    void submit(DiskRequest * req) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(req);
+        }
+        cvar.notify_one();
+    }
+
+private:
+    // Worker thread: run requests until destruction, and finish the queued ones first.
+    void work() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cvar.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            DiskRequest * req = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            req->ok = perform(req);
+            completion(req);
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cvar;
+    std::deque<DiskRequest *> queue;
+    bool stopping;
+    std::vector<std::thread> workers;
+};
+
+#ifdef RVEMU_IO_URING
+/*!
+ * Requests go to the kernel through an io_uring, set up with the raw system calls so
+ * that there is no liburing to link. The harts only fill submission entries; a reaper
+ * thread waits for completions and hands them on.
+ * */
+class UringDisk : public FdDisk {
+public:
+    // Set up a ring for fd, which it then owns. Return nullptr, leaving fd alone, if
+    // the kernel does not offer io_uring.
+    static std::unique_ptr<UringDisk> create(int fd, uint64_t size) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int ring = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &params);
+        if (ring < 0) {
+            return nullptr;
+        }
+        std::unique_ptr<UringDisk> disk(new UringDisk(fd, size, ring));
+        if (!disk->map(params)) {
+            disk->fd = -1;
+            return nullptr;
+        }
+        disk->reaper = std::thread([d = disk.get()]() { d->reap(); });
+        return disk;
+    }
+
+    ~UringDisk() {
+        if (reaper.joinable()) {
+            // A request with no DiskRequest behind it tells the reaper to stop.
+            std::lock_guard<std::mutex> lock(sq_mutex);
+            push(IORING_OP_NOP, 0, nullptr, 0, 0, 0);
+            enter(1, 0, 0);
+        }
+        if (reaper.joinable()) {
+            reaper.join();
+        }
+        if (nullptr != sq_ring) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (nullptr != cq_ring && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (nullptr != sqes) {
+            munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+        }
+        close(ring_fd);
+    }
+
+    bool asynchronous() const {
+        return true;
+    }
+
+    void submit(DiskRequest * req) {
+        std::lock_guard<std::mutex> lock(sq_mutex);
+        switch (req->op) {
+        case DiskRequest::Read:
+            push(IORING_OP_READV, (uint64_t)req, req->iov.data(), req->iov.size(), req->offset, 0);
+            break;
+        case DiskRequest::Write:
+            push(IORING_OP_WRITEV, (uint64_t)req, req->iov.data(), req->iov.size(), req->offset, 0);
+            break;
+        case DiskRequest::Flush:
+            push(IORING_OP_FSYNC, (uint64_t)req, nullptr, 0, 0, IORING_FSYNC_DATASYNC);
+            break;
+        }
+        if (enter(1, 0, 0) < 0) {
+            // Nothing was queued: take the entry back and do it here.
+            --sq_tail_local;
+            __atomic_store_n(sq_tail, sq_tail_local, __ATOMIC_RELEASE);
+            req->ok = perform(req);
+            completion(req);
+        }
+    }
+
+private:
+    UringDisk(int fd, uint64_t size, int ring_fd) : FdDisk(fd, size), ring_fd(ring_fd),
+        sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr) {}
+
+    bool map(const io_uring_params & p) {
+        sq_entries = p.sq_entries;
+        sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = 0 != (p.features & IORING_FEAT_SINGLE_MMAP);
+        if (single) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        void * sq = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (MAP_FAILED == sq) {
+            return false;
+        }
+        sq_ring = (uint8_t *)sq;
+        if (single) {
+            cq_ring = sq_ring;
+        } else {
+            void * cq = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (MAP_FAILED == cq) {
+                return false;
+            }
+            cq_ring = (uint8_t *)cq;
+        }
+        void * s = mmap(nullptr, sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (MAP_FAILED == s) {
+            return false;
+        }
+        sqes = (io_uring_sqe *)s;
+        sq_tail = (uint32_t *)(sq_ring + p.sq_off.tail);
+        sq_mask = *(uint32_t *)(sq_ring + p.sq_off.ring_mask);
+        cq_head = (uint32_t *)(cq_ring + p.cq_off.head);
+        cq_tail = (uint32_t *)(cq_ring + p.cq_off.tail);
+        cq_mask = *(uint32_t *)(cq_ring + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq_ring + p.cq_off.cqes);
+        // Submission entries are used in ring order.
+        uint32_t * array = (uint32_t *)(sq_ring + p.sq_off.array);
+        for (uint32_t i = 0; i < sq_entries; ++i) {
+            array[i] = i;
+        }
+        sq_tail_local = *sq_tail;
+        return true;
+    }
+
+    // Queue one entry; the caller holds sq_mutex. Without SQPOLL the kernel takes
+    // every entry in enter(), so the queue is empty again by the next push.
+    void push(uint8_t opcode, uint64_t user_data, const iovec * iov, uint32_t iovcnt, uint64_t offset, uint32_t flags) {
+        io_uring_sqe & sqe = sqes[sq_tail_local & sq_mask];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = (IORING_OP_NOP == opcode) ? -1 : fd;
+        sqe.addr = (uint64_t)iov;
+        sqe.len = iovcnt;
+        sqe.off = offset;
+        sqe.fsync_flags = flags;
+        sqe.user_data = user_data;
+        ++sq_tail_local;
+        __atomic_store_n(sq_tail, sq_tail_local, __ATOMIC_RELEASE);
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+        while (true) {
+            int r = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+            if (r >= 0 || EINTR != errno) {
+                return r;
+            }
+        }
+    }
+
+    // Reaper thread: complete requests as the kernel finishes them, until the stop entry.
+    void reap() {
+        while (true) {
+            enter(0, 1, IORING_ENTER_GETEVENTS);
+            uint32_t head = *cq_head;
+            uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            bool stop = false;
+            for (; head != tail; ++head) {
+                io_uring_cqe cqe = cqes[head & cq_mask];
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                DiskRequest * req = (DiskRequest *)cqe.user_data;
+                if (nullptr == req) {
+                    stop = true;
+                    continue;
+                }
+                if (DiskRequest::Flush == req->op) {
+                    req->ok = 0 == cqe.res;
+                } else {
+                    uint64_t total = 0;
+                    for (const iovec & v : req->iov) {
+                        total += v.iov_len;
+                    }
+                    // A short transfer is finished here rather than resubmitted.
+                    req->ok = cqe.res >= 0 && ((uint64_t)cqe.res == total || perform(req, cqe.res));
+                }
+                completion(req);
+            }
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    int ring_fd;
+    std::mutex sq_mutex;
+    uint8_t * sq_ring;
+    uint8_t * cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    io_uring_sqe * sqes;
+    uint32_t sq_entries;
+    uint32_t * sq_tail;
+    uint32_t sq_tail_local;
+    uint32_t sq_mask;
+    uint32_t * cq_head;
+    uint32_t * cq_tail;
+    uint32_t cq_mask;
+    io_uring_cqe * cqes;
+    std::thread reaper;
+};
+#endif
+
+// Overlay images begin with this.
+const char OVERLAY_MAGIC[8] = {'R', 'V', 'E', 'M', 'U', 'O', 'V', 'L'};
+const uint32_t OVERLAY_VERSION = 1;
+// Unit of copy-on-write. A multiple of the host page size, so clusters map cleanly.
+const uint64_t OVERLAY_CLUSTER_SIZE = 4096;
+const uint64_t OVERLAY_HEADER_SIZE = 4096;
+
+/*!
+ * First bytes of an overlay file, little-endian. After it comes a bitmap with a bit
+ * for each cluster of the disk, set once the overlay holds that cluster, and then
+ * room for every cluster at data_offset + cluster * cluster_size. The file is sparse:
+ * clusters never written take no space.
+ * */
+struct OverlayHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    // Size of the disk, which is that of the base.
+    uint64_t size;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+    // Path of the base image, relative to the directory of the overlay unless absolute.
+    char base[OVERLAY_HEADER_SIZE - 40];
+};
+
+static_assert(sizeof(OverlayHeader) == OVERLAY_HEADER_SIZE, "overlay header is one page");
+
+/*!
+ * A read-only base image under a per-instance overlay file. Reads of a cluster the
+ * overlay does not hold fall through to the base; the first write to it copies it
+ * into the overlay. The base is mapped shared and never written, so any number of
+ * emulators on one base share a single copy of it in the host page cache.
+ * */
+class OverlayDisk : public BlockBackend {
+public:
+    ~OverlayDisk() {
+        if (nullptr != base) {
+            munmap(base, size_);
+        }
+        if (nullptr != overlay) {
+            munmap(overlay, overlay_size);
+        }
+        if (-1 != fd) {
+            close(fd);
+        }
+    }
+
+    OverlayDisk(const OverlayDisk &) = delete;
+    OverlayDisk & operator=(const OverlayDisk &) = delete;
+
+    // Whether the file at path is an overlay.
+    static bool is_overlay(const std::string & path) {
+        char magic[sizeof(OVERLAY_MAGIC)];
+        int f = ::open(path.c_str(), O_RDONLY);
+        if (-1 == f) {
+            return false;
+        }
+        bool is = sizeof(magic) == pread(f, magic, sizeof(magic), 0) && 0 == std::memcmp(magic, OVERLAY_MAGIC, sizeof(magic));
+        close(f);
+        return is;
+    }
+
+    // Make an empty overlay at path on the base image at base_path, which is stored
+    // as given. Return false, with a message, on failure.
+    static bool create(const std::string & base_path, const std::string & path) {
+        std::string resolved = resolve(path, base_path);
+        struct stat st;
+        if (0 != stat(resolved.c_str(), &st)) {
+            std::cerr << "cannot open base image " << resolved << std::endl;
+            return false;
+        }
+        if (base_path.size() >= sizeof(OverlayHeader::base)) {
+            std::cerr << "base image path is too long" << std::endl;
+            return false;
+        }
+        OverlayHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC));
+        header.version = OVERLAY_VERSION;
+        header.cluster_size = OVERLAY_CLUSTER_SIZE;
+        header.size = st.st_size;
+        header.bitmap_offset = OVERLAY_HEADER_SIZE;
+        uint64_t clusters = (header.size + OVERLAY_CLUSTER_SIZE - 1) / OVERLAY_CLUSTER_SIZE;
+        uint64_t bitmap = (clusters + 7) / 8;
+        header.data_offset = header.bitmap_offset + (bitmap + OVERLAY_CLUSTER_SIZE - 1) / OVERLAY_CLUSTER_SIZE * OVERLAY_CLUSTER_SIZE;
+        std::memcpy(header.base, base_path.c_str(), base_path.size());
+        int f = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (-1 == f) {
+            std::cerr << "cannot create " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        bool ok = sizeof(header) == pwrite(f, &header, sizeof(header), 0)
+            && 0 == ftruncate(f, header.data_offset + clusters * OVERLAY_CLUSTER_SIZE)
+            && 0 == fsync(f);
+        close(f);
+        if (!ok) {
+            std::cerr << "cannot write " << path << std::endl;
+        }
+        return ok;
+    }
+
+    // Open the overlay at path and its base. Return nullptr, with a message, on failure.
+    static std::unique_ptr<OverlayDisk> open(const std::string & path) {
+        std::unique_ptr<OverlayDisk> disk(new OverlayDisk());
+        disk->fd = ::open(path.c_str(), O_RDWR);
+        struct stat st;
+        OverlayHeader & h = disk->header;
+        if (-1 == disk->fd || 0 != fstat(disk->fd, &st)
+            || sizeof(h) != pread(disk->fd, &h, sizeof(h), 0)
+            || 0 != std::memcmp(h.magic, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC))) {
+            std::cerr << "cannot open overlay " << path << std::endl;
+            return nullptr;
+        }
+        h.base[sizeof(h.base) - 1] = 0;
+        uint64_t clusters = (h.size + h.cluster_size - 1) / std::max<uint64_t>(h.cluster_size, 1);
+        if (OVERLAY_VERSION != h.version || 0 == h.cluster_size || 0 != h.cluster_size % PAGE_SIZE
+            || h.bitmap_offset + (clusters + 7) / 8 > h.data_offset
+            || (uint64_t)st.st_size < h.data_offset + clusters * h.cluster_size) {
+            std::cerr << path << " is not an overlay this emulator can use" << std::endl;
+            return nullptr;
+        }
+        disk->base_path_ = resolve(path, h.base);
+        int base_fd = ::open(disk->base_path_.c_str(), O_RDONLY);
+        struct stat base_st;
+        if (-1 == base_fd || 0 != fstat(base_fd, &base_st) || (uint64_t)base_st.st_size != h.size) {
+            std::cerr << "base image " << disk->base_path_ << " is missing or has changed size" << std::endl;
+            if (-1 != base_fd) {
+                close(base_fd);
+            }
+            return nullptr;
+        }
+        disk->size_ = h.size;
+        if (0 != h.size) {
+            void * p = mmap(nullptr, h.size, PROT_READ, MAP_SHARED, base_fd, 0);
+            disk->base = (MAP_FAILED == p) ? nullptr : (uint8_t *)p;
+        }
+        close(base_fd);
+        disk->overlay_size = st.st_size;
+        void * p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+        disk->overlay = (MAP_FAILED == p) ? nullptr : (uint8_t *)p;
+        if ((0 != h.size && nullptr == disk->base) || nullptr == disk->overlay) {
+            std::cerr << "cannot map " << path << std::endl;
+            return nullptr;
+        }
+        disk->bitmap = disk->overlay + h.bitmap_offset;
+        disk->clusters = disk->overlay + h.data_offset;
+        return disk;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    bool read(uint64_t offset, uint8_t * dst, uint64_t len) {
+        if (!contains(offset, len)) {
+            return false;
+        }
+        while (len > 0) {
+            uint64_t chunk = std::min(len, header.cluster_size - offset % header.cluster_size);
+            std::memcpy(dst, (allocated(offset / header.cluster_size) ? clusters : base) + offset, chunk);
+            dst += chunk;
+            offset += chunk;
+            len -= chunk;
+        }
+        return true;
+    }
+
+    bool write(uint64_t offset, const uint8_t * src, uint64_t len) {
+        if (!contains(offset, len)) {
+            return false;
+        }
+        while (len > 0) {
+            uint64_t cluster = offset / header.cluster_size;
+            uint64_t chunk = std::min(len, header.cluster_size - offset % header.cluster_size);
+            if (!allocated(cluster)) {
+                uint64_t start = cluster * header.cluster_size;
+                if (chunk != header.cluster_size) {
+                    // Keep the rest of the cluster.
+                    std::memcpy(clusters + start, base + start, std::min<uint64_t>(header.cluster_size, size_ - start));
+                }
+                // The data goes in before the bit that makes it visible.
+                std::memcpy(clusters + offset, src, chunk);
+                bitmap[cluster / 8] |= 1 << (cluster % 8);
+            } else {
+                std::memcpy(clusters + offset, src, chunk);
+            }
+            src += chunk;
+            offset += chunk;
+            len -= chunk;
+        }
+        return true;
+    }
+
+    bool flush() {
+        return 0 == msync(overlay, overlay_size, MS_SYNC);
+    }
+
+    uint64_t cluster_size() const {
+        return header.cluster_size;
+    }
+
+    const std::string & base_path() const {
+        return base_path_;
+    }
+
+    // Whether the overlay holds the cluster at index.
+    bool allocated(uint64_t index) const {
+        return 0 != (bitmap[index / 8] & (1 << (index % 8)));
+    }
+
+    // Drop every cluster the overlay holds, giving their space back to the file system.
+    bool discard() {
+        std::memset(bitmap, 0, header.data_offset - header.bitmap_offset);
+        return flush() && 0 == fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, header.data_offset, overlay_size - header.data_offset);
+    }
+
+    // Write every cluster the overlay holds into the base, then empty the overlay.
+    // committed is the number of clusters written. Return false, with a message, on
+    // failure.
+    bool commit(uint64_t & committed) {
+        committed = 0;
+        int base_fd = ::open(base_path_.c_str(), O_WRONLY);
+        if (-1 == base_fd) {
+            std::cerr << "cannot write base image " << base_path_ << std::endl;
+            return false;
+        }
+        uint64_t n = (size_ + header.cluster_size - 1) / header.cluster_size;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!allocated(i)) {
+                continue;
+            }
+            uint64_t offset = i * header.cluster_size;
+            uint64_t len = std::min<uint64_t>(header.cluster_size, size_ - offset);
+            if ((ssize_t)len != pwrite(base_fd, clusters + offset, len, offset)) {
+                std::cerr << "cannot write base image " << base_path_ << std::endl;
+                close(base_fd);
+                return false;
+            }
+            ++committed;
+        }
+        bool synced = 0 == fsync(base_fd);
+        close(base_fd);
+        // Only once the base has it all may the overlay let go.
+        if (!synced || !discard()) {
+            std::cerr << "cannot empty the overlay on " << base_path_ << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Write the disk the overlay presents to a new plain image. Return false, with a
+    // message, on failure.
+    bool flatten(const std::string & image) {
+        int out = ::open(image.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (-1 == out) {
+            std::cerr << "cannot create " << image << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        std::vector<uint8_t> buf(1024 * 1024);
+        bool ok = 0 == ftruncate(out, size_);
+        for (uint64_t offset = 0; ok && offset < size_; offset += buf.size()) {
+            uint64_t len = std::min<uint64_t>(buf.size(), size_ - offset);
+            ok = read(offset, buf.data(), len) && (ssize_t)len == pwrite(out, buf.data(), len, offset);
+        }
+        ok = ok && 0 == fsync(out);
+        close(out);
+        if (!ok) {
+            std::cerr << "cannot write " << image << std::endl;
+        }
+        return ok;
+    }
+
+private:
+    OverlayDisk() : fd(-1), base(nullptr), overlay(nullptr), overlay_size(0), size_(0) {}
+
+    // path taken relative to the directory of the overlay at from, unless absolute.
+    static std::string resolve(const std::string & from, const std::string & path) {
+        size_t slash = from.rfind('/');
+        if (path.empty() || '/' == path[0] || std::string::npos == slash) {
+            return path;
+        }
+        return from.substr(0, slash + 1) + path;
+    }
+
+    OverlayHeader header;
+    std::string base_path_;
+    int fd;
+    uint8_t * base;
+    uint8_t * overlay;
+    uint64_t overlay_size;
+    uint8_t * bitmap;
+    uint8_t * clusters;
+    uint64_t size_;
+};
+
+// Open the image at path for access by mode. Return nullptr if it cannot be opened.
+// Overlays are always read and written in place, through their mappings.
+std::unique_ptr<BlockBackend> open_disk(const std::string & path, DiskIo mode) {
+    if (OverlayDisk::is_overlay(path)) {
+        return OverlayDisk::open(path);
+    }
+    if (DiskIo::Mmap == mode) {
+        return FileDisk::open(path);
+    }
+    int fd = ::open(path.c_str(), O_RDWR);
+    struct stat st;
+    if (-1 == fd || 0 != fstat(fd, &st)) {
+        if (-1 != fd) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    if (DiskIo::Uring == mode) {
+#ifdef RVEMU_IO_URING
+        std::unique_ptr<UringDisk> disk = UringDisk::create(fd, st.st_size);
+        if (disk) {
+            return disk;
+        }
+#endif
+        std::cerr << "io_uring is not available; using a thread pool" << std::endl;
+    }
+    return std::unique_ptr<BlockBackend>(new ThreadPoolDisk(fd, st.st_size));
+}
+
+#endif  // _DISK_H_
@@ -0,0 +1,56 @@
+#ifndef _DOORBELL_H_
+#define _DOORBELL_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/*!
+ * Where harts in WFI sleep, shared by all harts on a bus. Anything that may make an
+ * interrupt pending rings it after doing so, and every sleeping hart wakes up to
+ * look. A hart reads `epoch()` before it looks for a pending interrupt and passes it
+ * to `wait()`, so a ring in between is not lost.
+ * */
+class Doorbell {
+public:
+    Doorbell() : epoch_(0), sleepers(0) {}
+
+    uint64_t epoch() const {
+        return epoch_.load();
+    }
+
+    // Wake every hart waiting. Cheap when none is, which is the common case.
+    void ring() {
+        epoch_.fetch_add(1);
+        if (0 != sleepers.load()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cvar.notify_all();
+        }
+    }
+
+    // Sleep until a ring after seen, or until timeout has passed.
+    void wait(uint64_t seen, std::chrono::nanoseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers.fetch_add(1);
+        cvar.wait_for(lock, timeout, [&]() { return epoch_.load() != seen; });
+        sleepers.fetch_sub(1);
+    }
+
+    // Sleep until a ring after seen.
+    void wait(uint64_t seen) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers.fetch_add(1);
+        cvar.wait(lock, [&]() { return epoch_.load() != seen; });
+        sleepers.fetch_sub(1);
+    }
+
+private:
+    std::atomic<uint64_t> epoch_;
+    std::atomic<uint32_t> sleepers;
+    std::mutex mutex;
+    std::condition_variable cvar;
+};
+
+#endif  // _DOORBELL_H_
@@ -1,125 +1,74 @@
 #ifndef _EXCEPTION_H_
 #define _EXCEPTION_H_
 
-
-#include <stdexcept>
-
-// Riscv Standard Exception
-// enum Exception {
-// 	LoadAccessFault,
-//     StoreAMOAccessFault,
-//     IllegalInstruction
-// };
-
-class RISCVException {
-public:
-	RISCVException(uint64_t code, uint64_t value): code_(code), value_(value) {}
-	int code() const { return code_; }
-	uint64_t value() const { return value_; }
-
-	virtual const char * what() const throw () = 0;
-	virtual bool is_fatal() = 0;
-protected:
-	uint64_t code_;
-	uint64_t value_;
-};
-
-class InstructionAddrMisaligned: public RISCVException {
-public:
-	InstructionAddrMisaligned(uint64_t addr): RISCVException(0, addr) {}
-	const char * what() const throw () { return "Instruction Address Misaligned"; }
-	bool is_fatal() { return true; }
-};
-
-class InstructionAccessFault: public RISCVException {
-public:
-	InstructionAccessFault(uint64_t addr): RISCVException(1, addr) {}
-	const char * what() const throw () { return "Instruction Access Fault"; }
-	bool is_fatal() { return true; }
-};
-
-class IllegalInstruction: public RISCVException {
-public:
-	IllegalInstruction(uint64_t inst): RISCVException(2, inst) {}
-	const char * what () const throw () { return "Illegal Instruction"; }
-	bool is_fatal() { return true; }
-};
-
-class Breakpoint: public RISCVException {
-public:
-	Breakpoint(uint64_t pc): RISCVException(3, pc) {}
-	const char * what() const throw () { return "Breakpoint"; }
-	bool is_fatal() { return false; }
-};
-
-class LoadAddrMisaligned: public RISCVException {
-public:
-	LoadAddrMisaligned(uint64_t addr): RISCVException(4, addr) {}
-	const char * what() { return "Load Address Misaligned"; }
-	bool is_fatal() { return false; }
-};
-
-class LoadAccessFault: public RISCVException {
-public:
-	LoadAccessFault(uint64_t addr): RISCVException(5, addr) {}
-	const char * what () const throw () { return "Load Access Fault"; }
-	bool is_fatal() { return true; };
-};
-
-class StoreAMOAddrMisaligned: public RISCVException {
-public:
-	StoreAMOAddrMisaligned(uint64_t addr): RISCVException(6, addr) {}
-	const char * what() const throw () {return "Store/AMO Address Misaligned";}
-	bool is_fatal() { return true; }
-};
-
-class StoreAMOAccessFault: public RISCVException {
-public:
-	StoreAMOAccessFault(uint64_t addr): RISCVException(7, addr) {}
-	const char * what () const throw () { return "Store/AMO Access Fault"; }
-	bool is_fatal() { return true; }
-};
-
-class EnvironmentCallFromUMode: public RISCVException {
-public:
-	EnvironmentCallFromUMode(uint64_t pc): RISCVException(8, pc) {}
-	const char * what () const throw () { return "Environment Call From U-Mode"; }
-	bool is_fatal() { return false; }
-};
-
-class EnvironmentCallFromSMode: public RISCVException {
-public:
-	EnvironmentCallFromSMode(uint64_t pc): RISCVException(9, pc) {}
-	const char * what () const throw () { return "Environment Call From S-Mode"; }
-	bool is_fatal() { return false; }
-};
-
-class EnvironmentCallFromMMode: public RISCVException {
-public:
-	EnvironmentCallFromMMode(uint64_t pc): RISCVException(11, pc) {}
-	const char * what () const throw () { return "Environment Call From M-Mode"; }
-	bool is_fatal() { return false; }
-};
-
-class InstructionPageFault: public RISCVException {
-public:
-	InstructionPageFault(uint64_t addr): RISCVException(12, addr) {}
-	const char * what() const throw () { return "Instruction Page Fault"; }
-	bool is_fatal() { return false; }
-};
-
-class LoadPageFault: public RISCVException {
-public:
-	LoadPageFault(uint64_t addr): RISCVException(13, addr) {}
-	const char * what() const throw () { return "Load Page Fault"; }
-	bool is_fatal() { return false; }
+#include <cstdint>
+
+// Riscv Standard Exception. The values are the exception codes written to xcause.
+enum class Exception : uint64_t {
+	InstructionAddrMisaligned = 0,
+	InstructionAccessFault = 1,
+	IllegalInstruction = 2,
+	Breakpoint = 3,
+	LoadAddrMisaligned = 4,
+	LoadAccessFault = 5,
+	StoreAMOAddrMisaligned = 6,
+	StoreAMOAccessFault = 7,
+	EnvironmentCallFromUMode = 8,
+	EnvironmentCallFromSMode = 9,
+	EnvironmentCallFromMMode = 11,
+	InstructionPageFault = 12,
+	LoadPageFault = 13,
+	StoreAMOPageFault = 15,
+	// the access or instruction completed normally.
+	None = ~0ull,
 };
 
-class StoreAMOPageFault: public RISCVException {
-public:
-	StoreAMOPageFault(uint64_t addr): RISCVException(15, addr) {}
-	const char * what() const throw () {return "StoreAMOPageFault"; }
-	bool is_fatal() { return false; }
+// Returned by an instruction instead of its next pc when it raised an exception. pc is
+// always even, so this can never be a real target.
+const uint64_t TRAPPED = ~0ull;
+
+/*!
+ * A synchronous exception raised by the current instruction: the cause and the value
+ * for xtval (the faulting address, the instruction bits or the pc).
+ * */
+struct Trap {
+	Exception code;
+	uint64_t value;
+
+	const char * what() const {
+		switch (code) {
+		case Exception::InstructionAddrMisaligned: return "Instruction Address Misaligned";
+		case Exception::InstructionAccessFault: return "Instruction Access Fault";
+		case Exception::IllegalInstruction: return "Illegal Instruction";
+		case Exception::Breakpoint: return "Breakpoint";
+		case Exception::LoadAddrMisaligned: return "Load Address Misaligned";
+		case Exception::LoadAccessFault: return "Load Access Fault";
+		case Exception::StoreAMOAddrMisaligned: return "Store/AMO Address Misaligned";
+		case Exception::StoreAMOAccessFault: return "Store/AMO Access Fault";
+		case Exception::EnvironmentCallFromUMode: return "Environment Call From U-Mode";
+		case Exception::EnvironmentCallFromSMode: return "Environment Call From S-Mode";
+		case Exception::EnvironmentCallFromMMode: return "Environment Call From M-Mode";
+		case Exception::InstructionPageFault: return "Instruction Page Fault";
+		case Exception::LoadPageFault: return "Load Page Fault";
+		case Exception::StoreAMOPageFault: return "StoreAMOPageFault";
+		default: return "No Exception";
+		}
+	}
+
+	// Fatal exceptions stop the emulator after they have been delivered.
+	bool is_fatal() const {
+		switch (code) {
+		case Exception::InstructionAddrMisaligned:
+		case Exception::InstructionAccessFault:
+		case Exception::IllegalInstruction:
+		case Exception::LoadAccessFault:
+		case Exception::StoreAMOAddrMisaligned:
+		case Exception::StoreAMOAccessFault:
+			return true;
+		default:
+			return false;
+		}
+	}
 };
 
-#endif
\ No newline at end of file
+#endif
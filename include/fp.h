@@ -0,0 +1,184 @@
+#ifndef _FP_H_
+#define _FP_H_
+
+#include <cfenv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// fflags, the accrued exception flags of fcsr.
+const uint64_t FFLAGS_NX = 1 << 0;
+const uint64_t FFLAGS_UF = 1 << 1;
+const uint64_t FFLAGS_OF = 1 << 2;
+const uint64_t FFLAGS_DZ = 1 << 3;
+const uint64_t FFLAGS_NV = 1 << 4;
+
+// Rounding modes of the rm field and of frm. RMM has no host equivalent and rounds
+// to nearest, ties to even. DYN in an instruction means frm.
+const uint64_t RM_RNE = 0;
+const uint64_t RM_RTZ = 1;
+const uint64_t RM_RDN = 2;
+const uint64_t RM_RUP = 3;
+const uint64_t RM_RMM = 4;
+const uint64_t RM_DYN = 7;
+
+// The raw bits of F, with the canonical NaN RISC-V produces.
+template <typename F> struct FpBits;
+template <> struct FpBits<float> {
+    typedef uint32_t type;
+    static const uint32_t canonical_nan = 0x7fc00000;
+    static const uint32_t quiet_bit = 1u << 22;
+};
+template <> struct FpBits<double> {
+    typedef uint64_t type;
+    static const uint64_t canonical_nan = 0x7ff8000000000000ull;
+    static const uint64_t quiet_bit = 1ull << 51;
+};
+
+template <typename F>
+inline typename FpBits<F>::type fp_bits(F value) {
+    typename FpBits<F>::type bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+template <typename F>
+inline F fp_from_bits(typename FpBits<F>::type bits) {
+    F value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/*!
+ * A 64-bit f register holds a single-precision value NaN-boxed: the upper 32 bits are
+ * all ones. A register that is not a valid box reads as the canonical NaN.
+ * */
+template <typename F>
+inline F fp_unbox(uint64_t reg) {
+    if (std::is_same<F, double>::value) {
+        return fp_from_bits<F>(reg);
+    }
+    return fp_from_bits<F>((reg >> 32) == 0xffffffff ? (uint32_t)reg : FpBits<float>::canonical_nan);
+}
+
+template <typename F>
+inline uint64_t fp_box(F value) {
+    uint64_t bits = fp_bits(value);
+    return std::is_same<F, double>::value ? bits : (0xffffffff00000000ull | bits);
+}
+
+// RISC-V does not propagate NaN payloads: every NaN result is the canonical NaN.
+template <typename F>
+inline F fp_canonical(F value) {
+    return std::isnan(value) ? fp_from_bits<F>(FpBits<F>::canonical_nan) : value;
+}
+
+template <typename F>
+inline bool fp_is_snan(F value) {
+    return std::isnan(value) && 0 == (fp_bits(value) & FpBits<F>::quiet_bit);
+}
+
+/*!
+ * FMIN and FMAX return the operand that is not a NaN if there is one, order -0.0 below
+ * +0.0, and only signal for signaling NaNs. flags gets NV for those.
+ * */
+template <typename F>
+inline F fp_min_max(F a, F b, bool max, uint64_t & flags) {
+    if (fp_is_snan(a) || fp_is_snan(b)) {
+        flags |= FFLAGS_NV;
+    }
+    if (std::isnan(a) && std::isnan(b)) {
+        return fp_from_bits<F>(FpBits<F>::canonical_nan);
+    }
+    if (std::isnan(a)) {
+        return b;
+    }
+    if (std::isnan(b)) {
+        return a;
+    }
+    if (a == b) {
+        // Only differs for zeros of opposite signs.
+        return (std::signbit(a) != max) ? a : b;
+    }
+    return ((a < b) != max) ? a : b;
+}
+
+/*!
+ * FCVT to an integer: round in the current host rounding mode and saturate. A NaN
+ * converts to the largest integer, and an out of range value to the nearest end of
+ * the range; both set NV and nothing else.
+ * */
+template <typename I, typename F>
+inline I fp_to_int(F value, uint64_t & flags) {
+    // The range is [lo, hi), with both ends powers of two or zero, so exact in F.
+    const F lo = (F)std::numeric_limits<I>::min();
+    const F hi = std::ldexp((F)1, std::numeric_limits<I>::digits);
+    if (std::isnan(value)) {
+        flags |= FFLAGS_NV;
+        return std::numeric_limits<I>::max();
+    }
+    F r = std::nearbyint(value);
+    if (r < lo || r >= hi) {
+        flags |= FFLAGS_NV;
+        return (r < lo) ? std::numeric_limits<I>::min() : std::numeric_limits<I>::max();
+    }
+    if (r != value) {
+        flags |= FFLAGS_NX;
+    }
+    return (I)r;
+}
+
+// The FCLASS mask of value: one bit among -inf, -normal, -subnormal, -0, +0,
+// +subnormal, +normal, +inf, signaling NaN and quiet NaN.
+template <typename F>
+inline uint64_t fp_class(F value) {
+    bool neg = std::signbit(value);
+    switch (std::fpclassify(value)) {
+    case FP_INFINITE: return neg ? 1 << 0 : 1 << 7;
+    case FP_NORMAL: return neg ? 1 << 1 : 1 << 6;
+    case FP_SUBNORMAL: return neg ? 1 << 2 : 1 << 5;
+    case FP_ZERO: return neg ? 1 << 3 : 1 << 4;
+    default: return fp_is_snan(value) ? 1 << 8 : 1 << 9;
+    }
+}
+
+/*!
+ * The host FPU does the arithmetic in the rounding mode of the instruction, and its
+ * sticky exception flags stand in for fflags until they are read. On SSE hosts both
+ * live in MXCSR; elsewhere <cfenv> reaches them.
+ * */
+inline void host_set_rounding(uint64_t rm) {
+#if defined(__SSE__)
+    // MXCSR.RC: nearest, down, up, toward zero.
+    static const uint32_t rc[5] = {0, 3, 1, 2, 0};
+    _mm_setcsr((_mm_getcsr() & ~0x6000u) | (rc[rm] << 13));
+#else
+    static const int modes[5] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST};
+    std::fesetround(modes[rm]);
+#endif
+}
+
+// Take the exception flags the host raised since the last call, as fflags.
+inline uint64_t host_take_flags() {
+#if defined(__SSE__)
+    uint32_t csr = _mm_getcsr();
+    _mm_setcsr(csr & ~0x3fu);
+    // MXCSR: IE, DE, ZE, OE, UE, PE. Denormal operands are not a RISC-V flag.
+    return ((csr & 0x01) ? FFLAGS_NV : 0) | ((csr & 0x04) ? FFLAGS_DZ : 0) | ((csr & 0x08) ? FFLAGS_OF : 0)
+         | ((csr & 0x10) ? FFLAGS_UF : 0) | ((csr & 0x20) ? FFLAGS_NX : 0);
+#else
+    int raised = std::fetestexcept(FE_ALL_EXCEPT);
+    std::feclearexcept(FE_ALL_EXCEPT);
+    return ((raised & FE_INVALID) ? FFLAGS_NV : 0) | ((raised & FE_DIVBYZERO) ? FFLAGS_DZ : 0)
+         | ((raised & FE_OVERFLOW) ? FFLAGS_OF : 0) | ((raised & FE_UNDERFLOW) ? FFLAGS_UF : 0)
+         | ((raised & FE_INEXACT) ? FFLAGS_NX : 0);
+#endif
+}
+
+#endif  // _FP_H_
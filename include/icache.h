@@ -0,0 +1,118 @@
+#ifndef _ICACHE_H_
+#define _ICACHE_H_
+
+#include "codemap.h"
+#include "decoder.h"
+#include "param.h"
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Number of instruction slots in one page: instructions start on any half-word.
+const uint64_t ICACHE_SLOTS = PAGE_SIZE / 2;
+
+/*!
+ * Predecoded instructions of every DRAM page that has been executed from, indexed by
+ * physical address. Slots are decoded lazily on first execution; a store to a page
+ * drops all of its decoded slots. Callers holding a page returned by `page()` must
+ * request it again once `invalidate()` or `sync()` reports that a page was dropped.
+ * Each hart has its own cache; the CodeMap tells it about stores by other harts.
+ * */
+class InstCache {
+public:
+    InstCache(CodeMap & map, uint64_t hartid = 0): map(map), hart(1ull << hartid), seen(map.generation()),
+        end(DRAM_BASE + map.size() * PAGE_SIZE - 1), pages(map.size()), live(map.size(), 0) {}
+
+    // Decoded slots of the page containing paddr, or nullptr if paddr is not in DRAM.
+    DecodedInst * page(uint64_t paddr) {
+        if (paddr < DRAM_BASE || paddr > end) {
+            return nullptr;
+        }
+        uint64_t index = (paddr - DRAM_BASE) / PAGE_SIZE;
+        std::unique_ptr<DecodedInst[]> & p = pages[index];
+        if (!p) {
+            p.reset(new DecodedInst[ICACHE_SLOTS]);
+            clear(p.get());
+        }
+        if (!live[index]) {
+            live[index] = 1;
+            map.claim(index, hart);
+        }
+        return p.get();
+    }
+
+    // Drop the decoded slots of the page containing paddr, here and on the other
+    // harts. Return true if this hart had the page handed out by `page()` since it
+    // was last dropped.
+    bool invalidate(uint64_t paddr) {
+        if (paddr < DRAM_BASE || paddr > end) {
+            return false;
+        }
+        uint64_t index = (paddr - DRAM_BASE) / PAGE_SIZE;
+        map.write(index, hart);
+        if (!live[index]) {
+            return false;
+        }
+        live[index] = 0;
+        clear(pages[index].get());
+        return true;
+    }
+
+    // Drop the decoded slots of every page touched by [paddr, paddr + len).
+    bool invalidate(uint64_t paddr, uint64_t len) {
+        bool dropped = false;
+        for (uint64_t a = paddr & ~(PAGE_SIZE - 1); a < paddr + len; a += PAGE_SIZE) {
+            dropped |= invalidate(a);
+        }
+        return dropped;
+    }
+
+    // Drop the pages other harts have written to since the last call. Return true if
+    // any page was dropped.
+    bool sync() {
+        uint64_t generation = map.generation();
+        if (generation == seen) {
+            return false;
+        }
+        seen = generation;
+        bool dropped = false;
+        for (uint64_t i = 0; i < pages.size(); ++i) {
+            if (live[i] && !map.is_owned(i, hart)) {
+                live[i] = 0;
+                clear(pages[i].get());
+                dropped = true;
+            }
+        }
+        return dropped;
+    }
+
+    void flush() {
+        for (uint64_t i = 0; i < pages.size(); ++i) {
+            if (live[i]) {
+                live[i] = 0;
+                clear(pages[i].get());
+                map.release(i, hart);
+            }
+        }
+    }
+
+private:
+    static void clear(DecodedInst * p) {
+        // OP_DECODE is zero, so a zeroed slot is an undecoded one.
+        memset((void *)p, 0, ICACHE_SLOTS * sizeof(DecodedInst));
+    }
+
+    CodeMap & map;
+    // the bit of this hart in the masks of the map.
+    uint64_t hart;
+    // generation of the map at the last sync().
+    uint64_t seen;
+    // last address of DRAM.
+    uint64_t end;
+    std::vector<std::unique_ptr<DecodedInst[]>> pages;
+    // whether a page may hold decoded slots.
+    std::vector<uint8_t> live;
+};
+
+#endif  // _ICACHE_H_
@@ -0,0 +1,473 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "bitmanip.h"
+#include "block.h"
+#include "decoder.h"
+#include "exception.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define RVEMU_JIT 1
+#include <sys/mman.h>
+#endif
+
+// Size of the executable buffer holding translated blocks.
+const size_t JIT_CODE_SIZE = 32 * 1024 * 1024;
+// Upper bound of the code generated for one guest instruction, and for a whole block.
+const size_t JIT_MAX_INST_CODE = 80;
+const size_t JIT_MAX_BLOCK_CODE = MAX_BLOCK_INSTS * JIT_MAX_INST_CODE + 64;
+
+/*!
+ * Translates blocks into x86-64 code. The generated function is
+ * `uint64_t f(CPU * cpu, uint64_t * regs)` and returns the pc to continue at, or
+ * TRAPPED if an instruction trapped. Integer ALU instructions, branches and jumps are
+ * emitted inline and operate directly on the guest register file; everything else
+ * (memory accesses, CSRs, system instructions) calls back into the interpreter
+ * through `helper(cpu, inst, inst_pc)`, which has the same return convention.
+ * */
+class Jit {
+public:
+    typedef uint64_t (*Helper)(CPU *, const DecodedInst *, uint64_t);
+
+    Jit(): buf(nullptr), used(0) {}
+
+    ~Jit() {
+#ifdef RVEMU_JIT
+        if (nullptr != buf) {
+            munmap(buf, JIT_CODE_SIZE);
+        }
+#endif
+    }
+
+    // Map the code buffer. Return false if the host cannot run translated code.
+    bool init() {
+#ifdef RVEMU_JIT
+        if (nullptr == buf) {
+            void * p = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (MAP_FAILED == p) {
+                return false;
+            }
+            buf = (uint8_t *)p;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool has_room() const {
+        return used + JIT_MAX_BLOCK_CODE <= JIT_CODE_SIZE;
+    }
+
+    // Drop all translated code. Blocks pointing into the buffer must be dropped too.
+    void reset() {
+        used = 0;
+    }
+
+    JitFunc compile(const Block & b, Helper helper) {
+        cur = buf + used;
+        uint8_t * entry = cur;
+        std::vector<uint8_t *> trap_jumps;
+
+        // push rbx; push rbp; push r12 (keeps the stack 16-byte aligned for calls)
+        emit8(0x53); emit8(0x55); emit8(0x41); emit8(0x54);
+        // mov rbx, rdi; mov rbp, rsi
+        emit8(0x48); emit8(0x89); emit8(0xfb);
+        emit8(0x48); emit8(0x89); emit8(0xf5);
+
+        size_t n = b.insts.size();
+        uint64_t inst_pc = b.pc;
+        for (size_t i = 0; i < n; inst_pc += inst_len(b.insts[i]), ++i) {
+            const DecodedInst & d = b.insts[i];
+            if (emit_inline(d, inst_pc)) {
+                continue;
+            }
+            // mov rdi, rbx
+            emit8(0x48); emit8(0x89); emit8(0xdf);
+            // movabs rsi, &d; movabs rdx, inst_pc; movabs rax, helper; call rax
+            emit8(0x48); emit8(0xbe); emit64((uint64_t)&d);
+            emit8(0x48); emit8(0xba); emit64(inst_pc);
+            emit8(0x48); emit8(0xb8); emit64((uint64_t)helper);
+            emit8(0xff); emit8(0xd0);
+            // What a block-ending instruction returns is the block's result. Any other
+            // one, even the last of a block cut at a page or length limit, is followed
+            // by more code, and a trap must skip it.
+            if (!ends_block(d.op)) {
+                // cmp rax, -1 (TRAPPED); je epilogue
+                emit8(0x48); emit8(0x83); emit8(0xf8); emit8(0xff);
+                emit8(0x0f); emit8(0x84);
+                trap_jumps.push_back(cur);
+                emit32(0);
+            }
+        }
+        if (!ends_block(b.insts.back().op)) {
+            // The block stopped at a page or length limit: continue after it.
+            mov_rax_imm(inst_pc);
+        }
+
+        uint8_t * epilogue = cur;
+        for (uint8_t * p : trap_jumps) {
+            int32_t rel = (int32_t)(epilogue - (p + 4));
+            memcpy(p, &rel, 4);
+        }
+        // pop r12; pop rbp; pop rbx; ret
+        emit8(0x41); emit8(0x5c); emit8(0x5d); emit8(0x5b); emit8(0xc3);
+
+        used = cur - buf;
+        return (JitFunc)entry;
+    }
+
+private:
+    void emit8(uint8_t v) {
+        *cur++ = v;
+    }
+
+    void emit32(uint32_t v) {
+        memcpy(cur, &v, 4);
+        cur += 4;
+    }
+
+    void emit64(uint64_t v) {
+        memcpy(cur, &v, 8);
+        cur += 8;
+    }
+
+    // mov r64, [rbp + 8 * reg]; x0 reads as xor r32, r32. r is 0 (rax) or 1 (rcx).
+    void load_reg(uint8_t r, uint8_t reg) {
+        if (0 == reg) {
+            emit8(0x31); emit8(0xc0 | (r << 3) | r);
+            return;
+        }
+        emit8(0x48); emit8(0x8b); emit8(0x85 | (r << 3)); emit32(8 * reg);
+    }
+
+    // mov [rbp + 8 * reg], rax. Writes to x0 are dropped.
+    void store_rax(uint8_t reg) {
+        if (0 == reg) {
+            return;
+        }
+        emit8(0x48); emit8(0x89); emit8(0x85); emit32(8 * reg);
+    }
+
+    void mov_rax_imm(uint64_t v) {
+        emit8(0x48); emit8(0xb8); emit64(v);
+    }
+
+    // movsxd rax, eax
+    void sext_eax() {
+        emit8(0x48); emit8(0x63); emit8(0xc0);
+    }
+
+    // rax = rax <op> rcx, where opcode is the x86 `op r/m64, r64` opcode.
+    void alu_rcx(uint8_t opcode, const DecodedInst & d, bool word) {
+        load_reg(0, d.rs1);
+        load_reg(1, d.rs2);
+        if (!word) {
+            emit8(0x48);
+        }
+        emit8(opcode); emit8(0xc8);
+        if (word) {
+            sext_eax();
+        }
+        store_rax(d.rd);
+    }
+
+    // rax = rax <op> imm32, where ext is the /digit of the x86 `op r/m64, imm32` form.
+    void alu_imm(uint8_t ext, const DecodedInst & d, bool word) {
+        load_reg(0, d.rs1);
+        if (!word) {
+            emit8(0x48);
+        }
+        emit8(0x81); emit8(0xc0 | (ext << 3)); emit32((uint32_t)d.imm);
+        if (word) {
+            sext_eax();
+        }
+        store_rax(d.rd);
+    }
+
+    // rax = rax <shift> cl or imm8, where ext is the /digit of the x86 shift group.
+    void shift(uint8_t ext, const DecodedInst & d, bool word, bool by_reg) {
+        load_reg(0, d.rs1);
+        if (by_reg) {
+            load_reg(1, d.rs2);
+        }
+        if (!word) {
+            emit8(0x48);
+        }
+        if (by_reg) {
+            emit8(0xd3); emit8(0xc0 | (ext << 3));
+        } else {
+            emit8(0xc1); emit8(0xc0 | (ext << 3)); emit8((uint8_t)d.imm);
+        }
+        if (word) {
+            sext_eax();
+        }
+        store_rax(d.rd);
+    }
+
+    // rax = (rs1 <cond> rs2 or imm) ? 1 : 0, cc is the x86 setcc condition code.
+    void set_if(uint8_t cc, const DecodedInst & d, bool by_reg) {
+        load_reg(0, d.rs1);
+        if (by_reg) {
+            load_reg(1, d.rs2);
+            // cmp rax, rcx
+            emit8(0x48); emit8(0x39); emit8(0xc8);
+        } else {
+            // cmp rax, imm32
+            emit8(0x48); emit8(0x3d); emit32((uint32_t)d.imm);
+        }
+        // setcc al; movzx eax, al
+        emit8(0x0f); emit8(0x90 | cc); emit8(0xc0);
+        emit8(0x0f); emit8(0xb6); emit8(0xc0);
+        store_rax(d.rd);
+    }
+
+    // rax = rs1 + rs2 * 2^n (lea rax, [rcx + rax * 2^n]), rs1 zero-extended from its
+    // low word first if uw.
+    void shift_add(uint8_t n, const DecodedInst & d, bool uw) {
+        load_reg(0, d.rs1);
+        load_reg(1, d.rs2);
+        if (uw) {
+            // mov eax, eax
+            emit8(0x89); emit8(0xc0);
+        }
+        emit8(0x48); emit8(0x8d); emit8(0x04); emit8((n << 6) | 0x01);
+        store_rax(d.rd);
+    }
+
+    // rax = (cond) ? rcx : rax after cmp rax, rcx, cc is the x86 condition code.
+    void select(uint8_t cc, const DecodedInst & d) {
+        load_reg(0, d.rs1);
+        load_reg(1, d.rs2);
+        emit8(0x48); emit8(0x39); emit8(0xc8);
+        emit8(0x48); emit8(0x0f); emit8(0x40 | cc); emit8(0xc1);
+        store_rax(d.rd);
+    }
+
+    // rax = <op> rax, for the two-byte opcodes 0f xx with rax as both operands. prefix
+    // is the mandatory f3 of lzcnt, tzcnt and popcnt, or 0.
+    void unary(uint8_t prefix, uint8_t opcode, const DecodedInst & d, bool word) {
+        load_reg(0, d.rs1);
+        if (0 != prefix) {
+            emit8(prefix);
+        }
+        if (!word) {
+            emit8(0x48);
+        }
+        emit8(0x0f); emit8(opcode); emit8(0xc0);
+        store_rax(d.rd);
+    }
+
+    // bts, btr or btc of rax by rcx or imm8; opcode is the register form and ext the
+    // /digit of the 0f ba immediate form. The offset is taken modulo 64 either way.
+    void bit_op(uint8_t opcode, uint8_t ext, const DecodedInst & d, bool by_reg) {
+        load_reg(0, d.rs1);
+        if (by_reg) {
+            load_reg(1, d.rs2);
+            emit8(0x48); emit8(0x0f); emit8(opcode); emit8(0xc8);
+        } else {
+            emit8(0x48); emit8(0x0f); emit8(0xba); emit8(0xc0 | (ext << 3)); emit8((uint8_t)d.imm);
+        }
+        store_rax(d.rd);
+    }
+
+    // rax = (rs1 <cond> rs2) ? pc + imm : next pc, ncc is the x86 condition code of
+    // the branch being NOT taken.
+    void branch(uint8_t ncc, const DecodedInst & d, uint64_t inst_pc) {
+        load_reg(0, d.rs1);
+        load_reg(1, d.rs2);
+        // cmp rax, rcx
+        emit8(0x48); emit8(0x39); emit8(0xc8);
+        mov_rax_imm(inst_pc + d.imm);
+        // movabs rdx, next pc; cmovncc rax, rdx
+        emit8(0x48); emit8(0xba); emit64(inst_pc + inst_len(d));
+        emit8(0x48); emit8(0x0f); emit8(0x40 | ncc); emit8(0xc2);
+    }
+
+    // Emit d as native code. Return false if it has to go through the helper.
+    bool emit_inline(const DecodedInst & d, uint64_t inst_pc) {
+        switch (d.op) {
+        case OP_ADD:  alu_rcx(0x01, d, false); return true;
+        case OP_SUB:  alu_rcx(0x29, d, false); return true;
+        case OP_AND:  alu_rcx(0x21, d, false); return true;
+        case OP_OR:   alu_rcx(0x09, d, false); return true;
+        case OP_XOR:  alu_rcx(0x31, d, false); return true;
+        case OP_ADDW: alu_rcx(0x01, d, true); return true;
+        case OP_SUBW: alu_rcx(0x29, d, true); return true;
+        case OP_MUL:
+            load_reg(0, d.rs1);
+            load_reg(1, d.rs2);
+            // imul rax, rcx
+            emit8(0x48); emit8(0x0f); emit8(0xaf); emit8(0xc1);
+            store_rax(d.rd);
+            return true;
+        case OP_MULW:
+            load_reg(0, d.rs1);
+            load_reg(1, d.rs2);
+            // imul eax, ecx
+            emit8(0x0f); emit8(0xaf); emit8(0xc1);
+            sext_eax();
+            store_rax(d.rd);
+            return true;
+        case OP_MULH:
+        case OP_MULHU:
+            load_reg(0, d.rs1);
+            load_reg(1, d.rs2);
+            // imul rcx or mul rcx, which leave the high word in rdx; mov rax, rdx
+            emit8(0x48); emit8(0xf7); emit8(OP_MULH == d.op ? 0xe9 : 0xe1);
+            emit8(0x48); emit8(0x89); emit8(0xd0);
+            store_rax(d.rd);
+            return true;
+        case OP_SLL:  shift(4, d, false, true); return true;
+        case OP_SRL:  shift(5, d, false, true); return true;
+        case OP_SRA:  shift(7, d, false, true); return true;
+        case OP_SLLW: shift(4, d, true, true); return true;
+        case OP_SRLW: shift(5, d, true, true); return true;
+        case OP_SRAW: shift(7, d, true, true); return true;
+        case OP_SLT:  set_if(0xc, d, true); return true;
+        case OP_SLTU: set_if(0x2, d, true); return true;
+        case OP_ADDI: alu_imm(0, d, false); return true;
+        case OP_ORI:  alu_imm(1, d, false); return true;
+        case OP_ANDI: alu_imm(4, d, false); return true;
+        case OP_XORI: alu_imm(6, d, false); return true;
+        case OP_ADDIW: alu_imm(0, d, true); return true;
+        case OP_SLLI: shift(4, d, false, false); return true;
+        case OP_SRLI: shift(5, d, false, false); return true;
+        case OP_SRAI: shift(7, d, false, false); return true;
+        case OP_SLLIW: shift(4, d, true, false); return true;
+        case OP_SRLIW: shift(5, d, true, false); return true;
+        case OP_SRAIW: shift(7, d, true, false); return true;
+        case OP_SLTI:  set_if(0xc, d, false); return true;
+        case OP_SLTIU: set_if(0x2, d, false); return true;
+        case OP_SH1ADD: shift_add(1, d, false); return true;
+        case OP_SH2ADD: shift_add(2, d, false); return true;
+        case OP_SH3ADD: shift_add(3, d, false); return true;
+        case OP_ADD_UW: shift_add(0, d, true); return true;
+        case OP_SH1ADD_UW: shift_add(1, d, true); return true;
+        case OP_SH2ADD_UW: shift_add(2, d, true); return true;
+        case OP_SH3ADD_UW: shift_add(3, d, true); return true;
+        case OP_SLLI_UW:
+            load_reg(0, d.rs1);
+            // mov eax, eax; shl rax, imm8
+            emit8(0x89); emit8(0xc0);
+            emit8(0x48); emit8(0xc1); emit8(0xe0); emit8((uint8_t)d.imm);
+            store_rax(d.rd);
+            return true;
+        case OP_ANDN:
+        case OP_ORN:
+            load_reg(0, d.rs1);
+            load_reg(1, d.rs2);
+            // not rcx; and or or rax, rcx
+            emit8(0x48); emit8(0xf7); emit8(0xd1);
+            emit8(0x48); emit8(OP_ANDN == d.op ? 0x21 : 0x09); emit8(0xc8);
+            store_rax(d.rd);
+            return true;
+        case OP_XNOR:
+            load_reg(0, d.rs1);
+            load_reg(1, d.rs2);
+            // xor rax, rcx; not rax
+            emit8(0x48); emit8(0x31); emit8(0xc8);
+            emit8(0x48); emit8(0xf7); emit8(0xd0);
+            store_rax(d.rd);
+            return true;
+        case OP_MIN:  select(0xf, d); return true;
+        case OP_MINU: select(0x7, d); return true;
+        case OP_MAX:  select(0xc, d); return true;
+        case OP_MAXU: select(0x2, d); return true;
+        case OP_CLZ: case OP_CTZ: case OP_CPOP:
+        case OP_CLZW: case OP_CTZW: case OP_CPOPW: {
+            // lzcnt, tzcnt or popcnt. The 32-bit forms count within the low word and
+            // clear the upper half, as clzw, ctzw and cpopw want.
+            if (!host_has_bit_counts()) {
+                return false;
+            }
+            bool word = (OP_CLZW == d.op || OP_CTZW == d.op || OP_CPOPW == d.op);
+            uint8_t opcode = (OP_CLZ == d.op || OP_CLZW == d.op) ? 0xbd
+                           : (OP_CTZ == d.op || OP_CTZW == d.op) ? 0xbc : 0xb8;
+            unary(0xf3, opcode, d, word);
+            return true;
+        }
+        // movsx rax, al or ax; movzx eax, ax
+        case OP_SEXT_B: unary(0, 0xbe, d, false); return true;
+        case OP_SEXT_H: unary(0, 0xbf, d, false); return true;
+        case OP_ZEXT_H: unary(0, 0xb7, d, true); return true;
+        case OP_REV8:
+            load_reg(0, d.rs1);
+            // bswap rax
+            emit8(0x48); emit8(0x0f); emit8(0xc8);
+            store_rax(d.rd);
+            return true;
+        case OP_ROL:   shift(0, d, false, true); return true;
+        case OP_ROR:   shift(1, d, false, true); return true;
+        case OP_RORI:  shift(1, d, false, false); return true;
+        case OP_ROLW:  shift(0, d, true, true); return true;
+        case OP_RORW:  shift(1, d, true, true); return true;
+        case OP_RORIW: shift(1, d, true, false); return true;
+        case OP_BSET:  bit_op(0xab, 5, d, true); return true;
+        case OP_BSETI: bit_op(0xab, 5, d, false); return true;
+        case OP_BCLR:  bit_op(0xb3, 6, d, true); return true;
+        case OP_BCLRI: bit_op(0xb3, 6, d, false); return true;
+        case OP_BINV:  bit_op(0xbb, 7, d, true); return true;
+        case OP_BINVI: bit_op(0xbb, 7, d, false); return true;
+        case OP_BEXT:
+        case OP_BEXTI:
+            load_reg(0, d.rs1);
+            // shr rax, cl or imm8; and eax, 1
+            if (OP_BEXT == d.op) {
+                load_reg(1, d.rs2);
+                emit8(0x48); emit8(0xd3); emit8(0xe8);
+            } else {
+                emit8(0x48); emit8(0xc1); emit8(0xe8); emit8((uint8_t)d.imm);
+            }
+            emit8(0x83); emit8(0xe0); emit8(0x01);
+            store_rax(d.rd);
+            return true;
+        case OP_LUI:
+            mov_rax_imm(d.imm);
+            store_rax(d.rd);
+            return true;
+        case OP_AUIPC:
+            mov_rax_imm(inst_pc + d.imm);
+            store_rax(d.rd);
+            return true;
+        case OP_FENCE:
+            // mfence, see CPU::exec_fence().
+            emit8(0x0f); emit8(0xae); emit8(0xf0);
+            return true;
+        case OP_BEQ:  branch(0x5, d, inst_pc); return true;
+        case OP_BNE:  branch(0x4, d, inst_pc); return true;
+        case OP_BLT:  branch(0xd, d, inst_pc); return true;
+        case OP_BGE:  branch(0xc, d, inst_pc); return true;
+        case OP_BLTU: branch(0x3, d, inst_pc); return true;
+        case OP_BGEU: branch(0x2, d, inst_pc); return true;
+        case OP_JAL:
+            mov_rax_imm(inst_pc + inst_len(d));
+            store_rax(d.rd);
+            mov_rax_imm(inst_pc + d.imm);
+            return true;
+        case OP_JALR:
+            // rcx = (rs1 + imm) & ~1, read before rd is written.
+            load_reg(1, d.rs1);
+            emit8(0x48); emit8(0x81); emit8(0xc1); emit32((uint32_t)d.imm);
+            emit8(0x48); emit8(0x83); emit8(0xe1); emit8(0xfe);
+            mov_rax_imm(inst_pc + inst_len(d));
+            store_rax(d.rd);
+            // mov rax, rcx
+            emit8(0x48); emit8(0x89); emit8(0xc8);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    uint8_t * buf;
+    size_t used;
+    uint8_t * cur;
+};
+
+#endif  // _JIT_H_
@@ -0,0 +1,133 @@
+#ifndef _MACHINE_H_
+#define _MACHINE_H_
+
+#include "Bus.h"
+#include "CPU.h"
+#include "snapshot.h"
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * Harts sharing one bus and one DRAM, each running circle() on a host thread of its
+ * own. As on QEMU's virt board every hart starts at DRAM_BASE in M-mode and tells
+ * itself apart by mhartid. Hart 0 runs on the calling thread; when it stops, so does
+ * the machine.
+ * */
+class Machine {
+public:
+    Machine(std::vector<uint8_t> & code, std::unique_ptr<BlockBackend> disk, uint64_t dram_size = DRAM_SIZE, uint64_t harts = 1)
+        : bus(code, std::move(disk), dram_size) {
+        for (uint64_t i = 0; i < harts; ++i) {
+            cpus.emplace_back(new CPU(bus, i));
+        }
+    }
+
+    void set_engine(Engine e) {
+        for (std::unique_ptr<CPU> & cpu : cpus) {
+            cpu->set_engine(e);
+        }
+    }
+
+    // Bits in each vector register of every hart; a snapshot brings its own.
+    void set_vlen(uint64_t bits) {
+        for (std::unique_ptr<CPU> & cpu : cpus) {
+            cpu->set_vlen(bits);
+        }
+    }
+
+    void set_clock(Clock c) {
+        bus.get_clint().set_clock(c);
+    }
+
+    void set_virtio_version(uint32_t version) {
+        bus.get_virtio_blk().set_version(version);
+    }
+
+    // Run every hart until hart 0 leaves DRAM or hits a fatal exception.
+    void run() {
+        while (true) {
+            std::vector<std::thread> threads;
+            for (size_t i = 1; i < cpus.size(); ++i) {
+                CPU * cpu = cpus[i].get();
+                threads.emplace_back([cpu]() { cpu->circle(); });
+            }
+            cpus[0]->circle();
+            for (size_t i = 1; i < cpus.size(); ++i) {
+                cpus[i]->stop();
+            }
+            for (std::thread & t : threads) {
+                t.join();
+            }
+            if (!snapshot_requested.exchange(false)) {
+                break;
+            }
+            // Every hart is between two instructions; take the snapshot and go on.
+            std::string path;
+            {
+                std::lock_guard<std::mutex> lock(snapshot_mutex);
+                path = snapshot_path;
+            }
+            std::cerr << (save(path) ? "snapshot written to " : "cannot write snapshot ") << path << std::endl;
+            for (std::unique_ptr<CPU> & cpu : cpus) {
+                cpu->resume();
+            }
+        }
+        // Let the console catch up before anything else is printed.
+        bus.get_uart().flush();
+    }
+
+    // Have run() write a snapshot to path at the next instruction boundary, then
+    // carry on. May be called from any thread.
+    void request_snapshot(const std::string & path) {
+        {
+            std::lock_guard<std::mutex> lock(snapshot_mutex);
+            snapshot_path = path;
+        }
+        snapshot_requested = true;
+        cpus[0]->stop();
+    }
+
+    // Write the state of the machine to path. No hart may be running. The disk is not
+    // part of it: a snapshot has to be restored on the disk as it is now.
+    bool save(const std::string & path) {
+        SnapshotWriter w;
+        for (std::unique_ptr<CPU> & cpu : cpus) {
+            cpu->save(w);
+        }
+        bus.save(w);
+        bus.get_virtio_blk().get_disk().flush();
+        return w.write(path, cpus.size(), bus.get_dram());
+    }
+
+    // Load a snapshot taken on a machine with as many harts and as much memory.
+    // Call before run(), and after set_clock().
+    bool restore(SnapshotReader & r) {
+        if (r.header().harts != cpus.size() || !r.load_dram(bus.get_dram())) {
+            return false;
+        }
+        for (std::unique_ptr<CPU> & cpu : cpus) {
+            cpu->restore(r);
+        }
+        bus.restore(r);
+        return r.ok();
+    }
+
+    CPU & hart(uint64_t hartid) {
+        return *cpus[hartid];
+    }
+
+private:
+    Bus bus;
+    std::vector<std::unique_ptr<CPU>> cpus;
+    std::atomic<bool> snapshot_requested{false};
+    std::mutex snapshot_mutex;
+    std::string snapshot_path;
+};
+
+#endif  // _MACHINE_H_
@@ -0,0 +1,75 @@
+#ifndef _MULDIV_H_
+#define _MULDIV_H_
+
+#include <cstdint>
+#include <limits>
+
+// High 64 bits of the 128-bit product of two unsigned words.
+inline uint64_t mulhu(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    return (uint64_t)(((unsigned __int128)a * b) >> 64);
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo = a_lo * b_lo;
+    uint64_t mid1 = a_hi * b_lo + (lo >> 32);
+    uint64_t mid2 = a_lo * b_hi + (uint32_t)mid1;
+    return a_hi * b_hi + (mid1 >> 32) + (mid2 >> 32);
+#endif
+}
+
+// Signed by signed, as MULH. Without a 128-bit type, a negative operand took 2^64
+// too much of the other operand into the unsigned high word.
+inline uint64_t mulh(int64_t a, int64_t b) {
+#if defined(__SIZEOF_INT128__)
+    return (uint64_t)(((__int128)a * b) >> 64);
+#else
+    return mulhu(a, b) - (a < 0 ? (uint64_t)b : 0) - (b < 0 ? (uint64_t)a : 0);
+#endif
+}
+
+// Signed by unsigned, as MULHSU.
+inline uint64_t mulhsu(int64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    return (uint64_t)(((__int128)a * (__int128)b) >> 64);
+#else
+    return mulhu(a, b) - (a < 0 ? b : 0);
+#endif
+}
+
+/*!
+ * Division never traps on RISC-V: dividing by zero gives all ones and a remainder of
+ * the dividend, and the most negative value divided by -1 gives itself and a remainder
+ * of zero. Both cases divide by 1 instead, which gets the overflow right as it is, and
+ * the result of a division by zero is patched in after; compilers turn the selects
+ * into conditional moves. S is a signed and U an unsigned 32- or 64-bit type.
+ * */
+template <typename S>
+inline S div_signed(S a, S b) {
+    bool zero = (0 == b);
+    bool overflow = (std::numeric_limits<S>::min() == a && -1 == b);
+    S q = a / ((zero || overflow) ? 1 : b);
+    return zero ? -1 : q;
+}
+
+template <typename S>
+inline S rem_signed(S a, S b) {
+    bool zero = (0 == b);
+    bool overflow = (std::numeric_limits<S>::min() == a && -1 == b);
+    S r = a % ((zero || overflow) ? 1 : b);
+    return zero ? a : r;
+}
+
+template <typename U>
+inline U div_unsigned(U a, U b) {
+    U q = a / ((0 == b) ? 1 : b);
+    return (0 == b) ? ~(U)0 : q;
+}
+
+template <typename U>
+inline U rem_unsigned(U a, U b) {
+    U r = a % ((0 == b) ? 1 : b);
+    return (0 == b) ? a : r;
+}
+
+#endif  // _MULDIV_H_
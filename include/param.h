@@ -9,9 +9,17 @@
  * https://github.com/qemu/qemu/blob/master/hw/riscv/virt.c#L46-L63 
  * */
 const uint64_t DRAM_BASE = 0x8000'0000;
+// Default size of DRAM, see `--memory`.
 const uint64_t DRAM_SIZE = 1024 * 1024 * 128;
 const uint64_t DRAM_END  = DRAM_BASE + DRAM_SIZE - 1;
 
+// Upper bound of the number of harts, see `--harts`.
+const uint64_t MAX_HARTS = 64;
+
+// Bits in a vector register by default, and at most, see `--vlen`.
+const uint64_t DEFAULT_VLEN = 128;
+const uint64_t MAX_VLEN = 1024;
+
 
 // The address which the core-local interruptor (CLINT) starts. It contains the timer and
 // generates per-hart software interrupts and timer interrupts.
@@ -19,8 +27,15 @@ const uint64_t CLINT_BASE = 0x200'0000;
 const uint64_t CLINT_SIZE = 0x10000;
 const uint64_t CLINT_END  = CLINT_BASE + CLINT_SIZE - 1;
 
+// Software interrupt pending bit of each hart, 4 bytes apart.
+const uint64_t CLINT_MSIP = CLINT_BASE;
+// Timer compare register of each hart, 8 bytes apart.
 const uint64_t CLINT_MTIMECMP = CLINT_BASE + 0x4000;
 const uint64_t CLINT_MTIME = CLINT_BASE + 0xbff8;
+// mtime ticks per second when it follows the host clock, as timebase-frequency on QEMU virt.
+const uint64_t TIMEBASE_FREQ = 10'000'000;
+// Most instructions a hart runs between two looks at the timer.
+const uint64_t TIMER_QUANTUM = 1024;
 
 // The address which the platform-level interrupt controller (PLIC) starts. The PLIC connects all external interrupts in the
 // system to all hart contexts in the system, via the external interrupt source in each hart.
@@ -28,10 +43,19 @@ const uint64_t PLIC_BASE = 0xc00'0000;
 const uint64_t PLIC_SIZE = 0x4000000;
 const uint64_t PLIC_END  = PLIC_BASE + PLIC_SIZE - 1;
 
+// Number of interrupt sources; source 0 means no interrupt.
+const uint64_t PLIC_SOURCES = 32;
+// Priority of each source, 4 bytes apart.
+const uint64_t PLIC_PRIORITY  = PLIC_BASE;
 const uint64_t PLIC_PENDING   = PLIC_BASE + 0x1000;
-const uint64_t PLIC_SENABLE   = PLIC_BASE + 0x2000;
-const uint64_t PLIC_SPRIORITY = PLIC_BASE + 0x201000;
-const uint64_t PLIC_SCLAIM    = PLIC_BASE + 0x201004;
+// Context 2 * hart is the M-mode context of a hart and 2 * hart + 1 its S-mode one.
+// Each context has its enable bits, and its threshold and claim/complete registers.
+const uint64_t PLIC_CONTEXTS  = 2 * MAX_HARTS;
+const uint64_t PLIC_ENABLE    = PLIC_BASE + 0x2000;
+const uint64_t PLIC_ENABLE_STRIDE = 0x80;
+const uint64_t PLIC_THRESHOLD = PLIC_BASE + 0x200000;
+const uint64_t PLIC_CLAIM     = PLIC_BASE + 0x200004;
+const uint64_t PLIC_CONTEXT_STRIDE = 0x1000;
 
 // UART
 const uint64_t UART_BASE = 0x1000'0000;
@@ -43,8 +67,15 @@ const uint64_t UART_IRQ  = 10;
 const uint64_t UART_RHR  = 0;
 // Transmit holding register (for output bytes).
 const uint64_t UART_THR  = 0;
+// Interrupt enable register. Bit 0 enables the received data interrupt.
+const uint64_t UART_IER  = 1;
+// Interrupt identification register (read) and FIFO control register (write).
+const uint64_t UART_IIR  = 2;
+const uint64_t UART_FCR  = 2;
 // Line control register.
 const uint64_t UART_LCR  = 3;
+// LCR bit 7 makes offsets 0 and 1 the divisor latch.
+const uint64_t MASK_UART_LCR_DLAB = 1 << 7;
 // Line status register.
 // LSR BIT 0:
 //     0 = no data in receive holding register or FIFO.
@@ -57,6 +88,10 @@ const uint64_t UART_LSR = 5;
 const uint64_t MASK_UART_LSR_RX = 1;
 // The transmitter (TX) bit MASK.
 const uint64_t MASK_UART_LSR_TX = 1 << 5;
+// Transmitter empty: both the TX FIFO and the shift register.
+const uint64_t MASK_UART_LSR_TEMT = 1 << 6;
+// Bytes the receive FIFO of a 16550 holds.
+const uint64_t UART_FIFO_SIZE = 16;
 
 // Virtio
 // The address which virtio starts.
@@ -67,21 +102,28 @@ const uint64_t VIRTIO_SIZE = 0x1000;
 const uint64_t VIRTIO_END = VIRTIO_BASE + VIRTIO_SIZE - 1;
 const uint64_t VIRTIO_IRQ = 1;
 
-// the number of virtio descriptors that must be power of 2
-const uint64_t DESC_NUM = 8;
+// the largest queue the device offers, a power of 2
+const uint64_t DESC_NUM = 256;
+
+// VIRTIO_VERSION of the legacy interface, with the queue at a guest page number
+const uint32_t VIRTIO_LEGACY = 1;
+// and of the modern one, with a 64-bit address for each part of the queue.
+const uint32_t VIRTIO_MODERN = 2;
 
 // always return 0x74726976
 const uint64_t VIRTIO_MAGIC = VIRTIO_BASE + 0x000;
-// The version. 1 is legacy.
+// The version, VIRTIO_LEGACY or VIRTIO_MODERN.
 const uint64_t VIRTIO_VERSION = VIRTIO_BASE + 0x004;
 // device type; 1 is net, 2 is disk
 const uint64_t VIRTIO_DEVICE_ID = VIRTIO_BASE + 0x008;
 // always return 0x554d4551
 const uint64_t VIRTIO_VENDOR_ID = VIRTIO_BASE + 0x00c;
-// Device feature.
+// Device features, the 32 bits selected by VIRTIO_DEVICE_FEATURES_SEL. Read-only.
 const uint64_t VIRTIO_DEVICE_FEATURES = VIRTIO_BASE + 0x010;
-// Driver features
+const uint64_t VIRTIO_DEVICE_FEATURES_SEL = VIRTIO_BASE + 0x014;
+// Driver features, the 32 bits selected by VIRTIO_DRIVER_FEATURES_SEL.
 const uint64_t VIRTIO_DRIVER_FEATURES = VIRTIO_BASE + 0X020;
+const uint64_t VIRTIO_DRIVER_FEATURES_SEL = VIRTIO_BASE + 0x024;
 // Page size for PFN, write-only
 const uint64_t VIRTIO_GUEST_PAGE_SIZE = VIRTIO_BASE + 0x028;
 // Select queue, write-only
@@ -90,14 +132,34 @@ const uint64_t VIRTIO_QUEUE_SEL = VIRTIO_BASE + 0x30;
 const uint64_t VIRTIO_QUEUE_NUM_MAX = VIRTIO_BASE + 0x034;
 // size of current queue, write-only
 const uint64_t VIRTIO_QUEUE_NUM = VIRTIO_BASE + 0x38;
-// Physical page number for queue, read and write.
+// Used ring alignment, write-only.
+const uint64_t VIRTIO_QUEUE_ALIGN = VIRTIO_BASE + 0x03c;
+// Physical page number for queue, read and write. Legacy only.
 const uint64_t VIRTIO_QUEUE_PFN = VIRTIO_BASE + 0x040; 
+// Whether the driver may use the queue, read and write. Modern only.
+const uint64_t VIRTIO_QUEUE_READY = VIRTIO_BASE + 0x044;
 // Notify the queue number, write-only.
 const uint64_t VIRTIO_QUEUE_NOTIFY = VIRTIO_BASE + 0x050;
+// Why the device interrupted, read-only; bit 0 is a used buffer notification.
+const uint64_t VIRTIO_INTERRUPT_STATUS = VIRTIO_BASE + 0x060;
+// Clears the bits written to it in the interrupt status, write-only.
+const uint64_t VIRTIO_INTERRUPT_ACK = VIRTIO_BASE + 0x064;
 // Device status, read and write. Reading from this register returns the current device status flags.
 // Writing non-zero values to this register sets the status flags, indicating the OS/driver
 // progress. Writing zero (0x0) to this register triggers a device reset.
 const uint64_t VIRTIO_STATUS = VIRTIO_BASE + 0x070;
+// Addresses of the descriptor table, available ring and used ring, as two 32-bit
+// halves each, write-only. Modern only.
+const uint64_t VIRTIO_QUEUE_DESC_LOW = VIRTIO_BASE + 0x080;
+const uint64_t VIRTIO_QUEUE_DESC_HIGH = VIRTIO_BASE + 0x084;
+const uint64_t VIRTIO_QUEUE_DRIVER_LOW = VIRTIO_BASE + 0x090;
+const uint64_t VIRTIO_QUEUE_DRIVER_HIGH = VIRTIO_BASE + 0x094;
+const uint64_t VIRTIO_QUEUE_DEVICE_LOW = VIRTIO_BASE + 0x0a0;
+const uint64_t VIRTIO_QUEUE_DEVICE_HIGH = VIRTIO_BASE + 0x0a4;
+// Changes whenever the configuration does, read-only. Modern only.
+const uint64_t VIRTIO_CONFIG_GENERATION = VIRTIO_BASE + 0x0fc;
+// Block device configuration, read-only: capacity in sectors, as two 32-bit halves.
+const uint64_t VIRTIO_CONFIG = VIRTIO_BASE + 0x100;
 
 const uint64_t PAGE_SIZE = 4096;
 const uint64_t SECTOR_SIZE = 512;
@@ -105,10 +167,31 @@ const uint64_t SECTOR_SIZE = 512;
 // virtio block request type
 const uint32_t VIRTIO_BLK_T_IN = 0;
 const uint32_t VIRTIO_BLK_T_OUT = 1;
+const uint32_t VIRTIO_BLK_T_FLUSH = 4;
+
+// virtio block request status, the last byte of a request
+const uint8_t VIRTIO_BLK_S_OK = 0;
+const uint8_t VIRTIO_BLK_S_IOERR = 1;
+const uint8_t VIRTIO_BLK_S_UNSUPP = 2;
 
 // virtqueue descriptor flags
 const uint16_t VIRTQ_DESC_F_NEXT = 1;
 const uint16_t VIRTQ_DESC_F_WRITE = 2;
 const uint64_t VIRTQ_DESC_F_INDIRECT = 4;
 
+// virtqueue available ring flag: the driver does not want an interrupt
+const uint16_t VIRTQ_AVAIL_F_NO_INTERRUPT = 1;
+
+// device status bits
+const uint32_t VIRTIO_STATUS_FEATURES_OK = 8;
+
+// feature bits
+const uint64_t VIRTIO_BLK_F_FLUSH = 9;
+// descriptors may point to a table of further descriptors
+const uint64_t VIRTIO_RING_F_INDIRECT_DESC = 28;
+// used_event and avail_event take the place of the ring flags
+const uint64_t VIRTIO_RING_F_EVENT_IDX = 29;
+// the driver is not a legacy one; required by the modern interface
+const uint64_t VIRTIO_F_VERSION_1 = 32;
+
 #endif
\ No newline at end of file
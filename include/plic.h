@@ -1,51 +1,143 @@
 #ifndef _PLIC_H_
 #define _PLIC_H_
 
+#include "device.h"
 #include "exception.h"
 #include "param.h"
+#include "snapshot.h"
 
-class Plic {
+#include <atomic>
+
+/*!
+ * Platform-level interrupt controller with an M-mode and an S-mode context per hart,
+ * laid out as on QEMU's virt board. Only sources below 32 exist, so a context has a
+ * single word of enable bits. Devices do not raise lines here: a hart polls them and
+ * routes an interrupt to its own S-mode context through `claim()`.
+ * */
+class Plic : public Device {
 public:
-    Plic() : pending(0), senable(0), spriority(0), sclaim(0) {}
+    Plic() : pending(0), serving(0) {
+        for (uint64_t i = 0; i < PLIC_SOURCES; ++i) {
+            priority[i] = 0;
+        }
+        for (uint64_t i = 0; i < PLIC_CONTEXTS; ++i) {
+            enable[i] = 0;
+            threshold[i] = 0;
+            claimed[i] = 0;
+        }
+    }
 
-    uint64_t load(uint64_t addr, uint64_t size) {
+    Exception load(uint64_t addr, uint64_t size, uint64_t & value) {
         if (size != 32) {
             std::cerr << "plic LoadAccessFault\n";
-            throw LoadAccessFault(addr);
-        }
-        if(PLIC_PENDING == addr) {
-            return pending;
-        } else if (PLIC_SENABLE == addr){
-            return senable;
-        } else if (PLIC_SPRIORITY == addr) {
-            return spriority;
-        } else if (PLIC_SCLAIM == addr) {
-            return sclaim;
-        } else {
-            return 0;
+            return Exception::LoadAccessFault;
         }
+        std::atomic<uint32_t> * reg = find(addr);
+        value = (nullptr == reg) ? 0 : reg->load();
+        return Exception::None;
     }
 
-    void store(uint64_t addr, uint64_t size, uint64_t value) {
+    Exception store(uint64_t addr, uint64_t size, uint64_t value) {
         if (size != 32) {
-            throw StoreAMOAccessFault(addr);
+            return Exception::StoreAMOAccessFault;
+        }
+        std::atomic<uint32_t> * reg = find(addr);
+        if (nullptr == reg) {
+            return Exception::None;
+        }
+        if (reg >= claimed && reg < claimed + PLIC_CONTEXTS) {
+            // Writing the claim register completes the interrupt it holds.
+            complete(*reg);
+        } else {
+            *reg = value;
+        }
+        return Exception::None;
+    }
+
+    // Whether the S-mode context of hart takes interrupts from source irq.
+    bool accepts(uint64_t hart, uint64_t irq) const {
+        uint64_t context = 2 * hart + 1;
+        return (enable[context].load(std::memory_order_relaxed) >> irq & 1)
+            && priority[irq].load(std::memory_order_relaxed) > threshold[context].load(std::memory_order_relaxed);
+    }
+
+    /*!
+     * Make irq the interrupt the next read of the S-mode claim register of hart returns.
+     * Like the gateway of a real PLIC, this fails while another context serves irq,
+     * and while the claim register of hart holds an interrupt not completed yet.
+     * */
+    bool claim(uint64_t hart, uint64_t irq) {
+        if (serving.fetch_or(1u << irq) >> irq & 1) {
+            return false;
+        }
+        uint32_t idle = 0;
+        if (!claimed[2 * hart + 1].compare_exchange_strong(idle, irq)) {
+            serving.fetch_and(~(1u << irq));
+            return false;
         }
-        if (addr == PLIC_PENDING) {
-	        pending = value;
-	    } else if (addr == PLIC_SENABLE) {
-	        senable = value;
-	    } else if (addr == PLIC_SPRIORITY) {
-	        spriority = value;
-	    } else if (addr == PLIC_SCLAIM) {
-	        sclaim = value;
-	    }
+        return true;
+    }
+
+    // Take back the claim of hart, for an interrupt that turned out not to be due.
+    void release(uint64_t hart) {
+        complete(claimed[2 * hart + 1]);
+    }
+
+    void save(SnapshotWriter & w) const {
+        w.put(priority);
+        w.put(pending);
+        w.put(enable);
+        w.put(threshold);
+        w.put(claimed);
+        w.put(serving);
+    }
+
+    void restore(SnapshotReader & r) {
+        r.get(priority);
+        r.get(pending);
+        r.get(enable);
+        r.get(threshold);
+        r.get(claimed);
+        r.get(serving);
     }
 
 private:
-    uint64_t pending;
-    uint64_t senable;
-    uint64_t spriority;
-    uint64_t sclaim;
+    void complete(std::atomic<uint32_t> & reg) {
+        uint32_t irq = reg.exchange(0);
+        serving.fetch_and(~(1u << irq));
+    }
+
+    // The register at addr, or nullptr if there is none.
+    std::atomic<uint32_t> * find(uint64_t addr) {
+        if (addr >= PLIC_PRIORITY && addr < PLIC_PRIORITY + 4 * PLIC_SOURCES) {
+            return &priority[(addr - PLIC_PRIORITY) / 4];
+        }
+        if (PLIC_PENDING == addr) {
+            return &pending;
+        }
+        if (addr >= PLIC_ENABLE && addr < PLIC_ENABLE + PLIC_ENABLE_STRIDE * PLIC_CONTEXTS) {
+            uint64_t offset = addr - PLIC_ENABLE;
+            return (0 == offset % PLIC_ENABLE_STRIDE) ? &enable[offset / PLIC_ENABLE_STRIDE] : nullptr;
+        }
+        if (addr >= PLIC_THRESHOLD && addr < PLIC_THRESHOLD + PLIC_CONTEXT_STRIDE * PLIC_CONTEXTS) {
+            uint64_t offset = addr - PLIC_THRESHOLD;
+            uint64_t context = offset / PLIC_CONTEXT_STRIDE;
+            switch (offset % PLIC_CONTEXT_STRIDE) {
+            case 0: return &threshold[context];
+            case PLIC_CLAIM - PLIC_THRESHOLD: return &claimed[context];
+            default: return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    std::atomic<uint32_t> priority[PLIC_SOURCES];
+    std::atomic<uint32_t> pending;
+    std::atomic<uint32_t> enable[PLIC_CONTEXTS];
+    std::atomic<uint32_t> threshold[PLIC_CONTEXTS];
+    std::atomic<uint32_t> claimed[PLIC_CONTEXTS];
+    // A bit per source claimed and not completed.
+    std::atomic<uint32_t> serving;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,193 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "Dram.h"
+#include "param.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Snapshots begin with this.
+const char SNAPSHOT_MAGIC[8] = {'R', 'V', 'E', 'M', 'U', 'S', 'N', 'P'};
+const uint32_t SNAPSHOT_VERSION = 4;
+
+/*!
+ * First bytes of a snapshot, in host byte order: a snapshot only goes back into the
+ * emulator build that wrote it. The state of the harts and devices follows, in the
+ * order they save it, and then DRAM, page aligned so that it can be mapped. Pages of
+ * DRAM that were all zero are holes in the file.
+ * */
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t harts;
+    uint64_t dram_size;
+    uint64_t state_size;
+    uint64_t dram_offset;
+};
+
+// Collects the state of a machine, then writes it out with its DRAM.
+class SnapshotWriter {
+public:
+    template <typename T>
+    void put(const T & value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values go in a snapshot");
+        const uint8_t * p = (const uint8_t *)&value;
+        state.insert(state.end(), p, p + sizeof(T));
+    }
+
+    template <typename T>
+    void put(const std::atomic<T> & value) {
+        put(value.load());
+    }
+
+    template <typename T, size_t N>
+    void put(const std::atomic<T> (& values)[N]) {
+        for (const std::atomic<T> & v : values) {
+            put(v.load());
+        }
+    }
+
+    // Write what was put, then the memory of dram, to a new file at path.
+    bool write(const std::string & path, uint32_t harts, Dram & dram) {
+        SnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.harts = harts;
+        header.dram_size = dram.size();
+        header.state_size = state.size();
+        header.dram_offset = (sizeof(header) + state.size() + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+        // Write a new file and rename it, so that a crash leaves the old snapshot.
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (-1 == fd) {
+            return false;
+        }
+        bool ok = whole(pwrite(fd, &header, sizeof(header), 0), sizeof(header))
+            && whole(pwrite(fd, state.data(), state.size(), sizeof(header)), state.size())
+            && 0 == ftruncate(fd, header.dram_offset + dram.size());
+        const uint8_t * mem = dram.host(DRAM_BASE);
+        for (uint64_t off = 0; ok && off < dram.size(); off += PAGE_SIZE) {
+            uint64_t len = std::min(PAGE_SIZE, dram.size() - off);
+            if (!zero(mem + off, len)) {
+                ok = whole(pwrite(fd, mem + off, len, header.dram_offset + off), len);
+            }
+        }
+        ok = ok && 0 == fsync(fd);
+        close(fd);
+        if (!ok || 0 != rename(tmp.c_str(), path.c_str())) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static bool whole(ssize_t written, size_t len) {
+        return written >= 0 && (size_t)written == len;
+    }
+
+    static bool zero(const uint8_t * p, uint64_t len) {
+        uint64_t word = 0;
+        for (uint64_t i = 0; i < len; i += sizeof(word)) {
+            std::memcpy(&word, p + i, sizeof(word));
+            if (0 != word) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> state;
+};
+
+// Gives the state of a machine back in the order it was put, and maps its DRAM.
+class SnapshotReader {
+public:
+    SnapshotReader() : fd(-1), pos(0), ok_(false) {}
+
+    ~SnapshotReader() {
+        if (-1 != fd) {
+            close(fd);
+        }
+    }
+
+    SnapshotReader(const SnapshotReader &) = delete;
+    SnapshotReader & operator=(const SnapshotReader &) = delete;
+
+    // Read the header and state of the snapshot at path. Return false if it is not one.
+    bool open(const std::string & path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (-1 == fd || 0 != fstat(fd, &st) || sizeof(header_) != pread(fd, &header_, sizeof(header_), 0)
+            || 0 != std::memcmp(header_.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))
+            || SNAPSHOT_VERSION != header_.version
+            || 0 != header_.dram_offset % PAGE_SIZE
+            || header_.dram_offset < sizeof(header_) + header_.state_size
+            || (uint64_t)st.st_size < header_.dram_offset + header_.dram_size) {
+            return false;
+        }
+        state.resize(header_.state_size);
+        ok_ = (ssize_t)state.size() == pread(fd, state.data(), state.size(), sizeof(header_));
+        return ok_;
+    }
+
+    const SnapshotHeader & header() const {
+        return header_;
+    }
+
+    // Whether every get() so far found its value.
+    bool ok() const {
+        return ok_;
+    }
+
+    template <typename T>
+    void get(T & value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values go in a snapshot");
+        if (pos + sizeof(T) > state.size()) {
+            ok_ = false;
+            std::memset(&value, 0, sizeof(T));
+            return;
+        }
+        std::memcpy(&value, state.data() + pos, sizeof(T));
+        pos += sizeof(T);
+    }
+
+    template <typename T>
+    void get(std::atomic<T> & value) {
+        T v;
+        get(v);
+        value = v;
+    }
+
+    template <typename T, size_t N>
+    void get(std::atomic<T> (& values)[N]) {
+        for (std::atomic<T> & v : values) {
+            get(v);
+        }
+    }
+
+    // Put the memory of the snapshot into dram, which must be the same size.
+    bool load_dram(Dram & dram) {
+        return dram.size() == header_.dram_size && dram.load(fd, header_.dram_offset);
+    }
+
+private:
+    int fd;
+    SnapshotHeader header_;
+    std::vector<uint8_t> state;
+    size_t pos;
+    bool ok_;
+};
+
+#endif  // _SNAPSHOT_H_
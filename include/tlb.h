@@ -0,0 +1,68 @@
+#ifndef _TLB_H_
+#define _TLB_H_
+
+#include "param.h"
+
+#include <cstdint>
+
+// Sv39 page table entry bits.
+const uint64_t PTE_V = 1ull << 0;
+const uint64_t PTE_R = 1ull << 1;
+const uint64_t PTE_W = 1ull << 2;
+const uint64_t PTE_X = 1ull << 3;
+const uint64_t PTE_U = 1ull << 4;
+
+// Number of entries of a TLB, a power of two.
+const uint64_t TLB_ENTRIES = 256;
+
+struct TlbEntry {
+    // virtual page number of the 4K page the entry maps, ~0 if the entry is empty.
+    uint64_t vpn;
+    // physical address of that page.
+    uint64_t ppage;
+    // the R/W/X/U bits of the leaf PTE.
+    uint64_t perm;
+    // host address of the page if it is plain memory, so that hits skip the bus.
+    uint8_t * host;
+};
+
+/*!
+ * Direct-mapped cache of Sv39 translations, indexed by the low bits of the VPN. 2M
+ * and 1G leaves are entered one 4K page at a time, as the pages are touched, so every
+ * entry has the same size and a lookup is a single probe. Entries keep the
+ * permission bits of their leaf; the caller checks them against the access on a hit.
+ * There are no ASIDs: the whole TLB is flushed on SATP writes and SFENCE.VMA.
+ * */
+class Tlb {
+public:
+    Tlb() {
+        flush();
+    }
+
+    // The entry translating addr, or nullptr on a miss.
+    const TlbEntry * find(uint64_t addr) const {
+        uint64_t vpn = addr / PAGE_SIZE;
+        const TlbEntry & e = entries[vpn & (TLB_ENTRIES - 1)];
+        return vpn == e.vpn ? &e : nullptr;
+    }
+
+    void insert(uint64_t addr, uint64_t paddr, uint64_t perm, uint8_t * host) {
+        uint64_t vpn = addr / PAGE_SIZE;
+        TlbEntry & e = entries[vpn & (TLB_ENTRIES - 1)];
+        e.vpn = vpn;
+        e.ppage = paddr & ~(PAGE_SIZE - 1);
+        e.perm = perm;
+        e.host = host;
+    }
+
+    void flush() {
+        for (uint64_t i = 0; i < TLB_ENTRIES; ++i) {
+            entries[i].vpn = ~0ull;
+        }
+    }
+
+private:
+    TlbEntry entries[TLB_ENTRIES];
+};
+
+#endif  // _TLB_H_
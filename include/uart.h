@@ -2,87 +2,270 @@
 #define _UART_H_
 
 #include "param.h"
-#include "Bus.h"
+#include "device.h"
+#include "doorbell.h"
 #include "exception.h"
+#include "snapshot.h"
+#include "util/spscRing.h"
 
-#include <iostream>
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
 #include <thread>
 
-class Uart {
+#include <poll.h>
+#include <unistd.h>
+
+// Bytes written by the guest and not yet on stdout.
+const size_t UART_TX_RING = 4096;
+// How long the writer lets output pile up before one write(), so that a burst of
+// single-byte THR stores costs one syscall.
+const std::chrono::microseconds UART_TX_LINGER(500);
+
+/*!
+ * A 16550 on stdin and stdout, without the mutex: registers are atomics and the
+ * FIFOs are lock-free rings.
+ *
+ * A reader thread moves stdin into the 16-byte receive FIFO and waits while it is
+ * full, so pasted input is never dropped. The line is infinitely fast, so the TX
+ * FIFO always reads as empty: THR stores go straight into a larger ring that a writer
+ * thread empties into stdout with as few write() calls as it can.
+ *
+ * Each ring has one producer and one consumer. On the guest side that holds as long
+ * as the driver serializes its RHR reads and THR writes, as it must on real hardware;
+ * if two harts race anyway, a byte is lost or repeated, never worse.
+ * */
+class Uart : public Device {
 public:
-	Uart() {
-		uart_ = new uint8_t [UART_SIZE];
-		std::fill_n(uart_, UART_SIZE, 0);
-		uart_[UART_LSR] |= MASK_UART_LSR_TX;
-		interrupt_ = false;
-		std::thread receive_thread([this]() {
-	        char byte;
-	        while (true) {
-	            std::cin.read(&byte, 1);
-	            std::unique_lock<std::mutex> lock(mutex_);
-	            // if data have been received but not yet be transferred.
-	            // this thread wait for it to be transferred.
-	            while ((uart_[UART_LSR] & MASK_UART_LSR_RX) == 1) {
-	                cvar_.wait(lock);
-	            }
-	            // data have been transferred, so receive next one.
-	            uart_[UART_RHR] = byte;
-	            interrupt_ = true;
-	            uart_[UART_LSR] |= MASK_UART_LSR_RX;
-	            cvar_.notify_one();
-	        }
-	    });
-	    receive_thread.detach();
+	Uart(Doorbell & doorbell) : doorbell(doorbell), interrupt_(false), stopping(false), busy(false) {
+		for (std::atomic<uint8_t> & r : regs) {
+			r = 0;
+		}
+		if (0 != pipe(wake_fds)) {
+			wake_fds[0] = wake_fds[1] = -1;
+		}
+		reader = std::thread([this]() { receive(); });
+		writer = std::thread([this]() { transmit(); });
 	}
 
 	~Uart() {
-		delete [] uart_;
+		stopping = true;
+		if (-1 != wake_fds[1]) {
+			char c = 0;
+			ssize_t n = write(wake_fds[1], &c, 1);
+			(void)n;
+		}
+		rx_bell.ring();
+		tx_bell.ring();
+		reader.join();
+		writer.join();
+		close(wake_fds[0]);
+		close(wake_fds[1]);
 	}
 
 	bool is_interrupting() {
-	    return std::atomic_exchange(&interrupt_, false);
+	    // Every hart polls this; only swap when there is something to take, so the
+	    // polls do not fight over the cache line.
+	    return interrupt_.load(std::memory_order_relaxed) && std::atomic_exchange(&interrupt_, false);
+	}
+
+	// Wait until everything the guest has written is on stdout.
+	void flush() {
+		while (!tx.empty() || busy.load()) {
+			tx_bell.ring();
+			std::this_thread::yield();
+		}
+	}
+
+	// The registers only: input not read yet belongs to the host, not the guest.
+	void save(SnapshotWriter & w) const {
+		w.put(regs);
+		w.put(dll);
+		w.put(dlm);
+		w.put(interrupt_);
+	}
+
+	void restore(SnapshotReader & r) {
+		r.get(regs);
+		r.get(dll);
+		r.get(dlm);
+		r.get(interrupt_);
+		// The reader may have got input in before IER was back.
+		if (!rx.empty() && rx_enabled()) {
+			interrupt_ = true;
+		}
 	}
 
-	uint64_t load(uint64_t addr, uint64_t size) {
+	Exception load(uint64_t addr, uint64_t size, uint64_t & value) {
 	    if (size != 8) {
 	    	std::cerr << "uart LoadAccessFault\n";
-	        throw LoadAccessFault(addr);
+	        return Exception::LoadAccessFault;
 	    }
-	    std::unique_lock<std::mutex> lock(mutex_);
 	    uint64_t index = addr - UART_BASE;
-	    if (UART_RHR == index) {
-            cvar_.notify_one();
-            uart_[UART_LSR] &= ~MASK_UART_LSR_RX;
-            return uart_[UART_RHR];
-	    }
-	    else {
-	    	return uart_[index];
+	    bool dlab = 0 != (regs[UART_LCR] & MASK_UART_LCR_DLAB);
+	    if (index >= 8) {
+	    	value = 0;
+	    } else if (UART_RHR == index && !dlab) {
+	    	uint8_t byte = 0;
+	    	rx.pop(byte);
+	    	value = byte;
+	    	// Make room for the reader, and interrupt again for what is left.
+	    	rx_bell.ring();
+	    	if (!rx.empty() && rx_enabled()) {
+	    		interrupt_ = true;
+	    	}
+	    } else if (UART_IIR == index) {
+	    	// FIFOs enabled, and received data available or no interrupt pending.
+	    	value = (regs[UART_FCR] & 1) ? 0xc0 : 0;
+	    	value |= (!rx.empty() && rx_enabled()) ? 0x04 : 0x01;
+	    } else if (UART_LSR == index) {
+	    	value = MASK_UART_LSR_TX | MASK_UART_LSR_TEMT | (rx.empty() ? 0 : MASK_UART_LSR_RX);
+	    } else if (UART_IER == index && dlab) {
+	    	value = dlm;
+	    } else if (UART_RHR == index) {
+	    	value = dll;
+	    } else {
+	    	value = regs[index];
 	    }
+	    return Exception::None;
 	}
 
-	void store(uint64_t addr, uint64_t size, uint64_t value) {
+	Exception store(uint64_t addr, uint64_t size, uint64_t value) {
 	    if (size != 8) {
 	    	std:: cout << "uart.store" << std::endl;
-	        throw StoreAMOAccessFault(addr);
+	        return Exception::StoreAMOAccessFault;
 	    }
-	    std::unique_lock<std::mutex> lock(mutex_);
 	    uint64_t index = addr - UART_BASE;
-	    if (UART_THR == index) {
-	            std::cout << (char)(value & 0xff);
-	            std::cout.flush();
+	    bool dlab = 0 != (regs[UART_LCR] & MASK_UART_LCR_DLAB);
+	    if (index >= 8) {
+	    	return Exception::None;
 	    }
-	    else {
-	    	uart_[index] = value & 0xff;
+	    if (UART_THR == index && !dlab) {
+	    	send(value & 0xff);
+	    } else if (UART_THR == index) {
+	    	dll = value & 0xff;
+	    } else if (UART_IER == index && dlab) {
+	    	dlm = value & 0xff;
+	    } else if (UART_FCR == index) {
+	    	// Bit 1 clears the receive FIFO; the line leaves nothing in the TX FIFO.
+	    	if (value & 0x2) {
+	    		rx.clear();
+	    		rx_bell.ring();
+	    	}
+	    	regs[UART_FCR] = value & 0xc1;
+	    } else {
+	    	regs[index] = value & 0xff;
+	    	if (UART_IER == index && !rx.empty() && rx_enabled()) {
+	    		interrupt_ = true;
+	    	}
 	    }
+	    return Exception::None;
 	}
 private:
-	uint8_t * uart_;
-	std::mutex mutex_;
-	std::condition_variable cvar_;
+	bool rx_enabled() const {
+		return 0 != (regs[UART_IER] & 1);
+	}
+
+	void send(uint8_t byte) {
+		bool was_empty = tx.empty();
+		while (!tx.push(byte)) {
+			// stdout is behind; let the writer catch up.
+			tx_bell.ring();
+			std::this_thread::yield();
+		}
+		// The writer only sleeps on an empty ring.
+		if (was_empty) {
+			tx_bell.ring();
+		}
+	}
+
+	// Reader thread: move stdin into the receive FIFO until EOF or destruction.
+	void receive() {
+		uint8_t buf[256];
+		while (!stopping) {
+			pollfd fds[2] = {{0, POLLIN, 0}, {wake_fds[0], POLLIN, 0}};
+			if (poll(fds, -1 == wake_fds[0] ? 1 : 2, -1) < 0) {
+				if (EINTR == errno) {
+					continue;
+				}
+				return;
+			}
+			if (fds[1].revents) {
+				return;
+			}
+			ssize_t n = read(0, buf, sizeof(buf));
+			if (n < 0 && EINTR == errno) {
+				continue;
+			}
+			if (n <= 0) {
+				// No more input.
+				return;
+			}
+			for (ssize_t i = 0; i < n && !stopping;) {
+				uint64_t seen = rx_bell.epoch();
+				size_t pushed = rx.push(buf + i, n - i);
+				if (0 == pushed) {
+					// Full: wait for the guest to read.
+					rx_bell.wait(seen);
+					continue;
+				}
+				i += pushed;
+				if (rx_enabled()) {
+					interrupt_ = true;
+				}
+				doorbell.ring();
+			}
+		}
+	}
+
+	// Writer thread: empty the TX ring into stdout in batches.
+	void transmit() {
+		uint8_t buf[UART_TX_RING];
+		while (true) {
+			uint64_t seen = tx_bell.epoch();
+			busy = true;
+			size_t n = tx.pop(buf, sizeof(buf));
+			for (size_t done = 0; done < n;) {
+				ssize_t w = write(1, buf + done, n - done);
+				if (w < 0 && EINTR != errno) {
+					break;
+				}
+				done += (w > 0) ? w : 0;
+			}
+			busy = false;
+			if (n > 0) {
+				continue;
+			}
+			if (stopping) {
+				return;
+			}
+			tx_bell.wait(seen);
+			if (!stopping) {
+				std::this_thread::sleep_for(UART_TX_LINGER);
+			}
+		}
+	}
+
+	Doorbell & doorbell;
+	// Registers without side effects, by offset.
+	std::atomic<uint8_t> regs[8];
+	// Divisor latch, only kept for the guest to read back.
+	std::atomic<uint8_t> dll{0};
+	std::atomic<uint8_t> dlm{0};
 	std::atomic<bool> interrupt_;
+	SpscRing<uint8_t, UART_FIFO_SIZE> rx;
+	SpscRing<uint8_t, UART_TX_RING> tx;
+	// Rung by the guest reading RHR, and by the writing side of tx.
+	Doorbell rx_bell;
+	Doorbell tx_bell;
+	std::atomic<bool> stopping;
+	// Whether the writer holds bytes it popped but has not written.
+	std::atomic<bool> busy;
+	// Written to on destruction to get the reader out of poll().
+	int wake_fds[2];
+	std::thread reader;
+	std::thread writer;
 };
 
-#endif
\ No newline at end of file
+#endif
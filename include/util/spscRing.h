@@ -0,0 +1,88 @@
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+
+/*!
+ * A fixed-size lock-free queue for one producer thread and one consumer thread. N
+ * must be a power of two. The producer only writes head and the consumer only writes
+ * tail, each on a cache line of its own, so neither side ever waits for the other.
+ * */
+template <typename T, size_t N>
+class SpscRing {
+	static_assert(0 == (N & (N - 1)), "N must be a power of two");
+public:
+	SpscRing(): head(0), tail(0) {}
+
+	// Producer: append value. Return false if the ring is full.
+	bool push(const T & value) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == N) {
+			return false;
+		}
+		slots[h & (N - 1)] = value;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Producer: append as many of the n values as fit. Return how many did.
+	size_t push(const T * values, size_t n) {
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t room = N - (h - tail.load(std::memory_order_acquire));
+		if (n > room) {
+			n = room;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			slots[(h + i) & (N - 1)] = values[i];
+		}
+		head.store(h + n, std::memory_order_release);
+		return n;
+	}
+
+	// Consumer: take the oldest value. Return false if the ring is empty.
+	bool pop(T & value) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (head.load(std::memory_order_acquire) == t) {
+			return false;
+		}
+		value = slots[t & (N - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: take up to n values into out. Return how many were taken.
+	size_t pop(T * out, size_t n) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t count = head.load(std::memory_order_acquire) - t;
+		if (n > count) {
+			n = count;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			out[i] = slots[(t + i) & (N - 1)];
+		}
+		tail.store(t + n, std::memory_order_release);
+		return n;
+	}
+
+	// Consumer: drop everything queued.
+	void clear() {
+		tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+	}
+
+	// Exact on the consumer side; elsewhere a snapshot.
+	bool empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+	size_t size() const {
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+private:
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+	alignas(64) T slots[N];
+};
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef _VECTOR_H_
+#define _VECTOR_H_
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "fp.h"
+
+// x86-64 hosts get AVX2 kernels, compiled for that target alone and picked at run
+// time; every other host, or one without AVX2 and FMA, takes the scalar loops.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define VECTOR_AVX2 1
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+
+inline bool host_has_avx2() {
+#if defined(VECTOR_AVX2)
+    static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has;
+#else
+    return false;
+#endif
+}
+
+// Vector registers are plain bytes: elements go in and out through memcpy.
+template <typename T>
+inline T vec_get(const T * p, size_t i) {
+    T value;
+    std::memcpy(&value, (const uint8_t *)p + i * sizeof(T), sizeof(T));
+    return value;
+}
+
+template <typename T>
+inline void vec_set(T * p, size_t i, T value) {
+    std::memcpy((uint8_t *)p + i * sizeof(T), &value, sizeof(T));
+}
+
+// Bit i of the mask register v0.
+inline bool vec_active(const uint8_t * mask, size_t i) {
+    return (mask[i / 8] >> (i % 8)) & 1;
+}
+
+#if defined(VECTOR_AVX2)
+/*!
+ * The AVX2 lanes of an element type: V holds 32 bytes of elements. AVX2 has no lane
+ * multiply for 8- and 64-bit integers, so those leave out mul() and fma().
+ * */
+template <typename T> struct Avx2Lanes;
+
+#define AVX2_INT_LANES(T, bits, set1, ...)                                              \
+template <> struct Avx2Lanes<T> {                                                       \
+    typedef __m256i V;                                                                  \
+    AVX2_TARGET static V load(const T * p) { return _mm256_loadu_si256((const V *)p); } \
+    AVX2_TARGET static void store(T * p, V v) { _mm256_storeu_si256((V *)p, v); }      \
+    AVX2_TARGET static V splat(T x) { return set1(x); }                                 \
+    AVX2_TARGET static V add(V a, V b) { return _mm256_add_epi##bits(a, b); }           \
+    AVX2_TARGET static V sub(V a, V b) { return _mm256_sub_epi##bits(a, b); }           \
+    AVX2_TARGET static V canonical(V v) { return v; }                                   \
+    __VA_ARGS__                                                                         \
+};
+
+#define AVX2_INT_MUL(bits)                                                              \
+    static const bool has_mul = true;                                                   \
+    AVX2_TARGET static V mul(V a, V b) { return _mm256_mullo_epi##bits(a, b); }         \
+    AVX2_TARGET static V fma(V a, V b, V c) { return add(mul(a, b), c); }
+
+AVX2_INT_LANES(uint8_t, 8, _mm256_set1_epi8, static const bool has_mul = false;)
+AVX2_INT_LANES(uint16_t, 16, _mm256_set1_epi16, AVX2_INT_MUL(16))
+AVX2_INT_LANES(uint32_t, 32, _mm256_set1_epi32, AVX2_INT_MUL(32))
+AVX2_INT_LANES(uint64_t, 64, _mm256_set1_epi64x, static const bool has_mul = false;)
+#undef AVX2_INT_MUL
+#undef AVX2_INT_LANES
+
+// Floating-point lanes replace every NaN they produce by the canonical NaN.
+#define AVX2_FP_LANES(T, V_, s)                                                         \
+template <> struct Avx2Lanes<T> {                                                       \
+    typedef V_ V;                                                                       \
+    static const bool has_mul = true;                                                   \
+    AVX2_TARGET static V load(const T * p) { return _mm256_loadu_##s(p); }             \
+    AVX2_TARGET static void store(T * p, V v) { _mm256_storeu_##s(p, v); }             \
+    AVX2_TARGET static V splat(T x) { return _mm256_set1_##s(x); }                      \
+    AVX2_TARGET static V add(V a, V b) { return _mm256_add_##s(a, b); }                 \
+    AVX2_TARGET static V sub(V a, V b) { return _mm256_sub_##s(a, b); }                 \
+    AVX2_TARGET static V mul(V a, V b) { return _mm256_mul_##s(a, b); }                 \
+    AVX2_TARGET static V fma(V a, V b, V c) { return _mm256_fmadd_##s(a, b, c); }       \
+    AVX2_TARGET static V canonical(V v) {                                               \
+        V nan = splat(fp_from_bits<T>(FpBits<T>::canonical_nan));                       \
+        return _mm256_blendv_##s(v, nan, _mm256_cmp_##s(v, v, _CMP_UNORD_Q));            \
+    }                                                                                   \
+};
+
+AVX2_FP_LANES(float, __m256, ps)
+AVX2_FP_LANES(double, __m256d, pd)
+#undef AVX2_FP_LANES
+#endif
+
+// The operand forms of OP-V: the second operand is vs1, rs1 (or an f register), or
+// the immediate.
+enum class VecForm {
+    VV, VX, VI,
+};
+
+/*!
+ * A source operand of an element-wise operation: the elements of a register group,
+ * or one scalar for every element (the .vx, .vi and .vf forms).
+ * */
+template <typename T>
+struct VecGroup {
+    const T * p;
+    T at(size_t i) const { return vec_get(p, i); }
+#if defined(VECTOR_AVX2)
+    AVX2_TARGET typename Avx2Lanes<T>::V lanes(size_t i) const { return Avx2Lanes<T>::load(p + i); }
+#endif
+};
+
+template <typename T>
+struct VecScalar {
+    T x;
+    T at(size_t) const { return x; }
+#if defined(VECTOR_AVX2)
+    AVX2_TARGET typename Avx2Lanes<T>::V lanes(size_t) const { return Avx2Lanes<T>::splat(x); }
+#endif
+};
+
+/*!
+ * The element-wise operations. scalar() computes one element from the old destination
+ * element d and the operands a (vs2) and b (vs1, rs1 or the immediate); lanes() does
+ * the same for 32 bytes of elements. Integer elements are unsigned and wrap.
+ * */
+struct VecAdd {
+    static const bool accumulate = false;
+    static const bool needs_mul = false;
+    template <typename T>
+    static T scalar(T, T a, T b) {
+        return (T)(a + b);
+    }
+#if defined(VECTOR_AVX2)
+    template <typename L>
+    AVX2_TARGET static typename L::V lanes(typename L::V, typename L::V a, typename L::V b) {
+        return L::add(a, b);
+    }
+#endif
+};
+
+struct VecSub {
+    static const bool accumulate = false;
+    static const bool needs_mul = false;
+    template <typename T>
+    static T scalar(T, T a, T b) {
+        return (T)(a - b);
+    }
+#if defined(VECTOR_AVX2)
+    template <typename L>
+    AVX2_TARGET static typename L::V lanes(typename L::V, typename L::V a, typename L::V b) {
+        return L::sub(a, b);
+    }
+#endif
+};
+
+struct VecMul {
+    static const bool accumulate = false;
+    static const bool needs_mul = true;
+    template <typename T>
+    static T scalar(T, T a, T b) {
+        if constexpr (std::is_floating_point<T>::value) {
+            return a * b;
+        } else {
+            return (T)((uint64_t)a * (uint64_t)b);
+        }
+    }
+#if defined(VECTOR_AVX2)
+    template <typename L>
+    AVX2_TARGET static typename L::V lanes(typename L::V, typename L::V a, typename L::V b) {
+        return L::mul(a, b);
+    }
+#endif
+};
+
+// vmv.v.*: b alone.
+struct VecMove {
+    static const bool accumulate = false;
+    static const bool needs_mul = false;
+    template <typename T>
+    static T scalar(T, T, T b) {
+        return b;
+    }
+#if defined(VECTOR_AVX2)
+    template <typename L>
+    AVX2_TARGET static typename L::V lanes(typename L::V, typename L::V, typename L::V b) {
+        return b;
+    }
+#endif
+};
+
+// vmacc and vfmacc: d + a * b, fused for floating point.
+struct VecMacc {
+    static const bool accumulate = true;
+    static const bool needs_mul = true;
+    template <typename T>
+    static T scalar(T d, T a, T b) {
+        if constexpr (std::is_floating_point<T>::value) {
+            return std::fma(a, b, d);
+        } else {
+            return (T)(d + (uint64_t)a * (uint64_t)b);
+        }
+    }
+#if defined(VECTOR_AVX2)
+    template <typename L>
+    AVX2_TARGET static typename L::V lanes(typename L::V d, typename L::V a, typename L::V b) {
+        return L::fma(a, b, d);
+    }
+#endif
+};
+
+template <typename T>
+inline T vec_canonical(T value) {
+    if constexpr (std::is_floating_point<T>::value) {
+        return fp_canonical(value);
+    } else {
+        return value;
+    }
+}
+
+template <typename Op, typename T, typename A, typename B>
+inline void vec_map_scalar(T * d, const A & a, const B & b, size_t n, const uint8_t * mask) {
+    for (size_t i = 0; i < n; i++) {
+        if (nullptr == mask || vec_active(mask, i)) {
+            T old = Op::accumulate ? vec_get(d, i) : (T)0;
+            vec_set(d, i, vec_canonical(Op::scalar(old, a.at(i), b.at(i))));
+        }
+    }
+}
+
+#if defined(VECTOR_AVX2)
+template <typename Op, typename T, typename A, typename B>
+AVX2_TARGET inline void vec_map_avx2(T * d, const A & a, const B & b, size_t n) {
+    typedef Avx2Lanes<T> L;
+    const size_t step = 32 / sizeof(T);
+    size_t i = 0;
+    for (; i + step <= n; i += step) {
+        typename L::V old = Op::accumulate ? L::load(d + i) : L::splat((T)0);
+        L::store(d + i, L::canonical(Op::template lanes<L>(old, a.lanes(i), b.lanes(i))));
+    }
+    for (; i < n; i++) {
+        T old = Op::accumulate ? vec_get(d, i) : (T)0;
+        vec_set(d, i, vec_canonical(Op::scalar(old, a.at(i), b.at(i))));
+    }
+}
+#endif
+
+/*!
+ * d[i] = op(d[i], a[i], b[i]) for the first n elements, only where the mask bit is set
+ * if there is a mask. Unmasked runs go through AVX2 when the host has it.
+ * */
+template <typename Op, typename T, typename A, typename B>
+inline void vec_map(T * d, const A & a, const B & b, size_t n, const uint8_t * mask) {
+#if defined(VECTOR_AVX2)
+    if constexpr (!Op::needs_mul || Avx2Lanes<T>::has_mul) {
+        if (nullptr == mask && host_has_avx2()) {
+            vec_map_avx2<Op>(d, a, b, n);
+            return;
+        }
+    }
+#endif
+    vec_map_scalar<Op>(d, a, b, n, mask);
+}
+
+#if defined(VECTOR_AVX2)
+template <typename T>
+AVX2_TARGET inline T vec_sum_avx2(const T * a, size_t n) {
+    typedef Avx2Lanes<T> L;
+    const size_t step = 32 / sizeof(T);
+    typename L::V acc = L::splat((T)0);
+    size_t i = 0;
+    for (; i + step <= n; i += step) {
+        acc = L::add(acc, L::load(a + i));
+    }
+    T lanes[32 / sizeof(T)];
+    L::store(lanes, acc);
+    T sum = 0;
+    for (size_t j = 0; j < step; j++) {
+        sum = (T)(sum + lanes[j]);
+    }
+    for (; i < n; i++) {
+        sum = (T)(sum + vec_get(a, i));
+    }
+    return sum;
+}
+#endif
+
+// Wrapping sum of the active integer elements among the first n, for vredsum.
+template <typename T>
+inline T vec_sum(const T * a, size_t n, const uint8_t * mask) {
+#if defined(VECTOR_AVX2)
+    if (nullptr == mask && host_has_avx2()) {
+        return vec_sum_avx2(a, n);
+    }
+#endif
+    T sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (nullptr == mask || vec_active(mask, i)) {
+            sum = (T)(sum + vec_get(a, i));
+        }
+    }
+    return sum;
+}
+
+// Floating-point sum in element order, for both vfredosum and vfredusum.
+template <typename F>
+inline F vec_fsum(F start, const F * a, size_t n, const uint8_t * mask) {
+    F sum = start;
+    for (size_t i = 0; i < n; i++) {
+        if (nullptr == mask || vec_active(mask, i)) {
+            sum += vec_get(a, i);
+        }
+    }
+    return fp_canonical(sum);
+}
+
+#endif  // _VECTOR_H_
@@ -1,111 +1,421 @@
 #ifndef _VIRTIO_H_
 #define _VIRTIO_H_
 
-#include <CPU.h>
+#include <device.h>
+#include <disk.h>
+#include <doorbell.h>
 #include <exception.h>
 #include <param.h>
+#include <snapshot.h>
 #include <Bus.h>
+#include <virtqueue.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #define MAX_BLOCK_QUEUE 1
 
-class VirtioBlock {
+class VirtioBlock : public Device {
 public:
-	VirtioBlock(std::vector<uint8_t> & disk_image): 
-	id(0), 
+	VirtioBlock(std::unique_ptr<BlockBackend> disk, Doorbell & doorbell): 
+	doorbell(doorbell),
+	version(VIRTIO_LEGACY),
+	device_features_sel(0),
 	driver_features(0), 
+	driver_features_sel(0),
 	page_size(0), 
 	queue_sel(0),
 	queue_num(0),
+	queue_align(PAGE_SIZE),
 	queue_pfn(0),
+	queue_ready(false),
+	queue_desc(0),
+	queue_driver(0),
+	queue_device(0),
 	queue_notify(MAX_BLOCK_QUEUE), 
+	interrupt_status(0),
 	status(0),
-	disk(disk_image){}
+	in_flight(0),
+	any_completed(false),
+	disk(std::move(disk)){
+		this->disk->set_completion([this](DiskRequest * req) { complete(req); });
+	}
+
+	~VirtioBlock() {
+		drain();
+		disk.reset();
+	}
+
+	// VIRTIO_LEGACY or VIRTIO_MODERN, the interface the driver finds. Set before it looks.
+	void set_version(uint32_t v) {
+		version = v;
+	}
+
+	uint64_t device_features() const {
+		uint64_t features = (1ull << VIRTIO_BLK_F_FLUSH) | (1ull << VIRTIO_RING_F_INDIRECT_DESC)
+		                  | (1ull << VIRTIO_RING_F_EVENT_IDX);
+		return (VIRTIO_MODERN == version) ? features | (1ull << VIRTIO_F_VERSION_1) : features;
+	}
 
+	// Whether the driver has accepted feature bit.
+	bool negotiated(uint64_t bit) const {
+		return 0 != (driver_features & device_features() & (1ull << bit));
+	}
+
+	// Whether the driver has set the queue up for use.
+	bool queue_live() const {
+		return (VIRTIO_MODERN == version) ? queue_ready : 0 != queue_pfn;
+	}
+
+	// Take the pending queue notification, if any. Only one of the polling harts gets it.
 	bool is_interrupting();
 
-	uint64_t load(uint64_t addr, uint64_t size);
+	// Held by the hart processing the queue.
+	std::mutex & queue_mutex() {
+		return mutex;
+	}
+
+	Exception load(uint64_t addr, uint64_t size, uint64_t & value);
+
+	Exception store(uint64_t addr, uint64_t size, uint64_t value);
 
-	void store(uint64_t addr, uint64_t size, uint64_t value);
+	// How far the device has got through the queue. Only touched under queue_mutex().
+	struct Progress {
+		// Next entry of the available ring to process.
+		uint16_t last_avail;
+		// Next entry of the used ring to fill.
+		uint16_t used_idx;
+	};
 
-	uint64_t get_new_id();
+	Progress & progress() {
+		return progress_;
+	}
+
+	// Record that buffers have been used, for the driver to find in the interrupt status.
+	void used_buffer_notify() {
+		interrupt_status.fetch_or(1);
+	}
+
+	// Number of descriptors in the queue.
+	uint64_t queue_size();
 
 	uint64_t desc_addr();
 
-	uint64_t read_disk(uint64_t addr);
+	uint64_t avail_addr();
+
+	uint64_t used_addr();
+
+	BlockBackend & get_disk() {
+		return *disk;
+	}
+
+	// A request on an asynchronous backend, from submission until a hart posts it
+	// to the used ring.
+	struct Request : DiskRequest {
+		uint16_t head;
+		// Guest address of the status byte.
+		uint64_t status_addr;
+		// Bytes the device writes into the chain if the request succeeds.
+		uint32_t written;
+		// Guest address of each of iov.
+		std::vector<uint64_t> paddrs;
+	};
+
+	// The request for the chain at head. A chain is in flight at most once.
+	Request & request(uint16_t head) {
+		return requests[head % DESC_NUM];
+	}
+
+	void submit(Request & req) {
+		in_flight.fetch_add(1);
+		disk->submit(&req);
+	}
+
+	// Whether requests have completed since the last take_completed().
+	bool has_completed() const {
+		return any_completed.load(std::memory_order_relaxed);
+	}
 
-	void write_disk(uint64_t addr, uint64_t value);
+	// Waits for requests in flight; those completed but not yet posted are saved.
+	void save(SnapshotWriter & w);
+
+	void restore(SnapshotReader & r);
+
+	// Move the completed requests into out. Only called under queue_mutex().
+	void take_completed(std::vector<Request *> & out) {
+		std::lock_guard<std::mutex> guard(completed_mutex);
+		any_completed = false;
+		out.swap(completed);
+		completed.clear();
+	}
 private:
-	uint64_t id;
-	uint32_t driver_features;
+	void complete(DiskRequest * req);
+
+	void drain();
+
+	// Forget the queue. Called under the queue mutex.
+	void reset_queue();
+
+	Doorbell & doorbell;
+	uint32_t version;
+	uint32_t device_features_sel;
+	uint64_t driver_features;
+	uint32_t driver_features_sel;
 	uint32_t page_size;
 	uint32_t queue_sel;
 	uint32_t queue_num;
+	uint32_t queue_align;
 	uint32_t queue_pfn;
-	uint32_t queue_notify;
+	bool queue_ready;
+	uint64_t queue_desc;
+	uint64_t queue_driver;
+	uint64_t queue_device;
+	std::atomic<uint32_t> queue_notify;
+	std::atomic<uint32_t> interrupt_status;
 	uint32_t status;
-	std::vector<uint8_t> disk;
+	Progress progress_ = Progress{0, 0};
+	Request requests[DESC_NUM];
+	std::atomic<uint32_t> in_flight;
+	std::mutex completed_mutex;
+	std::vector<Request *> completed;
+	std::atomic<bool> any_completed;
+	std::unique_ptr<BlockBackend> disk;
+	std::mutex mutex;
 };
 
+// Called by the backend, on a thread of its own.
+void VirtioBlock::complete(DiskRequest * req) {
+	{
+		std::lock_guard<std::mutex> guard(completed_mutex);
+		completed.push_back(static_cast<Request *>(req));
+		any_completed = true;
+	}
+	in_flight.fetch_sub(1);
+	// Any hart may post it, sleeping ones included.
+	doorbell.ring();
+}
+
+void VirtioBlock::save(SnapshotWriter & w) {
+	while (0 != in_flight.load()) {
+		std::this_thread::yield();
+	}
+	w.put(version);
+	w.put(device_features_sel);
+	w.put(driver_features);
+	w.put(driver_features_sel);
+	w.put(page_size);
+	w.put(queue_sel);
+	w.put(queue_num);
+	w.put(queue_align);
+	w.put(queue_pfn);
+	w.put(queue_ready);
+	w.put(queue_desc);
+	w.put(queue_driver);
+	w.put(queue_device);
+	w.put(queue_notify);
+	w.put(interrupt_status);
+	w.put(status);
+	w.put(progress_);
+	std::lock_guard<std::mutex> guard(completed_mutex);
+	w.put((uint64_t)completed.size());
+	for (Request * req : completed) {
+		w.put(req->head);
+		w.put(req->op);
+		w.put(req->ok);
+		w.put(req->status_addr);
+		w.put(req->written);
+	}
+}
+
+void VirtioBlock::restore(SnapshotReader & r) {
+	r.get(version);
+	r.get(device_features_sel);
+	r.get(driver_features);
+	r.get(driver_features_sel);
+	r.get(page_size);
+	r.get(queue_sel);
+	r.get(queue_num);
+	r.get(queue_align);
+	r.get(queue_pfn);
+	r.get(queue_ready);
+	r.get(queue_desc);
+	r.get(queue_driver);
+	r.get(queue_device);
+	r.get(queue_notify);
+	r.get(interrupt_status);
+	r.get(status);
+	r.get(progress_);
+	uint64_t count = 0;
+	r.get(count);
+	std::lock_guard<std::mutex> guard(completed_mutex);
+	completed.clear();
+	for (uint64_t i = 0; i < count && i < DESC_NUM && r.ok(); ++i) {
+		uint16_t head;
+		r.get(head);
+		// The memory the request went to is new to every hart, so iov may stay empty.
+		Request & req = request(head);
+		req.head = head;
+		req.iov.clear();
+		req.paddrs.clear();
+		r.get(req.op);
+		r.get(req.ok);
+		r.get(req.status_addr);
+		r.get(req.written);
+		completed.push_back(&req);
+	}
+	any_completed = !completed.empty();
+}
+
+void VirtioBlock::reset_queue() {
+	drain();
+	progress_ = Progress{0, 0};
+}
+
+// Wait for the backend to finish every request, and forget them; the queue is gone.
+void VirtioBlock::drain() {
+	while (0 != in_flight.load()) {
+		std::this_thread::yield();
+	}
+	std::lock_guard<std::mutex> guard(completed_mutex);
+	completed.clear();
+	any_completed = false;
+}
+
 bool VirtioBlock::is_interrupting() {
-	if (queue_notify < MAX_BLOCK_QUEUE) {
-		queue_notify = MAX_BLOCK_QUEUE;
-		return true;
+	if (queue_notify.load(std::memory_order_relaxed) >= MAX_BLOCK_QUEUE) {
+		return false;
 	}
-	return false;
+	return queue_notify.exchange(MAX_BLOCK_QUEUE) < MAX_BLOCK_QUEUE;
 }
 
-uint64_t VirtioBlock::load(uint64_t addr, uint64_t size) {
+Exception VirtioBlock::load(uint64_t addr, uint64_t size, uint64_t & value) {
 	if (32 != size) {
-		throw LoadAccessFault(addr);
+		return Exception::LoadAccessFault;
 	}
 	switch (addr) {
-	case VIRTIO_MAGIC: return 0x74726976;
-	case VIRTIO_VERSION: return 0x1;
-	case VIRTIO_DEVICE_ID: return 0x2;
-	case VIRTIO_VENDOR_ID: return 0x554d4551;
-	case VIRTIO_DEVICE_FEATURES: return 0;
-	case VIRTIO_DRIVER_FEATURES: return (uint64_t)driver_features;
-	case VIRTIO_QUEUE_NUM_MAX: return 8;
-	case VIRTIO_QUEUE_PFN: return (uint64_t)queue_pfn;
-	case VIRTIO_STATUS: return (uint64_t)status;
-	default: break;
+	case VIRTIO_MAGIC: value = 0x74726976; break;
+	case VIRTIO_VERSION: value = version; break;
+	case VIRTIO_DEVICE_ID: value = 0x2; break;
+	case VIRTIO_VENDOR_ID: value = 0x554d4551; break;
+	case VIRTIO_DEVICE_FEATURES:
+		value = (device_features_sel < 2) ? (uint32_t)(device_features() >> (32 * device_features_sel)) : 0;
+		break;
+	case VIRTIO_DRIVER_FEATURES:
+		value = (driver_features_sel < 2) ? (uint32_t)(driver_features >> (32 * driver_features_sel)) : 0;
+		break;
+	case VIRTIO_QUEUE_NUM_MAX: value = DESC_NUM; break;
+	case VIRTIO_QUEUE_PFN: value = (uint64_t)queue_pfn; break;
+	case VIRTIO_QUEUE_READY: value = queue_ready; break;
+	// The configuration never changes.
+	case VIRTIO_CONFIG_GENERATION: value = 0; break;
+	case VIRTIO_INTERRUPT_STATUS: value = interrupt_status.load(); break;
+	case VIRTIO_STATUS: value = (uint64_t)status; break;
+	case VIRTIO_CONFIG: value = (uint32_t)(disk->size() / SECTOR_SIZE); break;
+	case VIRTIO_CONFIG + 4: value = (disk->size() / SECTOR_SIZE) >> 32; break;
+	default: value = 0; break;
 	}
-	return 0;
+	return Exception::None;
 }
 
-void VirtioBlock::store(uint64_t addr, uint64_t size, uint64_t value) {
+Exception VirtioBlock::store(uint64_t addr, uint64_t size, uint64_t value) {
 	if (32 != size) {
-		throw StoreAMOAccessFault(addr);
+		return Exception::StoreAMOAccessFault;
 	}
 
 	switch (addr) {
-	case VIRTIO_DEVICE_FEATURES: driver_features = value; break;
+	case VIRTIO_DEVICE_FEATURES_SEL: device_features_sel = value; break;
+	case VIRTIO_DRIVER_FEATURES:
+		if (driver_features_sel < 2) {
+			uint64_t shift = 32 * driver_features_sel;
+			driver_features = (driver_features & ~(0xffffffffull << shift)) | ((value & 0xffffffff) << shift);
+		}
+		break;
+	case VIRTIO_DRIVER_FEATURES_SEL: driver_features_sel = value; break;
 	case VIRTIO_GUEST_PAGE_SIZE: page_size = value; break;
 	case VIRTIO_QUEUE_SEL: queue_sel = value; break;
 	case VIRTIO_QUEUE_NUM: queue_num = value; break;
-	case VIRTIO_QUEUE_PFN: queue_pfn = value; break;
-	case VIRTIO_QUEUE_NOTIFY: queue_notify = value; break;
-	case VIRTIO_STATUS: status = value; break;
+	case VIRTIO_QUEUE_ALIGN: queue_align = value; break;
+	case VIRTIO_QUEUE_PFN: {
+		std::lock_guard<std::mutex> guard(mutex);
+		reset_queue();
+		queue_pfn = value;
+		break;
+	}
+	case VIRTIO_QUEUE_READY: {
+		std::lock_guard<std::mutex> guard(mutex);
+		reset_queue();
+		queue_ready = value & 1;
+		break;
+	}
+	case VIRTIO_QUEUE_DESC_LOW: queue_desc = (queue_desc & ~0xffffffffull) | (value & 0xffffffff); break;
+	case VIRTIO_QUEUE_DESC_HIGH: queue_desc = (queue_desc & 0xffffffff) | ((value & 0xffffffff) << 32); break;
+	case VIRTIO_QUEUE_DRIVER_LOW: queue_driver = (queue_driver & ~0xffffffffull) | (value & 0xffffffff); break;
+	case VIRTIO_QUEUE_DRIVER_HIGH: queue_driver = (queue_driver & 0xffffffff) | ((value & 0xffffffff) << 32); break;
+	case VIRTIO_QUEUE_DEVICE_LOW: queue_device = (queue_device & ~0xffffffffull) | (value & 0xffffffff); break;
+	case VIRTIO_QUEUE_DEVICE_HIGH: queue_device = (queue_device & 0xffffffff) | ((value & 0xffffffff) << 32); break;
+	case VIRTIO_QUEUE_NOTIFY:
+		queue_notify = value;
+		// Any hart may process the queue, sleeping ones included.
+		doorbell.ring();
+		break;
+	case VIRTIO_INTERRUPT_ACK: interrupt_status.fetch_and(~(uint32_t)value); break;
+	case VIRTIO_STATUS:
+		if (0 == value) {
+			// device reset
+			std::lock_guard<std::mutex> guard(mutex);
+			reset_queue();
+			interrupt_status = 0;
+			driver_features = 0;
+			queue_pfn = 0;
+			queue_ready = false;
+			queue_desc = queue_driver = queue_device = 0;
+		}
+		if ((value & VIRTIO_STATUS_FEATURES_OK) && !(status & VIRTIO_STATUS_FEATURES_OK)
+		    && ((driver_features & ~device_features())
+		        || (VIRTIO_MODERN == version && !negotiated(VIRTIO_F_VERSION_1)))) {
+			// Refuse features we did not offer, and a legacy driver on the modern interface.
+			value &= ~VIRTIO_STATUS_FEATURES_OK;
+		}
+		status = value;
+		break;
 	default: break;
 	}
+	return Exception::None;
 }
 
-uint64_t VirtioBlock::get_new_id() {
-	return ++id;
+uint64_t VirtioBlock::queue_size() {
+	return (0 == queue_num || queue_num > DESC_NUM) ? DESC_NUM : queue_num;
 }
 
-// get the address of the virtqueue
+// 2.6.2 Legacy Interfaces: A Note on Virtqueue Layout
+// ------------------------------------------------------------------
+// Descriptor Table  | Available Ring | (...padding...) | Used Ring
+// ------------------------------------------------------------------
+// The modern interface has the driver say where each part is.
 uint64_t VirtioBlock::desc_addr() {
+	if (VIRTIO_MODERN == version) {
+		return queue_desc;
+	}
 	return (uint64_t)queue_pfn * (uint64_t)page_size;
 }
 
-uint64_t VirtioBlock::read_disk(uint64_t addr) {
-	return (uint64_t)disk[addr];
+uint64_t VirtioBlock::avail_addr() {
+	if (VIRTIO_MODERN == version) {
+		return queue_driver;
+	}
+	return desc_addr() + queue_size() * sizeof(VirtqDesc);
 }
 
-void VirtioBlock::write_disk(uint64_t addr, uint64_t value) {
-	disk[addr] = (uint8_t)value;
+uint64_t VirtioBlock::used_addr() {
+	if (VIRTIO_MODERN == version) {
+		return queue_device;
+	}
+	// flags, idx, ring and used_event of the available ring come before the padding.
+	uint64_t end = avail_addr() + 2 * (3 + queue_size());
+	uint64_t align = (0 == queue_align) ? PAGE_SIZE : queue_align;
+	return (end + align - 1) / align * align;
 }
 
 #endif
@@ -1,41 +1,218 @@
-#include <CPU.h>
+#include <machine.h>
 
 #include <fstream>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include <signal.h>
+
+
+static void usage(const char * name) {
+    std::cout << "Usage: " << name << " [--engine=interpreter|threaded|block|jit] [--memory=<size>[K|M|G]] [--harts=<n>]"
+              << " [--clock=instructions|host] [--disk-io=mmap|uring|threads] [--virtio=legacy|modern]"
+              << " [--vlen=<bits>]"
+              << " [--save=<snapshot>]"
+              << " <file name> <(option)disk image>" << std::endl;
+    std::cout << "       " << name << " [options] --restore=<snapshot> <(option)disk image>" << std::endl;
+    std::cout << "With --save, SIGUSR1 writes a snapshot of the machine and lets it run on. A snapshot"
+              << " has to be restored on the disk as it was when it was written." << std::endl;
+}
+
+// Parse a DRAM size such as "512M" or "2G"; a bare number is in MiB.
+static bool parse_memory(const std::string & s, uint64_t & size) {
+    size_t end = 0;
+    uint64_t n = 0;
+    try {
+        n = std::stoull(s, &end);
+    } catch (std::exception &) {
+        return false;
+    }
+    uint64_t unit = 1024 * 1024;
+    if (end + 1 == s.size()) {
+        switch (s[end]) {
+        case 'K': case 'k': unit = 1024; break;
+        case 'M': case 'm': unit = 1024 * 1024; break;
+        case 'G': case 'g': unit = 1024 * 1024 * 1024; break;
+        default: return false;
+        }
+    } else if (end != s.size()) {
+        return false;
+    }
+    size = n * unit;
+    // DRAM has to be whole pages and stay within the physical address space.
+    return 0 != n && n <= (1ull << BUS_ADDR_BITS) / unit && 0 == size % PAGE_SIZE
+        && DRAM_BASE + size <= (1ull << BUS_ADDR_BITS);
+}
 
 int main(int argc, char* argv[]) {
-    if (2 != argc && 3 != argc) {
-        std::cout << "Usage: " << argv[0] << " <file name> <(option)disk image>" << std::endl;
-        return 0;
+    Engine engine = Engine::Interpreter;
+    uint64_t memory = DRAM_SIZE;
+    uint64_t harts = 1;
+    uint64_t vlen = DEFAULT_VLEN;
+    Clock clock = Clock::Instructions;
+    DiskIo disk_io = DiskIo::Mmap;
+    std::string save_path;
+    std::string restore_path;
+    uint32_t virtio_version = VIRTIO_LEGACY;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (0 == arg.rfind("--engine=", 0)) {
+            std::string name = arg.substr(9);
+            if ("interpreter" == name) {
+                engine = Engine::Interpreter;
+            } else if ("threaded" == name) {
+                engine = Engine::Threaded;
+            } else if ("block" == name) {
+                engine = Engine::Block;
+            } else if ("jit" == name) {
+                engine = Engine::Jit;
+            } else {
+                usage(argv[0]);
+                return 0;
+            }
+        } else if (0 == arg.rfind("--memory=", 0)) {
+            if (!parse_memory(arg.substr(9), memory)) {
+                usage(argv[0]);
+                return 0;
+            }
+        } else if (0 == arg.rfind("--harts=", 0)) {
+            try {
+                harts = std::stoull(arg.substr(8));
+            } catch (std::exception &) {
+                harts = 0;
+            }
+            if (0 == harts || harts > MAX_HARTS) {
+                usage(argv[0]);
+                return 0;
+            }
+        } else if (0 == arg.rfind("--vlen=", 0)) {
+            try {
+                vlen = std::stoull(arg.substr(7));
+            } catch (std::exception &) {
+                vlen = 0;
+            }
+            // A power of two, at least ELEN.
+            if (vlen < 64 || vlen > MAX_VLEN || 0 != (vlen & (vlen - 1))) {
+                usage(argv[0]);
+                return 0;
+            }
+        } else if (0 == arg.rfind("--clock=", 0)) {
+            std::string name = arg.substr(8);
+            if ("instructions" == name) {
+                clock = Clock::Instructions;
+            } else if ("host" == name) {
+                clock = Clock::Host;
+            } else {
+                usage(argv[0]);
+                return 0;
+            }
+        } else if (0 == arg.rfind("--disk-io=", 0)) {
+            std::string name = arg.substr(10);
+            if ("mmap" == name) {
+                disk_io = DiskIo::Mmap;
+            } else if ("uring" == name) {
+                disk_io = DiskIo::Uring;
+            } else if ("threads" == name) {
+                disk_io = DiskIo::Threads;
+            } else {
+                usage(argv[0]);
+                return 0;
+            }
+        } else if (0 == arg.rfind("--virtio=", 0)) {
+            std::string name = arg.substr(9);
+            if ("legacy" == name) {
+                virtio_version = VIRTIO_LEGACY;
+            } else if ("modern" == name) {
+                virtio_version = VIRTIO_MODERN;
+            } else {
+                usage(argv[0]);
+                return 0;
+            }
+        } else if (0 == arg.rfind("--save=", 0)) {
+            save_path = arg.substr(7);
+        } else if (0 == arg.rfind("--restore=", 0)) {
+            restore_path = arg.substr(10);
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    // SIGUSR1 is taken by a thread of its own rather than a handler, so it has to be
+    // blocked before any other thread starts, disk threads included.
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    if (!save_path.empty()) {
+        pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
     }
 
-    std::ifstream file(argv[1], std::ios::binary);
-    if(!file){
-        std::cerr << "open file error" << std::endl;
+    // The kernel comes from the snapshot, and so do the harts and memory.
+    SnapshotReader snapshot;
+    if (!restore_path.empty()) {
+        if (!snapshot.open(restore_path)) {
+            std::cerr << restore_path << " is not a snapshot" << std::endl;
+            return 0;
+        }
+        harts = snapshot.header().harts;
+        memory = snapshot.header().dram_size;
+        files.insert(files.begin(), "");
+    }
+    if (1 != files.size() && 2 != files.size()) {
+        usage(argv[0]);
         return 0;
     }
-    std::vector<uint8_t> code((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    file.close();
 
-    std::vector<uint8_t> disk_img;
+    std::vector<uint8_t> code;
+    if (restore_path.empty()) {
+        std::ifstream file(files[0], std::ios::binary);
+        if(!file){
+            std::cerr << "open file error" << std::endl;
+            return 0;
+        }
+        code.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        file.close();
+    }
 
-    if (3 == argc) {
-        std::ifstream fdisk(argv[2], std::ios::binary);
-        if (!fdisk) {
+    std::unique_ptr<BlockBackend> disk(new MemoryDisk(std::vector<uint8_t>()));
+
+    if (2 == files.size()) {
+        disk = open_disk(files[1], disk_io);
+        if (!disk) {
             std::cerr << "open file error" << std::endl;
             return 0;
         }
-        std::vector<uint8_t> tmp((std::istreambuf_iterator<char>(fdisk)), std::istreambuf_iterator<char>());
-        fdisk.close();
-        disk_img.assign(tmp.begin(), tmp.end());
     }
-    
-    CPU cpu(code, disk_img);
 
-    cpu.circle();
+    if (code.size() > memory) {
+        std::cerr << "kernel does not fit in memory" << std::endl;
+        return 0;
+    }
+
+    Machine machine(code, std::move(disk), memory, harts);
+    machine.set_engine(engine);
+    machine.set_vlen(vlen);
+    machine.set_clock(clock);
+    machine.set_virtio_version(virtio_version);
+
+    if (!restore_path.empty() && !machine.restore(snapshot)) {
+        std::cerr << "cannot restore " << restore_path << std::endl;
+        return 0;
+    }
+
+    if (!save_path.empty()) {
+        std::thread([&machine, usr1, save_path]() {
+            int sig;
+            while (0 == sigwait(&usr1, &sig)) {
+                machine.request_snapshot(save_path);
+            }
+        }).detach();
+    }
+
+    machine.run();
 
-    cpu.dump_registers();
+    machine.hart(0).dump_registers();
 
     return 0;
 }
@@ -58,11 +58,12 @@ public:
 		return true;
 	}
 
-	static bool generate_rv_obj(const std::string & src_filename, const std::string & out_filename) {
+	static bool generate_rv_obj(const std::string & src_filename, const std::string & out_filename,
+								const std::string & march = "rv64g") {
 		std::string srcfile = "./test/" + src_filename;
 		std::string outfile = "./test/" + out_filename;
 		std::string cc = "clang";
-		std::string command = cc + " -target riscv64-unknown-elf -c -march=rv64g -mabi=lp64 -mno-relax " 
+		std::string command = cc + " -target riscv64-unknown-elf -c -march=" + march + " -mabi=lp64 -mno-relax " 
 								+ srcfile + " -o " + outfile;
 		std::string res = command_process(command);
 		if(!res.empty()) {
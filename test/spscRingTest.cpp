@@ -0,0 +1,55 @@
+#include <util/spscRing.h>
+
+#include <iostream>
+#include <thread>
+
+int main(int argc, char const *argv[])
+{
+	SpscRing<int, 16> ring;
+	const int count = 1000000;
+	std::thread producer([&ring]() {
+		int batch[5];
+		for(int i = 0; i < count;) {
+			if(i % 3) {
+				if(ring.push(i)) {
+					++i;
+				} else {
+					std::this_thread::yield();
+				}
+				continue;
+			}
+			int n = 0;
+			for(; n < 5 && i + n < count; ++n) {
+				batch[n] = i + n;
+			}
+			size_t pushed = ring.push(batch, n);
+			if(0 == pushed) {
+				std::this_thread::yield();
+			}
+			i += pushed;
+		}
+	});
+
+	int expected = 0;
+	int out[7];
+	while(expected < count) {
+		size_t n = ring.pop(out, 7);
+		if(0 == n) {
+			std::this_thread::yield();
+		}
+		for(size_t i = 0; i < n; ++i) {
+			if(out[i] != expected++) {
+				std::cout << "out of order at " << expected - 1 << std::endl;
+				producer.join();
+				return 1;
+			}
+		}
+	}
+	producer.join();
+	if(!ring.empty()) {
+		std::cout << "not empty" << std::endl;
+		return 1;
+	}
+	std::cout << "ok" << std::endl;
+	return 0;
+}
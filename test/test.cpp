@@ -1,14 +1,55 @@
 #include "generator.h"
 #include "CPU.h"
+#include "machine.h"
 #include "gtest/gtest.h"
 
-std::unique_ptr<CPU> get_cpu_test(const std::string & asm_str, size_t clock, const std::string & case_name) {
+#include <cstdlib>
+
+// The engine C programs are run with, chosen by RVEMU_ENGINE (interpreter by default),
+// so that the suite can be repeated against each engine.
+Engine get_test_engine() {
+    const char * name = std::getenv("RVEMU_ENGINE");
+    std::string engine = (nullptr == name) ? "" : name;
+    if ("threaded" == engine) {
+        return Engine::Threaded;
+    } else if ("block" == engine) {
+        return Engine::Block;
+    } else if ("jit" == engine) {
+        return Engine::Jit;
+    }
+    return Engine::Interpreter;
+}
+
+// The engines assembly tests run on: the one RVEMU_ENGINE names, or every engine.
+std::vector<Engine> get_test_engines() {
+    if (nullptr != std::getenv("RVEMU_ENGINE")) {
+        return {get_test_engine()};
+    }
+    return {Engine::Interpreter, Engine::Threaded, Engine::Block, Engine::Jit};
+}
+
+// Run code to its end on each engine, and check it leaves the registers ref has.
+void check_engines(const std::vector<uint8_t> & code, const CPU & ref, const std::string & case_name) {
+    for (Engine engine : get_test_engines()) {
+        std::vector<uint8_t> text = code, img;
+        std::unique_ptr<CPU> cpu = std::make_unique<CPU>(text, img);
+        cpu->set_engine(engine);
+        cpu->circle();
+        for (uint64_t r = 1; r < 32; ++r) {
+            EXPECT_EQ(cpu->get_reg_value((Reg_t)r), ref.get_reg_value((Reg_t)r))
+                << case_name << ": x" << r << " on engine " << (int)engine;
+        }
+    }
+}
+
+std::unique_ptr<CPU> get_cpu_test(const std::string & asm_str, size_t clock, const std::string & case_name,
+								  const std::string & march = "rv64g") {
 	std::string asmfile = case_name + ".S";
 	if(! Generator::write_rv_src(asm_str, asmfile)) {
 		return nullptr;
 	}
 	std::string objfile = case_name + ".o";
-	if(! Generator::generate_rv_obj(asmfile, objfile)) {
+	if(! Generator::generate_rv_obj(asmfile, objfile, march)) {
 		return nullptr;
 	}
 	std::string binfile = case_name + ".bin";
@@ -31,15 +72,19 @@ std::unique_ptr<CPU> get_cpu_test(const std::string & asm_str, size_t clock, con
         if(cpu->get_pc_value() > DRAM_END) {
             break;
         }
-        uint32_t inst = 0, new_pc = 0;
-        try {
-            inst = cpu->fetch();
+        uint64_t inst = 0, new_pc = TRAPPED;
+        if (cpu->fetch(inst)) {
             new_pc = cpu->execute(inst);
-            cpu->set_pc(new_pc);
-        } catch (RISCVException & e) {
-            std::cout << "\033[1m\033[31m" << e.what() << "#" << std::hex << e.value() << "\033[0m" << std::endl;
+        }
+        if (TRAPPED == new_pc) {
+            const Trap & t = cpu->get_trap();
+            std::cout << "\033[1m\033[31m" << t.what() << "#" << std::hex << t.value << "\033[0m" << std::endl;
             break;
         }
+        cpu->set_pc(new_pc);
+    }
+    if (clock > 0) {
+        check_engines(code, *cpu, case_name);
     }
     return cpu;
 }
@@ -68,6 +113,7 @@ std::unique_ptr<CPU> get_cpu_test(const std::string & src_str, const std::string
     std::vector<uint8_t> img;
 
     std::unique_ptr<CPU> cpu = std::make_unique<CPU>(code, img);
+    cpu->set_engine(get_test_engine());
     cpu->circle();
     return cpu;
 }
@@ -288,6 +334,582 @@ TEST(test_inst, wordOp) {
 	EXPECT_EQ(cpu->get_reg_value(A2), 0x7f00002a);
 }
 
+TEST(test_inst, amo) {
+	std::stringstream asm_str;
+	asm_str << "andi t0, sp, -64\n"
+            << "addi t1, zero, -5\n"
+            << "sw   t1, 0(t0)\n"
+            << "addi t2, zero, 3\n"
+            << "amoadd.w  a0, t2, (t0)\n"
+            << "amomax.w  a1, t2, (t0)\n"
+            << "amominu.w a2, t1, (t0)\n"
+            << "amoswap.w a3, t1, (t0)\n"
+            << "amomin.w  a4, t2, (t0)\n"
+            << "amoor.d   a5, t2, (t0)\n"
+            << "ld   a6, 0(t0)";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 11, "amo");
+	ASSERT_NE(cpu, nullptr);
+	EXPECT_EQ(cpu->get_reg_value(A0), (uint64_t)(int64_t)(-5));
+	EXPECT_EQ(cpu->get_reg_value(A1), (uint64_t)(int64_t)(-2));
+	EXPECT_EQ(cpu->get_reg_value(A2), 3);
+	EXPECT_EQ(cpu->get_reg_value(A3), 3);
+	EXPECT_EQ(cpu->get_reg_value(A4), (uint64_t)(int64_t)(-5));
+	EXPECT_EQ(cpu->get_reg_value(A5), 0xfffffffb);
+	EXPECT_EQ(cpu->get_reg_value(A6), 0xfffffffb);
+}
+
+TEST(test_inst, lr_sc) {
+	std::stringstream asm_str;
+	asm_str << "andi t0, sp, -64\n"
+            << "addi t1, zero, 41\n"
+            << "sd   t1, 0(t0)\n"
+            << "lr.d a0, (t0)\n"
+            << "addi a0, a0, 1\n"
+            << "sc.d a1, a0, (t0)\n"
+            << "sc.d a2, t1, (t0)\n"
+            << "ld   a3, 0(t0)";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 8, "lr_sc");
+	ASSERT_NE(cpu, nullptr);
+	EXPECT_EQ(cpu->get_reg_value(A0), 42);
+	EXPECT_EQ(cpu->get_reg_value(A1), 0);
+	EXPECT_EQ(cpu->get_reg_value(A2), 1);
+	EXPECT_EQ(cpu->get_reg_value(A3), 42);
+}
+
+TEST(test_inst, muldiv) {
+	std::stringstream asm_str;
+	asm_str << "li     t0, -7\n"
+            << "li     t1, 2\n"
+            << "li     t2, 0\n"
+            << "li     t3, 0x8000000000000000\n"
+            << "li     t4, -1\n"
+            << "mulh   a0, t0, t1\n"
+            << "mulhu  a1, t4, t4\n"
+            << "mulhsu a2, t0, t1\n"
+            << "div    a3, t0, t1\n"
+            << "rem    a4, t0, t1\n"
+            << "div    a5, t3, t4\n"
+            << "rem    a6, t3, t4\n"
+            << "divu   a7, t0, t2\n"
+            << "remu   s2, t0, t2\n"
+            << "divw   s3, t0, t2\n"
+            << "remw   s4, t0, t1\n"
+            << "divuw  s5, t4, t1\n"
+            << "remuw  s6, t4, t2\n"
+            << "mulw   s7, t0, t1\n"
+            << "li     t5, -0x80000000\n"
+            << "divw   s8, t5, t4";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 23, "muldiv");
+	ASSERT_NE(cpu, nullptr);
+	EXPECT_EQ(cpu->get_reg_value(A0), ~0ull);
+	EXPECT_EQ(cpu->get_reg_value(A1), 0xfffffffffffffffeull);
+	EXPECT_EQ(cpu->get_reg_value(A2), ~0ull);
+	EXPECT_EQ(cpu->get_reg_value(A3), (uint64_t)-3);
+	EXPECT_EQ(cpu->get_reg_value(A4), (uint64_t)-1);
+	EXPECT_EQ(cpu->get_reg_value(A5), 0x8000000000000000ull);
+	EXPECT_EQ(cpu->get_reg_value(A6), 0);
+	EXPECT_EQ(cpu->get_reg_value(A7), ~0ull);
+	EXPECT_EQ(cpu->get_reg_value(S2), (uint64_t)-7);
+	EXPECT_EQ(cpu->get_reg_value(S3), ~0ull);
+	EXPECT_EQ(cpu->get_reg_value(S4), (uint64_t)-1);
+	EXPECT_EQ(cpu->get_reg_value(S5), 0x7fffffff);
+	EXPECT_EQ(cpu->get_reg_value(S6), ~0ull);
+	EXPECT_EQ(cpu->get_reg_value(S7), (uint64_t)-14);
+	EXPECT_EQ(cpu->get_reg_value(S8), 0xffffffff80000000ull);
+}
+
+TEST(test_inst, fp) {
+	std::stringstream asm_str;
+	// ft4 holds a double, so as a single it is not NaN-boxed and reads as the canonical NaN.
+	asm_str << "li        t0, 3\n"
+            << "li        t1, 2\n"
+            << "fcvt.d.l  ft0, t0\n"
+            << "fcvt.d.l  ft1, t1\n"
+            << "fdiv.d    ft2, ft0, ft1\n"
+            << "fcvt.l.d  a0, ft2\n"
+            << "fcvt.l.d  a1, ft2, rtz\n"
+            << "frflags   a2\n"
+            << "fcvt.s.d  ft3, ft2\n"
+            << "fmv.x.w   a3, ft3\n"
+            << "fmv.x.d   a4, ft3\n"
+            << "fmv.d.x   ft4, t0\n"
+            << "fadd.s    ft5, ft4, ft4\n"
+            << "fmv.x.w   a5, ft5\n"
+            << "fsflags   zero\n"
+            << "fneg.d    ft6, ft0\n"
+            << "fcvt.wu.d a6, ft6\n"
+            << "frflags   a7\n"
+            << "fclass.d  s2, ft6\n"
+            << "flt.d     s3, ft1, ft0\n"
+            << "fmadd.d   ft7, ft0, ft1, ft2\n"
+            << "fcvt.l.d  s4, ft7\n"
+            << "csrr      s5, mstatus";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 23, "fp");
+	ASSERT_NE(cpu, nullptr);
+	EXPECT_EQ(cpu->get_reg_value(A0), 2);
+	EXPECT_EQ(cpu->get_reg_value(A1), 1);
+	EXPECT_EQ(cpu->get_reg_value(A2), FFLAGS_NX);
+	EXPECT_EQ(cpu->get_reg_value(A3), 0x3fc00000);
+	EXPECT_EQ(cpu->get_reg_value(A4), 0xffffffff3fc00000ull);
+	EXPECT_EQ(cpu->get_reg_value(A5), 0x7fc00000);
+	EXPECT_EQ(cpu->get_reg_value(A6), 0);
+	EXPECT_EQ(cpu->get_reg_value(A7), FFLAGS_NV);
+	EXPECT_EQ(cpu->get_reg_value(S2), 1 << 1);
+	EXPECT_EQ(cpu->get_reg_value(S3), 1);
+	EXPECT_EQ(cpu->get_reg_value(S4), 8);
+	EXPECT_EQ((cpu->get_reg_value(S5) >> 13) & 3, FS_DIRTY >> 13);
+	EXPECT_EQ(cpu->get_reg_value(S5) >> 63, 1);
+}
+
+TEST(test_inst, vector) {
+	std::stringstream asm_str;
+	// With the default VLEN of 128 bits, four 32-bit elements fit in one register; the
+	// last vsetvli asks for SEW > LMUL * ELEN and gets vill.
+	asm_str << "andi     sp, sp, -64\n"
+            << "addi     sp, sp, -64\n"
+            << "li       t0, 1\n"
+            << "sw       t0, 0(sp)\n"
+            << "li       t0, 2\n"
+            << "sw       t0, 4(sp)\n"
+            << "li       t0, 3\n"
+            << "sw       t0, 8(sp)\n"
+            << "li       t0, 4\n"
+            << "sw       t0, 12(sp)\n"
+            << "li       a1, 4\n"
+            << "vsetvli  a0, a1, e32, m1, ta, ma\n"
+            << "vle32.v  v1, (sp)\n"
+            << "vadd.vi  v2, v1, -3\n"
+            << "vadd.vx  v2, v2, a1\n"
+            << "vmul.vv  v3, v2, v1\n"
+            << "vmv.s.x  v4, zero\n"
+            << "vredsum.vs v4, v3, v4\n"
+            << "vmv.x.s  a2, v4\n"
+            << "vse32.v  v3, (sp)\n"
+            << "lw       a3, 12(sp)\n"
+            << "fcvt.s.w ft0, a1\n"
+            << "vfmv.v.f v5, ft0\n"
+            << "vfadd.vf v5, v5, ft0\n"
+            << "vfmv.f.s ft1, v5\n"
+            << "fcvt.w.s a4, ft1\n"
+            << "csrr     a5, vlenb\n"
+            << "vsetvli  a6, a1, e64, mf8, ta, ma\n"
+            << "csrr     a7, vtype\n"
+            << "csrr     s2, mstatus";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 30, "vector", "rv64gv");
+	ASSERT_NE(cpu, nullptr);
+	EXPECT_EQ(cpu->get_reg_value(A0), 4);
+	EXPECT_EQ(cpu->get_reg_value(A2), 40);
+	EXPECT_EQ(cpu->get_reg_value(A3), 20);
+	EXPECT_EQ(cpu->get_reg_value(A4), 8);
+	EXPECT_EQ(cpu->get_reg_value(A5), DEFAULT_VLEN / 8);
+	EXPECT_EQ(cpu->get_reg_value(A6), 0);
+	EXPECT_EQ(cpu->get_reg_value(A7), VTYPE_VILL);
+	EXPECT_EQ(cpu->get_reg_value(S2) & MASK_VS, VS_DIRTY);
+}
+
+TEST(test_inst, bitmanip) {
+	std::stringstream asm_str;
+	asm_str << "li       t0, -16\n"
+            << "li       t1, 3\n"
+            << "sh2add   a0, t1, t0\n"
+            << "clz      a1, t1\n"
+            << "ctz      a2, t0\n"
+            << "cpop     a3, t0\n"
+            << "cpopw    a4, t0\n"
+            << "rev8     a5, t1\n"
+            << "orc.b    a6, t1\n"
+            << "min      a7, t0, t1\n"
+            << "maxu     s2, t0, t1\n"
+            << "andn     s3, t0, t1\n"
+            << "bset     s4, t1, t1\n"
+            << "bexti    s5, t0, 4\n"
+            << "rori     s6, t1, 1\n"
+            << "add.uw   s7, t0, t1\n"
+            << "zext.h   s8, t0";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 17, "bitmanip", "rv64g_zba_zbb_zbs");
+	ASSERT_NE(cpu, nullptr);
+	EXPECT_EQ(cpu->get_reg_value(A0), (uint64_t)-4);
+	EXPECT_EQ(cpu->get_reg_value(A1), 62);
+	EXPECT_EQ(cpu->get_reg_value(A2), 4);
+	EXPECT_EQ(cpu->get_reg_value(A3), 60);
+	EXPECT_EQ(cpu->get_reg_value(A4), 28);
+	EXPECT_EQ(cpu->get_reg_value(A5), 0x0300000000000000ull);
+	EXPECT_EQ(cpu->get_reg_value(A6), 0xff);
+	EXPECT_EQ(cpu->get_reg_value(A7), (uint64_t)-16);
+	EXPECT_EQ(cpu->get_reg_value(S2), (uint64_t)-16);
+	EXPECT_EQ(cpu->get_reg_value(S3), (uint64_t)-16);
+	EXPECT_EQ(cpu->get_reg_value(S4), 11);
+	EXPECT_EQ(cpu->get_reg_value(S5), 1);
+	EXPECT_EQ(cpu->get_reg_value(S6), 0x8000000000000001ull);
+	EXPECT_EQ(cpu->get_reg_value(S7), 0xfffffff3);
+	EXPECT_EQ(cpu->get_reg_value(S8), 0xfff0);
+}
+
+TEST(test_inst, compressed) {
+	std::stringstream asm_str;
+	// The last jump lands on a 32-bit instruction that straddles the first two pages.
+	asm_str << "andi       sp, sp, -64\n"
+            << "c.li       a0, 5\n"
+            << "c.addi     a0, 3\n"
+            << "c.slli     a0, 2\n"
+            << "c.mv       a1, a0\n"
+            << "c.addiw    a1, -2\n"
+            << "c.addi16sp sp, -32\n"
+            << "c.addi4spn a2, sp, 16\n"
+            << "c.sdsp     a1, 8(sp)\n"
+            << "c.ldsp     a3, 8(sp)\n"
+            << "c.sd       a0, 0(a2)\n"
+            << "c.ld       a4, 0(a2)\n"
+            << "c.lui      a5, 1\n"
+            << "c.sub      a5, a4\n"
+            << "c.srai     a5, 5\n"
+            << "c.andi     a5, 0x1e\n"
+            << "la         t0, 1f\n"
+            << "c.jalr     t0\n"
+            << "1:\n"
+            << "c.beqz     a3, 2f\n"
+            << "c.bnez     a3, 3f\n"
+            << "2:\n"
+            << "c.li       s1, 1\n"
+            << "3:\n"
+            << "j          4f\n"
+            << "c.li       s1, 2\n"
+            << ".org       0xffe\n"
+            << "4:\n"
+            << ".option    norvc\n"
+            << "addi       a6, zero, 9\n"
+            << ".option    rvc\n"
+            << "c.li       a7, 3\n"
+            << "5:\n"
+            << "c.j        5b";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "compressed", "rv64gc");
+	ASSERT_NE(cpu, nullptr);
+	for (int i = 0; i < 40; ++i) {
+		ASSERT_TRUE(cpu->step());
+	}
+	EXPECT_EQ(cpu->get_reg_value(A0), 32);
+	EXPECT_EQ(cpu->get_reg_value(A1), 30);
+	EXPECT_EQ(cpu->get_reg_value(A2), cpu->get_reg_value(SP) + 16);
+	EXPECT_EQ(cpu->get_reg_value(A3), 30);
+	EXPECT_EQ(cpu->get_reg_value(A4), 32);
+	EXPECT_EQ(cpu->get_reg_value(A5), 126 & 0x1e);
+	EXPECT_EQ(cpu->get_reg_value(RA), cpu->get_reg_value(T0));
+	EXPECT_EQ(cpu->get_reg_value(S1), 0);
+	EXPECT_EQ(cpu->get_reg_value(A6), 9);
+	EXPECT_EQ(cpu->get_reg_value(A7), 3);
+	EXPECT_EQ(cpu->get_pc_value(), DRAM_BASE + 0x1004);
+}
+
+TEST(test_inst, store_to_code) {
+	std::stringstream asm_str;
+	// The store drops the decoded page it runs from, and the instruction after it still
+	// follows it: stepping 2 bytes would run the upper half of the sw as c.addi4spn a3.
+	// It turns the addi at target, which has run once, into addi a0, zero, 9.
+	asm_str << "la     s1, target\n"
+            << "li     t0, 0x00900513\n"
+            << "target:\n"
+            << "addi   a0, zero, 7\n"
+            << "add    a1, a1, a0\n"
+            << "bnez   s2, done\n"
+            << "li     s2, 1\n"
+            << "sw     t0, 0(s1)\n"
+            << "j      target\n"
+            << "done:\n";
+	std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "store_to_code");
+	ASSERT_NE(cpu, nullptr);
+	for (int i = 0; i < 13; ++i) {
+		ASSERT_TRUE(cpu->step());
+	}
+	EXPECT_EQ(cpu->get_reg_value(A0), 9);
+	EXPECT_EQ(cpu->get_reg_value(A1), 16);
+	EXPECT_EQ(cpu->get_reg_value(A3), 0);
+	for (Engine engine : get_test_engines()) {
+		cpu = get_cpu_test(asm_str.str(), 0, "store_to_code");
+		ASSERT_NE(cpu, nullptr);
+		cpu->set_engine(engine);
+		cpu->circle();
+		EXPECT_EQ(cpu->get_reg_value(A0), 9) << "engine " << (int)engine;
+		EXPECT_EQ(cpu->get_reg_value(A1), 16);
+		EXPECT_EQ(cpu->get_reg_value(A3), 0);
+	}
+}
+
+TEST(test_inst, self_modifying) {
+	// sub runs 50 times, so it has been decoded, built into a block and translated, before
+	// a store from another page turns its addi into addi a0, zero, 9.
+	std::stringstream asm_str;
+	asm_str << "la     s1, sub\n"
+            << "li     t0, 0x00900513\n"
+            << "again:\n"
+            << "jalr   s1\n"
+            << "add    a1, a1, a0\n"
+            << "addi   s2, s2, 1\n"
+            << "li     t1, 50\n"
+            << "bne    s2, t1, 1f\n"
+            << "sw     t0, 0(s1)\n"
+            << "1:\n"
+            << "li     t1, 100\n"
+            << "bne    s2, t1, again\n"
+            << "li     t0, 0x" << std::hex << DRAM_END + 1 << std::dec << "\n"
+            << "jr     t0\n"
+            << ".balign 4096\n"
+            << "sub:\n"
+            << "addi   a0, zero, 7\n"
+            << "ret";
+	for (Engine engine : get_test_engines()) {
+		std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "self_modifying");
+		ASSERT_NE(cpu, nullptr);
+		cpu->set_engine(engine);
+		cpu->circle();
+		EXPECT_EQ(cpu->get_reg_value(A1), 50 * 7 + 50 * 9) << "engine " << (int)engine;
+		EXPECT_EQ(cpu->get_pc_value(), DRAM_END + 1);
+	}
+}
+
+TEST(test_inst, jit_trap_at_block_end) {
+	std::stringstream asm_str;
+	// The faulting load is the last of a block cut at MAX_BLOCK_INSTS, so it goes
+	// through the helper with no block-ending instruction after it. The fault is fatal.
+	asm_str << ".rept " << MAX_BLOCK_INSTS - 1 << "\n"
+            << "addi   a0, a0, 1\n"
+            << ".endr\n"
+            << "ld     a3, 0(zero)\n"
+            << "li     a3, 9";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "jit_trap_at_block_end");
+	ASSERT_NE(cpu, nullptr);
+	cpu->set_engine(Engine::Jit);
+	cpu->circle();
+	EXPECT_EQ(cpu->get_reg_value(A0), MAX_BLOCK_INSTS - 1);
+	EXPECT_EQ(cpu->get_reg_value(A3), 0);
+	EXPECT_EQ(cpu->get_csr_value(MCAUSE), 5);
+	EXPECT_EQ(cpu->get_csr_value(MEPC), DRAM_BASE + 4 * (MAX_BLOCK_INSTS - 1));
+}
+
+TEST(test_inst, dram_end) {
+	// Doublewords starting in the last 4 bytes of DRAM run past its end.
+	const char * insts[] = {"ld a0, 0(t0)", "sd t1, 0(t0)"};
+	for (int store = 0; store < 2; ++store) {
+		std::stringstream asm_str;
+		asm_str << "li t0, 0x" << std::hex << DRAM_END - 3 << std::dec << "\n"
+		        << "li t1, -1\n"
+		        << "li a0, 1\n"
+		        << insts[store] << "\n"
+		        << "li a0, 2";
+		for (Engine engine : get_test_engines()) {
+			std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "dram_end");
+			ASSERT_NE(cpu, nullptr);
+			cpu->set_engine(engine);
+			cpu->circle();
+			uint64_t tail = 0;
+			EXPECT_EQ(cpu->get_bus().load(DRAM_END - 3, 32, tail), Exception::None);
+			EXPECT_EQ(tail, 0);
+			EXPECT_EQ(cpu->get_reg_value(A0), 1);
+			EXPECT_EQ(cpu->get_csr_value(MCAUSE), store ? 7 : 5) << "engine " << (int)engine;
+			EXPECT_EQ(cpu->get_csr_value(MTVAL), DRAM_END - 3);
+		}
+	}
+}
+
+// Turn on Sv39 with DRAM mapped to itself by a gigapage, and the 4 KiB frame pages[i]
+// at 0x40000000 + 4096 * i, all RWX; then enter S-mode at label smode. Traps go to
+// label trap in M-mode. The PTEs of the 4 KiB pages are at SV39_LEAF_TABLE.
+const uint64_t SV39_LEAF_TABLE = DRAM_BASE + 0x102000;
+
+static void put_sv39(std::stringstream & asm_str, const std::vector<uint64_t> & pages) {
+	const uint64_t root = DRAM_BASE + 0x100000, mid = root + 0x1000, leaf = SV39_LEAF_TABLE;
+	auto pte = [&asm_str](uint64_t table, uint64_t i, uint64_t pa, uint64_t flags) {
+		asm_str << "li t0, 0x" << std::hex << table + 8 * i << "\n"
+		        << "li t1, 0x" << (pa >> 12 << 10 | flags) << std::dec << "\n"
+		        << "sd t1, 0(t0)\n";
+	};
+	pte(root, DRAM_BASE >> 30, DRAM_BASE, 0xcf);
+	pte(root, 1, mid, 0x1);
+	pte(mid, 0, leaf, 0x1);
+	for (size_t i = 0; i < pages.size(); ++i) {
+		pte(leaf, i, pages[i], 0xcf);
+	}
+	asm_str << "la t0, trap\n" << "csrw mtvec, t0\n"
+	        << "li t0, 0x" << std::hex << (8ull << 60 | root >> 12) << std::dec << "\n" << "csrw satp, t0\n"
+	        << "li t0, 0x800\n" << "csrw mstatus, t0\n"
+	        << "la t0, smode\n" << "csrw mepc, t0\n"
+	        << "mret\n";
+}
+
+TEST(test_inst, page_cross) {
+	// The two virtual pages at 0x40000000 sit in frames 0x80200000 and 0x80204000,
+	// while 0x80201000 follows the first frame physically. 0x40002000 is not mapped.
+	std::stringstream asm_str;
+	asm_str << "li t0, 0x80200ffc\n" << "li t1, 0x11111111\n" << "sw t1, 0(t0)\n"
+	        << "li t0, 0x80201000\n" << "li t1, 0x22222222\n" << "sw t1, 0(t0)\n"
+	        << "li t0, 0x80204000\n" << "li t1, 0x33333333\n" << "sw t1, 0(t0)\n";
+	put_sv39(asm_str, {0x80200000, 0x80204000});
+	asm_str << "smode:\n"
+	        << "li s0, 0x40000ffc\n"
+	        << "ld a0, 0(s0)\n"
+	        << "li t1, 0x5555555544444444\n"
+	        << "sd t1, 2(s0)\n"
+	        << "li t0, 0x80204000\n"
+	        << "lw a1, 0(t0)\n"
+	        << "li t0, 0x80201000\n"
+	        << "lw a2, 0(t0)\n"
+	        // The second part faults: the first must not be written.
+	        << "li s0, 0x40001ffc\n"
+	        << "sd t1, 0(s0)\n"
+	        << "li a3, 1\n"
+	        << "trap:\n"
+	        << "csrr a4, mcause\n"
+	        << "csrr a5, mtval\n"
+	        << "li t0, 0x80204ffc\n"
+	        << "lw a6, 0(t0)";
+	for (Engine engine : get_test_engines()) {
+		std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "page_cross");
+		ASSERT_NE(cpu, nullptr);
+		cpu->set_engine(engine);
+		cpu->circle();
+		EXPECT_EQ(cpu->get_reg_value(A0), 0x3333333311111111ull) << "engine " << (int)engine;
+		EXPECT_EQ(cpu->get_reg_value(A1), 0x55554444);
+		EXPECT_EQ(cpu->get_reg_value(A2), 0x22222222);
+		EXPECT_EQ(cpu->get_reg_value(A3), 0);
+		EXPECT_EQ(cpu->get_reg_value(A4), 15);
+		EXPECT_EQ(cpu->get_reg_value(A5), 0x40002000);
+		EXPECT_EQ(cpu->get_reg_value(A6), 0);
+	}
+}
+
+TEST(test_inst, tlb_flush) {
+	// The guest moves its page at 0x40000000 to another frame twice, and must see the
+	// new frame after sfence.vma, then after writing satp.
+	std::stringstream asm_str;
+	asm_str << "li t0, 0x80200000\n" << "li t1, 1\n" << "sd t1, 0(t0)\n"
+	        << "li t0, 0x80201000\n" << "li t1, 2\n" << "sd t1, 0(t0)\n"
+	        << "li t0, 0x80202000\n" << "li t1, 3\n" << "sd t1, 0(t0)\n";
+	put_sv39(asm_str, {0x80200000});
+	asm_str << "smode:\n"
+	        << "li s0, 0x40000000\n"
+	        << "li s1, 0x" << std::hex << SV39_LEAF_TABLE << "\n"
+	        << "ld a0, 0(s0)\n"
+	        << "li t1, 0x" << (0x80201000 >> 12 << 10 | 0xcf) << "\n"
+	        << "sd t1, 0(s1)\n"
+	        << "sfence.vma\n"
+	        << "ld a1, 0(s0)\n"
+	        << "li t1, 0x" << (0x80202000 >> 12 << 10 | 0xcf) << std::dec << "\n"
+	        << "sd t1, 0(s1)\n"
+	        << "csrr t1, satp\n"
+	        << "csrw satp, t1\n"
+	        << "ld a2, 0(s0)\n"
+	        << "trap:\n"
+	        << ".word 0";
+	for (Engine engine : get_test_engines()) {
+		std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "tlb_flush");
+		ASSERT_NE(cpu, nullptr);
+		cpu->set_engine(engine);
+		cpu->circle();
+		EXPECT_EQ(cpu->get_reg_value(A0), 1) << "engine " << (int)engine;
+		EXPECT_EQ(cpu->get_reg_value(A1), 2);
+		EXPECT_EQ(cpu->get_reg_value(A2), 3);
+	}
+}
+
+TEST(test_inst, page_alias) {
+	// One frame of code at two virtual pages. auipc tells the aliases apart.
+	std::stringstream asm_str;
+	put_sv39(asm_str, {DRAM_BASE + 0x1000, DRAM_BASE + 0x1000});
+	asm_str << "smode:\n"
+	        << "li s0, 0x40000000\n"
+	        << "li s1, 0x40001000\n"
+	        << "li s2, 20\n"
+	        << "loop:\n"
+	        << "jalr s0\n"
+	        << "jalr s1\n"
+	        << "addi s2, s2, -1\n"
+	        << "bnez s2, loop\n"
+	        << "trap:\n"
+	        << ".word 0\n"
+	        << ".balign 4096\n"
+	        << "auipc t2, 0\n"
+	        << "add a0, a0, t2\n"
+	        << "ret";
+	for (Engine engine : get_test_engines()) {
+		std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "page_alias");
+		ASSERT_NE(cpu, nullptr);
+		cpu->set_engine(engine);
+		cpu->circle();
+		EXPECT_EQ(cpu->get_reg_value(A0), 20 * (0x40000000ull + 0x40001000ull)) << "engine " << (int)engine;
+		EXPECT_EQ(cpu->get_reg_value(S2), 0);
+	}
+}
+
+TEST(test_engine, threaded_traps) {
+	// Every trip round the loop leaves the threaded dispatch for the trap handler and
+	// comes back through mret.
+	std::stringstream asm_str;
+	asm_str << "la     t0, handler\n"
+            << "csrw   mtvec, t0\n"
+            << "li     s0, 100\n"
+            << "loop:\n"
+            << "ecall\n"
+            << "addi   s0, s0, -1\n"
+            << "bnez   s0, loop\n"
+            << "li     t0, 0x" << std::hex << DRAM_END + 1 << std::dec << "\n"
+            << "jr     t0\n"
+            << "handler:\n"
+            << "addi   a0, a0, 1\n"
+            << "csrr   t1, mepc\n"
+            << "addi   t1, t1, 4\n"
+            << "csrw   mepc, t1\n"
+            << "mret";
+	for (Engine engine : {Engine::Interpreter, Engine::Threaded}) {
+		std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "threaded_traps");
+		ASSERT_NE(cpu, nullptr);
+		cpu->set_engine(engine);
+		cpu->circle();
+		EXPECT_EQ(cpu->get_reg_value(A0), 100) << "engine " << (int)engine;
+		EXPECT_EQ(cpu->get_reg_value(S0), 0);
+		EXPECT_EQ(cpu->get_csr_value(MCAUSE), 11);
+		EXPECT_EQ(cpu->get_pc_value(), DRAM_END + 1);
+	}
+}
+
+TEST(test_engine, block_interrupts) {
+	// The loop is one block linked to itself. The timer interrupt must still be taken
+	// at one of its boundaries, and the blocks run on after mret.
+	std::stringstream asm_str;
+	asm_str << "la     t0, handler\n"
+            << "csrw   mtvec, t0\n"
+            << "li     t0, 0x2004000\n"
+            << "li     t1, 500\n"
+            << "sd     t1, 0(t0)\n"
+            << "li     t1, 0x80\n"
+            << "csrw   mie, t1\n"
+            << "csrsi  mstatus, 8\n"
+            << "loop:\n"
+            << "addi   a0, a0, 1\n"
+            << "beqz   a1, loop\n"
+            << "li     s0, 10\n"
+            << "1:\n"
+            << "addi   a2, a2, 1\n"
+            << "addi   s0, s0, -1\n"
+            << "bnez   s0, 1b\n"
+            << "li     t0, 0x" << std::hex << DRAM_END + 1 << std::dec << "\n"
+            << "jr     t0\n"
+            << "handler:\n"
+            << "li     a1, 1\n"
+            << "li     t1, -1\n"
+            << "sd     t1, 0(t0)\n"
+            << "mret";
+	for (Engine engine : {Engine::Block, Engine::Jit}) {
+		std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "block_interrupts");
+		ASSERT_NE(cpu, nullptr);
+		cpu->set_engine(engine);
+		cpu->circle();
+		EXPECT_EQ(cpu->get_reg_value(A1), 1) << "engine " << (int)engine;
+		EXPECT_GT(cpu->get_reg_value(A0), 100);
+		EXPECT_EQ(cpu->get_reg_value(A2), 10);
+		EXPECT_EQ(cpu->get_csr_value(MCAUSE), (1ull << 63) | 7);
+		EXPECT_EQ(cpu->get_pc_value(), DRAM_END + 1);
+	}
+}
+
 TEST(test_csr, csrs) {
 	std::stringstream asm_str;
 	asm_str << "addi t0, zero, 1\n"
@@ -311,6 +933,622 @@ TEST(test_csr, csrs) {
 	EXPECT_EQ(cpu->get_csr_value(SEPC), 6);
 }
 
+TEST(test_csr, fs_vs_reads) {
+	std::stringstream asm_str;
+	// Reading fcsr or vl keeps FS and VS Initial; writing fflags makes FS Dirty.
+	asm_str << "frflags a0\n"
+            << "frcsr   a1\n"
+            << "csrr    a2, vl\n"
+            << "csrr    s2, mstatus\n"
+            << "fsflags zero\n"
+            << "csrr    s3, mstatus";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 6, "fs_vs_reads", "rv64gv");
+	ASSERT_NE(cpu, nullptr);
+	EXPECT_EQ(cpu->get_reg_value(S2) & MASK_FS, FS_INITIAL);
+	EXPECT_EQ(cpu->get_reg_value(S2) & MASK_VS, VS_INITIAL);
+	EXPECT_EQ(cpu->get_reg_value(S3) & MASK_FS, FS_DIRTY);
+	EXPECT_EQ(cpu->get_reg_value(S3) & MASK_VS, VS_INITIAL);
+}
+
+TEST(test_clint, timer) {
+	std::stringstream asm_str;
+	// mtime counts instructions: the interrupt comes 64 instructions after reset.
+	asm_str << "la    t0, handler\n"
+            << "csrw  mtvec, t0\n"
+            << "li    t0, 0x2004000\n"
+            << "li    t1, 64\n"
+            << "sd    t1, 0(t0)\n"
+            << "li    t1, 0x80\n"
+            << "csrw  mie, t1\n"
+            << "csrsi mstatus, 8\n"
+            << "loop:\n"
+            << "addi  a0, a0, 1\n"
+            << "beqz  a1, loop\n"
+            << "csrr  a2, mip\n"
+            << "done:\n"
+            << "j     done\n"
+            << "handler:\n"
+            << "li    a1, 1\n"
+            << "li    t1, -1\n"
+            << "sd    t1, 0(t0)\n"
+            << "mret";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "timer");
+	ASSERT_NE(cpu, nullptr);
+	for (int i = 0; i < 200; ++i) {
+		ASSERT_TRUE(cpu->step());
+	}
+	EXPECT_EQ(cpu->get_reg_value(A1), 1);
+	EXPECT_GT(cpu->get_reg_value(A0), 20);
+	EXPECT_LT(cpu->get_reg_value(A0), 32);
+	EXPECT_EQ(cpu->get_csr_value(MCAUSE), (1ull << 63) | 7);
+	EXPECT_EQ(cpu->get_reg_value(A2) & MASK_MTIP, 0);
+}
+
+TEST(test_clint, vectored) {
+	// The timer interrupt (cause 7) goes to entry 7 of the table in Vectored mode, and
+	// to the base in mode 3, which is reserved and taken as Direct.
+	for (int tvec_mode : {1, 3}) {
+		std::stringstream asm_str;
+		asm_str << "la    t0, vectors\n"
+		        << "ori   t0, t0, " << tvec_mode << "\n"
+		        << "csrw  mtvec, t0\n"
+		        << "li    t0, 0x2004000\n"
+		        << "li    t1, 16\n"
+		        << "sd    t1, 0(t0)\n"
+		        << "li    t1, 0x80\n"
+		        << "csrw  mie, t1\n"
+		        << "csrsi mstatus, 8\n"
+		        << "loop:\n"
+		        << "beqz  a1, loop\n"
+		        << "done:\n"
+		        << "j     done\n"
+		        << ".p2align 6\n"
+		        << "vectors:\n"
+		        << "li    a1, 2\n"
+		        << "j     handler\n"
+		        << ".rept 5\n"
+		        << "j     handler\n"
+		        << ".endr\n"
+		        << "li    a1, 1\n"
+		        << "handler:\n"
+		        << "li    t1, -1\n"
+		        << "sd    t1, 0(t0)\n"
+		        << "mret";
+		std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "vectored");
+		ASSERT_NE(cpu, nullptr);
+		for (int i = 0; i < 100; ++i) {
+			ASSERT_TRUE(cpu->step());
+		}
+		EXPECT_EQ(cpu->get_reg_value(A1), 1 == tvec_mode ? 1 : 2);
+		EXPECT_EQ(cpu->get_csr_value(MCAUSE), (1ull << 63) | 7);
+	}
+}
+
+TEST(test_clint, wfi) {
+	std::stringstream asm_str;
+	// Interrupts are globally disabled: WFI just returns once MTIP is pending.
+	asm_str << "li    t0, 0x2004000\n"
+            << "li    t1, 5000\n"
+            << "sd    t1, 0(t0)\n"
+            << "li    t1, 0x80\n"
+            << "csrw  mie, t1\n"
+            << "wfi\n"
+            << "csrr  a0, mip\n"
+            << "li    t0, 0x200bff8\n"
+            << "ld    a1, 0(t0)\n"
+            << "done:\n"
+            << "j     done";
+    std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "wfi");
+	ASSERT_NE(cpu, nullptr);
+	for (int i = 0; i < 20; ++i) {
+		ASSERT_TRUE(cpu->step());
+	}
+	EXPECT_NE(cpu->get_reg_value(A0) & MASK_MTIP, 0);
+	EXPECT_GE(cpu->get_reg_value(A1), 5000);
+}
+
+// A device that remembers the last value stored to it and loads its own address.
+class EchoDevice : public Device {
+public:
+	Exception load(uint64_t addr, uint64_t size, uint64_t & value) {
+		value = addr + size;
+		return Exception::None;
+	}
+
+	Exception store(uint64_t addr, uint64_t size, uint64_t value) {
+		last = addr + size + value;
+		return Exception::None;
+	}
+
+	uint64_t last = 0;
+};
+
+TEST(test_bus, map) {
+	std::vector<uint8_t> code, img;
+	std::unique_ptr<Bus> bus = std::make_unique<Bus>(code, img, 1 << 20);
+	// Two devices in one page, the second running on into the next page.
+	EchoDevice a, b;
+	bus->map(0x20000000, 0x10, &a);
+	bus->map(0x20000010, 0x1000, &b);
+	uint64_t value = 0;
+	EXPECT_EQ(bus->store(0x20000008, 64, 5), Exception::None);
+	EXPECT_EQ(a.last, 0x20000008 + 64 + 5);
+	EXPECT_EQ(bus->load(0x20000014, 32, value), Exception::None);
+	EXPECT_EQ(value, 0x20000014 + 32);
+	EXPECT_EQ(bus->load(0x2000100c, 32, value), Exception::None);
+	EXPECT_EQ(value, 0x2000100c + 32);
+	EXPECT_EQ(b.last, 0);
+	// Past the end of b, and over the boundary between a and b.
+	EXPECT_EQ(bus->load(0x20001010, 8, value), Exception::LoadAccessFault);
+	EXPECT_EQ(bus->store(0x2000000c, 64, 1), Exception::StoreAMOAccessFault);
+	EXPECT_EQ(a.last, 0x20000008 + 64 + 5);
+	// DRAM resolves to host memory, devices do not.
+	EXPECT_NE(bus->host_page(DRAM_BASE + 0x1234), nullptr);
+	EXPECT_EQ(bus->host_page(0x20000000), nullptr);
+	EXPECT_EQ(bus->dram_end(), DRAM_BASE + (1 << 20) - 1);
+}
+
+TEST(test_bus, dram) {
+	std::vector<uint8_t> code = {1, 2, 3, 4};
+	const uint64_t size = 1ull << 30;
+	Dram dram(code, size);
+	EXPECT_EQ(dram.size(), size);
+	uint64_t value = 1;
+	EXPECT_EQ(dram.load(DRAM_BASE, 32, value), Exception::None);
+	EXPECT_EQ(value, 0x04030201);
+	EXPECT_EQ(dram.load(DRAM_BASE + size - 8, 64, value), Exception::None);
+	EXPECT_EQ(value, 0);
+#ifdef RVEMU_MMAP_DRAM
+	// A page is only populated once the guest touches it.
+	uint8_t * page = dram.host(DRAM_BASE + size / 2);
+	unsigned char resident = 1;
+	ASSERT_EQ(mincore(page, PAGE_SIZE, &resident), 0);
+	EXPECT_EQ(resident & 1, 0);
+	EXPECT_EQ(dram.store(DRAM_BASE + size / 2, 64, 1), Exception::None);
+	ASSERT_EQ(mincore(page, PAGE_SIZE, &resident), 0);
+	EXPECT_EQ(resident & 1, 1);
+#endif
+}
+
+TEST(test_plic, claim) {
+	Plic plic;
+	uint64_t claim0 = PLIC_CLAIM + PLIC_CONTEXT_STRIDE * 1;
+	uint64_t claim1 = PLIC_CLAIM + PLIC_CONTEXT_STRIDE * 3;
+	uint64_t value = 0;
+	EXPECT_TRUE(plic.claim(0, UART_IRQ));
+	// Hart 0 has not completed the UART yet, and no other hart may serve it.
+	EXPECT_FALSE(plic.claim(0, VIRTIO_IRQ));
+	EXPECT_FALSE(plic.claim(1, UART_IRQ));
+	EXPECT_TRUE(plic.claim(1, VIRTIO_IRQ));
+	plic.load(claim0, 32, value);
+	EXPECT_EQ(value, UART_IRQ);
+	// Read but not completed.
+	EXPECT_FALSE(plic.claim(0, VIRTIO_IRQ));
+	plic.store(claim0, 32, UART_IRQ);
+	EXPECT_FALSE(plic.claim(0, VIRTIO_IRQ));
+	EXPECT_TRUE(plic.claim(0, UART_IRQ));
+	plic.release(1);
+	plic.load(claim1, 32, value);
+	EXPECT_EQ(value, 0);
+	EXPECT_FALSE(plic.claim(1, UART_IRQ));
+	EXPECT_TRUE(plic.claim(1, VIRTIO_IRQ));
+}
+
+// The contents of the file at path.
+static std::vector<uint8_t> read_file(const std::string & path) {
+	std::ifstream file(path, std::ios::binary);
+	return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// A base image of three and a bit clusters, and an empty overlay on it.
+static std::vector<uint8_t> make_overlay(const std::string & name) {
+	std::vector<uint8_t> base(3 * OVERLAY_CLUSTER_SIZE + 100);
+	for (size_t i = 0; i < base.size(); ++i) {
+		base[i] = (uint8_t)(i * 7);
+	}
+	std::remove(("./test/" + name + ".img").c_str());
+	std::remove(("./test/" + name + ".ovl").c_str());
+	std::ofstream("./test/" + name + ".img", std::ios::binary).write((const char *)base.data(), base.size());
+	EXPECT_TRUE(OverlayDisk::create(name + ".img", "./test/" + name + ".ovl"));
+	return base;
+}
+
+// Store descriptor i of the virtqueue descriptor table at register base.
+static void put_desc(std::stringstream & asm_str, const char * base, int i, uint64_t addr, int len, int flags, int next) {
+	asm_str << "li t1, 0x" << std::hex << addr << std::dec << "\n" << "sd t1, " << 16 * i << "(" << base << ")\n"
+	        << "li t1, " << len << "\n" << "sw t1, " << 16 * i + 8 << "(" << base << ")\n"
+	        << "li t1, " << flags << "\n" << "sh t1, " << 16 * i + 12 << "(" << base << ")\n"
+	        << "li t1, " << next << "\n" << "sh t1, " << 16 * i + 14 << "(" << base << ")\n";
+}
+
+TEST(test_virtio, batch) {
+	// Two requests, made available at once: a flush, and a read of a sector past the
+	// end of the (empty) disk.
+	std::stringstream asm_str;
+	asm_str << "li s0, 0x80010000\n";
+	put_desc(asm_str, "s0", 0, 0x80010400, 16, 1, 1);
+	put_desc(asm_str, "s0", 1, 0x80010500, 1, 2, 0);
+	put_desc(asm_str, "s0", 2, 0x80010410, 16, 1, 3);
+	put_desc(asm_str, "s0", 3, 0x80010600, 512, 3, 4);
+	put_desc(asm_str, "s0", 4, 0x80010501, 1, 2, 0);
+	asm_str << "li t1, 4\n" << "sw t1, 0x400(s0)\n"
+	        << "li t1, -1\n" << "sh t1, 0x500(s0)\n"
+	        << "li t1, 2\n" << "sh t1, 0x82(s0)\n" << "sh t1, 0x86(s0)\n"
+	        << "li t0, 0x10001000\n"
+	        << "li t1, 4096\n" << "sw t1, 0x28(t0)\n"
+	        << "li t1, 8\n" << "sw t1, 0x38(t0)\n"
+	        << "li t1, 0x80010\n" << "sw t1, 0x40(t0)\n"
+	        << "li t2, 0x0c000000\n"
+	        << "li t1, 1\n" << "sw t1, 4(t2)\n"
+	        << "li t2, 0x0c002080\n"
+	        << "li t1, 2\n" << "sw t1, 0(t2)\n"
+	        << "csrsi mstatus, 8\n"
+	        << "sw zero, 0x50(t0)\n"
+	        << "nop\n"
+	        << "li s1, 0x80011000\n"
+	        << "lhu a0, 2(s1)\n"
+	        << "lw  a1, 4(s1)\n"
+	        << "lw  a2, 8(s1)\n"
+	        << "lw  a3, 12(s1)\n"
+	        << "lbu a4, 0x500(s0)\n"
+	        << "lbu a5, 0x501(s0)\n"
+	        << "lw  a6, 0x60(t0)\n"
+	        << "csrr a7, mip\n"
+	        << "done:\n"
+	        << "j done";
+	std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "batch");
+	ASSERT_NE(cpu, nullptr);
+	for (int i = 0; i < 200; ++i) {
+		ASSERT_TRUE(cpu->step());
+	}
+	EXPECT_EQ(cpu->get_reg_value(A0), 2);
+	EXPECT_EQ(cpu->get_reg_value(A1), 0);
+	EXPECT_EQ(cpu->get_reg_value(A2), 1);
+	EXPECT_EQ(cpu->get_reg_value(A3), 2);
+	EXPECT_EQ(cpu->get_reg_value(A4), VIRTIO_BLK_S_OK);
+	EXPECT_EQ(cpu->get_reg_value(A5), VIRTIO_BLK_S_IOERR);
+	EXPECT_EQ(cpu->get_reg_value(A6), 1);
+	EXPECT_NE(cpu->get_reg_value(A7) & MASK_SEIP, 0);
+}
+
+TEST(test_virtio, modern) {
+	// A flush through an indirect descriptor, on the modern interface with EVENT_IDX.
+	std::stringstream asm_str;
+	asm_str << "li s0, 0x80010000\n" << "li s1, 0x80010300\n";
+	put_desc(asm_str, "s0", 0, 0x80010300, 32, 4, 0);
+	put_desc(asm_str, "s1", 0, 0x80010400, 16, 1, 1);
+	put_desc(asm_str, "s1", 1, 0x80010500, 1, 2, 0);
+	asm_str << "li t1, 4\n" << "sw t1, 0x400(s0)\n"
+	        << "li t1, -1\n" << "sb t1, 0x500(s0)\n"
+	        << "li t1, 1\n" << "sh t1, 0x102(s0)\n"
+	        << "li t0, 0x10001000\n"
+	        << "li t1, 0x30000000\n" << "sw t1, 0x20(t0)\n"
+	        << "li t1, 1\n" << "sw t1, 0x24(t0)\n" << "sw t1, 0x20(t0)\n"
+	        << "li t1, 8\n" << "sw t1, 0x70(t0)\n"
+	        << "lw a0, 0x70(t0)\n"
+	        << "li t1, 4\n" << "sw t1, 0x38(t0)\n"
+	        << "sw s0, 0x80(t0)\n"
+	        << "addi t1, s0, 0x100\n" << "sw t1, 0x90(t0)\n"
+	        << "addi t1, s0, 0x200\n" << "sw t1, 0xa0(t0)\n"
+	        << "li t1, 1\n" << "sw t1, 0x44(t0)\n"
+	        << "li t2, 0x0c000000\n"
+	        << "li t1, 1\n" << "sw t1, 4(t2)\n"
+	        << "li t2, 0x0c002080\n"
+	        << "li t1, 2\n" << "sw t1, 0(t2)\n"
+	        << "csrsi mstatus, 8\n"
+	        << "sw zero, 0x50(t0)\n"
+	        << "nop\n"
+	        << "lhu a1, 0x202(s0)\n"
+	        << "lw  a2, 0x208(s0)\n"
+	        << "lbu a3, 0x500(s0)\n"
+	        << "lhu a4, 0x224(s0)\n"
+	        << "lw  a5, 0(t0)\n"
+	        << "lw  a6, 4(t0)\n"
+	        << "csrr a7, mip\n"
+	        << "done:\n"
+	        << "j done";
+	std::unique_ptr<CPU> cpu = get_cpu_test(asm_str.str(), 0, "modern");
+	ASSERT_NE(cpu, nullptr);
+	cpu->get_bus().get_virtio_blk().set_version(VIRTIO_MODERN);
+	for (int i = 0; i < 200; ++i) {
+		ASSERT_TRUE(cpu->step());
+	}
+	EXPECT_EQ(cpu->get_reg_value(A0), VIRTIO_STATUS_FEATURES_OK);
+	EXPECT_EQ(cpu->get_reg_value(A1), 1);
+	EXPECT_EQ(cpu->get_reg_value(A2), 1);
+	EXPECT_EQ(cpu->get_reg_value(A3), VIRTIO_BLK_S_OK);
+	EXPECT_EQ(cpu->get_reg_value(A4), 1);
+	EXPECT_EQ(cpu->get_reg_value(A5), 0x74726976);
+	EXPECT_EQ(cpu->get_reg_value(A6), VIRTIO_MODERN);
+	EXPECT_NE(cpu->get_reg_value(A7) & MASK_SEIP, 0);
+}
+
+TEST(test_disk, overlay) {
+	std::vector<uint8_t> base = make_overlay("overlay");
+	std::unique_ptr<OverlayDisk> disk = OverlayDisk::open("./test/overlay.ovl");
+	ASSERT_NE(disk, nullptr);
+	EXPECT_EQ(disk->size(), base.size());
+	// Nothing written yet: reads come from the base.
+	std::vector<uint8_t> buf(base.size());
+	ASSERT_TRUE(disk->read(0, buf.data(), buf.size()));
+	EXPECT_EQ(buf, base);
+	// A write into the middle of cluster 1, and one into the short last cluster.
+	const uint8_t data[4] = {1, 2, 3, 4};
+	ASSERT_TRUE(disk->write(OVERLAY_CLUSTER_SIZE + 100, data, sizeof(data)));
+	ASSERT_TRUE(disk->write(3 * OVERLAY_CLUSTER_SIZE + 10, data, sizeof(data)));
+	EXPECT_FALSE(disk->write(base.size() - 2, data, sizeof(data)));
+	EXPECT_FALSE(disk->allocated(0));
+	EXPECT_TRUE(disk->allocated(1));
+	EXPECT_FALSE(disk->allocated(2));
+	EXPECT_TRUE(disk->allocated(3));
+	std::vector<uint8_t> expected = base;
+	std::copy(data, data + sizeof(data), expected.begin() + OVERLAY_CLUSTER_SIZE + 100);
+	std::copy(data, data + sizeof(data), expected.begin() + 3 * OVERLAY_CLUSTER_SIZE + 10);
+	// The rest of each cluster was copied from the base.
+	ASSERT_TRUE(disk->read(0, buf.data(), buf.size()));
+	EXPECT_EQ(buf, expected);
+	EXPECT_EQ(read_file("./test/overlay.img"), base);
+	// The writes are in the overlay file, for the next open to see.
+	ASSERT_TRUE(disk->flush());
+	disk = OverlayDisk::open("./test/overlay.ovl");
+	ASSERT_NE(disk, nullptr);
+	ASSERT_TRUE(disk->read(0, buf.data(), buf.size()));
+	EXPECT_EQ(buf, expected);
+}
+
+TEST(test_disk, overlay_commit_flatten) {
+	std::vector<uint8_t> base = make_overlay("commit");
+	std::unique_ptr<OverlayDisk> disk = OverlayDisk::open("./test/commit.ovl");
+	ASSERT_NE(disk, nullptr);
+	std::vector<uint8_t> data(OVERLAY_CLUSTER_SIZE + 8, 0xa5);
+	ASSERT_TRUE(disk->write(OVERLAY_CLUSTER_SIZE - 4, data.data(), data.size()));
+	std::vector<uint8_t> expected = base;
+	std::copy(data.begin(), data.end(), expected.begin() + OVERLAY_CLUSTER_SIZE - 4);
+	// flatten writes out what the overlay presents, and leaves the base alone.
+	std::remove("./test/commit.flat");
+	ASSERT_TRUE(disk->flatten("./test/commit.flat"));
+	EXPECT_EQ(read_file("./test/commit.flat"), expected);
+	EXPECT_FALSE(disk->flatten("./test/commit.flat"));
+	EXPECT_EQ(read_file("./test/commit.img"), base);
+	// commit moves the three touched clusters into the base and empties the overlay.
+	uint64_t committed = 0;
+	ASSERT_TRUE(disk->commit(committed));
+	EXPECT_EQ(committed, 3);
+	EXPECT_EQ(read_file("./test/commit.img"), expected);
+	for (uint64_t i = 0; i < 4; ++i) {
+		EXPECT_FALSE(disk->allocated(i));
+	}
+	std::vector<uint8_t> buf(base.size());
+	ASSERT_TRUE(disk->read(0, buf.data(), buf.size()));
+	EXPECT_EQ(buf, expected);
+}
+
+TEST(test_disk, mmap) {
+	std::vector<uint8_t> image(3 * 512);
+	for (size_t i = 0; i < image.size(); ++i) {
+		image[i] = (uint8_t)(i * 3);
+	}
+	std::ofstream("./test/mmap.img", std::ios::binary).write((const char *)image.data(), image.size());
+	{
+		std::unique_ptr<BlockBackend> disk = open_disk("./test/mmap.img", DiskIo::Mmap);
+		ASSERT_NE(disk, nullptr);
+		ASSERT_NE(disk->data(), nullptr);
+		EXPECT_EQ(disk->size(), image.size());
+		EXPECT_EQ(0, memcmp(disk->data(), image.data(), image.size()));
+		uint8_t sector[512];
+		EXPECT_TRUE(disk->read(512, sector, sizeof(sector)));
+		EXPECT_EQ(0, memcmp(sector, image.data() + 512, sizeof(sector)));
+		memset(sector, 0xab, sizeof(sector));
+		EXPECT_TRUE(disk->write(1024, sector, sizeof(sector)));
+		EXPECT_FALSE(disk->write(1025, sector, sizeof(sector)));
+		EXPECT_FALSE(disk->read(1025, sector, sizeof(sector)));
+		EXPECT_TRUE(disk->flush());
+	}
+	// Writes land in the file.
+	std::fill(image.begin() + 1024, image.end(), 0xab);
+	EXPECT_EQ(read_file("./test/mmap.img"), image);
+}
+
+TEST(test_disk, asynchronous) {
+	std::vector<uint8_t> image(4 * 512);
+	for (DiskIo io : {DiskIo::Threads, DiskIo::Uring}) {
+		std::ofstream("./test/async.img", std::ios::binary).write((const char *)image.data(), image.size());
+		std::unique_ptr<BlockBackend> disk = open_disk("./test/async.img", io);
+		ASSERT_NE(disk, nullptr);
+		EXPECT_TRUE(disk->asynchronous());
+		std::mutex mutex;
+		std::condition_variable cv;
+		size_t done = 0;
+		disk->set_completion([&](DiskRequest *) {
+			std::lock_guard<std::mutex> lock(mutex);
+			++done;
+			cv.notify_all();
+		});
+		// Submit req and wait until the backend completes it on its own thread.
+		auto run = [&](DiskRequest & req) {
+			std::unique_lock<std::mutex> lock(mutex);
+			size_t before = done;
+			lock.unlock();
+			disk->submit(&req);
+			lock.lock();
+			return cv.wait_for(lock, std::chrono::seconds(5), [&]() { return done > before; });
+		};
+		uint8_t out[1024], in[1024] = {};
+		for (size_t i = 0; i < sizeof(out); ++i) {
+			out[i] = (uint8_t)(i * 5 + 1);
+		}
+		DiskRequest write{DiskRequest::Write, 512, {iovec{out, 512}, iovec{out + 512, 512}}, false};
+		ASSERT_TRUE(run(write));
+		EXPECT_TRUE(write.ok);
+		DiskRequest flush{DiskRequest::Flush, 0, {}, false};
+		ASSERT_TRUE(run(flush));
+		EXPECT_TRUE(flush.ok);
+		DiskRequest read{DiskRequest::Read, 512, {iovec{in, sizeof(in)}}, false};
+		ASSERT_TRUE(run(read));
+		EXPECT_TRUE(read.ok);
+		EXPECT_EQ(0, memcmp(in, out, sizeof(in)));
+		DiskRequest past{DiskRequest::Read, 3 * 512, {iovec{in, sizeof(in)}}, true};
+		ASSERT_TRUE(run(past));
+		EXPECT_FALSE(past.ok);
+		disk.reset();
+		std::vector<uint8_t> expected = image;
+		std::copy(out, out + sizeof(out), expected.begin() + 512);
+		EXPECT_EQ(read_file("./test/async.img"), expected);
+	}
+}
+
+TEST(test_snapshot, round_trip) {
+	// The guest sets up some state of every kind, and a virtio read on an asynchronous
+	// disk whose completion is held back: the PLIC stops accepting the interrupt right
+	// after the notify. It then spins until released, and reads it all back.
+	std::stringstream asm_str;
+	// Interrupts are latched, but mie keeps them from being taken.
+	asm_str << "csrsi mstatus, 8\n" << "li s0, 0x80010000\n";
+	put_desc(asm_str, "s0", 0, 0x80010400, 16, 1, 1);
+	put_desc(asm_str, "s0", 1, 0x80010600, 512, 3, 2);
+	put_desc(asm_str, "s0", 2, 0x80010500, 1, 2, 0);
+	asm_str << "li t1, -1\n" << "sb t1, 0x500(s0)\n"
+	        << "li t1, 1\n" << "sh t1, 0x82(s0)\n"
+	        << "li t0, 0x10001000\n"
+	        << "li t1, 4096\n" << "sw t1, 0x28(t0)\n"
+	        << "li t1, 8\n" << "sw t1, 0x38(t0)\n"
+	        << "li t1, 0x80010\n" << "sw t1, 0x40(t0)\n"
+	        << "li t2, 0x0c000000\n"
+	        << "li t1, 1\n" << "sw t1, 4(t2)\n"
+	        << "li t2, 0x0c002080\n"
+	        << "li t1, 2\n" << "sw t1, 0(t2)\n"
+	        << "sw zero, 0x50(t0)\n"
+	        << "sw zero, 0(t2)\n"
+	        << "li s1, 0x1234\n"
+	        << "li s11, -7\n"
+	        << "li t1, 0x400921fb54442d18\n" << "fmv.d.x ft0, t1\n"
+	        << "csrwi frm, 2\n"
+	        << "li t1, 4\n" << "vsetvli zero, t1, e64, m1, ta, ma\n"
+	        << "li t1, 0x55aa\n" << "vmv.v.x v1, t1\n"
+	        << "li t1, 0x77\n" << "csrw mscratch, t1\n"
+	        << "li t3, 0x2004000\n" << "li t1, 1000000\n" << "sd t1, 0(t3)\n"
+	        << "li t3, 0x2000000\n" << "li t1, 1\n" << "sw t1, 0(t3)\n"
+	        << "li s2, 0x80012000\n"
+	        << "spin:\n"
+	        << "lw t4, 0(s2)\n"
+	        << "beqz t4, spin\n"
+	        << "fmv.x.d a0, ft0\n"
+	        << "vmv.x.s a1, v1\n"
+	        << "csrr a2, mscratch\n"
+	        << "frrm a3\n"
+	        << "li t3, 0x2004000\n" << "ld a4, 0(t3)\n"
+	        << "li t3, 0x2000000\n" << "lw a5, 0(t3)\n"
+	        << "li t1, 2\n" << "sw t1, 0(t2)\n"
+	        << "nop\n"
+	        << "li s3, 0x80011000\n"
+	        << "lhu a6, 2(s3)\n"
+	        << "lbu a7, 0x500(s0)\n"
+	        << "ld s4, 0x600(s0)\n"
+	        << "csrr s5, mip\n"
+	        << "done:\n"
+	        << "j done";
+	ASSERT_TRUE(Generator::write_rv_src(asm_str.str(), "snapshot.S"));
+	ASSERT_TRUE(Generator::generate_rv_obj("snapshot.S", "snapshot.o", "rv64gv"));
+	ASSERT_TRUE(Generator::generate_rv_binary("snapshot.o", "snapshot.bin"));
+	std::vector<uint8_t> code = read_file("./test/snapshot.bin");
+	std::vector<uint8_t> sector(4096, 0x5a);
+	std::ofstream("./test/snapshot.img", std::ios::binary).write((const char *)sector.data(), sector.size());
+
+	Machine saved(code, open_disk("./test/snapshot.img", DiskIo::Threads));
+	for (int i = 0; i < 200; ++i) {
+		ASSERT_TRUE(saved.hart(0).step());
+	}
+	ASSERT_TRUE(saved.save("./test/snapshot.snp"));
+	EXPECT_TRUE(saved.hart(0).get_bus().get_virtio_blk().has_completed());
+
+	std::vector<uint8_t> other;
+	Machine restored(other, open_disk("./test/snapshot.img", DiskIo::Threads));
+	SnapshotReader r;
+	ASSERT_TRUE(r.open("./test/snapshot.snp"));
+	ASSERT_TRUE(restored.restore(r));
+	EXPECT_TRUE(restored.hart(0).get_bus().get_virtio_blk().has_completed());
+	for (Reg_t reg = (Reg_t)0; reg <= T6; reg = (Reg_t)(reg + 1)) {
+		EXPECT_EQ(restored.hart(0).get_reg_value(reg), saved.hart(0).get_reg_value(reg));
+	}
+	EXPECT_EQ(restored.hart(0).get_pc_value(), saved.hart(0).get_pc_value());
+	for (size_t addr : {MSTATUS, MIE, MIP, MSCRATCH, FCSR, VL, VTYPE, VLENB}) {
+		EXPECT_EQ(restored.hart(0).get_csr_value(addr), saved.hart(0).get_csr_value(addr));
+	}
+
+	// Both carry on alike once released.
+	for (Machine * m : {&saved, &restored}) {
+		m->hart(0).get_bus().store(0x80012000, 32, 1);
+		for (int i = 0; i < 100; ++i) {
+			ASSERT_TRUE(m->hart(0).step());
+		}
+		CPU & cpu = m->hart(0);
+		EXPECT_EQ(cpu.get_reg_value(S1), 0x1234);
+		EXPECT_EQ(cpu.get_reg_value(S11), (uint64_t)-7);
+		EXPECT_EQ(cpu.get_reg_value(A0), 0x400921fb54442d18ull);
+		EXPECT_EQ(cpu.get_reg_value(A1), 0x55aa);
+		EXPECT_EQ(cpu.get_reg_value(A2), 0x77);
+		EXPECT_EQ(cpu.get_reg_value(A3), 2);
+		EXPECT_EQ(cpu.get_reg_value(A4), 1000000);
+		EXPECT_EQ(cpu.get_reg_value(A5), 1);
+		// The held-back completion is posted.
+		EXPECT_EQ(cpu.get_reg_value(A6), 1);
+		EXPECT_EQ(cpu.get_reg_value(A7), VIRTIO_BLK_S_OK);
+		EXPECT_EQ(cpu.get_reg_value(S4), 0x5a5a5a5a5a5a5a5aull);
+		EXPECT_NE(cpu.get_reg_value(S5) & MASK_SEIP, 0);
+		EXPECT_NE(cpu.get_reg_value(S5) & MASK_MSIP, 0);
+	}
+}
+
+TEST(test_machine, harts) {
+	// Two harts add to one counter with amoadd, record their mhartid and count
+	// themselves done. Hart 0 waits for hart 1 before leaving DRAM, which stops both.
+	std::stringstream asm_str;
+	asm_str << "csrr     a0, mhartid\n"
+	        << "li       s0, 0x80100000\n"
+	        << "addi     s1, s0, 8\n"
+	        << "li       t2, 1\n"
+	        << "li       t1, 1000\n"
+	        << "1:\n"
+	        << "amoadd.d zero, t2, (s0)\n"
+	        << "addi     t1, t1, -1\n"
+	        << "bnez     t1, 1b\n"
+	        << "slli     t0, a0, 3\n"
+	        << "add      t0, s0, t0\n"
+	        << "addi     a1, a0, 1\n"
+	        << "sd       a1, 16(t0)\n"
+	        << "amoadd.d zero, t2, (s1)\n"
+	        << "bnez     a0, 3f\n"
+	        << "li       t4, 2\n"
+	        << "2:\n"
+	        << "ld       t3, 0(s1)\n"
+	        << "bne      t3, t4, 2b\n"
+	        << "li       t0, 0x" << std::hex << DRAM_END + 1 << std::dec << "\n"
+	        << "jr       t0\n"
+	        << "3:\n"
+	        << "wfi\n"
+	        << "j        3b";
+	ASSERT_TRUE(Generator::write_rv_src(asm_str.str(), "harts.S"));
+	ASSERT_TRUE(Generator::generate_rv_obj("harts.S", "harts.o"));
+	ASSERT_TRUE(Generator::generate_rv_binary("harts.o", "harts.bin"));
+	std::vector<uint8_t> code = read_file("./test/harts.bin");
+	for (Engine engine : get_test_engines()) {
+		std::vector<uint8_t> img;
+		Machine machine(code, std::unique_ptr<BlockBackend>(new MemoryDisk(img)), DRAM_SIZE, 2);
+		machine.set_engine(engine);
+		machine.run();
+		Bus & bus = machine.hart(0).get_bus();
+		uint64_t counter = 0, first = 0, second = 0;
+		bus.load(0x80100000, 64, counter);
+		bus.load(0x80100010, 64, first);
+		bus.load(0x80100018, 64, second);
+		EXPECT_EQ(counter, 2000) << "engine " << (int)engine;
+		EXPECT_EQ(first, 1);
+		EXPECT_EQ(second, 2);
+		EXPECT_EQ(machine.hart(0).get_reg_value(A0), 0);
+		EXPECT_EQ(machine.hart(1).get_reg_value(A0), 1);
+	}
+}
+
 TEST(test_uart, print) {
 	std::string src_str = R"(
 		int main() {
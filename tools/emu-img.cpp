@@ -0,0 +1,40 @@
+#include <disk.h>
+
+#include <string>
+
+
+static void usage(const char * name) {
+    std::cout << "Usage: " << name << " create <base image> <overlay>" << std::endl
+              << "       " << name << " commit <overlay>" << std::endl
+              << "       " << name << " flatten <overlay> <image>" << std::endl;
+}
+
+// Write every cluster the overlay holds into its base, then empty the overlay.
+static int commit(const std::string & path) {
+    std::unique_ptr<OverlayDisk> disk = OverlayDisk::open(path);
+    uint64_t committed;
+    if (!disk || !disk->commit(committed)) {
+        return 1;
+    }
+    std::cout << committed << " clusters committed to " << disk->base_path() << std::endl;
+    return 0;
+}
+
+// Write the disk the overlay presents to a new plain image.
+static int flatten(const std::string & path, const std::string & image) {
+    std::unique_ptr<OverlayDisk> disk = OverlayDisk::open(path);
+    return (disk && disk->flatten(image)) ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    std::string command = (argc > 1) ? argv[1] : "";
+    if ("create" == command && 4 == argc) {
+        return OverlayDisk::create(argv[2], argv[3]) ? 0 : 1;
+    } else if ("commit" == command && 3 == argc) {
+        return commit(argv[2]);
+    } else if ("flatten" == command && 4 == argc) {
+        return flatten(argv[2], argv[3]);
+    }
+    usage(argv[0]);
+    return 1;
+}